@@ -39,6 +39,13 @@ CFG_TEE_CLIENT_LOAD_PATH ?= /lib
 #   such as 1008.5 that test loading of corrupt TAs.
 CFG_TA_TEST_PATH ?= n
 
+# CFG_TA_ZSTD, CFG_TA_LZ4
+#   Enable loading of TAs compressed with zstd (<uuid>.ta.zst) or lz4
+#   (<uuid>.ta.lz4), linking with libzstd or liblz4. Files must include
+#   the uncompressed size in the frame header ("lz4 --content-size").
+CFG_TA_ZSTD ?= n
+CFG_TA_LZ4 ?= n
+
 # CFG_GP_SOCKETS
 #   Enable Global Platform Sockets support
 CFG_GP_SOCKETS ?= y
@@ -53,6 +60,18 @@ CFG_TA_GPROF_SUPPORT ?= y
 #   to dump something
 CFG_FTRACE_SUPPORT ?= y
 
+# CFG_FAKE_TEE
+#   Build an in-process stand-in for the OP-TEE driver, enabled with
+#   --fake-tee, which lets the supplicant be benchmarked and load tested
+#   on a host without a TEE.
+CFG_FAKE_TEE ?= n
+
+# CFG_FS_IO_URING
+#   Build support for --fs-engine io_uring, doing secure storage I/O
+#   through an io_uring (Linux 5.6 or later). The supplicant falls back
+#   to plain system calls if the kernel doesn't support it.
+CFG_FS_IO_URING ?= n
+
 # Default output directory.
 # May be absolute, or relative to the optee_client source directory.
 O               ?= out
@@ -0,0 +1,69 @@
+#!/usr/bin/env python3
+# SPDX-License-Identifier: BSD-2-Clause
+#
+# Copyright (c) 2026, Linaro Limited
+#
+# Creates a TA bundle for tee-supplicant --ta-bundle from TA binaries
+# named <uuid>.ta, see tee-supplicant/src/ta_bundle.h for the format.
+
+import argparse
+import os
+import struct
+import sys
+import uuid
+
+MAGIC = b'OPTEETAB'
+VERSION = 1
+ALIGN = 4096
+HDR = struct.Struct('<8sII')
+ENTRY = struct.Struct('<16sQQ')
+
+
+def ta_uuid(path):
+    name = os.path.basename(path)
+    if not name.endswith('.ta'):
+        sys.exit('{}: not named <uuid>.ta'.format(path))
+    try:
+        return uuid.UUID(name[:-3]).bytes
+    except ValueError:
+        sys.exit('{}: not named <uuid>.ta'.format(path))
+
+
+def align(n):
+    return (n + ALIGN - 1) // ALIGN * ALIGN
+
+
+def main():
+    parser = argparse.ArgumentParser(description='Create a TA bundle')
+    parser.add_argument('-o', '--out', required=True,
+                        help='bundle to create')
+    parser.add_argument('tas', nargs='+', metavar='TA',
+                        help='TA binary named <uuid>.ta')
+    args = parser.parse_args()
+
+    tas = {}
+    for path in args.tas:
+        u = ta_uuid(path)
+        if u in tas:
+            sys.exit('{}: duplicate of {}'.format(path, tas[u]))
+        tas[u] = path
+
+    offs = align(HDR.size + ENTRY.size * len(tas))
+    index = []
+    for u in sorted(tas):
+        size = os.path.getsize(tas[u])
+        index.append((u, offs, size))
+        offs = align(offs + size)
+
+    with open(args.out, 'wb') as f:
+        f.write(HDR.pack(MAGIC, VERSION, len(index)))
+        for u, offs, size in index:
+            f.write(ENTRY.pack(u, offs, size))
+        for u, offs, size in index:
+            f.seek(offs)
+            with open(tas[u], 'rb') as ta:
+                f.write(ta.read())
+
+
+if __name__ == '__main__':
+    main()
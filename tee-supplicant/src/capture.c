@@ -0,0 +1,626 @@
+/*
+ * Copyright (c) 2026, Linaro Limited
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <capture.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stats.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <tee_client_api.h>
+#include <teec_trace.h>
+#include <tee_supplicant.h>
+#include <unistd.h>
+
+#include "optee_msg_supplicant.h"
+
+#ifndef __aligned
+#define __aligned(x) __attribute__((__aligned__(x)))
+#endif
+#include <linux/tee.h>
+
+struct capture_rec {
+	uint64_t start;
+	size_t len;
+	uint8_t *buf;
+	void *va[CAPTURE_MAX_PARAMS];
+};
+
+static pthread_mutex_t capture_mutex = PTHREAD_MUTEX_INITIALIZER;
+static int capture_fd = -1;
+static uint64_t capture_base_ns;
+
+static bool write_all(int fd, const void *buf, size_t len)
+{
+	const uint8_t *p = buf;
+	ssize_t r = 0;
+
+	while (len) {
+		r = write(fd, p, len);
+		if (r < 0) {
+			if (errno == EINTR)
+				continue;
+			return false;
+		}
+		p += r;
+		len -= r;
+	}
+
+	return true;
+}
+
+static bool read_all(int fd, void *buf, size_t len)
+{
+	uint8_t *p = buf;
+	ssize_t r = 0;
+
+	while (len) {
+		r = read(fd, p, len);
+		if (r < 0) {
+			if (errno == EINTR)
+				continue;
+			return false;
+		}
+		if (!r)
+			return false;
+		p += r;
+		len -= r;
+	}
+
+	return true;
+}
+
+int capture_open(const char *path)
+{
+	struct capture_file_hdr hdr = {
+		.magic = CAPTURE_MAGIC,
+		.version = CAPTURE_VERSION,
+	};
+	int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0600);
+
+	if (fd < 0) {
+		EMSG("open(\"%s\"): %s", path, strerror(errno));
+		return -1;
+	}
+
+	if (!write_all(fd, &hdr, sizeof(hdr))) {
+		EMSG("write(\"%s\"): %s", path, strerror(errno));
+		close(fd);
+		return -1;
+	}
+
+	capture_base_ns = stats_now_ns();
+	capture_fd = fd;
+	return 0;
+}
+
+bool capture_enabled(void)
+{
+	return capture_fd >= 0;
+}
+
+static uint32_t param_type(struct tee_ioctl_param *param)
+{
+	return param->attr & TEE_IOCTL_PARAM_ATTR_TYPE_MASK;
+}
+
+static bool is_memref_in(struct tee_ioctl_param *param)
+{
+	return param_type(param) == TEE_IOCTL_PARAM_ATTR_TYPE_MEMREF_INPUT ||
+	       param_type(param) == TEE_IOCTL_PARAM_ATTR_TYPE_MEMREF_INOUT;
+}
+
+static bool is_memref_out(struct tee_ioctl_param *param)
+{
+	return param_type(param) == TEE_IOCTL_PARAM_ATTR_TYPE_MEMREF_OUTPUT ||
+	       param_type(param) == TEE_IOCTL_PARAM_ATTR_TYPE_MEMREF_INOUT;
+}
+
+struct capture_rec *capture_begin(uint32_t func, size_t num_params,
+				  struct tee_ioctl_param *params)
+{
+	struct capture_rec_hdr *hdr = NULL;
+	struct capture_param *cp = NULL;
+	struct capture_rec *rec = NULL;
+	uint8_t *payload = NULL;
+	size_t len = 0;
+	size_t n = 0;
+
+	if (!capture_enabled() || num_params > CAPTURE_MAX_PARAMS)
+		return NULL;
+
+	rec = calloc(1, sizeof(*rec));
+	if (!rec)
+		return NULL;
+
+	len = sizeof(*hdr) + num_params * sizeof(*cp);
+	for (n = 0; n < num_params; n++) {
+		rec->va[n] = tee_supp_param_to_va(params + n);
+		if (rec->va[n] && is_memref_in(params + n))
+			len += MEMREF_SIZE(params + n);
+	}
+
+	rec->buf = malloc(len);
+	if (!rec->buf) {
+		free(rec);
+		return NULL;
+	}
+	memset(rec->buf, 0, sizeof(*hdr) + num_params * sizeof(*cp));
+	rec->len = len;
+
+	hdr = (struct capture_rec_hdr *)rec->buf;
+	hdr->func = func;
+	hdr->num_params = num_params;
+
+	cp = (struct capture_param *)(hdr + 1);
+	payload = (uint8_t *)(cp + num_params);
+	for (n = 0; n < num_params; n++) {
+		cp[n].attr = params[n].attr;
+		cp[n].a = params[n].a;
+		cp[n].b = params[n].b;
+		cp[n].c = params[n].c;
+		if (!rec->va[n])
+			continue;
+		cp[n].flags = CAPTURE_PARAM_SHM_VALID;
+		if (is_memref_in(params + n)) {
+			cp[n].in_len = MEMREF_SIZE(params + n);
+			memcpy(payload, rec->va[n], cp[n].in_len);
+			payload += cp[n].in_len;
+		}
+	}
+
+	rec->start = stats_now_ns();
+	return rec;
+}
+
+void capture_end(struct capture_rec *rec, uint32_t ret,
+		 struct tee_ioctl_param *params)
+{
+	struct capture_rec_hdr *hdr = NULL;
+	struct capture_param *cp = NULL;
+	uint64_t end = stats_now_ns();
+	uint8_t *payload = NULL;
+	size_t out_len = 0;
+	size_t n = 0;
+	void *p = NULL;
+
+	if (!rec)
+		return;
+
+	hdr = (struct capture_rec_hdr *)rec->buf;
+	cp = (struct capture_param *)(hdr + 1);
+
+	/* Don't copy more than the buffer could hold */
+	for (n = 0; n < hdr->num_params; n++) {
+		if (rec->va[n] && is_memref_out(params + n)) {
+			cp[n].out_len = MEMREF_SIZE(params + n);
+			if (cp[n].out_len > cp[n].b)
+				cp[n].out_len = cp[n].b;
+			out_len += cp[n].out_len;
+		}
+	}
+
+	p = realloc(rec->buf, rec->len + out_len);
+	if (!p)
+		goto out;
+	rec->buf = p;
+	hdr = p;
+	cp = (struct capture_param *)(hdr + 1);
+
+	payload = rec->buf + rec->len;
+	for (n = 0; n < hdr->num_params; n++) {
+		cp[n].out_a = params[n].a;
+		cp[n].out_b = params[n].b;
+		cp[n].out_c = params[n].c;
+		if (cp[n].out_len) {
+			memcpy(payload, rec->va[n], cp[n].out_len);
+			payload += cp[n].out_len;
+		}
+	}
+	rec->len += out_len;
+
+	hdr->len = rec->len;
+	hdr->ret = ret;
+	hdr->start_ns = rec->start - capture_base_ns;
+	hdr->duration_ns = end - rec->start;
+
+	tee_supp_mutex_lock(&capture_mutex);
+	if (capture_fd >= 0 && !write_all(capture_fd, rec->buf, rec->len)) {
+		EMSG("capture write: %s, capture stopped", strerror(errno));
+		close(capture_fd);
+		capture_fd = -1;
+	}
+	tee_supp_mutex_unlock(&capture_mutex);
+
+out:
+	free(rec->buf);
+	free(rec);
+}
+
+int capture_read_open(const char *path)
+{
+	struct capture_file_hdr hdr;
+	int fd = open(path, O_RDONLY);
+
+	memset(&hdr, 0, sizeof(hdr));
+
+	if (fd < 0) {
+		EMSG("open(\"%s\"): %s", path, strerror(errno));
+		return -1;
+	}
+
+	if (!read_all(fd, &hdr, sizeof(hdr)) || hdr.magic != CAPTURE_MAGIC ||
+	    hdr.version != CAPTURE_VERSION) {
+		EMSG("\"%s\" isn't a capture file", path);
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+int capture_read_next(int fd, struct capture_rec_hdr **rec_ret)
+{
+	struct capture_rec_hdr hdr;
+	struct capture_rec_hdr *rec = NULL;
+	struct capture_param *cp = NULL;
+	size_t len = 0;
+	size_t n = 0;
+	ssize_t r = 0;
+
+	memset(&hdr, 0, sizeof(hdr));
+
+	do {
+		r = read(fd, &hdr, sizeof(hdr.len));
+	} while (r < 0 && errno == EINTR);
+	if (!r)
+		return 0;
+	if (r != sizeof(hdr.len) ||
+	    !read_all(fd, (uint8_t *)&hdr + sizeof(hdr.len),
+		      sizeof(hdr) - sizeof(hdr.len))) {
+		EMSG("truncated capture record");
+		return -1;
+	}
+
+	if (hdr.num_params > CAPTURE_MAX_PARAMS ||
+	    hdr.len < sizeof(hdr) + hdr.num_params * sizeof(*cp)) {
+		EMSG("corrupt capture record");
+		return -1;
+	}
+
+	rec = malloc(hdr.len);
+	if (!rec)
+		return -1;
+	memcpy(rec, &hdr, sizeof(hdr));
+
+	if (!read_all(fd, rec + 1, hdr.len - sizeof(hdr))) {
+		EMSG("truncated capture record");
+		free(rec);
+		return -1;
+	}
+
+	cp = (struct capture_param *)(rec + 1);
+	len = sizeof(hdr) + hdr.num_params * sizeof(*cp);
+	for (n = 0; n < hdr.num_params; n++)
+		len += (size_t)cp[n].in_len + cp[n].out_len;
+	if (len != hdr.len) {
+		EMSG("corrupt capture record");
+		free(rec);
+		return -1;
+	}
+
+	*rec_ret = rec;
+	return 1;
+}
+
+/*
+ * Handles returned by the handlers differ between the captured run and
+ * the replay, so the ones seen in the capture are translated to the ones
+ * returned during replay.
+ */
+enum replay_handle_kind {
+	REPLAY_HANDLE_FD,
+	REPLAY_HANDLE_DIR,
+	REPLAY_HANDLE_SOCKET,
+};
+
+struct replay_handle {
+	enum replay_handle_kind kind;
+	uint64_t old;
+	uint64_t new;
+};
+
+struct replay_state {
+	struct replay_handle *handles;
+	size_t num_handles;
+	size_t max_handles;
+	size_t num_records;
+	size_t num_skipped;
+	size_t num_mismatch;
+	size_t num_unmapped;
+	uint64_t captured_ns;
+	uint64_t replayed_ns;
+};
+
+static struct replay_handle *find_handle(struct replay_state *st,
+					 enum replay_handle_kind kind,
+					 uint64_t old)
+{
+	size_t n = 0;
+
+	for (n = 0; n < st->num_handles; n++)
+		if (st->handles[n].kind == kind && st->handles[n].old == old)
+			return st->handles + n;
+	return NULL;
+}
+
+static void add_handle(struct replay_state *st, enum replay_handle_kind kind,
+		       uint64_t old, uint64_t new)
+{
+	struct replay_handle *h = find_handle(st, kind, old);
+	void *p = NULL;
+
+	if (!h) {
+		if (st->num_handles == st->max_handles) {
+			p = realloc(st->handles, (st->max_handles * 2 + 16) *
+						 sizeof(*st->handles));
+			if (!p)
+				return;
+			st->handles = p;
+			st->max_handles = st->max_handles * 2 + 16;
+		}
+		h = st->handles + st->num_handles;
+		st->num_handles++;
+	}
+
+	h->kind = kind;
+	h->old = old;
+	h->new = new;
+}
+
+static void del_handle(struct replay_state *st, enum replay_handle_kind kind,
+		       uint64_t old)
+{
+	struct replay_handle *h = find_handle(st, kind, old);
+
+	if (h) {
+		st->num_handles--;
+		*h = st->handles[st->num_handles];
+	}
+}
+
+static uint64_t map_handle(struct replay_state *st,
+			   enum replay_handle_kind kind, uint64_t v)
+{
+	struct replay_handle *h = find_handle(st, kind, v);
+
+	if (h)
+		return h->new;
+
+	st->num_unmapped++;
+	return v;
+}
+
+/* Translates the handles passed to a handler */
+static void map_in_handles(struct replay_state *st, uint32_t func,
+			   size_t num_params, struct tee_ioctl_param *params)
+{
+	if (!num_params)
+		return;
+
+	if (func == OPTEE_MSG_RPC_CMD_FS) {
+		switch (params[0].a) {
+		case OPTEE_MRF_CLOSE:
+		case OPTEE_MRF_READ:
+		case OPTEE_MRF_WRITE:
+		case OPTEE_MRF_TRUNCATE:
+		case OPTEE_MRF_SYNC:
+		case OPTEE_MRF_READV:
+		case OPTEE_MRF_WRITEV:
+			params[0].b = map_handle(st, REPLAY_HANDLE_FD,
+						 params[0].b);
+			break;
+		case OPTEE_MRF_CLOSEDIR:
+		case OPTEE_MRF_READDIR:
+		case OPTEE_MRF_READDIR_BATCH:
+			params[0].b = map_handle(st, REPLAY_HANDLE_DIR,
+						 params[0].b);
+			break;
+		default:
+			break;
+		}
+	} else if (func == OPTEE_MSG_RPC_CMD_SOCKET) {
+		switch (params[0].a) {
+		case OPTEE_MRC_SOCKET_CLOSE:
+		case OPTEE_MRC_SOCKET_SEND:
+		case OPTEE_MRC_SOCKET_RECV:
+		case OPTEE_MRC_SOCKET_IOCTL:
+			params[0].c = map_handle(st, REPLAY_HANDLE_SOCKET,
+						 params[0].c);
+			break;
+		default:
+			break;
+		}
+	}
+}
+
+/* Learns the handles returned by a handler, or forgets closed ones */
+static void map_out_handles(struct replay_state *st, uint32_t func,
+			    struct capture_param *cp, size_t num_params,
+			    struct tee_ioctl_param *params)
+{
+	if (!num_params)
+		return;
+
+	if (func == OPTEE_MSG_RPC_CMD_FS) {
+		switch (cp[0].a) {
+		case OPTEE_MRF_OPEN:
+		case OPTEE_MRF_CREATE:
+			if (num_params > 2)
+				add_handle(st, REPLAY_HANDLE_FD, cp[2].out_a,
+					   params[2].a);
+			break;
+		case OPTEE_MRF_OPENDIR:
+			if (num_params > 2)
+				add_handle(st, REPLAY_HANDLE_DIR, cp[2].out_a,
+					   params[2].a);
+			break;
+		case OPTEE_MRF_CLOSE:
+			del_handle(st, REPLAY_HANDLE_FD, cp[0].b);
+			break;
+		case OPTEE_MRF_CLOSEDIR:
+			del_handle(st, REPLAY_HANDLE_DIR, cp[0].b);
+			break;
+		default:
+			break;
+		}
+	} else if (func == OPTEE_MSG_RPC_CMD_SOCKET) {
+		switch (cp[0].a) {
+		case OPTEE_MRC_SOCKET_OPEN:
+			if (num_params > 3)
+				add_handle(st, REPLAY_HANDLE_SOCKET,
+					   cp[3].out_a, params[3].a);
+			break;
+		case OPTEE_MRC_SOCKET_CLOSE:
+			del_handle(st, REPLAY_HANDLE_SOCKET, cp[0].c);
+			break;
+		default:
+			break;
+		}
+	}
+}
+
+static bool replay_one(struct replay_state *st, struct capture_rec_hdr *hdr,
+		       capture_dispatch_fn dispatch)
+{
+	struct tee_ioctl_param params[CAPTURE_MAX_PARAMS];
+	struct capture_param *cp = (struct capture_param *)(hdr + 1);
+	uint8_t *payload = (uint8_t *)(cp + hdr->num_params);
+	uint64_t start = 0;
+	uint64_t t = 0;
+	uint32_t ret = 0;
+	size_t n = 0;
+	uint8_t *va = NULL;
+
+	memset(params, 0, sizeof(params));
+
+	/* Shared memory is set up below, the driver isn't involved */
+	if (hdr->func == OPTEE_MSG_RPC_CMD_SHM_ALLOC ||
+	    hdr->func == OPTEE_MSG_RPC_CMD_SHM_FREE) {
+		st->num_skipped++;
+		return true;
+	}
+
+	for (n = 0; n < hdr->num_params; n++) {
+		params[n].attr = cp[n].attr;
+		params[n].a = cp[n].a;
+		params[n].b = cp[n].b;
+		params[n].c = cp[n].c;
+		if (!(cp[n].flags & CAPTURE_PARAM_SHM_VALID))
+			continue;
+
+		/* The payload must fit the memref it's replayed into */
+		if (MEMREF_SIZE(params + n) > SIZE_MAX ||
+		    MEMREF_SHM_OFFS(params + n) >
+				SIZE_MAX - MEMREF_SIZE(params + n) ||
+		    cp[n].in_len > MEMREF_SIZE(params + n)) {
+			EMSG("corrupt capture record");
+			return false;
+		}
+
+		va = tee_supp_local_shm(MEMREF_SHM_ID(params + n),
+					MEMREF_SHM_OFFS(params + n) +
+					MEMREF_SIZE(params + n));
+		if (!va) {
+			EMSG("out of memory");
+			return false;
+		}
+		if (cp[n].in_len) {
+			memcpy(va + MEMREF_SHM_OFFS(params + n), payload,
+			       cp[n].in_len);
+			payload += cp[n].in_len;
+		}
+	}
+
+	map_in_handles(st, hdr->func, hdr->num_params, params);
+
+	start = stats_now_ns();
+	ret = dispatch(hdr->func, hdr->num_params, params);
+	t = stats_now_ns() - start;
+	stats_record(stats_req_class(hdr->func, hdr->num_params, params), t);
+
+	st->num_records++;
+	st->captured_ns += hdr->duration_ns;
+	st->replayed_ns += t;
+	if (ret != hdr->ret) {
+		DMSG("record %zu: func %" PRIu32 " returned 0x%" PRIx32
+		     ", captured 0x%" PRIx32, st->num_records, hdr->func, ret,
+		     hdr->ret);
+		st->num_mismatch++;
+	}
+
+	if (ret == TEEC_SUCCESS && hdr->ret == TEEC_SUCCESS)
+		map_out_handles(st, hdr->func, cp, hdr->num_params, params);
+
+	return true;
+}
+
+int capture_replay(const char *path, capture_dispatch_fn dispatch)
+{
+	struct replay_state st;
+	struct capture_rec_hdr *hdr = NULL;
+	bool ok = true;
+	int fd = capture_read_open(path);
+	int r = 0;
+
+	memset(&st, 0, sizeof(st));
+
+	if (fd < 0)
+		return -1;
+
+	while (ok && (r = capture_read_next(fd, &hdr)) > 0) {
+		ok = replay_one(&st, hdr, dispatch);
+		free(hdr);
+	}
+	if (r < 0)
+		ok = false;
+	close(fd);
+	free(st.handles);
+
+	printf("replayed: %zu\n", st.num_records);
+	printf("skipped_shm: %zu\n", st.num_skipped);
+	printf("ret_mismatch: %zu\n", st.num_mismatch);
+	printf("unmapped_handles: %zu\n", st.num_unmapped);
+	printf("captured_ms: %" PRIu64 "\n", st.captured_ns / 1000000);
+	printf("replayed_ms: %" PRIu64 "\n", st.replayed_ns / 1000000);
+	stats_print(stdout);
+
+	return ok ? 0 : -1;
+}
@@ -0,0 +1,122 @@
+/*
+ * Copyright (c) 2026, Linaro Limited
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef CAPTURE_H
+#define CAPTURE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+struct tee_ioctl_param;
+
+/*
+ * Capture file format, all fields in host byte order:
+ *
+ * struct capture_file_hdr
+ * Records, each made of:
+ *   struct capture_rec_hdr
+ *   struct capture_param[num_params]
+ *   The in_len bytes of memref payload passed to the handler, for each
+ *   parameter in order.
+ *   The out_len bytes of memref payload returned by the handler, for each
+ *   parameter in order.
+ */
+#define CAPTURE_MAGIC		0x50414354	/* "TCAP" */
+#define CAPTURE_VERSION		1
+#define CAPTURE_MAX_PARAMS	16
+
+struct capture_file_hdr {
+	uint32_t magic;
+	uint32_t version;
+};
+
+struct capture_rec_hdr {
+	uint32_t len;		/* Size of the whole record */
+	uint32_t func;
+	uint32_t ret;
+	uint32_t num_params;
+	uint64_t start_ns;	/* Relative to the start of the capture */
+	uint64_t duration_ns;
+};
+
+/* The memref parameter referred to an existing shm object */
+#define CAPTURE_PARAM_SHM_VALID	(1 << 0)
+
+struct capture_param {
+	uint64_t attr;
+	uint64_t a;
+	uint64_t b;
+	uint64_t c;
+	uint64_t out_a;
+	uint64_t out_b;
+	uint64_t out_c;
+	uint32_t flags;
+	uint32_t in_len;
+	uint32_t out_len;
+	uint32_t pad;
+};
+
+struct capture_rec;
+
+/* Starts capturing requests to @path, returns 0 on success or -1 */
+int capture_open(const char *path);
+bool capture_enabled(void);
+
+/*
+ * Snapshots a request before it is passed to its handler. Returns NULL
+ * if capture isn't enabled or on error.
+ */
+struct capture_rec *capture_begin(uint32_t func, size_t num_params,
+				  struct tee_ioctl_param *params);
+
+/* Completes the record with the response and appends it to the file */
+void capture_end(struct capture_rec *rec, uint32_t ret,
+		 struct tee_ioctl_param *params);
+
+/* Opens a capture file for reading, returns a file descriptor or -1 */
+int capture_read_open(const char *path);
+
+/*
+ * Reads the next record of a capture file opened with capture_read_open()
+ * into a buffer which the caller frees. Returns 1 if a record was read, 0
+ * at the end of the file or -1 on error.
+ */
+int capture_read_next(int fd, struct capture_rec_hdr **rec);
+
+typedef uint32_t (*capture_dispatch_fn)(uint32_t func, size_t num_params,
+					struct tee_ioctl_param *params);
+
+/*
+ * Feeds the requests of a capture file to @dispatch, one at a time and as
+ * fast as possible, then prints a summary and the latency histograms to
+ * stdout. Shared memory is emulated with process local buffers so no TEE
+ * driver is needed. Returns 0 on success or -1.
+ */
+int capture_replay(const char *path, capture_dispatch_fn dispatch);
+
+#endif /*CAPTURE_H*/
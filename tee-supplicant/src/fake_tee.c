@@ -0,0 +1,1168 @@
+/*
+ * Copyright (c) 2026, Linaro Limited
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/* For memfd_create() */
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fake_tee.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <libgen.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stats.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/queue.h>
+#include <sys/stat.h>
+#include <tee_client_api.h>
+#include <teec_trace.h>
+#include <tee_supplicant.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "optee_msg_supplicant.h"
+
+#ifndef __aligned
+#define __aligned(x) __attribute__((__aligned__(x)))
+#endif
+#include <linux/tee.h>
+
+/* Max number of non-meta parameters of the requests issued */
+#define FAKE_MAX_PARAMS		3
+/*
+ * The file name is stored first in the shm object, followed by the
+ * extents of vectored requests, the data written and the area it's read
+ * back into
+ */
+#define FAKE_NAME_SIZE		64
+#define FAKE_MAX_EXTENTS	8
+#define FAKE_EXTS_SIZE		(FAKE_MAX_EXTENTS * sizeof(struct fake_extent))
+#define FAKE_DATA_OFFS		(FAKE_NAME_SIZE + FAKE_EXTS_SIZE)
+/* Directory enumerated by the sessions with enum=<n> */
+#define FAKE_ENUM_DIR		"fake-tee-enum"
+/* Max shm objects held at once by a session with churn=<n> */
+#define FAKE_MAX_CHURN		1024
+
+enum fake_op {
+	FAKE_OP_ALLOC,
+	FAKE_OP_CREATE,
+	FAKE_OP_WRITE,
+	FAKE_OP_READ,
+	FAKE_OP_CLOSE,
+	FAKE_OP_REMOVE,
+	FAKE_OP_OPENDIR,
+	FAKE_OP_READDIR,
+	FAKE_OP_CLOSEDIR,
+	FAKE_OP_TA_SIZE,
+	FAKE_OP_TA_LOAD,
+	FAKE_OP_FREE,
+	FAKE_NUM_OPS
+};
+
+static const char *const fake_op_names[FAKE_NUM_OPS] = {
+	[FAKE_OP_ALLOC] = "shm_alloc",
+	[FAKE_OP_CREATE] = "fs_create",
+	[FAKE_OP_WRITE] = "fs_write",
+	[FAKE_OP_READ] = "fs_read",
+	[FAKE_OP_CLOSE] = "fs_close",
+	[FAKE_OP_REMOVE] = "fs_remove",
+	[FAKE_OP_OPENDIR] = "fs_opendir",
+	[FAKE_OP_READDIR] = "fs_readdir",
+	[FAKE_OP_CLOSEDIR] = "fs_closedir",
+	[FAKE_OP_TA_SIZE] = "ta_size",
+	[FAKE_OP_TA_LOAD] = "ta_load",
+	[FAKE_OP_FREE] = "shm_free",
+};
+
+/* See OPTEE_MRF_READV */
+struct fake_extent {
+	uint64_t offs;
+	uint64_t len;
+};
+
+/*
+ * A request issued by a secure thread. The index of the thread is
+ * passed as meta parameter so the response can be routed back even when
+ * responses arrive out of order.
+ */
+struct fake_req {
+	size_t id;
+	uint32_t func;
+	uint32_t ret;
+	size_t num_params;
+	struct tee_ioctl_param params[FAKE_MAX_PARAMS];
+	bool done;
+	STAILQ_ENTRY(fake_req) link;
+};
+
+struct fake_thread {
+	pthread_t thread;
+	struct fake_req req;
+	pthread_cond_t cond;
+	size_t first_session;
+	size_t num_errors;
+	uint64_t *lat[FAKE_NUM_OPS];
+	size_t num_lat[FAKE_NUM_OPS];
+};
+
+/*
+ * Requests not yet received by the supplicant are queued, all state is
+ * protected by the mutex.
+ */
+struct fake_tee {
+	bool enabled;
+	size_t num_threads;
+	size_t rate;
+	size_t count;
+	size_t size;
+	bool reg_mem;
+	size_t enum_files;
+	bool readdir_batch;
+	bool vec_io;
+	const char *ta_path;
+	uint8_t ta_uuid[TEE_IOCTL_UUID_LEN];
+	bool ta_cold;
+	size_t churn;
+	int fd;
+	int next_shm_id;
+	pthread_mutex_t mutex;
+	pthread_cond_t recv_cond;
+	STAILQ_HEAD(fake_req_head, fake_req) queue;
+	struct fake_thread *threads;
+};
+
+static struct fake_tee fake = {
+	.num_threads = 4,
+	.count = 10000,
+	.size = 4096,
+	.reg_mem = true,
+	.readdir_batch = true,
+	.fd = -1,
+	.next_shm_id = 1,
+	.mutex = PTHREAD_MUTEX_INITIALIZER,
+	.recv_cond = PTHREAD_COND_INITIALIZER,
+	.queue = STAILQ_HEAD_INITIALIZER(fake.queue),
+};
+
+/* Parses the UUID a TA file at @path is named after */
+static bool parse_ta_uuid(const char *path, uint8_t *uuid)
+{
+	char *str = strdup(path);
+	const char *p = NULL;
+	size_t n = 0;
+	bool res = false;
+
+	if (!str)
+		return false;
+	p = basename(str);
+	while (n < TEE_IOCTL_UUID_LEN) {
+		if (*p == '-' && (n == 4 || n == 6 || n == 8 || n == 10))
+			p++;
+		if (sscanf(p, "%2hhx", uuid + n) != 1 || !p[0] || !p[1])
+			goto out;
+		p += 2;
+		n++;
+	}
+	res = *p == '.';
+out:
+	free(str);
+	return res;
+}
+
+static bool parse_num(const char *str, size_t *res)
+{
+	unsigned long long v = 0;
+	char *endp = NULL;
+
+	errno = 0;
+	v = strtoull(str, &endp, 0);
+	if (errno || endp == str || *endp || v > SIZE_MAX)
+		return false;
+
+	*res = v;
+	return true;
+}
+
+int fake_tee_configure(const char *spec)
+{
+	char *str = strdup(spec);
+	char *saveptr = NULL;
+	char *tok = NULL;
+	char *val = NULL;
+	int rc = 0;
+
+	if (!str)
+		return -1;
+
+	for (tok = strtok_r(str, ",", &saveptr); tok && !rc;
+	     tok = strtok_r(NULL, ",", &saveptr)) {
+		val = strchr(tok, '=');
+		if (!val) {
+			rc = -1;
+			break;
+		}
+		*val++ = '\0';
+
+		if (!strcmp(tok, "threads")) {
+			if (!parse_num(val, &fake.num_threads) ||
+			    !fake.num_threads)
+				rc = -1;
+		} else if (!strcmp(tok, "rate")) {
+			if (!parse_num(val, &fake.rate))
+				rc = -1;
+		} else if (!strcmp(tok, "count")) {
+			if (!parse_num(val, &fake.count))
+				rc = -1;
+		} else if (!strcmp(tok, "size")) {
+			if (!parse_num(val, &fake.size) || !fake.size ||
+			    fake.size > (UINT32_MAX - FAKE_DATA_OFFS) / 2)
+				rc = -1;
+		} else if (!strcmp(tok, "shm")) {
+			if (!strcmp(val, "reg"))
+				fake.reg_mem = true;
+			else if (!strcmp(val, "alloc"))
+				fake.reg_mem = false;
+			else
+				rc = -1;
+		} else if (!strcmp(tok, "enum")) {
+			if (!parse_num(val, &fake.enum_files))
+				rc = -1;
+		} else if (!strcmp(tok, "readdir")) {
+			if (!strcmp(val, "single"))
+				fake.readdir_batch = false;
+			else if (!strcmp(val, "batch"))
+				fake.readdir_batch = true;
+			else
+				rc = -1;
+		} else if (!strcmp(tok, "io")) {
+			if (!strcmp(val, "single"))
+				fake.vec_io = false;
+			else if (!strcmp(val, "vec"))
+				fake.vec_io = true;
+			else
+				rc = -1;
+		} else if (!strcmp(tok, "ta")) {
+			free((char *)fake.ta_path);
+			fake.ta_path = strdup(val);
+			if (!fake.ta_path ||
+			    !parse_ta_uuid(val, fake.ta_uuid))
+				rc = -1;
+		} else if (!strcmp(tok, "churn")) {
+			if (!parse_num(val, &fake.churn) ||
+			    fake.churn > FAKE_MAX_CHURN)
+				rc = -1;
+		} else if (!strcmp(tok, "cache")) {
+			if (!strcmp(val, "cold"))
+				fake.ta_cold = true;
+			else if (!strcmp(val, "warm"))
+				fake.ta_cold = false;
+			else
+				rc = -1;
+		} else {
+			rc = -1;
+		}
+	}
+
+	if (rc)
+		EMSG("invalid fake TEE configuration \"%s\"", spec);
+	else
+		fake.enabled = true;
+
+	free(str);
+	return rc;
+}
+
+bool fake_tee_enabled(void)
+{
+	return fake.enabled;
+}
+
+static void set_value(struct tee_ioctl_param *p, uint64_t attr, uint64_t a,
+		      uint64_t b)
+{
+	memset(p, 0, sizeof(*p));
+	p->attr = attr;
+	p->a = a;
+	p->b = b;
+}
+
+static void set_memref(struct tee_ioctl_param *p, uint64_t attr,
+		       uint64_t offs, uint64_t size, uint64_t id)
+{
+	memset(p, 0, sizeof(*p));
+	p->attr = attr;
+	MEMREF_SHM_OFFS(p) = offs;
+	MEMREF_SIZE(p) = size;
+	MEMREF_SHM_ID(p) = id;
+}
+
+/* Issues a request and waits for the response, like a secure thread */
+static uint32_t fake_rpc(struct fake_thread *t, enum fake_op op,
+			 uint32_t func, size_t num_params,
+			 struct tee_ioctl_param *params)
+{
+	uint64_t start = stats_now_ns();
+	uint32_t ret = 0;
+
+	tee_supp_mutex_lock(&fake.mutex);
+
+	t->req.func = func;
+	t->req.num_params = num_params;
+	memcpy(t->req.params, params, num_params * sizeof(*params));
+	t->req.done = false;
+	STAILQ_INSERT_TAIL(&fake.queue, &t->req, link);
+	pthread_cond_signal(&fake.recv_cond);
+
+	while (!t->req.done)
+		pthread_cond_wait(&t->cond, &fake.mutex);
+
+	memcpy(params, t->req.params, num_params * sizeof(*params));
+	ret = t->req.ret;
+
+	tee_supp_mutex_unlock(&fake.mutex);
+
+	t->lat[op][t->num_lat[op]] = stats_now_ns() - start;
+	t->num_lat[op]++;
+	/* Reaching the end of a directory isn't an error */
+	if (ret != TEEC_SUCCESS &&
+	    (op != FAKE_OP_READDIR || ret != TEEC_ERROR_ITEM_NOT_FOUND))
+		t->num_errors++;
+
+	return ret;
+}
+
+/*
+ * The content of the file of session @n at @offs. It differs between
+ * sessions and between blocks of a file, so data read from another file
+ * or offset doesn't match.
+ */
+static uint8_t file_pattern(size_t n, uint64_t offs)
+{
+	return (n * 131 + offs * 7 + offs / 256) & 0xff;
+}
+
+/*
+ * Splits the data of a file session into extents, one unless io=vec.
+ * They're in reverse file order so each extent is served on its own.
+ * Returns the number of extents.
+ */
+static size_t file_extents(struct fake_extent *e)
+{
+	size_t num = 1;
+	size_t len = 0;
+	size_t n = 0;
+	size_t k = 0;
+
+	if (fake.vec_io)
+		num = fake.size < FAKE_MAX_EXTENTS ? fake.size :
+						      FAKE_MAX_EXTENTS;
+	len = fake.size / num;
+	for (n = 0; n < num; n++) {
+		k = num - 1 - n;
+		e[n].offs = k * len;
+		e[n].len = k == num - 1 ? fake.size - k * len : len;
+	}
+
+	return num;
+}
+
+/*
+ * Fills @buf with the payload of the extents @e of session @n or, if
+ * @check, compares @buf against it. Returns false on a mismatch.
+ */
+static bool file_payload(size_t n, const struct fake_extent *e,
+			 size_t num_exts, uint8_t *buf, bool check)
+{
+	size_t k = 0;
+	size_t i = 0;
+
+	for (k = 0; k < num_exts; k++) {
+		for (i = 0; i < e[k].len; i++, buf++) {
+			if (!check)
+				*buf = file_pattern(n, e[k].offs + i);
+			else if (*buf != file_pattern(n, e[k].offs + i))
+				return false;
+		}
+	}
+
+	return true;
+}
+
+/*
+ * Writes or, if @read, reads back the data of a file session with
+ * OPTEE_MRF_WRITE and OPTEE_MRF_READ or, with io=vec, with
+ * OPTEE_MRF_WRITEV and OPTEE_MRF_READV. Returns the result and the
+ * number of bytes transferred in @len.
+ */
+static uint32_t file_io(struct fake_thread *t, uint64_t shm_id, uint64_t fd,
+			size_t num_exts, bool read, size_t *len)
+{
+	struct tee_ioctl_param p[FAKE_MAX_PARAMS];
+	uint64_t attr = TEE_IOCTL_PARAM_ATTR_TYPE_MEMREF_INPUT;
+	enum fake_op op = FAKE_OP_WRITE;
+	size_t offs = FAKE_DATA_OFFS;
+	size_t num_params = 2;
+	uint32_t cmd = OPTEE_MRF_WRITE;
+	uint32_t ret = 0;
+
+	if (read) {
+		attr = TEE_IOCTL_PARAM_ATTR_TYPE_MEMREF_OUTPUT;
+		op = FAKE_OP_READ;
+		offs += fake.size;
+		cmd = OPTEE_MRF_READ;
+	}
+
+	if (fake.vec_io)
+		cmd = read ? OPTEE_MRF_READV : OPTEE_MRF_WRITEV;
+	set_value(p, TEE_IOCTL_PARAM_ATTR_TYPE_VALUE_INPUT, cmd, fd);
+
+	/* The extents go in between, the file offset is 0 otherwise */
+	if (fake.vec_io) {
+		p[0].c = num_exts;
+		set_memref(p + 1, TEE_IOCTL_PARAM_ATTR_TYPE_MEMREF_INPUT,
+			   FAKE_NAME_SIZE,
+			   num_exts * sizeof(struct fake_extent), shm_id);
+		num_params = 3;
+	}
+	set_memref(p + num_params - 1, attr, offs, fake.size, shm_id);
+	ret = fake_rpc(t, op, OPTEE_MSG_RPC_CMD_FS, num_params, p);
+	*len = MEMREF_SIZE(p + num_params - 1);
+
+	return ret;
+}
+
+/*
+ * A file is created, written, read back into a separate area and checked
+ * against what was written, and removed.
+ */
+static void file_session(struct fake_thread *t, size_t n, uint64_t shm_id,
+			 uint8_t *va)
+{
+	struct tee_ioctl_param p[FAKE_MAX_PARAMS];
+	struct fake_extent e[FAKE_MAX_EXTENTS];
+	uint8_t *rbuf = va + FAKE_DATA_OFFS + fake.size;
+	size_t num_exts = file_extents(e);
+	uint64_t fd = 0;
+	size_t len = 0;
+	int name_len = 0;
+
+	name_len = snprintf((char *)va, FAKE_NAME_SIZE, "/fake-tee-%zu", n);
+	memcpy(va + FAKE_NAME_SIZE, e, num_exts * sizeof(*e));
+	file_payload(n, e, num_exts, va + FAKE_DATA_OFFS, false);
+	memset(rbuf, 0, fake.size);
+
+	set_value(p, TEE_IOCTL_PARAM_ATTR_TYPE_VALUE_INPUT, OPTEE_MRF_CREATE,
+		  0);
+	set_memref(p + 1, TEE_IOCTL_PARAM_ATTR_TYPE_MEMREF_INPUT, 0,
+		   name_len + 1, shm_id);
+	set_value(p + 2, TEE_IOCTL_PARAM_ATTR_TYPE_VALUE_OUTPUT, 0, 0);
+	if (fake_rpc(t, FAKE_OP_CREATE, OPTEE_MSG_RPC_CMD_FS, 3, p))
+		return;
+	fd = p[2].a;
+
+	file_io(t, shm_id, fd, num_exts, false, &len);
+
+	if (!file_io(t, shm_id, fd, num_exts, true, &len)) {
+		if (len != fake.size) {
+			EMSG("short read of %s", (char *)va);
+			t->num_errors++;
+		} else if (!file_payload(n, e, num_exts, rbuf, true)) {
+			EMSG("%s doesn't read back as written", (char *)va);
+			t->num_errors++;
+		}
+	}
+
+	set_value(p, TEE_IOCTL_PARAM_ATTR_TYPE_VALUE_INPUT, OPTEE_MRF_CLOSE,
+		  fd);
+	fake_rpc(t, FAKE_OP_CLOSE, OPTEE_MSG_RPC_CMD_FS, 1, p);
+
+	set_value(p, TEE_IOCTL_PARAM_ATTR_TYPE_VALUE_INPUT, OPTEE_MRF_REMOVE,
+		  0);
+	set_memref(p + 1, TEE_IOCTL_PARAM_ATTR_TYPE_MEMREF_INPUT, 0,
+		   name_len + 1, shm_id);
+	fake_rpc(t, FAKE_OP_REMOVE, OPTEE_MSG_RPC_CMD_FS, 2, p);
+}
+
+/* Returns the number of names packed by OPTEE_MRF_READDIR_BATCH, or -1 */
+static ssize_t count_names(const uint8_t *buf, size_t len)
+{
+	ssize_t count = 0;
+	size_t offs = 0;
+	uint16_t l = 0;
+
+	while (offs < len) {
+		if (len - offs < sizeof(l))
+			return -1;
+		memcpy(&l, buf + offs, sizeof(l));
+		offs += sizeof(l);
+		if (!l || l > len - offs || buf[offs + l - 1])
+			return -1;
+		offs += l;
+		count++;
+	}
+
+	return count;
+}
+
+/* All names of the directory with enum=<n> files are listed */
+static void enum_session(struct fake_thread *t, uint64_t shm_id,
+			 uint8_t *va)
+{
+	struct tee_ioctl_param p[FAKE_MAX_PARAMS];
+	uint64_t handle = 0;
+	ssize_t names = 0;
+	size_t count = 0;
+	int name_len = 0;
+	uint32_t ret = 0;
+
+	name_len = snprintf((char *)va, FAKE_NAME_SIZE, "/%s", FAKE_ENUM_DIR);
+
+	set_value(p, TEE_IOCTL_PARAM_ATTR_TYPE_VALUE_INPUT, OPTEE_MRF_OPENDIR,
+		  0);
+	set_memref(p + 1, TEE_IOCTL_PARAM_ATTR_TYPE_MEMREF_INPUT, 0,
+		   name_len + 1, shm_id);
+	set_value(p + 2, TEE_IOCTL_PARAM_ATTR_TYPE_VALUE_OUTPUT, 0, 0);
+	if (fake_rpc(t, FAKE_OP_OPENDIR, OPTEE_MSG_RPC_CMD_FS, 3, p))
+		return;
+	handle = p[2].a;
+
+	while (true) {
+		set_memref(p + 1, TEE_IOCTL_PARAM_ATTR_TYPE_MEMREF_OUTPUT,
+			   FAKE_NAME_SIZE, fake.size, shm_id);
+		if (fake.readdir_batch) {
+			set_value(p, TEE_IOCTL_PARAM_ATTR_TYPE_VALUE_INPUT,
+				  OPTEE_MRF_READDIR_BATCH, handle);
+			set_value(p + 2, TEE_IOCTL_PARAM_ATTR_TYPE_VALUE_OUTPUT,
+				  0, 0);
+			ret = fake_rpc(t, FAKE_OP_READDIR,
+				       OPTEE_MSG_RPC_CMD_FS, 3, p);
+			if (ret)
+				break;
+			names = count_names(va + FAKE_NAME_SIZE,
+					    MEMREF_SIZE(p + 1));
+			if (names != (ssize_t)p[2].a) {
+				EMSG("bad names from %s", FAKE_ENUM_DIR);
+				t->num_errors++;
+				break;
+			}
+			count += p[2].a;
+			if (p[2].b)
+				break;
+		} else {
+			set_value(p, TEE_IOCTL_PARAM_ATTR_TYPE_VALUE_INPUT,
+				  OPTEE_MRF_READDIR, handle);
+			ret = fake_rpc(t, FAKE_OP_READDIR,
+				       OPTEE_MSG_RPC_CMD_FS, 2, p);
+			if (ret)
+				break;
+			count++;
+		}
+	}
+
+	if ((!ret || ret == TEEC_ERROR_ITEM_NOT_FOUND) &&
+	    count != fake.enum_files) {
+		EMSG("%zu of %zu names listed", count, fake.enum_files);
+		t->num_errors++;
+	}
+
+	set_value(p, TEE_IOCTL_PARAM_ATTR_TYPE_VALUE_INPUT, OPTEE_MRF_CLOSEDIR,
+		  handle);
+	fake_rpc(t, FAKE_OP_CLOSEDIR, OPTEE_MSG_RPC_CMD_FS, 1, p);
+}
+
+/* Drops the TA file from the page cache, so it's read from storage */
+static void evict_ta(struct fake_thread *t)
+{
+	int fd = open(fake.ta_path, O_RDONLY | O_CLOEXEC);
+	int e = 0;
+
+	if (fd < 0) {
+		EMSG("%s: %s", fake.ta_path, strerror(errno));
+		t->num_errors++;
+		return;
+	}
+	e = posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+	if (e) {
+		EMSG("posix_fadvise: %s", strerror(e));
+		t->num_errors++;
+	}
+	close(fd);
+}
+
+/*
+ * A TA load as done by OP-TEE: the size of the TA is queried, a shm
+ * object of that size allocated, the TA loaded into it and the shm
+ * object freed.
+ */
+static void ta_session(struct fake_thread *t)
+{
+	struct tee_ioctl_param p[FAKE_MAX_PARAMS];
+	uint64_t shm_id = 0;
+	uint64_t size = 0;
+
+	if (fake.ta_cold)
+		evict_ta(t);
+
+	set_value(p, TEE_IOCTL_PARAM_ATTR_TYPE_VALUE_INPUT, 0, 0);
+	memcpy(&p[0].a, fake.ta_uuid, sizeof(fake.ta_uuid));
+	set_memref(p + 1, TEE_IOCTL_PARAM_ATTR_TYPE_MEMREF_OUTPUT, 0, 0, 0);
+	if (fake_rpc(t, FAKE_OP_TA_SIZE, OPTEE_MSG_RPC_CMD_LOAD_TA, 2, p))
+		return;
+	size = MEMREF_SIZE(p + 1);
+
+	set_value(p, TEE_IOCTL_PARAM_ATTR_TYPE_VALUE_INOUT, 0, size);
+	if (fake_rpc(t, FAKE_OP_ALLOC, OPTEE_MSG_RPC_CMD_SHM_ALLOC, 1, p))
+		return;
+	shm_id = p[0].c;
+
+	set_value(p, TEE_IOCTL_PARAM_ATTR_TYPE_VALUE_INPUT, 0, 0);
+	memcpy(&p[0].a, fake.ta_uuid, sizeof(fake.ta_uuid));
+	set_memref(p + 1, TEE_IOCTL_PARAM_ATTR_TYPE_MEMREF_OUTPUT, 0, size,
+		   shm_id);
+	fake_rpc(t, FAKE_OP_TA_LOAD, OPTEE_MSG_RPC_CMD_LOAD_TA, 2, p);
+
+	set_value(p, TEE_IOCTL_PARAM_ATTR_TYPE_VALUE_INPUT, 0, shm_id);
+	fake_rpc(t, FAKE_OP_FREE, OPTEE_MSG_RPC_CMD_SHM_FREE, 1, p);
+}
+
+/*
+ * Identifies the holder of a shm object in a churn session, it's stored
+ * at both ends of the object.
+ */
+struct churn_stamp {
+	uint64_t thread;
+	uint64_t session;
+	uint64_t index;
+};
+
+/* Sizes are spread up to size=<n>, over the pool classes it covers */
+static size_t churn_size(size_t n, size_t i)
+{
+	return 2 * sizeof(struct churn_stamp) +
+	       (n * 7919 + i * 104729) % (fake.size + 1);
+}
+
+/* Returns true if the shm object @id looks up to the stamped buffer */
+static bool churn_check(struct fake_thread *t, size_t n, size_t i,
+			uint64_t id)
+{
+	struct tee_ioctl_param p;
+	struct churn_stamp stamp;
+	size_t size = churn_size(n, i);
+	uint8_t *va = NULL;
+
+	memset(&p, 0, sizeof(p));
+	memset(&stamp, 0, sizeof(stamp));
+	stamp.thread = t->req.id;
+	stamp.session = n;
+	stamp.index = i;
+
+	set_memref(&p, TEE_IOCTL_PARAM_ATTR_TYPE_MEMREF_INOUT, 0, size, id);
+	va = tee_supp_param_to_va(&p);
+	if (!va || memcmp(va, &stamp, sizeof(stamp)) ||
+	    memcmp(va + size - sizeof(stamp), &stamp, sizeof(stamp)))
+		return false;
+
+	/* The bounds of the object must be checked too */
+	set_memref(&p, TEE_IOCTL_PARAM_ATTR_TYPE_MEMREF_INOUT, 1, size, id);
+	return !tee_supp_param_to_va(&p);
+}
+
+/*
+ * Allocates churn=<n> shm objects of assorted sizes, stamps each with its
+ * holder, and frees them in an interleaved order after checking that
+ * every id still looks up to its own buffer. With several threads doing
+ * the same the shm hash and pool are exercised concurrently, a lookup
+ * hitting a buffer of another thread shows up as a bad stamp.
+ */
+static void churn_session(struct fake_thread *t, size_t n)
+{
+	struct tee_ioctl_param p[FAKE_MAX_PARAMS];
+	struct churn_stamp stamp;
+	uint64_t ids[FAKE_MAX_CHURN];
+	size_t num = 0;
+	size_t size = 0;
+	size_t i = 0;
+	uint8_t *va = NULL;
+
+	memset(&stamp, 0, sizeof(stamp));
+	stamp.thread = t->req.id;
+	stamp.session = n;
+
+	for (num = 0; num < fake.churn; num++) {
+		size = churn_size(n, num);
+		set_value(p, TEE_IOCTL_PARAM_ATTR_TYPE_VALUE_INOUT, 0, size);
+		if (fake_rpc(t, FAKE_OP_ALLOC, OPTEE_MSG_RPC_CMD_SHM_ALLOC, 1,
+			     p))
+			break;
+		ids[num] = p[0].c;
+
+		set_memref(p, TEE_IOCTL_PARAM_ATTR_TYPE_MEMREF_INOUT, 0, size,
+			   ids[num]);
+		va = tee_supp_param_to_va(p);
+		if (!va) {
+			EMSG("shm %" PRIu64 " not found", ids[num]);
+			t->num_errors++;
+			continue;
+		}
+		stamp.index = num;
+		memcpy(va, &stamp, sizeof(stamp));
+		memcpy(va + size - sizeof(stamp), &stamp, sizeof(stamp));
+	}
+
+	for (i = 0; i < num; i++) {
+		if (!churn_check(t, n, i, ids[i])) {
+			EMSG("shm %" PRIu64 " of thread %zu session %zu "
+			     "index %zu doesn't look up to its buffer",
+			     ids[i], t->req.id, n, i);
+			t->num_errors++;
+		}
+	}
+
+	/* Odd indexes first, so the frees are spread over the hash */
+	for (i = 0; i < num; i++) {
+		set_value(p, TEE_IOCTL_PARAM_ATTR_TYPE_VALUE_INPUT, 0,
+			  ids[(i * 2 + 1) % (num | 1)]);
+		fake_rpc(t, FAKE_OP_FREE, OPTEE_MSG_RPC_CMD_SHM_FREE, 1, p);
+	}
+}
+
+/*
+ * A storage session of a TA, through a shm object allocated for the
+ * purpose.
+ */
+static void run_session(struct fake_thread *t, size_t n)
+{
+	struct tee_ioctl_param p[FAKE_MAX_PARAMS];
+	uint64_t shm_id = 0;
+	uint8_t *va = NULL;
+
+	if (fake.ta_path) {
+		ta_session(t);
+		return;
+	}
+	if (fake.churn) {
+		churn_session(t, n);
+		return;
+	}
+
+	set_value(p, TEE_IOCTL_PARAM_ATTR_TYPE_VALUE_INOUT, 0,
+		  FAKE_DATA_OFFS + 2 * fake.size);
+	if (fake_rpc(t, FAKE_OP_ALLOC, OPTEE_MSG_RPC_CMD_SHM_ALLOC, 1, p))
+		return;
+	shm_id = p[0].c;
+
+	set_memref(p, TEE_IOCTL_PARAM_ATTR_TYPE_MEMREF_INOUT, 0,
+		   FAKE_DATA_OFFS + 2 * fake.size, shm_id);
+	va = tee_supp_param_to_va(p);
+	if (!va) {
+		EMSG("shm %" PRIu64 " not found", shm_id);
+		t->num_errors++;
+	} else if (fake.enum_files) {
+		enum_session(t, shm_id, va);
+	} else {
+		file_session(t, n, shm_id, va);
+	}
+
+	set_value(p, TEE_IOCTL_PARAM_ATTR_TYPE_VALUE_INPUT, 0, shm_id);
+	fake_rpc(t, FAKE_OP_FREE, OPTEE_MSG_RPC_CMD_SHM_FREE, 1, p);
+}
+
+/*
+ * Creates or, if @remove, removes the files listed by enum_session()
+ * directly in the secure storage directory.
+ */
+static int setup_enum_dir(bool remove)
+{
+	char path[PATH_MAX] = { 0 };
+	size_t n = 0;
+	int fd = -1;
+
+	for (n = 0; n < fake.enum_files; n++) {
+		snprintf(path, sizeof(path), "%s/%s",
+			 supplicant_params.fs_parent_path, FAKE_ENUM_DIR);
+		if (!n && !remove && mkdir(path, 0700) && errno != EEXIST)
+			return -1;
+		snprintf(path, sizeof(path), "%s/%s/%zu",
+			 supplicant_params.fs_parent_path, FAKE_ENUM_DIR, n);
+		if (remove) {
+			unlink(path);
+			continue;
+		}
+		fd = open(path, O_WRONLY | O_CREAT | O_CLOEXEC, 0600);
+		if (fd < 0)
+			return -1;
+		close(fd);
+	}
+
+	if (remove) {
+		snprintf(path, sizeof(path), "%s/%s",
+			 supplicant_params.fs_parent_path, FAKE_ENUM_DIR);
+		rmdir(path);
+	}
+	return 0;
+}
+
+static void timespec_add_ns(struct timespec *ts, uint64_t ns)
+{
+	ns += ts->tv_nsec;
+	ts->tv_sec += ns / 1000000000;
+	ts->tv_nsec = ns % 1000000000;
+}
+
+static void *secure_thread(void *arg)
+{
+	struct fake_thread *t = arg;
+	struct timespec next;
+	uint64_t period = 0;
+	size_t n = 0;
+
+	memset(&next, 0, sizeof(next));
+
+	/* Each thread paces its share of the total rate */
+	if (fake.rate)
+		period = (uint64_t)fake.num_threads * 1000000000 / fake.rate;
+	clock_gettime(CLOCK_MONOTONIC, &next);
+
+	for (n = t->first_session; n < fake.count; n += fake.num_threads) {
+		if (period) {
+			while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME,
+					       &next, NULL) == EINTR)
+				;
+			timespec_add_ns(&next, period);
+		}
+		run_session(t, n);
+	}
+
+	return NULL;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+	uint64_t va = *(const uint64_t *)a;
+	uint64_t vb = *(const uint64_t *)b;
+
+	return (va > vb) - (va < vb);
+}
+
+static uint64_t percentile_us(uint64_t *v, size_t count, unsigned int pm)
+{
+	return v[(count - 1) * pm / 1000] / 1000;
+}
+
+static void print_op_latencies(enum fake_op op)
+{
+	uint64_t *v = NULL;
+	uint64_t sum = 0;
+	size_t count = 0;
+	size_t n = 0;
+
+	for (n = 0; n < fake.num_threads; n++)
+		count += fake.threads[n].num_lat[op];
+	if (!count)
+		return;
+
+	v = malloc(count * sizeof(*v));
+	if (!v)
+		return;
+
+	count = 0;
+	for (n = 0; n < fake.num_threads; n++) {
+		memcpy(v + count, fake.threads[n].lat[op],
+		       fake.threads[n].num_lat[op] * sizeof(*v));
+		count += fake.threads[n].num_lat[op];
+	}
+	qsort(v, count, sizeof(*v), cmp_u64);
+	for (n = 0; n < count; n++)
+		sum += v[n];
+
+	printf("%s %zu %" PRIu64 " %" PRIu64 " %" PRIu64 " %" PRIu64 " %"
+	       PRIu64 " %" PRIu64 "\n", fake_op_names[op], count,
+	       sum / count / 1000, percentile_us(v, count, 500),
+	       percentile_us(v, count, 900), percentile_us(v, count, 990),
+	       percentile_us(v, count, 999), v[count - 1] / 1000);
+	free(v);
+}
+
+/* Runs the secure threads, prints the results and ends the process */
+static void *fake_main(void *arg)
+{
+	uint64_t start = stats_now_ns();
+	uint64_t elapsed = 0;
+	size_t num_errors = 0;
+	size_t num_rpcs = 0;
+	size_t n = 0;
+	size_t m = 0;
+	int e = 0;
+
+	(void)arg;
+
+	/* The listed files are created directly in the directory layout */
+	if (fake.enum_files && strcmp(supplicant_params.fs_backend, "dir")) {
+		EMSG("enum=<n> needs --fs-backend dir");
+		exit(EXIT_FAILURE);
+	}
+
+	if (setup_enum_dir(false)) {
+		EMSG("failed to create %s/%s: %s",
+		     supplicant_params.fs_parent_path, FAKE_ENUM_DIR,
+		     strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+	start = stats_now_ns();
+
+	for (n = 0; n < fake.num_threads; n++) {
+		e = pthread_create(&fake.threads[n].thread, NULL,
+				   secure_thread, fake.threads + n);
+		if (e) {
+			EMSG("pthread_create: %s", strerror(e));
+			exit(EXIT_FAILURE);
+		}
+	}
+	for (n = 0; n < fake.num_threads; n++)
+		pthread_join(fake.threads[n].thread, NULL);
+
+	elapsed = stats_now_ns() - start;
+	setup_enum_dir(true);
+	if (!elapsed)
+		elapsed = 1;
+	for (n = 0; n < fake.num_threads; n++) {
+		num_errors += fake.threads[n].num_errors;
+		for (m = 0; m < FAKE_NUM_OPS; m++)
+			num_rpcs += fake.threads[n].num_lat[m];
+	}
+
+	printf("secure_threads: %zu\n", fake.num_threads);
+	printf("sessions: %zu\n", fake.count);
+	printf("rpcs: %zu\n", num_rpcs);
+	printf("errors: %zu\n", num_errors);
+	printf("elapsed_ms: %" PRIu64 "\n", elapsed / 1000000);
+	printf("sessions_per_sec: %" PRIu64 "\n",
+	       (uint64_t)fake.count * 1000000000 / elapsed);
+	printf("rpcs_per_sec: %" PRIu64 "\n",
+	       (uint64_t)num_rpcs * 1000000000 / elapsed);
+	printf("# rpc count mean_us p50_us p90_us p99_us p999_us max_us\n");
+	for (m = 0; m < FAKE_NUM_OPS; m++)
+		print_op_latencies(m);
+	printf("# supplicant\n");
+	stats_print(stdout);
+	fflush(stdout);
+
+	exit(num_errors ? EXIT_FAILURE : EXIT_SUCCESS);
+}
+
+int fake_tee_open(void)
+{
+	struct fake_thread *t = NULL;
+	pthread_t thread;
+	size_t per_thread = 0;
+	size_t num = 0;
+	size_t n = 0;
+	size_t m = 0;
+	int e = 0;
+
+	memset(&thread, 0, sizeof(thread));
+
+	fake.fd = open("/dev/null", O_RDWR | O_CLOEXEC);
+	if (fake.fd < 0)
+		return -1;
+
+	fake.threads = calloc(fake.num_threads, sizeof(*fake.threads));
+	if (!fake.threads)
+		goto err;
+
+	/* Enumerating sessions issue up to enum=<n> + 1 readdir requests */
+	per_thread = fake.count / fake.num_threads + 1;
+	for (n = 0; n < fake.num_threads; n++) {
+		t = fake.threads + n;
+		t->req.id = n;
+		t->first_session = n;
+		e = pthread_cond_init(&t->cond, NULL);
+		if (e) {
+			EMSG("pthread_cond_init: %s", strerror(e));
+			goto err;
+		}
+		for (m = 0; m < FAKE_NUM_OPS; m++) {
+			num = per_thread;
+			if (m == FAKE_OP_READDIR)
+				num *= fake.enum_files + 1;
+			if (fake.churn &&
+			    (m == FAKE_OP_ALLOC || m == FAKE_OP_FREE))
+				num *= fake.churn;
+			t->lat[m] = malloc(num * sizeof(uint64_t));
+			if (!t->lat[m])
+				goto err;
+		}
+	}
+
+	e = pthread_create(&thread, NULL, fake_main, NULL);
+	if (e) {
+		EMSG("pthread_create: %s", strerror(e));
+		goto err;
+	}
+	pthread_detach(thread);
+
+	return fake.fd;
+err:
+	close(fake.fd);
+	fake.fd = -1;
+	return -1;
+}
+
+static int fake_recv(struct tee_ioctl_buf_data *data)
+{
+	struct tee_iocl_supp_recv_arg *recv = NULL;
+	struct tee_ioctl_param *p = NULL;
+	struct fake_req *req = NULL;
+
+	if (data->buf_len < sizeof(*recv))
+		return -EINVAL;
+	recv = (struct tee_iocl_supp_recv_arg *)(uintptr_t)data->buf_ptr;
+	p = (struct tee_ioctl_param *)(recv + 1);
+	if (data->buf_len < sizeof(*recv) + recv->num_params * sizeof(*p) ||
+	    recv->num_params < FAKE_MAX_PARAMS + 1)
+		return -EINVAL;
+
+	tee_supp_mutex_lock(&fake.mutex);
+	while (STAILQ_EMPTY(&fake.queue))
+		pthread_cond_wait(&fake.recv_cond, &fake.mutex);
+	req = STAILQ_FIRST(&fake.queue);
+	STAILQ_REMOVE_HEAD(&fake.queue, link);
+	tee_supp_mutex_unlock(&fake.mutex);
+
+	/* Nobody else touches the request until it's completed */
+	memset(p, 0, sizeof(*p));
+	p->attr = TEE_IOCTL_PARAM_ATTR_META;
+	p->a = req->id;
+	memcpy(p + 1, req->params, req->num_params * sizeof(*p));
+	recv->func = req->func;
+	recv->num_params = req->num_params + 1;
+
+	return 0;
+}
+
+static int fake_send(struct tee_ioctl_buf_data *data)
+{
+	struct tee_iocl_supp_send_arg *send = NULL;
+	struct tee_ioctl_param *p = NULL;
+	struct fake_req *req = NULL;
+
+	if (data->buf_len < sizeof(*send))
+		return -EINVAL;
+	send = (struct tee_iocl_supp_send_arg *)(uintptr_t)data->buf_ptr;
+	p = (struct tee_ioctl_param *)(send + 1);
+	if (data->buf_len < sizeof(*send) + send->num_params * sizeof(*p) ||
+	    !send->num_params || !(p->attr & TEE_IOCTL_PARAM_ATTR_META) ||
+	    p->a >= fake.num_threads)
+		return -EINVAL;
+
+	req = &fake.threads[p->a].req;
+	if (send->num_params - 1 != req->num_params)
+		return -EINVAL;
+
+	tee_supp_mutex_lock(&fake.mutex);
+	memcpy(req->params, p + 1, req->num_params * sizeof(*p));
+	req->ret = send->ret;
+	req->done = true;
+	pthread_cond_signal(&fake.threads[p->a].cond);
+	tee_supp_mutex_unlock(&fake.mutex);
+
+	return 0;
+}
+
+static int fake_shm_alloc(struct tee_ioctl_shm_alloc_data *data)
+{
+	int fd = memfd_create("fake-tee-shm", MFD_CLOEXEC);
+
+	if (fd < 0)
+		return -errno;
+	if (ftruncate(fd, data->size)) {
+		close(fd);
+		return -ENOMEM;
+	}
+
+	data->id = __atomic_fetch_add(&fake.next_shm_id, 1, __ATOMIC_RELAXED);
+	return fd;
+}
+
+static int fake_shm_register(struct tee_ioctl_shm_register_data *data)
+{
+	int fd = dup(fake.fd);
+
+	if (fd < 0)
+		return -errno;
+
+	data->id = __atomic_fetch_add(&fake.next_shm_id, 1, __ATOMIC_RELAXED);
+	return fd;
+}
+
+int fake_tee_ioctl(int fd, unsigned long req, void *data)
+{
+	struct tee_ioctl_version_data *vers = data;
+	int rc = 0;
+
+	if (fd != fake.fd) {
+		errno = EBADF;
+		return -1;
+	}
+
+	switch (req) {
+	case TEE_IOC_VERSION:
+		memset(vers, 0, sizeof(*vers));
+		vers->impl_id = TEE_IMPL_ID_OPTEE;
+		vers->gen_caps = TEE_GEN_CAP_GP | TEE_GEN_CAP_PRIVILEGED;
+		if (fake.reg_mem)
+			vers->gen_caps |= TEE_GEN_CAP_REG_MEM;
+		break;
+	case TEE_IOC_SUPPL_RECV:
+		rc = fake_recv(data);
+		break;
+	case TEE_IOC_SUPPL_SEND:
+		rc = fake_send(data);
+		break;
+	case TEE_IOC_SHM_ALLOC:
+		rc = fake_shm_alloc(data);
+		break;
+	case TEE_IOC_SHM_REGISTER:
+		rc = fake_shm_register(data);
+		break;
+	default:
+		rc = -ENOTTY;
+		break;
+	}
+
+	if (rc < 0) {
+		errno = -rc;
+		return -1;
+	}
+	return rc;
+}
@@ -0,0 +1,109 @@
+/*
+ * Copyright (c) 2026, Linaro Limited
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef FAKE_TEE_H
+#define FAKE_TEE_H
+
+#include <errno.h>
+#include <stdbool.h>
+
+/*
+ * An in-process stand-in for the OP-TEE driver used to benchmark the
+ * supplicant without a TEE. The file descriptor returned by
+ * fake_tee_open() is passed to fake_tee_ioctl() in place of ioctl() on
+ * /dev/teepriv. A number of synthetic secure world threads issue
+ * storage sessions, each made of shm alloc, fs create, write, read
+ * back and check, close, remove and shm free, or with enum=<n> of shm
+ * alloc, listing a directory and shm free, with ta=<path> TA loads, or
+ * with churn=<n> many shm allocs and frees, through
+ * TEE_IOC_SUPPL_RECV/SEND. When all
+ * sessions are done end to end latencies and throughput are printed and
+ * the process exits.
+ */
+
+#ifdef CFG_FAKE_TEE
+
+/*
+ * Configures the fake from a comma separated list of key=value pairs:
+ * threads=<n>	concurrent secure threads
+ * rate=<n>	sessions per second for all threads, 0 for no limit
+ * count=<n>	total number of sessions
+ * size=<n>	bytes written and read by each session
+ * io=single|vec	write and read with OPTEE_MRF_WRITE and OPTEE_MRF_READ
+ *		or with OPTEE_MRF_WRITEV and OPTEE_MRF_READV, in up to 8
+ *		extents
+ * shm=reg|alloc	emulate TEE_GEN_CAP_REG_MEM or TEE_IOC_SHM_ALLOC
+ * enum=<n>	list a directory of n files instead of writing a file,
+ *		with --fs-backend dir only
+ * readdir=single|batch	list with OPTEE_MRF_READDIR or, by default,
+ *		with OPTEE_MRF_READDIR_BATCH into a buffer of size bytes
+ * ta=<path>	load the TA at path, named after its UUID, instead of
+ *		storage sessions; it must be the file the supplicant loads
+ * cache=warm|cold	with ta=<path>, cold evicts the TA from the page
+ *		cache before each load
+ * churn=<n>	allocate n shm objects of up to size bytes, check that
+ *		each looks up to its own buffer and free them, instead of
+ *		storage sessions; at most 1024
+ * Returns 0 on success or -1.
+ */
+int fake_tee_configure(const char *spec);
+bool fake_tee_enabled(void);
+
+/* Returns a file descriptor standing in for an opened /dev/teepriv */
+int fake_tee_open(void);
+int fake_tee_ioctl(int fd, unsigned long req, void *data);
+
+#else
+
+static inline int fake_tee_configure(const char *spec)
+{
+	(void)spec;
+
+	return -1;
+}
+
+static inline bool fake_tee_enabled(void)
+{
+	return false;
+}
+
+static inline int fake_tee_open(void)
+{
+	return -1;
+}
+
+static inline int fake_tee_ioctl(int fd, unsigned long req, void *data)
+{
+	(void)fd;
+	(void)req;
+	(void)data;
+
+	errno = ENOTTY;
+	return -1;
+}
+
+#endif /*CFG_FAKE_TEE*/
+#endif /*FAKE_TEE_H*/
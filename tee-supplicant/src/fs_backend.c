@@ -0,0 +1,478 @@
+/*
+ * Copyright (c) 2026, Linaro Limited
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <fs_backend.h>
+#include <handle.h>
+#include <optee_msg_supplicant.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <tee_supplicant.h>
+
+#ifndef __aligned
+#define __aligned(x) __attribute__((__aligned__(x)))
+#endif
+#include <linux/tee.h>
+
+static const struct fs_backend *const fs_backends[] = {
+	&fs_container_backend,
+	&fs_ram_backend,
+};
+
+/* Names listed by OPTEE_MRF_OPENDIR, handed out by the readdir requests */
+struct fs_backend_dir {
+	char **names;
+	size_t count;
+	size_t pos;
+};
+
+static pthread_mutex_t dir_db_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct handle_db dir_db =
+		HANDLE_DB_INITIALIZER_WITH_MUTEX(&dir_db_mutex);
+
+/* See OPTEE_MRF_READV */
+struct fs_backend_extent {
+	uint64_t offs;
+	uint64_t len;
+};
+
+const struct fs_backend *fs_backend_find(const char *name)
+{
+	size_t n = 0;
+
+	for (n = 0; n < sizeof(fs_backends) / sizeof(fs_backends[0]); n++)
+		if (!strcmp(fs_backends[n]->name, name))
+			return fs_backends[n];
+
+	return NULL;
+}
+
+bool fs_backend_list_add(const char *dir, const char *name, char ***names,
+			 size_t *count)
+{
+	size_t dir_len = strlen(dir);
+	const char *slash = NULL;
+	size_t len = 0;
+	char **n = NULL;
+	size_t i = 0;
+
+	/* Directories are the name prefixes up to a '/' */
+	while (dir_len && dir[dir_len - 1] == '/')
+		dir_len--;
+	if (strncmp(name, dir, dir_len) || (dir_len && name[dir_len] != '/'))
+		return true;
+
+	name += dir_len + !!dir_len;
+	slash = strchr(name, '/');
+	len = slash ? (size_t)(slash - name) : strlen(name);
+
+	for (i = 0; i < *count; i++)
+		if (!strncmp((*names)[i], name, len) && !(*names)[i][len])
+			return true;
+
+	n = realloc(*names, (*count + 1) * sizeof(*n));
+	if (!n)
+		return false;
+	*names = n;
+	n[*count] = strndup(name, len);
+	if (!n[*count])
+		return false;
+	(*count)++;
+	return true;
+}
+
+static bool param_type_is(struct tee_ioctl_param *param, uint64_t type)
+{
+	return (param->attr & TEE_IOCTL_PARAM_ATTR_TYPE_MASK) == type;
+}
+
+static bool params_are(size_t num_params, struct tee_ioctl_param *params,
+		       size_t n, uint64_t t1, uint64_t t2)
+{
+	if (num_params != n ||
+	    !param_type_is(params, TEE_IOCTL_PARAM_ATTR_TYPE_VALUE_INPUT))
+		return false;
+	if (n > 1 && !param_type_is(params + 1, t1))
+		return false;
+	if (n > 2 && !param_type_is(params + 2, t2))
+		return false;
+	return true;
+}
+
+/* Returns the NUL terminated name in @param without leading '/' */
+static const char *param_to_name(struct tee_ioctl_param *param)
+{
+	const char *name = tee_supp_param_to_va(param);
+
+	if (!name || !memchr(name, 0, MEMREF_SIZE(param)))
+		return NULL;
+
+	while (*name == '/')
+		name++;
+	return name;
+}
+
+static TEEC_Result do_open(const struct fs_backend *be, bool create,
+			   size_t num_params, struct tee_ioctl_param *params)
+{
+	TEEC_Result res = TEEC_ERROR_GENERIC;
+	const char *name = NULL;
+	int fd = -1;
+
+	if (!params_are(num_params, params, 3,
+			TEE_IOCTL_PARAM_ATTR_TYPE_MEMREF_INPUT,
+			TEE_IOCTL_PARAM_ATTR_TYPE_VALUE_OUTPUT))
+		return TEEC_ERROR_BAD_PARAMETERS;
+
+	name = param_to_name(params + 1);
+	if (!name || !*name)
+		return TEEC_ERROR_BAD_PARAMETERS;
+
+	res = be->open(name, create, &fd);
+	if (res)
+		return res;
+
+	params[2].a = fd;
+	return TEEC_SUCCESS;
+}
+
+static TEEC_Result do_read(const struct fs_backend *be, size_t num_params,
+			   struct tee_ioctl_param *params)
+{
+	TEEC_Result res = TEEC_ERROR_GENERIC;
+	size_t len = 0;
+	void *buf = NULL;
+
+	if (!params_are(num_params, params, 2,
+			TEE_IOCTL_PARAM_ATTR_TYPE_MEMREF_OUTPUT, 0))
+		return TEEC_ERROR_BAD_PARAMETERS;
+
+	buf = tee_supp_param_to_va(params + 1);
+	if (!buf)
+		return TEEC_ERROR_BAD_PARAMETERS;
+	len = MEMREF_SIZE(params + 1);
+
+	res = be->read(params[0].b, buf, &len, params[0].c);
+	if (res)
+		return res;
+
+	MEMREF_SIZE(params + 1) = len;
+	return TEEC_SUCCESS;
+}
+
+static TEEC_Result do_write(const struct fs_backend *be, size_t num_params,
+			    struct tee_ioctl_param *params)
+{
+	void *buf = NULL;
+
+	if (!params_are(num_params, params, 2,
+			TEE_IOCTL_PARAM_ATTR_TYPE_MEMREF_INPUT, 0))
+		return TEEC_ERROR_BAD_PARAMETERS;
+
+	buf = tee_supp_param_to_va(params + 1);
+	if (!buf)
+		return TEEC_ERROR_BAD_PARAMETERS;
+
+	return be->write(params[0].b, buf, MEMREF_SIZE(params + 1),
+			 params[0].c);
+}
+
+static TEEC_Result do_remove(const struct fs_backend *be, size_t num_params,
+			     struct tee_ioctl_param *params)
+{
+	const char *name = NULL;
+
+	if (!params_are(num_params, params, 2,
+			TEE_IOCTL_PARAM_ATTR_TYPE_MEMREF_INPUT, 0))
+		return TEEC_ERROR_BAD_PARAMETERS;
+
+	name = param_to_name(params + 1);
+	if (!name || !*name)
+		return TEEC_ERROR_BAD_PARAMETERS;
+
+	return be->remove(name);
+}
+
+static TEEC_Result do_rename(const struct fs_backend *be, size_t num_params,
+			     struct tee_ioctl_param *params)
+{
+	const char *old_name = NULL;
+	const char *new_name = NULL;
+
+	if (!params_are(num_params, params, 3,
+			TEE_IOCTL_PARAM_ATTR_TYPE_MEMREF_INPUT,
+			TEE_IOCTL_PARAM_ATTR_TYPE_MEMREF_INPUT))
+		return TEEC_ERROR_BAD_PARAMETERS;
+
+	old_name = param_to_name(params + 1);
+	new_name = param_to_name(params + 2);
+	if (!old_name || !*old_name || !new_name || !*new_name)
+		return TEEC_ERROR_BAD_PARAMETERS;
+
+	return be->rename(old_name, new_name, params[0].b);
+}
+
+static void free_dir(struct fs_backend_dir *dir)
+{
+	size_t n = 0;
+
+	for (n = 0; n < dir->count; n++)
+		free(dir->names[n]);
+	free(dir->names);
+	free(dir);
+}
+
+static TEEC_Result do_opendir(const struct fs_backend *be,
+			      size_t num_params,
+			      struct tee_ioctl_param *params)
+{
+	TEEC_Result res = TEEC_ERROR_GENERIC;
+	struct fs_backend_dir *dir = NULL;
+	const char *name = NULL;
+	int handle = 0;
+
+	if (!params_are(num_params, params, 3,
+			TEE_IOCTL_PARAM_ATTR_TYPE_MEMREF_INPUT,
+			TEE_IOCTL_PARAM_ATTR_TYPE_VALUE_OUTPUT))
+		return TEEC_ERROR_BAD_PARAMETERS;
+
+	name = param_to_name(params + 1);
+	if (!name)
+		return TEEC_ERROR_BAD_PARAMETERS;
+
+	dir = calloc(1, sizeof(*dir));
+	if (!dir)
+		return TEEC_ERROR_OUT_OF_MEMORY;
+
+	res = be->list(name, &dir->names, &dir->count);
+	if (!res && !dir->count)
+		res = TEEC_ERROR_ITEM_NOT_FOUND;
+	if (res) {
+		free_dir(dir);
+		return res;
+	}
+
+	handle = handle_get(&dir_db, dir);
+	if (handle < 0) {
+		free_dir(dir);
+		return TEEC_ERROR_OUT_OF_MEMORY;
+	}
+
+	params[2].a = handle;
+	return TEEC_SUCCESS;
+}
+
+static TEEC_Result do_closedir(size_t num_params,
+			       struct tee_ioctl_param *params)
+{
+	struct fs_backend_dir *dir = NULL;
+
+	if (!params_are(num_params, params, 1, 0, 0))
+		return TEEC_ERROR_BAD_PARAMETERS;
+
+	dir = handle_put(&dir_db, params[0].b);
+	if (!dir)
+		return TEEC_ERROR_BAD_PARAMETERS;
+
+	free_dir(dir);
+	return TEEC_SUCCESS;
+}
+
+static TEEC_Result do_readdir(size_t num_params,
+			      struct tee_ioctl_param *params)
+{
+	struct fs_backend_dir *dir = NULL;
+	size_t len = 0;
+	char *buf = NULL;
+
+	if (!params_are(num_params, params, 2,
+			TEE_IOCTL_PARAM_ATTR_TYPE_MEMREF_OUTPUT, 0))
+		return TEEC_ERROR_BAD_PARAMETERS;
+
+	buf = tee_supp_param_to_va(params + 1);
+	if (!buf)
+		return TEEC_ERROR_BAD_PARAMETERS;
+
+	dir = handle_lookup(&dir_db, params[0].b);
+	if (!dir)
+		return TEEC_ERROR_BAD_PARAMETERS;
+	if (dir->pos == dir->count)
+		return TEEC_ERROR_ITEM_NOT_FOUND;
+
+	len = strlen(dir->names[dir->pos]) + 1;
+	if (len > MEMREF_SIZE(params + 1)) {
+		MEMREF_SIZE(params + 1) = len;
+		return TEEC_ERROR_SHORT_BUFFER;
+	}
+
+	memcpy(buf, dir->names[dir->pos], len);
+	MEMREF_SIZE(params + 1) = len;
+	dir->pos++;
+	return TEEC_SUCCESS;
+}
+
+static TEEC_Result do_readdir_batch(size_t num_params,
+				    struct tee_ioctl_param *params)
+{
+	struct fs_backend_dir *dir = NULL;
+	uint8_t *buf = NULL;
+	size_t used = 0;
+	size_t count = 0;
+	size_t len = 0;
+	uint16_t l = 0;
+
+	if (!params_are(num_params, params, 3,
+			TEE_IOCTL_PARAM_ATTR_TYPE_MEMREF_OUTPUT,
+			TEE_IOCTL_PARAM_ATTR_TYPE_VALUE_OUTPUT))
+		return TEEC_ERROR_BAD_PARAMETERS;
+
+	buf = tee_supp_param_to_va(params + 1);
+	if (!buf)
+		return TEEC_ERROR_BAD_PARAMETERS;
+
+	dir = handle_lookup(&dir_db, params[0].b);
+	if (!dir)
+		return TEEC_ERROR_BAD_PARAMETERS;
+	if (dir->pos == dir->count)
+		return TEEC_ERROR_ITEM_NOT_FOUND;
+
+	while (dir->pos < dir->count) {
+		len = strlen(dir->names[dir->pos]) + 1;
+		if (sizeof(l) + len > MEMREF_SIZE(params + 1) - used)
+			break;
+		l = len;
+		memcpy(buf + used, &l, sizeof(l));
+		memcpy(buf + used + sizeof(l), dir->names[dir->pos], len);
+		used += sizeof(l) + len;
+		dir->pos++;
+		count++;
+	}
+
+	if (!count) {
+		MEMREF_SIZE(params + 1) = sizeof(l) + len;
+		return TEEC_ERROR_SHORT_BUFFER;
+	}
+
+	MEMREF_SIZE(params + 1) = used;
+	params[2].a = count;
+	params[2].b = dir->pos == dir->count;
+	return TEEC_SUCCESS;
+}
+
+static TEEC_Result do_rw_vector(const struct fs_backend *be, bool write,
+				size_t num_params,
+				struct tee_ioctl_param *params)
+{
+	TEEC_Result res = TEEC_ERROR_GENERIC;
+	struct fs_backend_extent *e = NULL;
+	uint8_t *buf = NULL;
+	uint64_t total = 0;
+	size_t len = 0;
+	size_t n = 0;
+
+	if (!params_are(num_params, params, 3,
+			TEE_IOCTL_PARAM_ATTR_TYPE_MEMREF_INPUT,
+			write ? TEE_IOCTL_PARAM_ATTR_TYPE_MEMREF_INPUT :
+				TEE_IOCTL_PARAM_ATTR_TYPE_MEMREF_OUTPUT))
+		return TEEC_ERROR_BAD_PARAMETERS;
+
+	e = tee_supp_param_to_va(params + 1);
+	buf = tee_supp_param_to_va(params + 2);
+	if (!e || !buf || params[0].c > MEMREF_SIZE(params + 1) / sizeof(*e))
+		return TEEC_ERROR_BAD_PARAMETERS;
+	for (n = 0; n < params[0].c; n++) {
+		if (e[n].len > MEMREF_SIZE(params + 2) - total)
+			return TEEC_ERROR_BAD_PARAMETERS;
+		total += e[n].len;
+	}
+
+	total = 0;
+	for (n = 0; n < params[0].c; n++) {
+		len = e[n].len;
+		if (write)
+			res = be->write(params[0].b, buf + total, len,
+					e[n].offs);
+		else
+			res = be->read(params[0].b, buf + total, &len,
+				       e[n].offs);
+		if (res)
+			return res;
+		total += len;
+		if (len < e[n].len)
+			break;
+	}
+
+	if (!write)
+		MEMREF_SIZE(params + 2) = total;
+	return TEEC_SUCCESS;
+}
+
+TEEC_Result fs_backend_process(const struct fs_backend *be,
+			       size_t num_params,
+			       struct tee_ioctl_param *params)
+{
+	switch (params->a) {
+	case OPTEE_MRF_OPEN:
+		return do_open(be, false, num_params, params);
+	case OPTEE_MRF_CREATE:
+		return do_open(be, true, num_params, params);
+	case OPTEE_MRF_CLOSE:
+		if (!params_are(num_params, params, 1, 0, 0))
+			return TEEC_ERROR_BAD_PARAMETERS;
+		return be->close(params[0].b);
+	case OPTEE_MRF_READ:
+		return do_read(be, num_params, params);
+	case OPTEE_MRF_WRITE:
+		return do_write(be, num_params, params);
+	case OPTEE_MRF_TRUNCATE:
+		if (!params_are(num_params, params, 1, 0, 0))
+			return TEEC_ERROR_BAD_PARAMETERS;
+		return be->truncate(params[0].b, params[0].c);
+	case OPTEE_MRF_REMOVE:
+		return do_remove(be, num_params, params);
+	case OPTEE_MRF_RENAME:
+		return do_rename(be, num_params, params);
+	case OPTEE_MRF_OPENDIR:
+		return do_opendir(be, num_params, params);
+	case OPTEE_MRF_CLOSEDIR:
+		return do_closedir(num_params, params);
+	case OPTEE_MRF_READDIR:
+		return do_readdir(num_params, params);
+	case OPTEE_MRF_SYNC:
+		if (!params_are(num_params, params, 1, 0, 0))
+			return TEEC_ERROR_BAD_PARAMETERS;
+		return be->sync(params[0].b);
+	case OPTEE_MRF_READDIR_BATCH:
+		return do_readdir_batch(num_params, params);
+	case OPTEE_MRF_READV:
+		return do_rw_vector(be, false, num_params, params);
+	case OPTEE_MRF_WRITEV:
+		return do_rw_vector(be, true, num_params, params);
+	default:
+		return TEEC_ERROR_BAD_PARAMETERS;
+	}
+}
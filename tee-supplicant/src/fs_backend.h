@@ -0,0 +1,102 @@
+/*
+ * Copyright (c) 2026, Linaro Limited
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef FS_BACKEND_H
+#define FS_BACKEND_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <tee_client_api.h>
+
+struct tee_ioctl_param;
+
+/*
+ * Secure storage is by default kept as one host file per object below
+ * --fs-parent-path, served directly by tee_supp_fs.c. Other layouts,
+ * selected with --fs-backend, implement these operations and
+ * fs_backend_process() decodes the OPTEE_MRF_* requests for them.
+ *
+ * Names are those used by the secure side without leading '/', with
+ * '/' separating directories which exist implicitly while they hold
+ * files. File handles are small integers returned to the secure side.
+ * All functions return a TEEC_Result and may be called concurrently.
+ */
+struct fs_backend {
+	const char *name;
+	/* Set if --fs-parent-path must be made before init() */
+	bool needs_root;
+	/* Called before the first request, @root is --fs-parent-path */
+	int (*init)(const char *root);
+	TEEC_Result (*open)(const char *name, bool create, int *fd);
+	TEEC_Result (*close)(int fd);
+	/* Updates @len if the end of the file is reached */
+	TEEC_Result (*read)(int fd, void *buf, size_t *len, uint64_t offs);
+	TEEC_Result (*write)(int fd, const void *buf, size_t len,
+			     uint64_t offs);
+	TEEC_Result (*truncate)(int fd, uint64_t len);
+	TEEC_Result (*remove)(const char *name);
+	TEEC_Result (*rename)(const char *old_name, const char *new_name,
+			      bool overwrite);
+	/*
+	 * Returns a malloc()ed array of the malloc()ed names of the files
+	 * and directories in directory @name, TEEC_ERROR_ITEM_NOT_FOUND if
+	 * there are none.
+	 */
+	TEEC_Result (*list)(const char *name, char ***names, size_t *count);
+	TEEC_Result (*sync)(int fd);
+	/* Optional: imports the files of the directory layout at @root */
+	int (*migrate)(const char *root);
+	void (*print_stats)(FILE *f);
+};
+
+/*
+ * Largest file a backend keeps, larger writes and truncates fail. It's
+ * the limit of the 32-bit block numbers of the container, far above
+ * anything the secure side stores.
+ */
+#define FS_BACKEND_MAX_FILE_SIZE	((uint64_t)(UINT32_MAX - 1) * 4096)
+
+extern const struct fs_backend fs_container_backend;
+extern const struct fs_backend fs_ram_backend;
+
+/* Returns the backend called @name or NULL */
+const struct fs_backend *fs_backend_find(const char *name);
+
+/*
+ * For list(): adds the name of the entry of directory @dir, "" for the
+ * root, which holds file @name, if any, to @names unless already there.
+ * Returns false if out of memory.
+ */
+bool fs_backend_list_add(const char *dir, const char *name, char ***names,
+			 size_t *count);
+
+TEEC_Result fs_backend_process(const struct fs_backend *be,
+			       size_t num_params,
+			       struct tee_ioctl_param *params);
+
+#endif /*FS_BACKEND_H*/
@@ -0,0 +1,1414 @@
+/*
+ * Copyright (c) 2026, Linaro Limited
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/* For nftw() */
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <fs_backend.h>
+#include <ftw.h>
+#include <handle.h>
+#include <inttypes.h>
+#include <libgen.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/queue.h>
+#include <sys/stat.h>
+#include <teec_trace.h>
+#include <tee_supplicant.h>
+#include <unistd.h>
+
+/*
+ * All secure storage files are kept in one container file instead of a
+ * host file per object and directories per TA. The container is made
+ * of blocks of CTR_BLOCK_SIZE:
+ *
+ * - Blocks 0 and 1 hold two copies of struct ctr_super, the valid one
+ *   with the highest generation is used.
+ * - Then come two journal areas of journal_blocks each, of which the
+ *   super block selects the active one. They're sized from the initial
+ *   size of the container, 1/CTR_JOURNAL_RATIO of it each.
+ * - The remaining blocks hold file data, handed out by an extent
+ *   allocator. The container is grown when they run out.
+ *
+ * File data is never overwritten in place: a write goes to newly
+ * allocated blocks, which are then mapped into the file by a record
+ * appended to the journal. The journal is the only metadata, at start
+ * up the records of the active area are replayed, up to the first one
+ * which is torn or left from an earlier use of the area. Records are
+ * made durable in batches by ctr_commit(), which syncs the data blocks
+ * before writing the records, so a record never refers to data which
+ * isn't on disk. Blocks a record unmaps are only reused once it's
+ * durable. When the active area is full the whole state is written as
+ * records to the other area, which the super block is then switched
+ * to. Since that must always fit, writes and new names are refused once
+ * the worst case size of the state would exceed an area.
+ *
+ * Without --fs-durability deferred every update is committed before the
+ * request returns, otherwise only at the same points as the directory
+ * layout syncs files. Since records are replayed in order, a crash
+ * loses the updates after some point, never some in between.
+ */
+#define CTR_BLOCK_SIZE		4096
+#define CTR_MAGIC		"OPTEECTR"
+#define CTR_VERSION		1
+#define CTR_MIN_JOURNAL_BLOCKS	256
+#define CTR_MAX_JOURNAL_BLOCKS	(64 * 1024)
+/* Enough for a map record per block of a fully fragmented container */
+#define CTR_JOURNAL_RATIO	64
+#define CTR_REC_MAGIC		0x43524543
+/* Uncommitted records which force a commit in deferred mode */
+#define CTR_MAX_PENDING		(64 * 1024)
+
+/* All integers are in native byte order */
+struct ctr_super {
+	char magic[8];
+	uint32_t version;
+	uint32_t block_size;
+	uint64_t generation;
+	uint32_t journal_blocks;
+	uint32_t active;	/* Journal area in use, 0 or 1 */
+	uint64_t seq;		/* Sequence number of its first record */
+	uint32_t crc;
+	uint32_t reserved;	/* Zero, keeps the crc free of padding */
+};
+
+enum ctr_rec_type {
+	CTR_REC_CREATE = 1,	/* Payload: name */
+	CTR_REC_MAP,		/* Payload: struct ctr_rec_map */
+	CTR_REC_SIZE,		/* Payload: uint64_t size */
+	CTR_REC_REMOVE,
+	CTR_REC_RENAME,		/* Payload: new name */
+};
+
+struct ctr_rec {
+	uint32_t magic;
+	uint16_t type;
+	uint16_t len;		/* Of the payload following the record */
+	uint64_t seq;
+	uint32_t id;		/* Of the file */
+	uint32_t crc;		/* Of record and payload, with crc = 0 */
+};
+
+/* Maps @count blocks from @phys at block @file_blk of the file */
+struct ctr_rec_map {
+	uint64_t file_blk;
+	uint64_t phys;
+	uint64_t count;
+	uint64_t size;		/* Of the file after the update */
+};
+
+struct ctr_file {
+	uint32_t id;
+	char *name;
+	uint64_t size;
+	uint32_t *blocks;	/* Block of each file block, 0 for holes */
+	size_t num_blocks;
+	unsigned int refs;	/* Open handles */
+	bool removed;
+	TAILQ_ENTRY(ctr_file) link;
+};
+
+static struct {
+	pthread_mutex_t mutex;
+	int fd;
+	char path[PATH_MAX];
+	dev_t dev;
+	ino_t ino;
+	struct ctr_super sb;
+	TAILQ_HEAD(ctr_file_head, ctr_file) files;
+	size_t num_files;
+	uint32_t next_id;
+	struct handle_db handles;
+	/* One bit per block, set for used blocks */
+	uint8_t *bitmap;
+	uint32_t num_blocks;
+	uint32_t num_free;
+	uint32_t cursor;
+	/* Next record and where it goes in the active journal area */
+	uint64_t seq;
+	size_t tail;
+	bool replaying;
+	/* Records not yet written, and blocks to free once they are */
+	uint8_t *pending;
+	size_t pending_len;
+	size_t pending_size;
+	/* Checkpoints are built here, keeping the pending records */
+	uint8_t *snap;
+	size_t snap_size;
+	/* Of the names of all files, for the size of a checkpoint */
+	size_t names_len;
+	uint32_t *freed;
+	size_t num_freed;
+	size_t max_freed;
+	uint64_t commits;
+	uint64_t checkpoints;
+} ctr = {
+	.mutex = PTHREAD_MUTEX_INITIALIZER,
+	.fd = -1,
+	.files = TAILQ_HEAD_INITIALIZER(ctr.files),
+	.next_id = 1,
+	.handles = HANDLE_DB_INITIALIZER,
+};
+
+static uint32_t crc32(uint32_t crc, const void *data, size_t len)
+{
+	const uint8_t *p = data;
+	size_t n = 0;
+	int b = 0;
+
+	crc = ~crc;
+	for (n = 0; n < len; n++) {
+		crc ^= p[n];
+		for (b = 0; b < 8; b++)
+			crc = (crc >> 1) ^ (0xedb88320 & -(crc & 1));
+	}
+	return ~crc;
+}
+
+static int pread_all(void *buf, size_t len, uint64_t offs)
+{
+	uint8_t *b = buf;
+	ssize_t r = 0;
+
+	while (len) {
+		r = pread(ctr.fd, b, len, offs);
+		if (r < 0 && errno == EINTR)
+			continue;
+		if (r <= 0)
+			return -1;
+		b += r;
+		len -= r;
+		offs += r;
+	}
+	return 0;
+}
+
+static int pwrite_all(const void *buf, size_t len, uint64_t offs)
+{
+	const uint8_t *b = buf;
+	ssize_t r = 0;
+
+	while (len) {
+		r = pwrite(ctr.fd, b, len, offs);
+		if (r < 0 && errno == EINTR)
+			continue;
+		if (r < 0)
+			return -1;
+		b += r;
+		len -= r;
+		offs += r;
+	}
+	return 0;
+}
+
+static int sync_container(void)
+{
+	while (fdatasync(ctr.fd)) {
+		if (errno != EINTR)
+			return -1;
+	}
+	return 0;
+}
+
+static uint32_t data_start(void)
+{
+	return 2 + 2 * ctr.sb.journal_blocks;
+}
+
+static size_t journal_size(void)
+{
+	return (size_t)ctr.sb.journal_blocks * CTR_BLOCK_SIZE;
+}
+
+/* Records recreating a file, and a data block of it, in a checkpoint */
+#define CTR_FILE_META	(2 * sizeof(struct ctr_rec) + sizeof(uint64_t))
+#define CTR_BLOCK_META	(sizeof(struct ctr_rec) + sizeof(struct ctr_rec_map))
+
+/*
+ * Returns for how many more data blocks a checkpoint would still fit
+ * in a journal area with @files more files and @names_len more bytes
+ * of names, assuming a map record for each block.
+ */
+static uint64_t meta_room(size_t files, size_t names_len)
+{
+	uint64_t used = ctr.num_blocks - ctr.num_free - data_start();
+	uint64_t meta = (uint64_t)(ctr.num_files + files) * CTR_FILE_META +
+			ctr.names_len + names_len + used * CTR_BLOCK_META;
+
+	if (meta >= journal_size())
+		return 0;
+	return (journal_size() - meta) / CTR_BLOCK_META;
+}
+
+static bool block_used(uint32_t b)
+{
+	return ctr.bitmap[b / 8] & (1 << (b % 8));
+}
+
+static void set_block_used(uint32_t b, bool used)
+{
+	if (used) {
+		ctr.bitmap[b / 8] |= 1 << (b % 8);
+		ctr.num_free--;
+	} else {
+		ctr.bitmap[b / 8] &= ~(1 << (b % 8));
+		ctr.num_free++;
+	}
+}
+
+/* Adds at least @min blocks to the container */
+static int grow(uint32_t min)
+{
+	uint32_t num = ctr.num_blocks / 2;
+	uint8_t *bitmap = NULL;
+	uint32_t b = 0;
+	int e = 0;
+
+	if (num < min)
+		num = min;
+	if (num > UINT32_MAX - ctr.num_blocks)
+		return -1;
+
+	e = posix_fallocate(ctr.fd, (off_t)ctr.num_blocks * CTR_BLOCK_SIZE,
+			    (off_t)num * CTR_BLOCK_SIZE);
+	if (e) {
+		EMSG("growing %s: %s", ctr.path, strerror(e));
+		return -1;
+	}
+
+	bitmap = realloc(ctr.bitmap, (ctr.num_blocks + num + 7) / 8);
+	if (!bitmap)
+		return -1;
+	ctr.bitmap = bitmap;
+	for (b = ctr.num_blocks; b < ctr.num_blocks + num; b++) {
+		ctr.bitmap[b / 8] &= ~(1 << (b % 8));
+		ctr.num_free++;
+	}
+	ctr.num_blocks += num;
+	return 0;
+}
+
+/*
+ * Allocates up to @want contiguous blocks, returns the number allocated
+ * and the first in @phys, or 0 if the container can't grow.
+ */
+static uint32_t alloc_blocks(uint32_t want, uint32_t *phys)
+{
+	uint64_t room = meta_room(0, 0);
+	uint32_t start = 0;
+	uint32_t b = 0;
+	uint32_t n = 0;
+
+	if (!room) {
+		EMSG("%s: no room in the journal for more data", ctr.path);
+		return 0;
+	}
+	if (want > room)
+		want = room;
+	if (!ctr.num_free && grow(want))
+		return 0;
+
+	/* Next fit, files written together are laid out together */
+	b = ctr.cursor;
+	while (block_used(b)) {
+		if (++b == ctr.num_blocks)
+			b = data_start();
+	}
+	start = b;
+	while (n < want && b < ctr.num_blocks && !block_used(b)) {
+		set_block_used(b, true);
+		b++;
+		n++;
+	}
+
+	ctr.cursor = b < ctr.num_blocks ? b : data_start();
+	*phys = start;
+	return n;
+}
+
+/* Makes room for @num more blocks to be freed by free_block_later() */
+static int reserve_freed(size_t num)
+{
+	uint32_t *freed = NULL;
+	size_t n = ctr.max_freed;
+
+	if (ctr.replaying || ctr.num_freed + num <= ctr.max_freed)
+		return 0;
+
+	if (!n)
+		n = 256;
+	while (n < ctr.num_freed + num)
+		n *= 2;
+	freed = realloc(ctr.freed, n * sizeof(*freed));
+	if (!freed)
+		return -1;
+	ctr.freed = freed;
+	ctr.max_freed = n;
+	return 0;
+}
+
+/* Frees @b once the records written so far are durable */
+static int free_block_later(uint32_t b)
+{
+	if (ctr.replaying)
+		return 0;
+
+	if (reserve_freed(1))
+		return -1;
+	ctr.freed[ctr.num_freed++] = b;
+	return 0;
+}
+
+static void release_freed(void)
+{
+	size_t n = 0;
+
+	for (n = 0; n < ctr.num_freed; n++)
+		set_block_used(ctr.freed[n], false);
+	ctr.num_freed = 0;
+}
+
+static int add_rec(enum ctr_rec_type type, uint32_t id, const void *payload,
+		   size_t len)
+{
+	struct ctr_rec rec = {
+		.magic = CTR_REC_MAGIC,
+		.type = type,
+		.len = len,
+		.seq = ctr.seq,
+		.id = id,
+	};
+	uint8_t *p = NULL;
+	size_t n = 0;
+
+	if (len > UINT16_MAX)
+		return -1;
+
+	if (ctr.pending_len + sizeof(rec) + len > ctr.pending_size) {
+		n = ctr.pending_size ? ctr.pending_size : 4096;
+		while (n < ctr.pending_len + sizeof(rec) + len)
+			n *= 2;
+		p = realloc(ctr.pending, n);
+		if (!p)
+			return -1;
+		ctr.pending = p;
+		ctr.pending_size = n;
+	}
+
+	rec.crc = crc32(crc32(0, &rec, sizeof(rec)), payload, len);
+	memcpy(ctr.pending + ctr.pending_len, &rec, sizeof(rec));
+	memcpy(ctr.pending + ctr.pending_len + sizeof(rec), payload, len);
+	ctr.pending_len += sizeof(rec) + len;
+	ctr.seq++;
+	return 0;
+}
+
+static int write_super(struct ctr_super *sb)
+{
+	uint8_t blk[CTR_BLOCK_SIZE] = { 0 };
+
+	sb->crc = 0;
+	sb->crc = crc32(0, sb, sizeof(*sb));
+	memcpy(blk, sb, sizeof(*sb));
+	if (pwrite_all(blk, sizeof(blk),
+		       (sb->generation % 2) * CTR_BLOCK_SIZE) ||
+	    sync_container())
+		return -1;
+	return 0;
+}
+
+static uint64_t journal_offs(uint32_t area)
+{
+	return (2 + (uint64_t)area * ctr.sb.journal_blocks) * CTR_BLOCK_SIZE;
+}
+
+static int snapshot_file(struct ctr_file *f);
+
+/*
+ * Writes the whole state to the journal area not in use and switches
+ * to it, dropping the pending records which the state includes. If
+ * that fails they're kept, the next commit tries again.
+ */
+static int checkpoint(void)
+{
+	struct ctr_super sb = ctr.sb;
+	struct ctr_file *f = NULL;
+	uint8_t *pending = ctr.pending;
+	size_t pending_len = ctr.pending_len;
+	size_t pending_size = ctr.pending_size;
+	uint64_t seq = ctr.seq;
+	size_t len = 0;
+	int res = -1;
+
+	/* add_rec() appends to ctr.pending, point it at the snapshot */
+	ctr.pending = ctr.snap;
+	ctr.pending_len = 0;
+	ctr.pending_size = ctr.snap_size;
+	sb.seq = ctr.seq;
+	sb.active = !ctr.sb.active;
+	sb.generation++;
+
+	TAILQ_FOREACH(f, &ctr.files, link)
+		if (!f->removed && snapshot_file(f))
+			goto out;
+	len = ctr.pending_len;
+	if (len > journal_size()) {
+		EMSG("%s: metadata exceeds the journal", ctr.path);
+		goto out;
+	}
+
+	if (sync_container() ||
+	    pwrite_all(ctr.pending, len, journal_offs(sb.active)) ||
+	    sync_container() || write_super(&sb))
+		goto out;
+	res = 0;
+out:
+	ctr.snap = ctr.pending;
+	ctr.snap_size = ctr.pending_size;
+	ctr.pending = pending;
+	ctr.pending_size = pending_size;
+	if (res) {
+		ctr.pending_len = pending_len;
+		ctr.seq = seq;
+		return res;
+	}
+
+	ctr.sb = sb;
+	ctr.tail = len;
+	ctr.pending_len = 0;
+	ctr.checkpoints++;
+	release_freed();
+	return 0;
+}
+
+/* Makes the updates done so far durable */
+static int commit(void)
+{
+	if (!ctr.pending_len) {
+		release_freed();
+		return 0;
+	}
+
+	if (ctr.tail + ctr.pending_len > journal_size())
+		return checkpoint();
+
+	/* Data first, so records never point at data not on disk */
+	if (sync_container() ||
+	    pwrite_all(ctr.pending, ctr.pending_len,
+		       journal_offs(ctr.sb.active) + ctr.tail) ||
+	    sync_container())
+		return -1;
+
+	ctr.tail += ctr.pending_len;
+	ctr.pending_len = 0;
+	ctr.commits++;
+	release_freed();
+	return 0;
+}
+
+/* Commits unless deferred durability allows to wait for a barrier */
+static TEEC_Result commit_unless_deferred(bool barrier)
+{
+	if (supplicant_params.fs_deferred_sync && !barrier &&
+	    ctr.pending_len < CTR_MAX_PENDING)
+		return TEEC_SUCCESS;
+	if (commit())
+		return TEEC_ERROR_GENERIC;
+	return TEEC_SUCCESS;
+}
+
+static struct ctr_file *find_file(const char *name)
+{
+	struct ctr_file *f = NULL;
+
+	TAILQ_FOREACH(f, &ctr.files, link)
+		if (!f->removed && !strcmp(f->name, name))
+			return f;
+	return NULL;
+}
+
+static struct ctr_file *find_file_id(uint32_t id)
+{
+	struct ctr_file *f = NULL;
+
+	TAILQ_FOREACH(f, &ctr.files, link)
+		if (!f->removed && f->id == id)
+			return f;
+	return NULL;
+}
+
+static struct ctr_file *new_file(uint32_t id, const char *name, size_t len)
+{
+	struct ctr_file *f = calloc(1, sizeof(*f));
+
+	if (!f)
+		return NULL;
+	f->name = strndup(name, len);
+	if (!f->name) {
+		free(f);
+		return NULL;
+	}
+	f->id = id;
+	if (id >= ctr.next_id)
+		ctr.next_id = id + 1;
+	TAILQ_INSERT_TAIL(&ctr.files, f, link);
+	ctr.num_files++;
+	ctr.names_len += strlen(f->name);
+	return f;
+}
+
+static void free_file(struct ctr_file *f)
+{
+	TAILQ_REMOVE(&ctr.files, f, link);
+	ctr.num_files--;
+	ctr.names_len -= strlen(f->name);
+	free(f->blocks);
+	free(f->name);
+	free(f);
+}
+
+/* Unmaps the blocks of @f from file block @blk on */
+static void file_unmap_from(struct ctr_file *f, size_t blk)
+{
+	size_t n = 0;
+
+	for (n = blk; n < f->num_blocks; n++) {
+		if (f->blocks[n] && !free_block_later(f->blocks[n]))
+			f->blocks[n] = 0;
+	}
+}
+
+static int file_map(struct ctr_file *f, uint64_t file_blk, uint32_t phys,
+		    uint32_t count)
+{
+	uint32_t *blocks = NULL;
+	size_t n = 0;
+
+	if (file_blk + count > f->num_blocks) {
+		n = file_blk + count;
+		blocks = realloc(f->blocks, n * sizeof(*blocks));
+		if (!blocks)
+			return -1;
+		memset(blocks + f->num_blocks, 0,
+		       (n - f->num_blocks) * sizeof(*blocks));
+		f->blocks = blocks;
+		f->num_blocks = n;
+	}
+
+	/* Nothing can fail once the first block is mapped */
+	if (reserve_freed(count))
+		return -1;
+	for (n = 0; n < count; n++) {
+		if (f->blocks[file_blk + n])
+			free_block_later(f->blocks[file_blk + n]);
+		f->blocks[file_blk + n] = phys + n;
+	}
+	return 0;
+}
+
+static void file_set_size(struct ctr_file *f, uint64_t size)
+{
+	file_unmap_from(f, (size + CTR_BLOCK_SIZE - 1) / CTR_BLOCK_SIZE);
+	f->size = size;
+}
+
+/* Adds records recreating @f, used by checkpoint() */
+static int snapshot_file(struct ctr_file *f)
+{
+	struct ctr_rec_map map = { 0 };
+	size_t n = 0;
+
+	if (add_rec(CTR_REC_CREATE, f->id, f->name, strlen(f->name)))
+		return -1;
+
+	for (n = 0; n < f->num_blocks; n++) {
+		if (!f->blocks[n])
+			continue;
+		if (map.count && n == map.file_blk + map.count &&
+		    f->blocks[n] == map.phys + map.count) {
+			map.count++;
+			continue;
+		}
+		if (map.count &&
+		    add_rec(CTR_REC_MAP, f->id, &map, sizeof(map)))
+			return -1;
+		map.file_blk = n;
+		map.phys = f->blocks[n];
+		map.count = 1;
+		map.size = f->size;
+	}
+	if (map.count && add_rec(CTR_REC_MAP, f->id, &map, sizeof(map)))
+		return -1;
+
+	return add_rec(CTR_REC_SIZE, f->id, &f->size, sizeof(f->size));
+}
+
+/* Applies a record read from the journal, returns false if it's bad */
+static bool apply_rec(struct ctr_rec *rec, uint8_t *payload)
+{
+	struct ctr_file *f = find_file_id(rec->id);
+	struct ctr_rec_map map = { 0 };
+	char *name = NULL;
+
+	switch (rec->type) {
+	case CTR_REC_CREATE:
+		return !f && new_file(rec->id, (char *)payload, rec->len);
+	case CTR_REC_MAP:
+		if (!f || rec->len != sizeof(map))
+			return false;
+		memcpy(&map, payload, sizeof(map));
+		if (map.phys < data_start() ||
+		    map.phys + map.count > ctr.num_blocks ||
+		    map.file_blk + map.count > UINT32_MAX ||
+		    file_map(f, map.file_blk, map.phys, map.count))
+			return false;
+		f->size = map.size;
+		return true;
+	case CTR_REC_SIZE:
+		if (!f || rec->len != sizeof(f->size))
+			return false;
+		memcpy(&f->size, payload, sizeof(f->size));
+		if (f->size > FS_BACKEND_MAX_FILE_SIZE)
+			return false;
+		file_set_size(f, f->size);
+		return true;
+	case CTR_REC_REMOVE:
+		if (!f)
+			return false;
+		free_file(f);
+		return true;
+	case CTR_REC_RENAME:
+		if (!f)
+			return false;
+		name = strndup((char *)payload, rec->len);
+		if (!name)
+			return false;
+		ctr.names_len += strlen(name) - strlen(f->name);
+		free(f->name);
+		f->name = name;
+		return true;
+	default:
+		return false;
+	}
+}
+
+/* Replays the active journal area and rebuilds the block bitmap */
+static int replay(void)
+{
+	uint8_t *journal = malloc(journal_size());
+	struct ctr_file *f = NULL;
+	struct ctr_rec rec;
+	uint32_t crc = 0;
+	size_t offs = 0;
+	size_t n = 0;
+	int res = -1;
+
+	if (!journal)
+		return -1;
+	if (pread_all(journal, journal_size(),
+		      journal_offs(ctr.sb.active)))
+		goto out;
+
+	ctr.replaying = true;
+	ctr.seq = ctr.sb.seq;
+	while (offs + sizeof(rec) <= journal_size()) {
+		memcpy(&rec, journal + offs, sizeof(rec));
+		if (rec.magic != CTR_REC_MAGIC || rec.seq != ctr.seq ||
+		    offs + sizeof(rec) + rec.len > journal_size())
+			break;
+		crc = rec.crc;
+		rec.crc = 0;
+		if (crc32(crc32(0, &rec, sizeof(rec)),
+			  journal + offs + sizeof(rec), rec.len) != crc)
+			break;
+		if (!apply_rec(&rec, journal + offs + sizeof(rec))) {
+			EMSG("%s: bad record %" PRIu64, ctr.path, rec.seq);
+			goto out;
+		}
+		offs += sizeof(rec) + rec.len;
+		ctr.seq++;
+	}
+	ctr.replaying = false;
+	ctr.tail = offs;
+
+	ctr.bitmap = calloc((ctr.num_blocks + 7) / 8, 1);
+	if (!ctr.bitmap)
+		goto out;
+	ctr.num_free = ctr.num_blocks;
+	for (n = 0; n < data_start(); n++)
+		set_block_used(n, true);
+	TAILQ_FOREACH(f, &ctr.files, link) {
+		for (n = 0; n < f->num_blocks; n++) {
+			if (!f->blocks[n])
+				continue;
+			if (block_used(f->blocks[n])) {
+				EMSG("%s: block %" PRIu32 " used twice",
+				     ctr.path, f->blocks[n]);
+				goto out;
+			}
+			set_block_used(f->blocks[n], true);
+		}
+	}
+	ctr.cursor = data_start();
+	res = 0;
+out:
+	ctr.replaying = false;
+	free(journal);
+	return res;
+}
+
+static bool super_valid(struct ctr_super *sb)
+{
+	uint32_t crc = sb->crc;
+	struct ctr_super s = *sb;
+
+	s.crc = 0;
+	return !memcmp(s.magic, CTR_MAGIC, sizeof(s.magic)) &&
+	       s.version == CTR_VERSION && s.block_size == CTR_BLOCK_SIZE &&
+	       s.journal_blocks >= CTR_MIN_JOURNAL_BLOCKS &&
+	       s.journal_blocks <= CTR_MAX_JOURNAL_BLOCKS && s.active < 2 &&
+	       crc32(0, &s, sizeof(s)) == crc;
+}
+
+static int format(void)
+{
+	struct ctr_super sb;
+	size_t size = supplicant_params.fs_container_size;
+	size_t blocks = size / CTR_BLOCK_SIZE / CTR_JOURNAL_RATIO;
+	char dir[PATH_MAX] = { 0 };
+	int fd = -1;
+	int e = 0;
+
+	if (blocks < CTR_MIN_JOURNAL_BLOCKS)
+		blocks = CTR_MIN_JOURNAL_BLOCKS;
+	if (blocks > CTR_MAX_JOURNAL_BLOCKS)
+		blocks = CTR_MAX_JOURNAL_BLOCKS;
+	if (size < (2 + 2 * blocks + 1) * CTR_BLOCK_SIZE)
+		size = (2 + 2 * blocks + 1) * CTR_BLOCK_SIZE;
+	e = posix_fallocate(ctr.fd, 0, size);
+	if (e) {
+		EMSG("allocating %s: %s", ctr.path, strerror(e));
+		return -1;
+	}
+
+	memset(&sb, 0, sizeof(sb));
+	memcpy(sb.magic, CTR_MAGIC, sizeof(sb.magic));
+	sb.version = CTR_VERSION;
+	sb.block_size = CTR_BLOCK_SIZE;
+	sb.journal_blocks = blocks;
+	sb.seq = 1;
+	if (write_super(&sb))
+		return -1;
+
+	/* Make the new container itself durable */
+	strncpy(dir, ctr.path, sizeof(dir));
+	dir[sizeof(dir) - 1] = '\0';
+	fd = open(dirname(dir), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (fd >= 0) {
+		fsync(fd);
+		close(fd);
+	}
+	return 0;
+}
+
+static int ctr_init(const char *root)
+{
+	uint8_t blk[CTR_BLOCK_SIZE] = { 0 };
+	struct ctr_super sb[2];
+	struct stat st;
+	size_t n = 0;
+	int res = -1;
+
+	memset(&st, 0, sizeof(st));
+	memset(sb, 0, sizeof(sb));
+
+	tee_supp_mutex_lock(&ctr.mutex);
+	if (ctr.fd >= 0) {
+		res = 0;
+		goto out;
+	}
+
+	if (supplicant_params.fs_container)
+		n = snprintf(ctr.path, sizeof(ctr.path), "%s",
+			     supplicant_params.fs_container);
+	else
+		n = snprintf(ctr.path, sizeof(ctr.path), "%s/storage.ctr",
+			     root);
+	if (n >= sizeof(ctr.path))
+		goto out;
+
+	ctr.fd = open(ctr.path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+	if (ctr.fd < 0) {
+		EMSG("open %s: %s", ctr.path, strerror(errno));
+		goto out;
+	}
+	if (fstat(ctr.fd, &st))
+		goto err;
+	if (!st.st_size && format())
+		goto err;
+
+	for (n = 0; n < 2; n++) {
+		if (pread_all(blk, sizeof(blk), n * CTR_BLOCK_SIZE))
+			goto bad;
+		memcpy(sb + n, blk, sizeof(sb[n]));
+	}
+	if (super_valid(sb) &&
+	    (!super_valid(sb + 1) || sb[0].generation > sb[1].generation))
+		ctr.sb = sb[0];
+	else if (super_valid(sb + 1))
+		ctr.sb = sb[1];
+	else
+		goto bad;
+
+	if (fstat(ctr.fd, &st) ||
+	    st.st_size / CTR_BLOCK_SIZE > UINT32_MAX ||
+	    st.st_size / CTR_BLOCK_SIZE <= data_start())
+		goto bad;
+	ctr.num_blocks = st.st_size / CTR_BLOCK_SIZE;
+	ctr.dev = st.st_dev;
+	ctr.ino = st.st_ino;
+
+	if (replay())
+		goto bad;
+
+	IMSG("%s: %zu files, %" PRIu32 " of %" PRIu32 " blocks free",
+	     ctr.path, ctr.num_files, ctr.num_free, ctr.num_blocks);
+	res = 0;
+	goto out;
+bad:
+	EMSG("%s: not a valid container", ctr.path);
+err:
+	close(ctr.fd);
+	ctr.fd = -1;
+out:
+	tee_supp_mutex_unlock(&ctr.mutex);
+	return res;
+}
+
+static TEEC_Result ctr_open(const char *name, bool create, int *fd)
+{
+	TEEC_Result res = TEEC_ERROR_GENERIC;
+	struct ctr_file *f = NULL;
+	uint64_t size = 0;
+
+	tee_supp_mutex_lock(&ctr.mutex);
+	f = find_file(name);
+	if (!f && !create) {
+		res = TEEC_ERROR_ITEM_NOT_FOUND;
+		goto out;
+	}
+
+	if (create && f) {
+		/* Like O_TRUNC */
+		if (add_rec(CTR_REC_SIZE, f->id, &size, sizeof(size)))
+			goto out;
+		file_set_size(f, 0);
+	} else if (create) {
+		if (!meta_room(1, strlen(name))) {
+			EMSG("%s: no room in the journal for more files",
+			     ctr.path);
+			goto out;
+		}
+		if (add_rec(CTR_REC_CREATE, ctr.next_id, name, strlen(name)))
+			goto out;
+		f = new_file(ctr.next_id, name, strlen(name));
+		if (!f)
+			goto out;
+	}
+
+	*fd = handle_get(&ctr.handles, f);
+	if (*fd < 0) {
+		res = TEEC_ERROR_OUT_OF_MEMORY;
+		goto out;
+	}
+	f->refs++;
+
+	res = TEEC_SUCCESS;
+	if (create)
+		res = commit_unless_deferred(true);
+out:
+	tee_supp_mutex_unlock(&ctr.mutex);
+	return res;
+}
+
+static TEEC_Result ctr_close(int fd)
+{
+	TEEC_Result res = TEEC_ERROR_BAD_PARAMETERS;
+	struct ctr_file *f = NULL;
+
+	tee_supp_mutex_lock(&ctr.mutex);
+	f = handle_put(&ctr.handles, fd);
+	if (!f)
+		goto out;
+
+	res = commit_unless_deferred(true);
+	f->refs--;
+	if (!f->refs && f->removed) {
+		/* The removal is committed, nothing refers to the blocks */
+		file_unmap_from(f, 0);
+		if (!res)
+			release_freed();
+		free_file(f);
+	}
+out:
+	tee_supp_mutex_unlock(&ctr.mutex);
+	return res;
+}
+
+/* Reads @len bytes of @f at @offs, holes read as zeroes */
+static int read_blocks(struct ctr_file *f, uint8_t *buf, size_t len,
+		       uint64_t offs)
+{
+	uint64_t blk = 0;
+	uint64_t next = 0;
+	uint32_t phys = 0;
+	uint32_t p = 0;
+	size_t boffs = 0;
+	size_t n = 0;
+
+	while (len) {
+		blk = offs / CTR_BLOCK_SIZE;
+		boffs = offs % CTR_BLOCK_SIZE;
+		phys = blk < f->num_blocks ? f->blocks[blk] : 0;
+
+		/* Extend over the blocks following on disk, or over holes */
+		n = CTR_BLOCK_SIZE - boffs;
+		while (n < len) {
+			next = blk + (boffs + n) / CTR_BLOCK_SIZE;
+			p = next < f->num_blocks ? f->blocks[next] : 0;
+			if (phys ? p != phys + (next - blk) : p != 0)
+				break;
+			n += CTR_BLOCK_SIZE;
+		}
+		if (n > len)
+			n = len;
+
+		if (!phys)
+			memset(buf, 0, n);
+		else if (pread_all(buf, n,
+				   (uint64_t)phys * CTR_BLOCK_SIZE + boffs))
+			return -1;
+
+		buf += n;
+		len -= n;
+		offs += n;
+	}
+	return 0;
+}
+
+static TEEC_Result ctr_read(int fd, void *buf, size_t *len, uint64_t offs)
+{
+	TEEC_Result res = TEEC_ERROR_BAD_PARAMETERS;
+	struct ctr_file *f = NULL;
+
+	tee_supp_mutex_lock(&ctr.mutex);
+	f = handle_lookup(&ctr.handles, fd);
+	if (!f)
+		goto out;
+
+	if (offs >= f->size)
+		*len = 0;
+	else if (*len > f->size - offs)
+		*len = f->size - offs;
+
+	res = TEEC_SUCCESS;
+	if (read_blocks(f, buf, *len, offs))
+		res = TEEC_ERROR_GENERIC;
+out:
+	tee_supp_mutex_unlock(&ctr.mutex);
+	return res;
+}
+
+/*
+ * Writes @len bytes at @offs of @f to new blocks, which replace the
+ * old ones, leaving the file @size bytes long. Partial blocks are
+ * completed from the old ones. If a run of blocks can't be mapped its
+ * record is dropped and the blocks freed, runs mapped before are kept.
+ */
+static int write_blocks(struct ctr_file *f, const uint8_t *buf, size_t len,
+			uint64_t offs, uint64_t size)
+{
+	struct ctr_rec_map map = { 0 };
+	uint64_t end = offs + len;
+	uint64_t blk = offs / CTR_BLOCK_SIZE;
+	uint64_t last = (end - 1) / CTR_BLOCK_SIZE;
+	uint64_t run_start = 0;
+	uint64_t s = 0;
+	uint64_t e = 0;
+	size_t pending_len = 0;
+	uint8_t *bounce = NULL;
+	uint64_t seq = 0;
+	uint32_t phys = 0;
+	uint32_t n = 0;
+	int res = -1;
+
+	while (blk <= last) {
+		n = alloc_blocks(last - blk + 1 > UINT32_MAX ?
+				 UINT32_MAX : last - blk + 1, &phys);
+		if (!n)
+			return -1;
+
+		bounce = calloc(n, CTR_BLOCK_SIZE);
+		if (!bounce)
+			goto out;
+		run_start = blk * CTR_BLOCK_SIZE;
+		if (offs > run_start &&
+		    read_blocks(f, bounce, CTR_BLOCK_SIZE, run_start))
+			goto out;
+		if (blk + n - 1 == last && end % CTR_BLOCK_SIZE &&
+		    (n > 1 || offs <= run_start) &&
+		    read_blocks(f, bounce + (n - 1) * CTR_BLOCK_SIZE,
+				CTR_BLOCK_SIZE, last * CTR_BLOCK_SIZE))
+			goto out;
+
+		s = offs > run_start ? offs : run_start;
+		e = run_start + (uint64_t)n * CTR_BLOCK_SIZE;
+		if (e > end)
+			e = end;
+		memcpy(bounce + (s - run_start), buf + (s - offs), e - s);
+
+		if (pwrite_all(bounce, (size_t)n * CTR_BLOCK_SIZE,
+			       (uint64_t)phys * CTR_BLOCK_SIZE))
+			goto out;
+		free(bounce);
+		bounce = NULL;
+
+		map.file_blk = blk;
+		map.phys = phys;
+		map.count = n;
+		map.size = e > f->size ? e : f->size;
+		if (map.size > size)
+			map.size = size;
+		pending_len = ctr.pending_len;
+		seq = ctr.seq;
+		if (!f->removed &&
+		    add_rec(CTR_REC_MAP, f->id, &map, sizeof(map)))
+			goto out;
+		if (file_map(f, blk, phys, n)) {
+			ctr.pending_len = pending_len;
+			ctr.seq = seq;
+			goto out;
+		}
+		f->size = map.size;
+		blk += n;
+	}
+	res = 0;
+out:
+	if (res)
+		while (n--)
+			set_block_used(phys + n, false);
+	free(bounce);
+	return res;
+}
+
+static TEEC_Result ctr_write(int fd, const void *buf, size_t len,
+			     uint64_t offs)
+{
+	TEEC_Result res = TEEC_ERROR_BAD_PARAMETERS;
+	struct ctr_file *f = NULL;
+
+	tee_supp_mutex_lock(&ctr.mutex);
+	f = handle_lookup(&ctr.handles, fd);
+	if (!f || offs + len < offs || offs + len > FS_BACKEND_MAX_FILE_SIZE)
+		goto out;
+
+	res = TEEC_SUCCESS;
+	if (!len)
+		goto out;
+	if (write_blocks(f, buf, len, offs,
+			 offs + len > f->size ? offs + len : f->size)) {
+		res = TEEC_ERROR_GENERIC;
+		goto out;
+	}
+	/* Writes to the first block commit updates of the REE FS */
+	res = commit_unless_deferred(offs < CTR_BLOCK_SIZE);
+out:
+	tee_supp_mutex_unlock(&ctr.mutex);
+	return res;
+}
+
+static TEEC_Result ctr_truncate(int fd, uint64_t len)
+{
+	TEEC_Result res = TEEC_ERROR_BAD_PARAMETERS;
+	uint8_t blk[CTR_BLOCK_SIZE] = { 0 };
+	struct ctr_file *f = NULL;
+	size_t tail = len % CTR_BLOCK_SIZE;
+
+	tee_supp_mutex_lock(&ctr.mutex);
+	f = handle_lookup(&ctr.handles, fd);
+	if (!f || len > FS_BACKEND_MAX_FILE_SIZE)
+		goto out;
+
+	res = TEEC_ERROR_GENERIC;
+	/* Bytes past the end must read as zeroes if the file grows again */
+	if (len < f->size && tail &&
+	    len / CTR_BLOCK_SIZE < f->num_blocks &&
+	    f->blocks[len / CTR_BLOCK_SIZE]) {
+		if (read_blocks(f, blk, tail, len - tail) ||
+		    write_blocks(f, blk, CTR_BLOCK_SIZE, len - tail, len))
+			goto out;
+	}
+	if (!f->removed && add_rec(CTR_REC_SIZE, f->id, &len, sizeof(len)))
+		goto out;
+	file_set_size(f, len);
+	res = commit_unless_deferred(true);
+out:
+	tee_supp_mutex_unlock(&ctr.mutex);
+	return res;
+}
+
+/* Removes @f, called with the mutex held */
+static int remove_file(struct ctr_file *f)
+{
+	if (add_rec(CTR_REC_REMOVE, f->id, NULL, 0))
+		return -1;
+
+	f->removed = true;
+	if (!f->refs) {
+		file_unmap_from(f, 0);
+		free_file(f);
+	}
+	return 0;
+}
+
+static TEEC_Result ctr_remove(const char *name)
+{
+	TEEC_Result res = TEEC_ERROR_ITEM_NOT_FOUND;
+	struct ctr_file *f = NULL;
+
+	tee_supp_mutex_lock(&ctr.mutex);
+	f = find_file(name);
+	if (!f)
+		goto out;
+	res = TEEC_ERROR_GENERIC;
+	if (remove_file(f))
+		goto out;
+	res = commit_unless_deferred(true);
+out:
+	tee_supp_mutex_unlock(&ctr.mutex);
+	return res;
+}
+
+static TEEC_Result ctr_rename(const char *old_name, const char *new_name,
+			      bool overwrite)
+{
+	TEEC_Result res = TEEC_ERROR_ITEM_NOT_FOUND;
+	struct ctr_file *f = NULL;
+	struct ctr_file *t = NULL;
+	char *name = NULL;
+
+	tee_supp_mutex_lock(&ctr.mutex);
+	f = find_file(old_name);
+	if (!f)
+		goto out;
+	t = find_file(new_name);
+	if (t == f) {
+		res = TEEC_SUCCESS;
+		goto out;
+	}
+	if (t && !overwrite) {
+		res = TEEC_ERROR_ACCESS_CONFLICT;
+		goto out;
+	}
+
+	res = TEEC_ERROR_GENERIC;
+	if (strlen(new_name) > strlen(f->name) &&
+	    !meta_room(0, strlen(new_name) - strlen(f->name))) {
+		EMSG("%s: no room in the journal for longer names", ctr.path);
+		goto out;
+	}
+	name = strdup(new_name);
+	if (!name || (t && remove_file(t)) ||
+	    add_rec(CTR_REC_RENAME, f->id, name, strlen(name))) {
+		free(name);
+		goto out;
+	}
+	ctr.names_len += strlen(name) - strlen(f->name);
+	free(f->name);
+	f->name = name;
+	res = commit_unless_deferred(true);
+out:
+	tee_supp_mutex_unlock(&ctr.mutex);
+	return res;
+}
+
+static TEEC_Result ctr_list(const char *name, char ***names, size_t *count)
+{
+	TEEC_Result res = TEEC_SUCCESS;
+	struct ctr_file *f = NULL;
+
+	tee_supp_mutex_lock(&ctr.mutex);
+	TAILQ_FOREACH(f, &ctr.files, link) {
+		if (!f->removed &&
+		    !fs_backend_list_add(name, f->name, names, count)) {
+			res = TEEC_ERROR_OUT_OF_MEMORY;
+			break;
+		}
+	}
+	tee_supp_mutex_unlock(&ctr.mutex);
+
+	return res;
+}
+
+static TEEC_Result ctr_sync(int fd)
+{
+	TEEC_Result res = TEEC_ERROR_BAD_PARAMETERS;
+
+	tee_supp_mutex_lock(&ctr.mutex);
+	if (handle_lookup(&ctr.handles, fd))
+		res = commit_unless_deferred(true);
+	tee_supp_mutex_unlock(&ctr.mutex);
+
+	return res;
+}
+
+static struct {
+	const char *root;
+	size_t files;
+	size_t bytes;
+	size_t skipped;
+} migration;
+
+static int read_host_file(const char *path, uint8_t *buf, size_t len)
+{
+	ssize_t r = 0;
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+
+	if (fd < 0)
+		return -1;
+	while (len) {
+		r = read(fd, buf, len);
+		if (r < 0 && errno == EINTR)
+			continue;
+		if (r <= 0)
+			break;
+		buf += r;
+		len -= r;
+	}
+	close(fd);
+	return len ? -1 : 0;
+}
+
+static int migrate_file(const char *path, const struct stat *st,
+			int type, struct FTW *ftw)
+{
+	const char *name = path + strlen(migration.root);
+	size_t len = st->st_size;
+	TEEC_Result res = TEEC_ERROR_GENERIC;
+	uint8_t *buf = NULL;
+	bool exists = false;
+	int fd = -1;
+
+	(void)ftw;
+
+	if (type != FTW_F ||
+	    (st->st_dev == ctr.dev && st->st_ino == ctr.ino))
+		return 0;
+	while (*name == '/')
+		name++;
+
+	tee_supp_mutex_lock(&ctr.mutex);
+	exists = find_file(name);
+	tee_supp_mutex_unlock(&ctr.mutex);
+	if (exists) {
+		migration.skipped++;
+		return 0;
+	}
+
+	buf = malloc(len ? len : 1);
+	if (!buf || read_host_file(path, buf, len) ||
+	    ctr_open(name, true, &fd)) {
+		EMSG("migrating %s failed", path);
+		free(buf);
+		return -1;
+	}
+	res = ctr_write(fd, buf, len, 0);
+	if (ctr_close(fd))
+		res = TEEC_ERROR_GENERIC;
+	free(buf);
+	if (res) {
+		EMSG("migrating %s failed", path);
+		return -1;
+	}
+
+	migration.files++;
+	migration.bytes += len;
+	return 0;
+}
+
+static int ctr_migrate(const char *root)
+{
+	int res = 0;
+
+	memset(&migration, 0, sizeof(migration));
+	migration.root = root;
+
+	res = nftw(root, migrate_file, 16, FTW_PHYS);
+	tee_supp_mutex_lock(&ctr.mutex);
+	if (commit())
+		res = -1;
+	tee_supp_mutex_unlock(&ctr.mutex);
+
+	IMSG("migrated %zu files, %zu bytes, from %s to %s, %zu already "
+	     "present", migration.files, migration.bytes, root, ctr.path,
+	     migration.skipped);
+	return res ? -1 : 0;
+}
+
+static void ctr_print_stats(FILE *f)
+{
+	tee_supp_mutex_lock(&ctr.mutex);
+	fprintf(f, "fs_container files %zu blocks %" PRIu32 " free %" PRIu32
+		" commits %" PRIu64 " checkpoints %" PRIu64 "\n",
+		ctr.num_files, ctr.num_blocks, ctr.num_free, ctr.commits,
+		ctr.checkpoints);
+	tee_supp_mutex_unlock(&ctr.mutex);
+}
+
+const struct fs_backend fs_container_backend = {
+	.name = "container",
+	.needs_root = true,
+	.init = ctr_init,
+	.open = ctr_open,
+	.close = ctr_close,
+	.read = ctr_read,
+	.write = ctr_write,
+	.truncate = ctr_truncate,
+	.remove = ctr_remove,
+	.rename = ctr_rename,
+	.list = ctr_list,
+	.sync = ctr_sync,
+	.migrate = ctr_migrate,
+	.print_stats = ctr_print_stats,
+};
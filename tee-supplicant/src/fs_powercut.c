@@ -0,0 +1,361 @@
+/*
+ * Copyright (c) 2026, Linaro Limited
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <fs_powercut.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/param.h>
+#include <sys/queue.h>
+#include <sys/stat.h>
+#include <teec_trace.h>
+#include <tee_supp_fs.h>
+#include <tee_supplicant.h>
+#include <unistd.h>
+
+/* Inconsistent power cuts logged, the others are only counted */
+#define PC_MAX_LOGGED	16
+
+/* The head area of a file, zero past its end */
+struct pc_head {
+	uint8_t data[REE_FS_HEAD_AREA_SIZE];
+};
+
+struct pc_file {
+	dev_t dev;
+	ino_t ino;
+	uint8_t *data;		/* As written */
+	uint8_t *durable;	/* As left by a power cut */
+	uint32_t *commit;	/* Commits before the last write of each byte */
+	size_t len;
+	size_t durable_len;
+	size_t size;		/* Of each of the above arrays */
+	/* Writes to the head area, and what it held after the last two */
+	uint32_t commits;
+	struct pc_head head;
+	struct pc_head prev_head;
+	bool head_unsynced;	/* Written since the last sync */
+	bool uncommitted;	/* The last commit may be lost */
+	TAILQ_ENTRY(pc_file) link;
+};
+
+static struct {
+	pthread_mutex_t mutex;
+	TAILQ_HEAD(pc_file_head, pc_file) files;
+	size_t uncommitted;
+	size_t points;
+	size_t failures;
+	bool out_of_memory;
+} pc = {
+	.mutex = PTHREAD_MUTEX_INITIALIZER,
+	.files = TAILQ_HEAD_INITIALIZER(pc.files),
+};
+
+static bool file_resize(struct pc_file *f, size_t len)
+{
+	uint8_t *data = NULL;
+	uint8_t *durable = NULL;
+	uint32_t *commit = NULL;
+	size_t n = f->size ? f->size : 4096;
+
+	if (f->size && len <= f->size)
+		return true;
+	while (n < len)
+		n *= 2;
+
+	data = realloc(f->data, n);
+	if (data)
+		f->data = data;
+	durable = realloc(f->durable, n);
+	if (durable)
+		f->durable = durable;
+	commit = realloc(f->commit, n * sizeof(*commit));
+	if (commit)
+		f->commit = commit;
+	if (!data || !durable || !commit)
+		return false;
+	f->size = n;
+	return true;
+}
+
+static void get_head(struct pc_head *h, const uint8_t *data, size_t len)
+{
+	len = MIN(len, sizeof(h->data));
+	memcpy(h->data, data, len);
+	memset(h->data + len, 0, sizeof(h->data) - len);
+}
+
+/* Sets the length of @f as written, new bytes read as zeroes */
+static bool file_set_len(struct pc_file *f, size_t len)
+{
+	size_t n = 0;
+
+	if (!file_resize(f, len))
+		return false;
+	for (n = f->len; n < len; n++) {
+		f->data[n] = 0;
+		f->commit[n] = f->commits;
+	}
+	f->len = len;
+	return true;
+}
+
+static void file_make_durable(struct pc_file *f)
+{
+	memcpy(f->durable, f->data, f->len);
+	f->durable_len = f->len;
+	f->head_unsynced = false;
+}
+
+/* Starts tracking the file @fd with @st as it is now, assumed durable */
+static struct pc_file *file_new(int fd, struct stat *st)
+{
+	struct pc_file *f = calloc(1, sizeof(*f));
+	ssize_t r = 0;
+
+	if (!f || !file_resize(f, st->st_size))
+		goto err;
+	f->dev = st->st_dev;
+	f->ino = st->st_ino;
+	while (f->len < (size_t)st->st_size) {
+		r = pread(fd, f->data + f->len, st->st_size - f->len, f->len);
+		if (r <= 0)
+			goto err;
+		f->len += r;
+	}
+	memset(f->commit, 0, f->len * sizeof(*f->commit));
+	file_make_durable(f);
+	get_head(&f->head, f->data, f->len);
+	TAILQ_INSERT_TAIL(&pc.files, f, link);
+	return f;
+err:
+	if (f) {
+		free(f->data);
+		free(f->durable);
+		free(f->commit);
+	}
+	free(f);
+	return NULL;
+}
+
+/* Returns the tracked file @fd, or NULL if it isn't a regular file */
+static struct pc_file *file_get(int fd)
+{
+	struct pc_file *f = NULL;
+	struct stat st;
+
+	memset(&st, 0, sizeof(st));
+	if (fstat(fd, &st) || !S_ISREG(st.st_mode))
+		return NULL;
+
+	TAILQ_FOREACH(f, &pc.files, link)
+		if (f->dev == st.st_dev && f->ino == st.st_ino)
+			return f;
+
+	f = file_new(fd, &st);
+	if (!f)
+		pc.out_of_memory = true;
+	return f;
+}
+
+/*
+ * Returns true if the bytes from @from on last written before the
+ * commit before which @commit commits were done are durable.
+ */
+static bool written_durable(struct pc_file *f, size_t from, uint32_t commit)
+{
+	size_t n = 0;
+
+	for (n = from; n < f->len; n++)
+		if (f->commit[n] < commit &&
+		    (n >= f->durable_len || f->durable[n] != f->data[n]))
+			return false;
+	return true;
+}
+
+/*
+ * Returns true if after a power cut losing all unsynced writes @f would
+ * be in the state left by that commit, @h being what the head area
+ * held then.
+ */
+static bool state_durable(struct pc_file *f, struct pc_head *h,
+			  uint32_t commit)
+{
+	struct pc_head durable;
+
+	get_head(&durable, f->durable, f->durable_len);
+	return !memcmp(durable.data, h->data, sizeof(h->data)) &&
+	       written_durable(f, 0, commit);
+}
+
+static const char *check_file(struct pc_file *f)
+{
+	bool new_state = state_durable(f, &f->head, f->commits);
+	bool uncommitted = !new_state || f->head_unsynced;
+
+	if (f->uncommitted != uncommitted) {
+		f->uncommitted = uncommitted;
+		if (uncommitted)
+			pc.uncommitted++;
+		else
+			pc.uncommitted--;
+	}
+
+	if (!new_state && (!f->commits ||
+			   !state_durable(f, &f->prev_head, f->commits - 1)))
+		return "neither in its old nor its new state";
+	/* Unsynced writes may be durable in any order, the head first */
+	if (f->head_unsynced &&
+	    !written_durable(f, REE_FS_HEAD_AREA_SIZE, f->commits))
+		return "head area may be durable before data it commits";
+	if (pc.uncommitted > 1)
+		return "more than one file may lose its last commit";
+	return NULL;
+}
+
+/* Simulates a power cut after operation @op on @f */
+static void power_cut(struct pc_file *f, const char *op)
+{
+	const char *msg = check_file(f);
+
+	pc.points++;
+	if (msg && pc.failures++ < PC_MAX_LOGGED)
+		EMSG("power cut after %s of inode %ju: %s", op,
+		     (uintmax_t)f->ino, msg);
+}
+
+void fs_powercut_created(int fd)
+{
+	struct pc_file *f = NULL;
+
+	if (!supplicant_params.fs_powercut)
+		return;
+
+	tee_supp_mutex_lock(&pc.mutex);
+	f = file_get(fd);
+	if (f) {
+		/* A new file, the inode may have been used by a removed one */
+		f->len = 0;
+		f->durable_len = 0;
+		f->commits = 0;
+		f->head_unsynced = false;
+		get_head(&f->head, f->data, f->len);
+		power_cut(f, "create");
+	}
+	tee_supp_mutex_unlock(&pc.mutex);
+}
+
+void fs_powercut_written(int fd, const void *buf, size_t len, off_t offs)
+{
+	struct pc_file *f = NULL;
+	size_t n = 0;
+
+	if (!supplicant_params.fs_powercut)
+		return;
+
+	tee_supp_mutex_lock(&pc.mutex);
+	f = file_get(fd);
+	if (!f)
+		goto out;
+	if (offs + len > f->len && !file_set_len(f, offs + len)) {
+		pc.out_of_memory = true;
+		goto out;
+	}
+
+	memcpy(f->data + offs, buf, len);
+	for (n = 0; n < len; n++)
+		f->commit[offs + n] = f->commits;
+	if (offs < REE_FS_HEAD_AREA_SIZE) {
+		f->prev_head = f->head;
+		get_head(&f->head, f->data, f->len);
+		f->commits++;
+		f->head_unsynced = true;
+	}
+	if (!supplicant_params.fs_deferred_sync)
+		file_make_durable(f);
+	power_cut(f, "write");
+out:
+	tee_supp_mutex_unlock(&pc.mutex);
+}
+
+void fs_powercut_truncated(int fd, off_t len)
+{
+	struct pc_file *f = NULL;
+
+	if (!supplicant_params.fs_powercut)
+		return;
+
+	tee_supp_mutex_lock(&pc.mutex);
+	f = file_get(fd);
+	if (!f)
+		goto out;
+	if (!file_set_len(f, len)) {
+		pc.out_of_memory = true;
+		goto out;
+	}
+	if (!supplicant_params.fs_deferred_sync)
+		file_make_durable(f);
+	power_cut(f, "truncate");
+out:
+	tee_supp_mutex_unlock(&pc.mutex);
+}
+
+void fs_powercut_synced(int fd)
+{
+	struct pc_file *f = NULL;
+
+	if (!supplicant_params.fs_powercut)
+		return;
+
+	tee_supp_mutex_lock(&pc.mutex);
+	f = file_get(fd);
+	if (f) {
+		file_make_durable(f);
+		power_cut(f, "sync");
+	}
+	tee_supp_mutex_unlock(&pc.mutex);
+}
+
+size_t fs_powercut_report(FILE *f)
+{
+	size_t failures = 0;
+
+	tee_supp_mutex_lock(&pc.mutex);
+	if (pc.out_of_memory) {
+		EMSG("out of memory, not all power cuts were checked");
+		pc.failures++;
+	}
+	fprintf(f, "powercut_points: %zu\n", pc.points);
+	fprintf(f, "powercut_failures: %zu\n", pc.failures);
+	failures = pc.failures;
+	tee_supp_mutex_unlock(&pc.mutex);
+
+	return failures;
+}
@@ -0,0 +1,71 @@
+/*
+ * Copyright (c) 2026, Linaro Limited
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef FS_POWERCUT_H
+#define FS_POWERCUT_H
+
+#include <stddef.h>
+#include <stdio.h>
+#include <sys/types.h>
+
+/*
+ * With --fs-powercut a replay checks that secure storage files of the
+ * directory layout survive a power cut at any point. The contents of
+ * each file are tracked as written and as durable: the latter only
+ * follow when the file is synced, or with every write when files are
+ * opened with O_SYNC. After each write, truncate or sync a power cut
+ * is simulated, which may keep any of the unsynced writes, and the file
+ * must then be in its old or its new state:
+ *
+ * - Losing all unsynced writes, the head area must be as after the last
+ *   write to it, or the one before, the update it commits being lost,
+ *   and anything written before that head area write must be durable.
+ * - An unsynced head area write may be durable without anything else,
+ *   so anything written before it must be durable already.
+ * - At most one file may lose its last commit, or an update depending
+ *   on it, such as of dirf.db, could survive without it.
+ */
+
+/* Called once the file @fd has been created, or truncated by opening */
+void fs_powercut_created(int fd);
+
+/* Called once @len bytes at @offs of @fd have been written */
+void fs_powercut_written(int fd, const void *buf, size_t len, off_t offs);
+
+/* Called once @fd has been truncated to @len bytes */
+void fs_powercut_truncated(int fd, off_t len);
+
+/* Called once data written to @fd is durable */
+void fs_powercut_synced(int fd);
+
+/*
+ * Prints the number of power cuts simulated and of those which left a
+ * file inconsistent, returns the latter.
+ */
+size_t fs_powercut_report(FILE *f);
+
+#endif /*FS_POWERCUT_H*/
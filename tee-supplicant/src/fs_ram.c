@@ -0,0 +1,360 @@
+/*
+ * Copyright (c) 2026, Linaro Limited
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <fs_backend.h>
+#include <handle.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/queue.h>
+#include <teec_trace.h>
+#include <tee_supplicant.h>
+
+/*
+ * Secure storage kept in memory only, for test rigs and short-lived
+ * containers which must not leave objects on disk, and to measure the
+ * overhead of the storage layer without the host filesystem. Everything
+ * is lost when tee-supplicant exits.
+ *
+ * Directories exist implicitly while they hold files, as with the
+ * directory layout where removing the last file of a directory removes
+ * the directory too. A removed file stays readable through handles
+ * still open to it until they are closed.
+ */
+struct ram_file {
+	char *name;
+	uint8_t *data;
+	size_t size;
+	size_t alloc_size;
+	unsigned int refs;	/* Open handles */
+	bool removed;
+	TAILQ_ENTRY(ram_file) link;
+};
+
+static struct {
+	pthread_mutex_t mutex;
+	TAILQ_HEAD(ram_file_head, ram_file) files;
+	size_t num_files;
+	size_t bytes;
+	struct handle_db handles;
+} ram = {
+	.mutex = PTHREAD_MUTEX_INITIALIZER,
+	.files = TAILQ_HEAD_INITIALIZER(ram.files),
+	.handles = HANDLE_DB_INITIALIZER,
+};
+
+static struct ram_file *find_file(const char *name)
+{
+	struct ram_file *f = NULL;
+
+	TAILQ_FOREACH(f, &ram.files, link)
+		if (!f->removed && !strcmp(f->name, name))
+			return f;
+	return NULL;
+}
+
+static void free_file(struct ram_file *f)
+{
+	TAILQ_REMOVE(&ram.files, f, link);
+	ram.num_files--;
+	ram.bytes -= f->size;
+	free(f->data);
+	free(f->name);
+	free(f);
+}
+
+/* Removes @f, which is freed once no handle refers to it */
+static void remove_file(struct ram_file *f)
+{
+	f->removed = true;
+	if (!f->refs)
+		free_file(f);
+}
+
+/*
+ * Sets the size of @f, bytes it grows by read as zeroes. The allocation
+ * is doubled as the file grows, so @size must be at most half of the
+ * address space for it not to wrap.
+ */
+static int set_size(struct ram_file *f, uint64_t size)
+{
+	size_t n = f->alloc_size;
+	uint8_t *p = NULL;
+
+	if (size > FS_BACKEND_MAX_FILE_SIZE || size > SIZE_MAX / 2)
+		return -1;
+
+	if (size > f->alloc_size) {
+		if (!n)
+			n = 4096;
+		while (n < size)
+			n *= 2;
+		p = realloc(f->data, n);
+		if (!p)
+			return -1;
+		f->data = p;
+		f->alloc_size = n;
+	}
+	if (size > f->size)
+		memset(f->data + f->size, 0, size - f->size);
+
+	ram.bytes = ram.bytes - f->size + size;
+	f->size = size;
+	return 0;
+}
+
+static int ram_init(const char *root)
+{
+	(void)root;
+
+	IMSG("secure storage is kept in memory and lost at exit");
+	return 0;
+}
+
+static TEEC_Result ram_open(const char *name, bool create, int *fd)
+{
+	TEEC_Result res = TEEC_ERROR_OUT_OF_MEMORY;
+	struct ram_file *f = NULL;
+
+	tee_supp_mutex_lock(&ram.mutex);
+	f = find_file(name);
+	if (!f && !create) {
+		res = TEEC_ERROR_ITEM_NOT_FOUND;
+		goto out;
+	}
+
+	if (f && create) {
+		/* Like O_TRUNC */
+		set_size(f, 0);
+	} else if (create) {
+		f = calloc(1, sizeof(*f));
+		if (!f)
+			goto out;
+		f->name = strdup(name);
+		if (!f->name) {
+			free(f);
+			goto out;
+		}
+		TAILQ_INSERT_TAIL(&ram.files, f, link);
+		ram.num_files++;
+	}
+
+	*fd = handle_get(&ram.handles, f);
+	if (*fd < 0)
+		goto out;
+	f->refs++;
+	res = TEEC_SUCCESS;
+out:
+	tee_supp_mutex_unlock(&ram.mutex);
+	return res;
+}
+
+static TEEC_Result ram_close(int fd)
+{
+	TEEC_Result res = TEEC_ERROR_BAD_PARAMETERS;
+	struct ram_file *f = NULL;
+
+	tee_supp_mutex_lock(&ram.mutex);
+	f = handle_put(&ram.handles, fd);
+	if (f) {
+		f->refs--;
+		if (!f->refs && f->removed)
+			free_file(f);
+		res = TEEC_SUCCESS;
+	}
+	tee_supp_mutex_unlock(&ram.mutex);
+
+	return res;
+}
+
+static TEEC_Result ram_read(int fd, void *buf, size_t *len, uint64_t offs)
+{
+	TEEC_Result res = TEEC_ERROR_BAD_PARAMETERS;
+	struct ram_file *f = NULL;
+
+	tee_supp_mutex_lock(&ram.mutex);
+	f = handle_lookup(&ram.handles, fd);
+	if (f) {
+		if (offs >= f->size)
+			*len = 0;
+		else if (*len > f->size - offs)
+			*len = f->size - offs;
+		if (*len)
+			memcpy(buf, f->data + offs, *len);
+		res = TEEC_SUCCESS;
+	}
+	tee_supp_mutex_unlock(&ram.mutex);
+
+	return res;
+}
+
+static TEEC_Result ram_write(int fd, const void *buf, size_t len,
+			     uint64_t offs)
+{
+	TEEC_Result res = TEEC_ERROR_BAD_PARAMETERS;
+	struct ram_file *f = NULL;
+
+	tee_supp_mutex_lock(&ram.mutex);
+	f = handle_lookup(&ram.handles, fd);
+	if (!f)
+		goto out;
+
+	res = TEEC_ERROR_OUT_OF_MEMORY;
+	if (len > FS_BACKEND_MAX_FILE_SIZE ||
+	    offs > FS_BACKEND_MAX_FILE_SIZE - len ||
+	    (offs + len > f->size && set_size(f, offs + len)))
+		goto out;
+	memcpy(f->data + offs, buf, len);
+	res = TEEC_SUCCESS;
+out:
+	tee_supp_mutex_unlock(&ram.mutex);
+	return res;
+}
+
+static TEEC_Result ram_truncate(int fd, uint64_t len)
+{
+	TEEC_Result res = TEEC_ERROR_BAD_PARAMETERS;
+	struct ram_file *f = NULL;
+
+	tee_supp_mutex_lock(&ram.mutex);
+	f = handle_lookup(&ram.handles, fd);
+	if (f) {
+		res = TEEC_ERROR_OUT_OF_MEMORY;
+		if (!set_size(f, len))
+			res = TEEC_SUCCESS;
+	}
+	tee_supp_mutex_unlock(&ram.mutex);
+
+	return res;
+}
+
+static TEEC_Result ram_remove(const char *name)
+{
+	TEEC_Result res = TEEC_ERROR_ITEM_NOT_FOUND;
+	struct ram_file *f = NULL;
+
+	tee_supp_mutex_lock(&ram.mutex);
+	f = find_file(name);
+	if (f) {
+		remove_file(f);
+		res = TEEC_SUCCESS;
+	}
+	tee_supp_mutex_unlock(&ram.mutex);
+
+	return res;
+}
+
+static TEEC_Result ram_rename(const char *old_name, const char *new_name,
+			      bool overwrite)
+{
+	TEEC_Result res = TEEC_ERROR_ITEM_NOT_FOUND;
+	struct ram_file *f = NULL;
+	struct ram_file *t = NULL;
+	char *name = NULL;
+
+	tee_supp_mutex_lock(&ram.mutex);
+	f = find_file(old_name);
+	if (!f)
+		goto out;
+	t = find_file(new_name);
+	if (t == f) {
+		res = TEEC_SUCCESS;
+		goto out;
+	}
+	if (t && !overwrite) {
+		res = TEEC_ERROR_ACCESS_CONFLICT;
+		goto out;
+	}
+
+	res = TEEC_ERROR_OUT_OF_MEMORY;
+	name = strdup(new_name);
+	if (!name)
+		goto out;
+	if (t)
+		remove_file(t);
+	free(f->name);
+	f->name = name;
+	res = TEEC_SUCCESS;
+out:
+	tee_supp_mutex_unlock(&ram.mutex);
+	return res;
+}
+
+static TEEC_Result ram_list(const char *name, char ***names, size_t *count)
+{
+	TEEC_Result res = TEEC_SUCCESS;
+	struct ram_file *f = NULL;
+
+	tee_supp_mutex_lock(&ram.mutex);
+	TAILQ_FOREACH(f, &ram.files, link) {
+		if (!f->removed &&
+		    !fs_backend_list_add(name, f->name, names, count)) {
+			res = TEEC_ERROR_OUT_OF_MEMORY;
+			break;
+		}
+	}
+	tee_supp_mutex_unlock(&ram.mutex);
+
+	return res;
+}
+
+static TEEC_Result ram_sync(int fd)
+{
+	TEEC_Result res = TEEC_ERROR_BAD_PARAMETERS;
+
+	tee_supp_mutex_lock(&ram.mutex);
+	if (handle_lookup(&ram.handles, fd))
+		res = TEEC_SUCCESS;
+	tee_supp_mutex_unlock(&ram.mutex);
+
+	return res;
+}
+
+static void ram_print_stats(FILE *f)
+{
+	tee_supp_mutex_lock(&ram.mutex);
+	fprintf(f, "fs_ram files %zu bytes %zu\n", ram.num_files, ram.bytes);
+	tee_supp_mutex_unlock(&ram.mutex);
+}
+
+const struct fs_backend fs_ram_backend = {
+	.name = "ram",
+	.init = ram_init,
+	.open = ram_open,
+	.close = ram_close,
+	.read = ram_read,
+	.write = ram_write,
+	.truncate = ram_truncate,
+	.remove = ram_remove,
+	.rename = ram_rename,
+	.list = ram_list,
+	.sync = ram_sync,
+	.print_stats = ram_print_stats,
+};
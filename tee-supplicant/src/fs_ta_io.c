@@ -0,0 +1,464 @@
+/*
+ * Copyright (c) 2026, Linaro Limited
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <errno.h>
+#include <fs_ta_io.h>
+#include <inttypes.h>
+#include <optee_msg_supplicant.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/param.h>
+#include <sys/queue.h>
+#include <teec_trace.h>
+#include <tee_supplicant.h>
+#include <time.h>
+
+#ifndef __aligned
+#define __aligned(x) __attribute__((__aligned__(x)))
+#endif
+#include <linux/tee.h>
+
+#define FS_TA_NAME_MAX		64
+/* TAs accounted on their own, the others are accounted to "*" */
+#define FS_TA_MAX		256
+/* Handles above are accounted to "." */
+#define FS_TA_MAX_HANDLE	65536
+#define FS_TA_MAX_RATE		UINT32_MAX
+#define NSEC_PER_SEC		1000000000ULL
+
+struct fs_ta_limit {
+	char *name;
+	uint64_t bytes;
+	uint64_t ops;
+	STAILQ_ENTRY(fs_ta_limit) link;
+};
+
+/*
+ * A bucket holds at most a second worth of tokens. A request takes its
+ * tokens up front even if the bucket then goes into debt, and waits
+ * until the debt has been paid back by the rate, so requests larger
+ * than the bucket are delayed rather than failed.
+ */
+struct fs_ta_bucket {
+	uint64_t rate;		/* Tokens per second, 0 for no limit */
+	int64_t tokens;
+};
+
+struct fs_ta {
+	char name[FS_TA_NAME_MAX];
+	struct fs_ta_bucket bytes;
+	struct fs_ta_bucket ops;
+	uint64_t refilled_ns;
+	uint64_t reads;
+	uint64_t read_bytes;
+	uint64_t writes;
+	uint64_t write_bytes;
+	uint64_t other;
+	uint64_t throttled;
+	uint64_t delay_us;
+};
+
+/* TA index + 1 by handle, 0 if not known */
+struct fs_ta_handles {
+	unsigned int *tas;
+	size_t num;
+};
+
+static struct {
+	/* Set up before any request */
+	STAILQ_HEAD(, fs_ta_limit) limits;
+	struct fs_ta_limit def_limit;
+	bool limited;
+
+	pthread_mutex_t mutex;
+	struct fs_ta *tas;
+	size_t num_tas;
+	struct fs_ta_handles files;
+	struct fs_ta_handles dirs;
+} fs_ta_io = {
+	.limits = STAILQ_HEAD_INITIALIZER(fs_ta_io.limits),
+	.mutex = PTHREAD_MUTEX_INITIALIZER,
+};
+
+static bool parse_rate(const char *s, char end, const char **endp,
+		       uint64_t *rate)
+{
+	unsigned long long v = 0;
+	char *e = NULL;
+
+	errno = 0;
+	v = strtoull(s, &e, 0);
+	if (errno || e == s || *e != end || v > FS_TA_MAX_RATE)
+		return false;
+
+	*rate = v;
+	*endp = e;
+	return true;
+}
+
+int fs_ta_io_configure(const char *spec)
+{
+	struct fs_ta_limit *l = NULL;
+	const char *p = strchr(spec, ':');
+	uint64_t bytes = 0;
+	uint64_t ops = 0;
+	size_t len = 0;
+
+	if (!p || p == spec || p - spec >= FS_TA_NAME_MAX)
+		return -1;
+	len = p - spec;
+
+	if (!parse_rate(p + 1, ':', &p, &bytes) ||
+	    !parse_rate(p + 1, '\0', &p, &ops))
+		return -1;
+
+	if (len == 1 && *spec == '*') {
+		l = &fs_ta_io.def_limit;
+	} else {
+		STAILQ_FOREACH(l, &fs_ta_io.limits, link)
+			if (strlen(l->name) == len &&
+			    !strncmp(l->name, spec, len))
+				break;
+	}
+	if (!l) {
+		l = calloc(1, sizeof(*l));
+		if (!l)
+			return -1;
+		l->name = strndup(spec, len);
+		if (!l->name) {
+			free(l);
+			return -1;
+		}
+		STAILQ_INSERT_TAIL(&fs_ta_io.limits, l, link);
+	}
+
+	l->bytes = bytes;
+	l->ops = ops;
+	if (bytes || ops)
+		fs_ta_io.limited = true;
+	return 0;
+}
+
+static bool fs_ta_io_enabled(void)
+{
+	return fs_ta_io.limited || supplicant_params.stats_file;
+}
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	memset(&ts, 0, sizeof(ts));
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec;
+}
+
+static const struct fs_ta_limit *find_limit(const char *name)
+{
+	struct fs_ta_limit *l = NULL;
+
+	STAILQ_FOREACH(l, &fs_ta_io.limits, link)
+		if (!strcmp(l->name, name))
+			return l;
+	return &fs_ta_io.def_limit;
+}
+
+/* Returns the index of TA @name of @len bytes, added if new, or -1 */
+static int find_ta(const char *name, size_t len)
+{
+	const struct fs_ta_limit *l = NULL;
+	struct fs_ta *tas = NULL;
+	struct fs_ta *t = NULL;
+	size_t n = 0;
+
+	if (len >= FS_TA_NAME_MAX) {
+		name = "*";
+		len = 1;
+	}
+
+	for (n = 0; n < fs_ta_io.num_tas; n++)
+		if (strlen(fs_ta_io.tas[n].name) == len &&
+		    !memcmp(fs_ta_io.tas[n].name, name, len))
+			return n;
+
+	if (n >= FS_TA_MAX && (len != 1 || *name != '*'))
+		return find_ta("*", 1);
+
+	tas = realloc(fs_ta_io.tas, (n + 1) * sizeof(*tas));
+	if (!tas)
+		return -1;
+	fs_ta_io.tas = tas;
+	fs_ta_io.num_tas++;
+
+	t = tas + n;
+	memset(t, 0, sizeof(*t));
+	memcpy(t->name, name, len);
+	l = find_limit(t->name);
+	t->bytes.rate = l->bytes;
+	t->ops.rate = l->ops;
+	return n;
+}
+
+/* Returns the TA of name @param, of a directory if @dir, or -1 */
+static int ta_of_name(struct tee_ioctl_param *param, bool dir)
+{
+	const char *name = tee_supp_param_to_va(param);
+	const char *end = NULL;
+	size_t len = 0;
+
+	if (!name)
+		return -1;
+
+	len = strnlen(name, MEMREF_SIZE(param));
+	while (len && *name == '/') {
+		name++;
+		len--;
+	}
+	end = memchr(name, '/', len);
+	if (end)
+		len = end - name;
+	else if (!dir || !len)
+		return find_ta(".", 1);
+
+	return find_ta(name, len);
+}
+
+static int ta_of_handle(struct fs_ta_handles *h, uint64_t handle)
+{
+	if (handle < h->num && h->tas[handle])
+		return h->tas[handle] - 1;
+	return find_ta(".", 1);
+}
+
+/* Sets the TA of @handle, forgets it with @ta -1 */
+static void set_handle(struct fs_ta_handles *h, uint64_t handle, int ta)
+{
+	unsigned int *tas = NULL;
+	size_t n = 0;
+
+	if (handle >= FS_TA_MAX_HANDLE)
+		return;
+
+	if (handle >= h->num) {
+		if (ta < 0)
+			return;
+		n = handle + 64;
+		tas = realloc(h->tas, n * sizeof(*tas));
+		if (!tas)
+			return;
+		memset(tas + h->num, 0, (n - h->num) * sizeof(*tas));
+		h->tas = tas;
+		h->num = n;
+	}
+	h->tas[handle] = ta + 1;
+}
+
+/* Returns the TA of a request and the bytes it reads or writes */
+static int ta_of_request(size_t num_params, struct tee_ioctl_param *params,
+			 uint64_t *bytes)
+{
+	switch (params->a) {
+	case OPTEE_MRF_OPEN:
+	case OPTEE_MRF_CREATE:
+	case OPTEE_MRF_REMOVE:
+	case OPTEE_MRF_RENAME:
+		if (num_params < 2)
+			return -1;
+		return ta_of_name(params + 1, false);
+	case OPTEE_MRF_OPENDIR:
+		if (num_params < 2)
+			return -1;
+		return ta_of_name(params + 1, true);
+	case OPTEE_MRF_CLOSEDIR:
+	case OPTEE_MRF_READDIR:
+	case OPTEE_MRF_READDIR_BATCH:
+		return ta_of_handle(&fs_ta_io.dirs, params->b);
+	case OPTEE_MRF_READ:
+	case OPTEE_MRF_WRITE:
+		if (num_params > 1 && tee_supp_param_is_memref(params + 1))
+			*bytes = MEMREF_SIZE(params + 1);
+		return ta_of_handle(&fs_ta_io.files, params->b);
+	case OPTEE_MRF_READV:
+	case OPTEE_MRF_WRITEV:
+		if (num_params > 2 && tee_supp_param_is_memref(params + 2))
+			*bytes = MEMREF_SIZE(params + 2);
+		return ta_of_handle(&fs_ta_io.files, params->b);
+	default:
+		return ta_of_handle(&fs_ta_io.files, params->b);
+	}
+}
+
+static void refill(struct fs_ta_bucket *b, uint64_t elapsed_ns)
+{
+	if (!b->rate)
+		return;
+
+	b->tokens += b->rate * elapsed_ns / NSEC_PER_SEC;
+	if (b->tokens > (int64_t)b->rate)
+		b->tokens = b->rate;
+}
+
+/* Takes @n tokens and returns how long to wait to be out of debt */
+static uint64_t take(struct fs_ta_bucket *b, uint64_t n)
+{
+	uint64_t debt = 0;
+
+	if (!b->rate)
+		return 0;
+
+	b->tokens -= MIN(n, (uint64_t)INT32_MAX);
+	if (b->tokens >= 0)
+		return 0;
+
+	debt = -b->tokens;
+	return debt / b->rate * NSEC_PER_SEC +
+	       debt % b->rate * NSEC_PER_SEC / b->rate;
+}
+
+void fs_ta_io_begin(struct fs_ta_io_req *req, size_t num_params,
+		    struct tee_ioctl_param *params)
+{
+	struct fs_ta *t = NULL;
+	uint64_t byte_wait = 0;
+	struct timespec ts;
+	uint64_t bytes = 0;
+	uint64_t wait = 0;
+	uint64_t now = 0;
+
+	req->ta = -1;
+	if (!fs_ta_io_enabled() || !num_params ||
+	    !tee_supp_param_is_value(params))
+		return;
+
+	if (fs_ta_io.limited)
+		now = now_ns();
+
+	tee_supp_mutex_lock(&fs_ta_io.mutex);
+	req->ta = ta_of_request(num_params, params, &bytes);
+	if (req->ta >= 0 && fs_ta_io.limited) {
+		t = fs_ta_io.tas + req->ta;
+		refill(&t->ops, MIN(now - t->refilled_ns, NSEC_PER_SEC));
+		refill(&t->bytes, MIN(now - t->refilled_ns, NSEC_PER_SEC));
+		t->refilled_ns = now;
+		wait = take(&t->ops, 1);
+		if (bytes)
+			byte_wait = take(&t->bytes, bytes);
+		wait = MAX(wait, byte_wait);
+		if (wait) {
+			t->throttled++;
+			t->delay_us += wait / 1000;
+		}
+	}
+	tee_supp_mutex_unlock(&fs_ta_io.mutex);
+
+	if (!wait)
+		return;
+
+	memset(&ts, 0, sizeof(ts));
+	ts.tv_sec = wait / NSEC_PER_SEC;
+	ts.tv_nsec = wait % NSEC_PER_SEC;
+	while (nanosleep(&ts, &ts) && errno == EINTR)
+		;
+}
+
+void fs_ta_io_end(struct fs_ta_io_req *req, size_t num_params,
+		  struct tee_ioctl_param *params, uint32_t res)
+{
+	struct fs_ta *t = NULL;
+
+	if (req->ta < 0)
+		return;
+
+	tee_supp_mutex_lock(&fs_ta_io.mutex);
+	t = fs_ta_io.tas + req->ta;
+	switch (params->a) {
+	case OPTEE_MRF_READ:
+		t->reads++;
+		if (!res)
+			t->read_bytes += MEMREF_SIZE(params + 1);
+		break;
+	case OPTEE_MRF_READV:
+		t->reads++;
+		if (!res)
+			t->read_bytes += MEMREF_SIZE(params + 2);
+		break;
+	case OPTEE_MRF_WRITE:
+		t->writes++;
+		if (!res)
+			t->write_bytes += MEMREF_SIZE(params + 1);
+		break;
+	case OPTEE_MRF_WRITEV:
+		t->writes++;
+		if (!res)
+			t->write_bytes += MEMREF_SIZE(params + 2);
+		break;
+	case OPTEE_MRF_OPEN:
+	case OPTEE_MRF_CREATE:
+		t->other++;
+		if (!res && num_params > 2)
+			set_handle(&fs_ta_io.files, params[2].a, req->ta);
+		break;
+	case OPTEE_MRF_OPENDIR:
+		t->other++;
+		if (!res && num_params > 2)
+			set_handle(&fs_ta_io.dirs, params[2].a, req->ta);
+		break;
+	case OPTEE_MRF_CLOSE:
+		t->other++;
+		set_handle(&fs_ta_io.files, params->b, -1);
+		break;
+	case OPTEE_MRF_CLOSEDIR:
+		t->other++;
+		set_handle(&fs_ta_io.dirs, params->b, -1);
+		break;
+	default:
+		t->other++;
+		break;
+	}
+	tee_supp_mutex_unlock(&fs_ta_io.mutex);
+}
+
+void fs_ta_io_print_stats(FILE *f)
+{
+	struct fs_ta *t = NULL;
+	size_t n = 0;
+
+	tee_supp_mutex_lock(&fs_ta_io.mutex);
+	for (n = 0; n < fs_ta_io.num_tas; n++) {
+		t = fs_ta_io.tas + n;
+		fprintf(f, "fs_ta %s reads %" PRIu64 " bytes %" PRIu64
+			" writes %" PRIu64 " bytes %" PRIu64 " other %" PRIu64
+			" limit %" PRIu64 " bytes %" PRIu64 " ops throttled %"
+			PRIu64 " delay_ms %" PRIu64 "\n", t->name, t->reads,
+			t->read_bytes, t->writes, t->write_bytes, t->other,
+			t->bytes.rate, t->ops.rate, t->throttled,
+			t->delay_us / 1000);
+	}
+	tee_supp_mutex_unlock(&fs_ta_io.mutex);
+}
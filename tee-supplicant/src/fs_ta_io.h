@@ -0,0 +1,70 @@
+/*
+ * Copyright (c) 2026, Linaro Limited
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef FS_TA_IO_H
+#define FS_TA_IO_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+struct tee_ioctl_param;
+
+/*
+ * Secure storage requests are accounted to the TA directory they touch,
+ * the first component of the name of the file or directory relative to
+ * the secure storage root, and may be throttled per TA with token
+ * buckets. Files directly in the root, as the REE FS of OP-TEE keeps
+ * them, are accounted to ".".
+ */
+struct fs_ta_io_req {
+	int ta;		/* Index of the TA, or -1 if not accounted */
+};
+
+/*
+ * Parses a limit "<ta>:<bytes>:<ops>" of bytes read or written and of
+ * requests per second, 0 for no limit, for TA directory <ta> or "*" for
+ * each TA without a limit of its own. Returns 0 on success or -1 on
+ * error.
+ */
+int fs_ta_io_configure(const char *spec);
+
+/*
+ * Called before serving an OPTEE_MSG_RPC_CMD_FS request, looks up the
+ * TA of the request and delays the calling thread as long as the TA is
+ * over its limits.
+ */
+void fs_ta_io_begin(struct fs_ta_io_req *req, size_t num_params,
+		    struct tee_ioctl_param *params);
+
+/* Called once the request has been served with result @res */
+void fs_ta_io_end(struct fs_ta_io_req *req, size_t num_params,
+		  struct tee_ioctl_param *params, uint32_t res);
+
+void fs_ta_io_print_stats(FILE *f);
+
+#endif /*FS_TA_IO_H*/
@@ -0,0 +1,482 @@
+/*
+ * Copyright (c) 2026, Linaro Limited
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <errno.h>
+#include <fs_uring.h>
+#include <inttypes.h>
+#include <linux/io_uring.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <teec_trace.h>
+#include <tee_supplicant.h>
+#include <unistd.h>
+
+/*
+ * One ring is shared by all threads. A thread fills its SQEs and submits
+ * them with the ring mutex held, then waits for its completions. The
+ * first waiter to find nobody reaping waits in the kernel for
+ * completions and hands them out to their owners, the other waiters
+ * sleep on the condition. Requests in flight are limited to the size of
+ * the SQ, the CQ is twice as large so it can't overflow.
+ *
+ * Descriptors used often are added to a table of registered files so
+ * the kernel doesn't need to look them up for each request. Secure
+ * storage files are few and kept open by the descriptor cache, so a
+ * small table is enough.
+ */
+#define FS_URING_ENTRIES	64
+#define FS_URING_NUM_FILES	64
+#define FS_URING_MAX_FD		1024
+#define FS_URING_REG_USES	8
+
+struct fs_uring_req {
+	int res;
+	bool done;
+};
+
+struct fs_uring_fd {
+	uint16_t uses;
+	int16_t slot;
+};
+
+static struct {
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	bool enabled;
+	int fd;
+	unsigned int sq_entries;
+	unsigned int *sq_tail;
+	unsigned int *sq_mask;
+	unsigned int *sq_array;
+	struct io_uring_sqe *sqes;
+	unsigned int *cq_head;
+	unsigned int *cq_tail;
+	unsigned int *cq_mask;
+	struct io_uring_cqe *cqes;
+	unsigned int inflight;
+	bool reaping;
+	bool files_registered;
+	struct fs_uring_fd fds[FS_URING_MAX_FD];
+	int slot_fd[FS_URING_NUM_FILES];
+	uint64_t requests;
+	uint64_t fixed_requests;
+	uint64_t linked;
+	uint64_t unsubmitted;
+} ring = {
+	.mutex = PTHREAD_MUTEX_INITIALIZER,
+	.cond = PTHREAD_COND_INITIALIZER,
+	.fd = -1,
+};
+
+static int sys_io_uring_setup(unsigned int entries, struct io_uring_params *p)
+{
+	return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_io_uring_enter(int fd, unsigned int to_submit,
+			      unsigned int min_complete, unsigned int flags)
+{
+	return syscall(__NR_io_uring_enter, fd, to_submit, min_complete,
+		       flags, NULL, 0);
+}
+
+static int sys_io_uring_register(int fd, unsigned int opcode, void *arg,
+				 unsigned int nr_args)
+{
+	return syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+static bool probe_ops(void)
+{
+	static const uint8_t ops[] = {
+		IORING_OP_READ, IORING_OP_WRITE, IORING_OP_FSYNC,
+	};
+	struct io_uring_probe *probe = NULL;
+	size_t sz = sizeof(*probe) + 256 * sizeof(struct io_uring_probe_op);
+	bool res = false;
+	size_t n = 0;
+
+	probe = calloc(1, sz);
+	if (!probe)
+		return false;
+
+	if (sys_io_uring_register(ring.fd, IORING_REGISTER_PROBE, probe, 256))
+		goto out;
+
+	for (n = 0; n < sizeof(ops); n++)
+		if (ops[n] > probe->last_op ||
+		    !(probe->ops[ops[n]].flags & IO_URING_OP_SUPPORTED))
+			goto out;
+	res = true;
+out:
+	free(probe);
+	return res;
+}
+
+int fs_uring_init(void)
+{
+	struct io_uring_params p;
+	size_t sq_size = 0;
+	size_t cq_size = 0;
+	uint8_t *sq = NULL;
+	uint8_t *cq = NULL;
+	void *sqes = NULL;
+	size_t n = 0;
+
+	memset(&p, 0, sizeof(p));
+	p.flags = IORING_SETUP_CQSIZE;
+	p.cq_entries = 2 * FS_URING_ENTRIES;
+
+	ring.fd = sys_io_uring_setup(FS_URING_ENTRIES, &p);
+	if (ring.fd < 0) {
+		IMSG("io_uring_setup: %s", strerror(errno));
+		return -1;
+	}
+
+	if (!(p.features & IORING_FEAT_SINGLE_MMAP) ||
+	    !(p.features & IORING_FEAT_NODROP) || !probe_ops()) {
+		IMSG("io_uring lacks needed features");
+		goto err;
+	}
+
+	sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+	cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if (cq_size > sq_size)
+		sq_size = cq_size;
+
+	sq = mmap(NULL, sq_size, PROT_READ | PROT_WRITE,
+		  MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_SQ_RING);
+	if (sq == MAP_FAILED)
+		goto err;
+	cq = sq;
+
+	sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe),
+		    PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+		    ring.fd, IORING_OFF_SQES);
+	if (sqes == MAP_FAILED) {
+		munmap(sq, sq_size);
+		goto err;
+	}
+
+	ring.sq_entries = p.sq_entries;
+	ring.sq_tail = (void *)(sq + p.sq_off.tail);
+	ring.sq_mask = (void *)(sq + p.sq_off.ring_mask);
+	ring.sq_array = (void *)(sq + p.sq_off.array);
+	ring.sqes = sqes;
+	ring.cq_head = (void *)(cq + p.cq_off.head);
+	ring.cq_tail = (void *)(cq + p.cq_off.tail);
+	ring.cq_mask = (void *)(cq + p.cq_off.ring_mask);
+	ring.cqes = (void *)(cq + p.cq_off.cqes);
+
+	for (n = 0; n < FS_URING_MAX_FD; n++)
+		ring.fds[n].slot = -1;
+	for (n = 0; n < FS_URING_NUM_FILES; n++)
+		ring.slot_fd[n] = -1;
+	ring.files_registered = !sys_io_uring_register(ring.fd,
+						       IORING_REGISTER_FILES,
+						       ring.slot_fd,
+						       FS_URING_NUM_FILES);
+
+	ring.enabled = true;
+	return 0;
+err:
+	close(ring.fd);
+	ring.fd = -1;
+	return -1;
+}
+
+bool fs_uring_enabled(void)
+{
+	return ring.enabled;
+}
+
+/* Called with the mutex held, points @sqe at @fd */
+static void set_fd(struct io_uring_sqe *sqe, int fd)
+{
+	struct fs_uring_fd *f = NULL;
+	size_t n = 0;
+
+	sqe->fd = fd;
+	if (!ring.files_registered || fd < 0 || fd >= FS_URING_MAX_FD)
+		return;
+
+	f = ring.fds + fd;
+	if (f->slot < 0 && ++f->uses >= FS_URING_REG_USES) {
+		for (n = 0; n < FS_URING_NUM_FILES; n++)
+			if (ring.slot_fd[n] < 0)
+				break;
+		if (n < FS_URING_NUM_FILES) {
+			struct io_uring_files_update up = {
+				.offset = n,
+				.fds = (uintptr_t)&fd,
+			};
+
+			if (sys_io_uring_register(ring.fd,
+						  IORING_REGISTER_FILES_UPDATE,
+						  &up, 1) == 1) {
+				ring.slot_fd[n] = fd;
+				f->slot = n;
+			}
+		}
+	}
+
+	if (f->slot >= 0) {
+		sqe->fd = f->slot;
+		sqe->flags |= IOSQE_FIXED_FILE;
+		ring.fixed_requests++;
+	}
+}
+
+void fs_uring_close_fd(int fd)
+{
+	struct fs_uring_fd *f = NULL;
+	int unused = -1;
+
+	if (!ring.enabled || fd < 0 || fd >= FS_URING_MAX_FD)
+		return;
+
+	tee_supp_mutex_lock(&ring.mutex);
+	f = ring.fds + fd;
+	if (f->slot >= 0) {
+		struct io_uring_files_update up = {
+			.offset = f->slot,
+			.fds = (uintptr_t)&unused,
+		};
+
+		sys_io_uring_register(ring.fd, IORING_REGISTER_FILES_UPDATE,
+				      &up, 1);
+		ring.slot_fd[f->slot] = -1;
+		f->slot = -1;
+	}
+	f->uses = 0;
+	tee_supp_mutex_unlock(&ring.mutex);
+}
+
+/* Called with the mutex held */
+static void reap(void)
+{
+	unsigned int head = *ring.cq_head;
+	unsigned int tail = __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE);
+	struct io_uring_cqe *cqe = NULL;
+	struct fs_uring_req *req = NULL;
+
+	while (head != tail) {
+		cqe = ring.cqes + (head & *ring.cq_mask);
+		req = (void *)(uintptr_t)cqe->user_data;
+		req->res = cqe->res;
+		req->done = true;
+		ring.inflight--;
+		head++;
+	}
+	__atomic_store_n(ring.cq_head, head, __ATOMIC_RELEASE);
+}
+
+static bool all_done(struct fs_uring_req *reqs, size_t n)
+{
+	size_t i = 0;
+
+	for (i = 0; i < n; i++)
+		if (!reqs[i].done)
+			return false;
+	return true;
+}
+
+/*
+ * Submits the @n SQEs in @sqes, linked if @n > 1, and waits until all
+ * have completed. The results are returned in @reqs.
+ */
+static void submit_and_wait(struct io_uring_sqe *sqes,
+			    struct fs_uring_req *reqs, size_t n)
+{
+	struct io_uring_sqe *sqe = NULL;
+	unsigned int tail = 0;
+	unsigned int idx = 0;
+	size_t i = 0;
+	int err = EAGAIN;
+	int r = 0;
+
+	tee_supp_mutex_lock(&ring.mutex);
+
+	while (ring.inflight + n > ring.sq_entries)
+		pthread_cond_wait(&ring.cond, &ring.mutex);
+
+	tail = *ring.sq_tail;
+	for (i = 0; i < n; i++) {
+		idx = tail & *ring.sq_mask;
+		sqe = ring.sqes + idx;
+		*sqe = sqes[i];
+		set_fd(sqe, sqes[i].fd);
+		sqe->user_data = (uintptr_t)(reqs + i);
+		if (i + 1 < n)
+			sqe->flags |= IOSQE_IO_LINK;
+		ring.sq_array[idx] = idx;
+		tail++;
+	}
+	__atomic_store_n(ring.sq_tail, tail, __ATOMIC_RELEASE);
+	ring.inflight += n;
+	ring.requests += n;
+	if (n > 1)
+		ring.linked++;
+
+	do {
+		r = sys_io_uring_enter(ring.fd, n, 0, 0);
+	} while (r < 0 && errno == EINTR);
+	if (r < 0) {
+		err = errno;
+		EMSG("io_uring_enter: %s", strerror(err));
+		r = 0;
+	}
+
+	/*
+	 * SQEs the kernel didn't take would stay in the SQ, their owner
+	 * waiting for ever, so they're taken back and failed. The rest of
+	 * a link isn't submitted on its own as it wouldn't be ordered after
+	 * the part already submitted.
+	 */
+	if ((size_t)r < n) {
+		__atomic_store_n(ring.sq_tail, tail - (n - r),
+				 __ATOMIC_RELEASE);
+		ring.inflight -= n - r;
+		ring.unsubmitted += n - r;
+		for (i = r; i < n; i++) {
+			reqs[i].res = -err;
+			reqs[i].done = true;
+		}
+		pthread_cond_broadcast(&ring.cond);
+	}
+
+	while (!all_done(reqs, n)) {
+		if (ring.reaping) {
+			pthread_cond_wait(&ring.cond, &ring.mutex);
+			continue;
+		}
+
+		ring.reaping = true;
+		tee_supp_mutex_unlock(&ring.mutex);
+		sys_io_uring_enter(ring.fd, 0, 1, IORING_ENTER_GETEVENTS);
+		tee_supp_mutex_lock(&ring.mutex);
+		reap();
+		ring.reaping = false;
+		pthread_cond_broadcast(&ring.cond);
+	}
+
+	tee_supp_mutex_unlock(&ring.mutex);
+}
+
+static void prep_rw(struct io_uring_sqe *sqe, uint8_t op, int fd,
+		    const void *buf, size_t len, off_t offs)
+{
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode = op;
+	sqe->fd = fd;
+	sqe->addr = (uintptr_t)buf;
+	/* Longer requests are completed by the callers' loops */
+	sqe->len = len > INT32_MAX ? INT32_MAX : len;
+	sqe->off = offs;
+}
+
+static void prep_fdatasync(struct io_uring_sqe *sqe, int fd)
+{
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode = IORING_OP_FSYNC;
+	sqe->fd = fd;
+	sqe->fsync_flags = IORING_FSYNC_DATASYNC;
+}
+
+static ssize_t result(int res)
+{
+	if (res < 0) {
+		errno = -res;
+		return -1;
+	}
+	return res;
+}
+
+ssize_t fs_uring_pread(int fd, void *buf, size_t len, off_t offs)
+{
+	struct fs_uring_req req = { };
+	struct io_uring_sqe sqe;
+
+	prep_rw(&sqe, IORING_OP_READ, fd, buf, len, offs);
+	submit_and_wait(&sqe, &req, 1);
+	return result(req.res);
+}
+
+ssize_t fs_uring_pwrite(int fd, const void *buf, size_t len, off_t offs)
+{
+	struct fs_uring_req req = { };
+	struct io_uring_sqe sqe;
+
+	prep_rw(&sqe, IORING_OP_WRITE, fd, buf, len, offs);
+	submit_and_wait(&sqe, &req, 1);
+	return result(req.res);
+}
+
+int fs_uring_fdatasync(int fd)
+{
+	struct fs_uring_req req = { };
+	struct io_uring_sqe sqe;
+
+	prep_fdatasync(&sqe, fd);
+	submit_and_wait(&sqe, &req, 1);
+	return result(req.res);
+}
+
+int fs_uring_pwrite_synced(int fd, const void *buf, size_t len, off_t offs)
+{
+	struct fs_uring_req reqs[3] = { };
+	struct io_uring_sqe sqes[3];
+
+	if (len > INT32_MAX)
+		return -1;
+
+	prep_fdatasync(sqes, fd);
+	prep_rw(sqes + 1, IORING_OP_WRITE, fd, buf, len, offs);
+	prep_fdatasync(sqes + 2, fd);
+	submit_and_wait(sqes, reqs, 3);
+
+	/* A short write breaks the link, the last sync is then cancelled */
+	if (reqs[0].res < 0 || reqs[1].res != (int)len || reqs[2].res < 0)
+		return -1;
+	return 0;
+}
+
+void fs_uring_print_stats(FILE *f)
+{
+	if (!ring.enabled)
+		return;
+
+	tee_supp_mutex_lock(&ring.mutex);
+	fprintf(f, "fs_uring requests %" PRIu64 " fixed_file %" PRIu64
+		" linked %" PRIu64 " unsubmitted %" PRIu64 "\n", ring.requests,
+		ring.fixed_requests, ring.linked, ring.unsubmitted);
+	tee_supp_mutex_unlock(&ring.mutex);
+}
@@ -0,0 +1,127 @@
+/*
+ * Copyright (c) 2026, Linaro Limited
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef FS_URING_H
+#define FS_URING_H
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <sys/types.h>
+
+#ifdef CFG_FS_IO_URING
+
+/*
+ * Sets up an io_uring shared by all threads doing secure storage I/O.
+ * Returns 0 on success or -1 if the kernel can't provide one, in which
+ * case the functions below must not be used.
+ */
+int fs_uring_init(void);
+bool fs_uring_enabled(void);
+
+/*
+ * Like pread(), pwrite() and fdatasync(), but submitted to the ring and
+ * waited for. Return -1 with errno set on failure.
+ */
+ssize_t fs_uring_pread(int fd, void *buf, size_t len, off_t offs);
+ssize_t fs_uring_pwrite(int fd, const void *buf, size_t len, off_t offs);
+int fs_uring_fdatasync(int fd);
+
+/*
+ * Submits fdatasync(), pwrite() and fdatasync() of @fd as one linked
+ * sequence. Returns 0 if all of @len bytes were written and synced, or
+ * -1.
+ */
+int fs_uring_pwrite_synced(int fd, const void *buf, size_t len, off_t offs);
+
+/* Must be called before a descriptor used with the ring is closed */
+void fs_uring_close_fd(int fd);
+
+void fs_uring_print_stats(FILE *f);
+
+#else
+
+static inline int fs_uring_init(void)
+{
+	return -1;
+}
+
+static inline bool fs_uring_enabled(void)
+{
+	return false;
+}
+
+static inline ssize_t fs_uring_pread(int fd, void *buf, size_t len,
+				     off_t offs)
+{
+	(void)fd;
+	(void)buf;
+	(void)len;
+	(void)offs;
+
+	return -1;
+}
+
+static inline ssize_t fs_uring_pwrite(int fd, const void *buf, size_t len,
+				      off_t offs)
+{
+	(void)fd;
+	(void)buf;
+	(void)len;
+	(void)offs;
+
+	return -1;
+}
+
+static inline int fs_uring_fdatasync(int fd)
+{
+	(void)fd;
+
+	return -1;
+}
+
+static inline int fs_uring_pwrite_synced(int fd, const void *buf,
+					 size_t len, off_t offs)
+{
+	(void)fd;
+	(void)buf;
+	(void)len;
+	(void)offs;
+
+	return -1;
+}
+
+static inline void fs_uring_close_fd(int fd)
+{
+	(void)fd;
+}
+
+static inline void fs_uring_print_stats(FILE *f)
+{
+	(void)f;
+}
+
+#endif /* CFG_FS_IO_URING */
+#endif /* FS_URING_H */
@@ -0,0 +1,279 @@
+/*
+ * Copyright (c) 2026, Linaro Limited
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <errno.h>
+#include <inttypes.h>
+#include <lanes.h>
+#include <optee_msg_supplicant.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/queue.h>
+#include <teec_trace.h>
+#include <tee_supplicant.h>
+
+#ifndef __aligned
+#define __aligned(x) __attribute__((__aligned__(x)))
+#endif
+#include <linux/tee.h>
+
+struct lane_item {
+	void *item;
+	STAILQ_ENTRY(lane_item) link;
+};
+
+struct lane {
+	const char *name;
+	size_t limit;
+	size_t reserved;
+	size_t active;
+	size_t queued;
+	size_t peak_active;
+	size_t peak_queued;
+	uint64_t admitted;
+	uint64_t deferred;
+	STAILQ_HEAD(, lane_item) queue;
+};
+
+static pthread_mutex_t lane_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* Threads not reserved by any lane, if the pool has a limit */
+static bool lane_pool_limited;
+static size_t lane_shared_threads;
+
+/* In order of priority when picking queued requests */
+static struct lane lanes[LANE_NUM] = {
+	[LANE_STORAGE] = {
+		.name = "storage",
+		.reserved = 2,
+		.queue = STAILQ_HEAD_INITIALIZER(lanes[LANE_STORAGE].queue),
+	},
+	[LANE_GENERAL] = {
+		.name = "general",
+		.reserved = 1,
+		.queue = STAILQ_HEAD_INITIALIZER(lanes[LANE_GENERAL].queue),
+	},
+	[LANE_SOCKET] = {
+		.name = "socket",
+		.queue = STAILQ_HEAD_INITIALIZER(lanes[LANE_SOCKET].queue),
+	},
+};
+
+unsigned int lane_of(uint32_t func, size_t num_params,
+		     struct tee_ioctl_param *params)
+{
+	switch (func) {
+	case OPTEE_MSG_RPC_CMD_FS:
+	case OPTEE_MSG_RPC_CMD_RPMB:
+		return LANE_STORAGE;
+	case OPTEE_MSG_RPC_CMD_SOCKET:
+		if (!num_params || !tee_supp_param_is_value(params))
+			return LANE_GENERAL;
+		/* Only requests which may wait for the peer are slow */
+		switch (params->a) {
+		case OPTEE_MRC_SOCKET_OPEN:
+		case OPTEE_MRC_SOCKET_SEND:
+		case OPTEE_MRC_SOCKET_RECV:
+			return LANE_SOCKET;
+		default:
+			return LANE_GENERAL;
+		}
+	default:
+		return LANE_GENERAL;
+	}
+}
+
+int lane_configure(const char *spec)
+{
+	unsigned long limit = 0;
+	unsigned long reserved = 0;
+	const char *p = strchr(spec, ':');
+	char *endp = NULL;
+	size_t n = 0;
+
+	if (!p)
+		return -1;
+
+	for (n = 0; n < LANE_NUM; n++)
+		if (strlen(lanes[n].name) == (size_t)(p - spec) &&
+		    !strncmp(lanes[n].name, spec, p - spec))
+			break;
+	if (n == LANE_NUM)
+		return -1;
+
+	errno = 0;
+	limit = strtoul(p + 1, &endp, 0);
+	if (errno || endp == p + 1 || *endp != ':')
+		return -1;
+	p = endp + 1;
+	reserved = strtoul(p, &endp, 0);
+	if (errno || endp == p || *endp)
+		return -1;
+	if (limit && reserved > limit)
+		return -1;
+
+	lanes[n].limit = limit;
+	lanes[n].reserved = reserved;
+	return 0;
+}
+
+int lane_init(size_t max_threads)
+{
+	size_t reserved = 0;
+	size_t n = 0;
+
+	for (n = 0; n < LANE_NUM; n++)
+		reserved += lanes[n].reserved;
+
+	if (!max_threads)
+		return 0;
+
+	lane_pool_limited = true;
+	if (reserved > max_threads) {
+		EMSG("lanes reserve %zu threads, more than the max %zu",
+		     reserved, max_threads);
+		return -1;
+	}
+
+	lane_shared_threads = max_threads - reserved;
+	return 0;
+}
+
+/* Number of requests running on threads not reserved by their lane */
+static size_t shared_in_use(void)
+{
+	size_t used = 0;
+	size_t n = 0;
+
+	for (n = 0; n < LANE_NUM; n++)
+		if (lanes[n].active > lanes[n].reserved)
+			used += lanes[n].active - lanes[n].reserved;
+
+	return used;
+}
+
+static bool may_admit(struct lane *l)
+{
+	if (l->limit && l->active >= l->limit)
+		return false;
+
+	if (l->active < l->reserved || !lane_pool_limited)
+		return true;
+
+	return shared_in_use() < lane_shared_threads;
+}
+
+static void admit(struct lane *l)
+{
+	l->active++;
+	l->admitted++;
+	if (l->active > l->peak_active)
+		l->peak_active = l->active;
+}
+
+bool lane_admit(unsigned int lane, void *(*copy)(void *arg), void *arg)
+{
+	struct lane *l = lanes + lane;
+	struct lane_item *li = NULL;
+	bool ret = true;
+
+	tee_supp_mutex_lock(&lane_mutex);
+
+	if (may_admit(l))
+		goto admit;
+
+	li = calloc(1, sizeof(*li));
+	if (li)
+		li->item = copy(arg);
+	if (!li || !li->item) {
+		/* Better serve the request now than to fail it */
+		EMSG("out of memory, admitting to lane %s anyway", l->name);
+		free(li);
+		goto admit;
+	}
+
+	STAILQ_INSERT_TAIL(&l->queue, li, link);
+	l->queued++;
+	l->deferred++;
+	if (l->queued > l->peak_queued)
+		l->peak_queued = l->queued;
+	ret = false;
+	goto out;
+
+admit:
+	admit(l);
+out:
+	tee_supp_mutex_unlock(&lane_mutex);
+	return ret;
+}
+
+void *lane_done(unsigned int lane, unsigned int *next_lane)
+{
+	struct lane_item *li = NULL;
+	void *item = NULL;
+	size_t n = 0;
+
+	tee_supp_mutex_lock(&lane_mutex);
+
+	lanes[lane].active--;
+
+	for (n = 0; n < LANE_NUM; n++) {
+		li = STAILQ_FIRST(&lanes[n].queue);
+		if (!li || !may_admit(lanes + n))
+			continue;
+
+		STAILQ_REMOVE_HEAD(&lanes[n].queue, link);
+		lanes[n].queued--;
+		admit(lanes + n);
+		item = li->item;
+		*next_lane = n;
+		free(li);
+		break;
+	}
+
+	tee_supp_mutex_unlock(&lane_mutex);
+
+	return item;
+}
+
+void lane_print_stats(FILE *f, void *arg)
+{
+	size_t n = 0;
+
+	(void)arg;
+
+	tee_supp_mutex_lock(&lane_mutex);
+	for (n = 0; n < LANE_NUM; n++)
+		fprintf(f, "lane %s limit %zu reserved %zu active %zu peak %zu "
+			"queued %zu peak %zu admitted %" PRIu64 " deferred %"
+			PRIu64 "\n", lanes[n].name, lanes[n].limit,
+			lanes[n].reserved, lanes[n].active,
+			lanes[n].peak_active, lanes[n].queued,
+			lanes[n].peak_queued, lanes[n].admitted,
+			lanes[n].deferred);
+	tee_supp_mutex_unlock(&lane_mutex);
+}
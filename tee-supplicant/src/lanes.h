@@ -0,0 +1,84 @@
+/*
+ * Copyright (c) 2026, Linaro Limited
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef LANES_H
+#define LANES_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+struct tee_ioctl_param;
+
+/*
+ * Requests are served in lanes so that slow requests, like sockets
+ * waiting for the network, can't occupy all threads of the pool and
+ * starve secure storage. Each lane has a concurrency limit and a number
+ * of reserved threads which the other lanes can't use. A request which
+ * can't be admitted to its lane is queued until a request completes.
+ */
+enum lane_id {
+	LANE_STORAGE,
+	LANE_GENERAL,
+	LANE_SOCKET,
+	LANE_NUM,
+};
+
+unsigned int lane_of(uint32_t func, size_t num_params,
+		     struct tee_ioctl_param *params);
+
+/*
+ * Parses a lane configuration "<name>:<limit>:<reserved>", a limit of 0
+ * means no limit. Returns 0 on success or -1 on error.
+ */
+int lane_configure(const char *spec);
+
+/*
+ * Checks that the reservations fit in a pool of at most max_threads
+ * threads (0 for no limit). Returns 0 on success or -1 on error.
+ */
+int lane_init(size_t max_threads);
+
+/*
+ * Admits a request to @lane or queues it. If the request can't be
+ * admitted copy(arg) is called, with the lane mutex held, to get the
+ * item to queue. Returns true if the request was admitted and is to be
+ * served now, false if it has been queued.
+ */
+bool lane_admit(unsigned int lane, void *(*copy)(void *arg), void *arg);
+
+/*
+ * Releases the slot held by a request in @lane and returns a queued item
+ * which has been admitted in its place, with its lane in *next_lane, or
+ * NULL if there is none.
+ */
+void *lane_done(unsigned int lane, unsigned int *next_lane);
+
+void lane_print_stats(FILE *f, void *arg);
+
+#endif /*LANES_H*/
@@ -148,6 +148,53 @@
  */
 #define OPTEE_MRF_READDIR		10
 
+/*
+ * Make data written to a file durable, only needed when tee-supplicant
+ * runs with --fs-durability deferred
+ *
+ * [in]  param[0].u.value.a	OPTEE_MRF_SYNC
+ * [in]  param[0].u.value.b	file descriptor of open file
+ */
+#define OPTEE_MRF_SYNC			11
+
+/*
+ * Read as many of the next file names of a directory as fit
+ *
+ * Each name is stored as a 16-bit length in native byte order, counting
+ * the terminating NUL, followed by the NUL terminated name. Entries are
+ * packed without padding. Names that didn't fit are returned by the
+ * next request. If not even the next name fits TEEC_ERROR_SHORT_BUFFER
+ * is returned with param[1].u.tmem.size set to the size needed, and if
+ * there are no more names TEEC_ERROR_ITEM_NOT_FOUND is returned.
+ *
+ * [in]     param[0].u.value.a	OPTEE_MRF_READDIR_BATCH
+ * [in]     param[0].u.value.b	handle to open directory
+ * [out]    param[1].u.tmem	packed file names
+ * [out]    param[2].u.value.a	number of names returned
+ * [out]    param[2].u.value.b	non-zero if there are no more names
+ */
+#define OPTEE_MRF_READDIR_BATCH		12
+
+/*
+ * Read or write a number of extents of a file with one request
+ *
+ * param[1] holds an array of extents, each a struct { uint64_t offs;
+ * uint64_t len; } in native byte order. param[2] holds the payload of
+ * all extents back to back, in the order of the array. Extents are
+ * processed in order, as if each was an OPTEE_MRF_READ or
+ * OPTEE_MRF_WRITE of its own. A read stops at the end of the file and
+ * param[2].u.tmem.size is updated with the number of bytes read.
+ *
+ * [in]     param[0].u.value.a	OPTEE_MRF_READV or OPTEE_MRF_WRITEV
+ * [in]     param[0].u.value.b	file descriptor of open file
+ * [in]     param[0].u.value.c	number of extents
+ * [in]     param[1].u.tmem	the extents
+ * [out]    param[2].u.tmem	payload read, for OPTEE_MRF_READV
+ * [in]     param[2].u.tmem	payload to write, for OPTEE_MRF_WRITEV
+ */
+#define OPTEE_MRF_READV			13
+#define OPTEE_MRF_WRITEV		14
+
 /*
  * End of definitions for messages with .cmd == OPTEE_MSG_RPC_CMD_FS
  */
@@ -0,0 +1,447 @@
+/*
+ * Copyright (c) 2026, Linaro Limited
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <errno.h>
+#include <inttypes.h>
+#include <optee_msg_supplicant.h>
+#include <pthread.h>
+#include <stats.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <teec_trace.h>
+#include <tee_supplicant.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifndef __aligned
+#define __aligned(x) __attribute__((__aligned__(x)))
+#endif
+#include <linux/tee.h>
+
+#ifndef PATH_MAX
+#define PATH_MAX 255
+#endif
+
+/*
+ * Latencies are recorded in microseconds in HDR style histograms: values
+ * below HIST_SUB have a bucket each, above that each power of two range
+ * is split in HIST_SUB buckets. This keeps the relative error of reported
+ * percentiles below 1 / HIST_SUB for any value with a fixed number of
+ * buckets. The last bucket catches everything above ~30 minutes.
+ */
+#define HIST_SUB_BITS		2
+#define HIST_SUB		(1 << HIST_SUB_BITS)
+#define HIST_NUM_BUCKETS	(HIST_SUB * 30)
+
+#define STATS_MAX_PROVIDERS	16
+
+struct stats_hist {
+	uint64_t count;
+	uint64_t sum_us;
+	uint64_t max_us;
+	uint64_t buckets[HIST_NUM_BUCKETS];
+};
+
+/*
+ * Histograms of a thread. Only the owning thread updates them, readers
+ * use atomic loads so they never see torn values. When a thread exits
+ * its histograms are handed over to the next new thread so the counts
+ * are preserved and memory stays bounded by the peak number of threads.
+ */
+struct stats_thread {
+	bool in_use;
+	struct stats_hist hist[STATS_NUM_CLASSES];
+	struct stats_thread *next;
+};
+
+struct stats_provider {
+	void (*fn)(FILE *f, void *arg);
+	void *arg;
+};
+
+static pthread_mutex_t stats_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct stats_thread *stats_threads;
+static struct stats_provider stats_providers[STATS_MAX_PROVIDERS];
+static size_t stats_num_providers;
+static pthread_key_t stats_key;
+static pthread_once_t stats_key_once = PTHREAD_ONCE_INIT;
+static char stats_path[PATH_MAX];
+static unsigned int stats_interval;
+
+static const char * const fs_op_names[STATS_FS_MAX_OPS] = {
+	[OPTEE_MRF_OPEN] = "fs_open",
+	[OPTEE_MRF_CREATE] = "fs_create",
+	[OPTEE_MRF_CLOSE] = "fs_close",
+	[OPTEE_MRF_READ] = "fs_read",
+	[OPTEE_MRF_WRITE] = "fs_write",
+	[OPTEE_MRF_TRUNCATE] = "fs_truncate",
+	[OPTEE_MRF_REMOVE] = "fs_remove",
+	[OPTEE_MRF_RENAME] = "fs_rename",
+	[OPTEE_MRF_OPENDIR] = "fs_opendir",
+	[OPTEE_MRF_CLOSEDIR] = "fs_closedir",
+	[OPTEE_MRF_READDIR] = "fs_readdir",
+	[OPTEE_MRF_SYNC] = "fs_sync",
+	[OPTEE_MRF_READDIR_BATCH] = "fs_readdir_batch",
+	[OPTEE_MRF_READV] = "fs_readv",
+	[OPTEE_MRF_WRITEV] = "fs_writev",
+};
+
+static const char * const socket_op_names[STATS_SOCKET_MAX_OPS] = {
+	[OPTEE_MRC_SOCKET_OPEN] = "socket_open",
+	[OPTEE_MRC_SOCKET_CLOSE] = "socket_close",
+	[OPTEE_MRC_SOCKET_CLOSE_ALL] = "socket_close_all",
+	[OPTEE_MRC_SOCKET_SEND] = "socket_send",
+	[OPTEE_MRC_SOCKET_RECV] = "socket_recv",
+	[OPTEE_MRC_SOCKET_IOCTL] = "socket_ioctl",
+};
+
+static const char * const class_names[STATS_FS_BASE] = {
+	[STATS_LOAD_TA] = "load_ta",
+	[STATS_RPMB] = "rpmb",
+	[STATS_SHM_ALLOC] = "shm_alloc",
+	[STATS_SHM_FREE] = "shm_free",
+	[STATS_GPROF] = "gprof",
+	[STATS_FTRACE] = "ftrace",
+	[STATS_OTHER] = "other",
+};
+
+unsigned int stats_req_class(uint32_t func, size_t num_params,
+			     struct tee_ioctl_param *params)
+{
+	uint64_t sub_op = UINT64_MAX;
+
+	if (num_params && tee_supp_param_is_value(params))
+		sub_op = params->a;
+
+	switch (func) {
+	case OPTEE_MSG_RPC_CMD_LOAD_TA:
+		return STATS_LOAD_TA;
+	case OPTEE_MSG_RPC_CMD_RPMB:
+		return STATS_RPMB;
+	case OPTEE_MSG_RPC_CMD_SHM_ALLOC:
+		return STATS_SHM_ALLOC;
+	case OPTEE_MSG_RPC_CMD_SHM_FREE:
+		return STATS_SHM_FREE;
+	case OPTEE_MSG_RPC_CMD_GPROF:
+		return STATS_GPROF;
+	case OPTEE_MSG_RPC_CMD_FTRACE:
+		return STATS_FTRACE;
+	case OPTEE_MSG_RPC_CMD_FS:
+		if (sub_op < STATS_FS_MAX_OPS)
+			return STATS_FS_BASE + sub_op;
+		return STATS_OTHER;
+	case OPTEE_MSG_RPC_CMD_SOCKET:
+		if (sub_op < STATS_SOCKET_MAX_OPS)
+			return STATS_SOCKET_BASE + sub_op;
+		return STATS_OTHER;
+	default:
+		return STATS_OTHER;
+	}
+}
+
+const char *stats_req_class_name(unsigned int cls)
+{
+	const char *name = NULL;
+
+	if (cls < STATS_FS_BASE)
+		name = class_names[cls];
+	else if (cls < STATS_SOCKET_BASE)
+		name = fs_op_names[cls - STATS_FS_BASE];
+	else if (cls < STATS_NUM_CLASSES)
+		name = socket_op_names[cls - STATS_SOCKET_BASE];
+
+	return name ? name : "unknown";
+}
+
+uint64_t stats_now_ns(void)
+{
+	struct timespec ts;
+
+	memset(&ts, 0, sizeof(ts));
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static unsigned int hist_bucket(uint64_t us)
+{
+	unsigned int msb = 0;
+	unsigned int idx = 0;
+
+	if (us < HIST_SUB)
+		return us;
+
+	msb = 63 - __builtin_clzll(us);
+	idx = (msb - HIST_SUB_BITS + 1) * HIST_SUB +
+	      ((us >> (msb - HIST_SUB_BITS)) & (HIST_SUB - 1));
+	if (idx >= HIST_NUM_BUCKETS)
+		return HIST_NUM_BUCKETS - 1;
+
+	return idx;
+}
+
+/* Returns the largest value recorded in bucket @idx */
+static uint64_t hist_bucket_max(unsigned int idx)
+{
+	unsigned int shift = 0;
+
+	if (idx < HIST_SUB)
+		return idx;
+
+	shift = idx / HIST_SUB - 1;
+	return (((uint64_t)HIST_SUB + idx % HIST_SUB + 1) << shift) - 1;
+}
+
+static void stats_thread_release(void *p)
+{
+	struct stats_thread *st = p;
+
+	__atomic_store_n(&st->in_use, false, __ATOMIC_RELEASE);
+}
+
+static void stats_key_init(void)
+{
+	int e = pthread_key_create(&stats_key, stats_thread_release);
+
+	if (e) {
+		EMSG("pthread_key_create: %s", strerror(e));
+		EMSG("terminating...");
+		exit(EXIT_FAILURE);
+	}
+}
+
+static struct stats_thread *stats_thread_get(void)
+{
+	struct stats_thread *st = NULL;
+
+	pthread_once(&stats_key_once, stats_key_init);
+
+	st = pthread_getspecific(stats_key);
+	if (st)
+		return st;
+
+	tee_supp_mutex_lock(&stats_mutex);
+
+	for (st = stats_threads; st; st = st->next)
+		if (!__atomic_load_n(&st->in_use, __ATOMIC_ACQUIRE))
+			break;
+
+	if (!st) {
+		st = calloc(1, sizeof(*st));
+		if (st) {
+			st->next = stats_threads;
+			stats_threads = st;
+		}
+	}
+	if (st)
+		st->in_use = true;
+
+	tee_supp_mutex_unlock(&stats_mutex);
+
+	if (st)
+		pthread_setspecific(stats_key, st);
+
+	return st;
+}
+
+static void inc_relaxed(uint64_t *p, uint64_t v)
+{
+	__atomic_store_n(p, __atomic_load_n(p, __ATOMIC_RELAXED) + v,
+			 __ATOMIC_RELAXED);
+}
+
+void stats_record(unsigned int cls, uint64_t ns)
+{
+	struct stats_thread *st = stats_thread_get();
+	struct stats_hist *h = NULL;
+	uint64_t us = ns / 1000;
+
+	if (!st || cls >= STATS_NUM_CLASSES)
+		return;
+
+	h = st->hist + cls;
+	inc_relaxed(&h->count, 1);
+	inc_relaxed(&h->sum_us, us);
+	inc_relaxed(h->buckets + hist_bucket(us), 1);
+	if (us > h->max_us)
+		__atomic_store_n(&h->max_us, us, __ATOMIC_RELAXED);
+}
+
+int stats_add_provider(void (*fn)(FILE *f, void *arg), void *arg)
+{
+	int ret = -1;
+
+	tee_supp_mutex_lock(&stats_mutex);
+	if (stats_num_providers < STATS_MAX_PROVIDERS) {
+		stats_providers[stats_num_providers].fn = fn;
+		stats_providers[stats_num_providers].arg = arg;
+		__atomic_store_n(&stats_num_providers, stats_num_providers + 1,
+				 __ATOMIC_RELEASE);
+		ret = 0;
+	}
+	tee_supp_mutex_unlock(&stats_mutex);
+
+	return ret;
+}
+
+static uint64_t hist_percentile(const struct stats_hist *h, unsigned int pct)
+{
+	uint64_t target = (h->count * pct + 99) / 100;
+	uint64_t acc = 0;
+	unsigned int n = 0;
+
+	for (n = 0; n < HIST_NUM_BUCKETS; n++) {
+		acc += h->buckets[n];
+		if (acc >= target)
+			return hist_bucket_max(n);
+	}
+
+	return h->max_us;
+}
+
+static void print_histograms(FILE *f)
+{
+	struct stats_hist *sum = NULL;
+	struct stats_thread *st = NULL;
+	const struct stats_hist *h = NULL;
+	unsigned int cls = 0;
+	unsigned int n = 0;
+	uint64_t max_us = 0;
+
+	sum = calloc(STATS_NUM_CLASSES, sizeof(*sum));
+	if (!sum)
+		return;
+
+	tee_supp_mutex_lock(&stats_mutex);
+	for (st = stats_threads; st; st = st->next) {
+		for (cls = 0; cls < STATS_NUM_CLASSES; cls++) {
+			h = st->hist + cls;
+			sum[cls].count += __atomic_load_n(&h->count,
+							  __ATOMIC_RELAXED);
+			sum[cls].sum_us += __atomic_load_n(&h->sum_us,
+							   __ATOMIC_RELAXED);
+			max_us = __atomic_load_n(&h->max_us, __ATOMIC_RELAXED);
+			if (max_us > sum[cls].max_us)
+				sum[cls].max_us = max_us;
+			for (n = 0; n < HIST_NUM_BUCKETS; n++)
+				sum[cls].buckets[n] +=
+					__atomic_load_n(h->buckets + n,
+							__ATOMIC_RELAXED);
+		}
+	}
+	tee_supp_mutex_unlock(&stats_mutex);
+
+	fprintf(f, "# request count mean_us p50_us p90_us p99_us max_us\n");
+	for (cls = 0; cls < STATS_NUM_CLASSES; cls++) {
+		h = sum + cls;
+		if (!h->count)
+			continue;
+		fprintf(f, "%s %" PRIu64 " %" PRIu64 " %" PRIu64 " %" PRIu64
+			" %" PRIu64 " %" PRIu64 "\n",
+			stats_req_class_name(cls), h->count,
+			h->sum_us / h->count, hist_percentile(h, 50),
+			hist_percentile(h, 90), hist_percentile(h, 99),
+			h->max_us);
+	}
+
+	free(sum);
+}
+
+void stats_print(FILE *f)
+{
+	size_t n = 0;
+
+	/* Providers are never removed so no need to hold the mutex */
+	for (n = 0; n < __atomic_load_n(&stats_num_providers,
+					__ATOMIC_ACQUIRE); n++)
+		stats_providers[n].fn(f, stats_providers[n].arg);
+	print_histograms(f);
+}
+
+static void write_stats_file(void)
+{
+	char tmp_path[PATH_MAX + 4] = { 0 };
+	FILE *f = NULL;
+
+	snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", stats_path);
+	f = fopen(tmp_path, "w");
+	if (!f) {
+		EMSG("fopen(\"%s\"): %s", tmp_path, strerror(errno));
+		return;
+	}
+
+	stats_print(f);
+
+	if (fclose(f)) {
+		EMSG("fclose(\"%s\"): %s", tmp_path, strerror(errno));
+		unlink(tmp_path);
+		return;
+	}
+
+	if (rename(tmp_path, stats_path))
+		EMSG("rename(\"%s\"): %s", stats_path, strerror(errno));
+}
+
+static void *stats_thread_main(void *arg)
+{
+	(void)arg;
+
+	while (true) {
+		sleep(stats_interval);
+		write_stats_file();
+	}
+
+	return NULL;
+}
+
+int stats_start(const char *path, unsigned int interval_secs)
+{
+	pthread_t tid;
+	int n = 0;
+	int e = 0;
+
+	memset(&tid, 0, sizeof(tid));
+
+	n = snprintf(stats_path, sizeof(stats_path), "%s", path);
+	if (n < 0 || (size_t)n >= sizeof(stats_path))
+		return -1;
+	stats_interval = interval_secs ? interval_secs : 1;
+
+	e = pthread_create(&tid, NULL, stats_thread_main, NULL);
+	if (e) {
+		EMSG("pthread_create: %s", strerror(e));
+		return -1;
+	}
+
+	e = pthread_detach(tid);
+	if (e)
+		EMSG("pthread_detach: %s", strerror(e));
+
+	return 0;
+}
@@ -0,0 +1,86 @@
+/*
+ * Copyright (c) 2026, Linaro Limited
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+struct tee_ioctl_param;
+
+/*
+ * Requests are classified by command and, for file system and socket
+ * requests, by sub-command.
+ */
+#define STATS_FS_MAX_OPS	16
+#define STATS_SOCKET_MAX_OPS	8
+
+enum stats_req_class {
+	STATS_LOAD_TA,
+	STATS_RPMB,
+	STATS_SHM_ALLOC,
+	STATS_SHM_FREE,
+	STATS_GPROF,
+	STATS_FTRACE,
+	STATS_OTHER,
+	STATS_FS_BASE,
+	STATS_SOCKET_BASE = STATS_FS_BASE + STATS_FS_MAX_OPS,
+	STATS_NUM_CLASSES = STATS_SOCKET_BASE + STATS_SOCKET_MAX_OPS,
+};
+
+unsigned int stats_req_class(uint32_t func, size_t num_params,
+			     struct tee_ioctl_param *params);
+const char *stats_req_class_name(unsigned int cls);
+
+/*
+ * Records the latency of a request in the histograms of the calling
+ * thread. Only the calling thread updates its histograms so this doesn't
+ * take any locks.
+ */
+void stats_record(unsigned int cls, uint64_t ns);
+
+/* Returns monotonic time in nanoseconds */
+uint64_t stats_now_ns(void);
+
+/*
+ * Registers a function printing a section of the stats file, each
+ * provider is called with @arg every time the file is rewritten.
+ * Returns 0 on success or -1 if no more providers can be added.
+ */
+int stats_add_provider(void (*fn)(FILE *f, void *arg), void *arg);
+
+/* Prints all sections of the stats file to @f */
+void stats_print(FILE *f);
+
+/*
+ * Starts a thread rewriting the stats file every interval_secs seconds.
+ * Returns 0 on success or -1 on failure.
+ */
+int stats_start(const char *path, unsigned int interval_secs);
+
+#endif /*STATS_H*/
@@ -0,0 +1,234 @@
+/*
+ * Copyright (c) 2026, Linaro Limited
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <endian.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <ta_bundle.h>
+#include <teec_ta_load.h>
+#include <teec_trace.h>
+#include <unistd.h>
+
+/*
+ * The bundle is mapped once at startup and never unmapped, lookups only
+ * read the mapping so they don't need any locking.
+ */
+static const uint8_t *bundle;
+static const struct ta_bundle_entry *bundle_index;
+static size_t bundle_num_entries;
+
+static void uuid_to_octets(uint8_t d[16], const TEEC_UUID *s)
+{
+	d[0] = s->timeLow >> 24;
+	d[1] = s->timeLow >> 16;
+	d[2] = s->timeLow >> 8;
+	d[3] = s->timeLow;
+	d[4] = s->timeMid >> 8;
+	d[5] = s->timeMid;
+	d[6] = s->timeHiAndVersion >> 8;
+	d[7] = s->timeHiAndVersion;
+	memcpy(d + 8, s->clockSeqAndNode, sizeof(s->clockSeqAndNode));
+}
+
+/*
+ * TA images must lie after the header and index, in the first aligned
+ * offset following them or later. The caller has checked that the index
+ * fits in the file.
+ */
+static bool check_index(const struct ta_bundle_entry *index, size_t num,
+			size_t size)
+{
+	uint64_t data_start = sizeof(struct ta_bundle_hdr) +
+			      (uint64_t)num * sizeof(*index);
+	uint64_t offs = 0;
+	uint64_t sz = 0;
+	size_t n = 0;
+
+	data_start = (data_start + TA_BUNDLE_ALIGN - 1) /
+		     TA_BUNDLE_ALIGN * TA_BUNDLE_ALIGN;
+
+	for (n = 0; n < num; n++) {
+		offs = le64toh(index[n].offs);
+		sz = le64toh(index[n].size);
+		if (offs % TA_BUNDLE_ALIGN || offs < data_start ||
+		    offs > size || sz > size - offs)
+			return false;
+		if (n && memcmp(index[n - 1].uuid, index[n].uuid,
+				sizeof(index[n].uuid)) >= 0)
+			return false;
+	}
+
+	return true;
+}
+
+int ta_bundle_open(const char *path)
+{
+	const struct ta_bundle_hdr *hdr = NULL;
+	struct stat st;
+	size_t num = 0;
+	void *p = NULL;
+	int fd = -1;
+
+	memset(&st, 0, sizeof(st));
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		EMSG("open(\"%s\"): %s", path, strerror(errno));
+		return -1;
+	}
+
+	if (fstat(fd, &st) || (size_t)st.st_size < sizeof(*hdr)) {
+		EMSG("\"%s\": not a TA bundle", path);
+		goto err;
+	}
+
+	p = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (p == MAP_FAILED) {
+		EMSG("mmap(\"%s\"): %s", path, strerror(errno));
+		goto err;
+	}
+	close(fd);
+
+	hdr = p;
+	num = le32toh(hdr->num_entries);
+	if (memcmp(hdr->magic, TA_BUNDLE_MAGIC, sizeof(hdr->magic)) ||
+	    le32toh(hdr->version) != TA_BUNDLE_VERSION ||
+	    num > (st.st_size - sizeof(*hdr)) / sizeof(*bundle_index) ||
+	    !check_index((const void *)(hdr + 1), num, st.st_size)) {
+		EMSG("\"%s\": bad TA bundle", path);
+		munmap(p, st.st_size);
+		return -1;
+	}
+
+	bundle = p;
+	bundle_index = (const void *)(hdr + 1);
+	bundle_num_entries = num;
+	DMSG("\"%s\": %zu TAs", path, num);
+
+	return 0;
+err:
+	close(fd);
+	return -1;
+}
+
+static const struct ta_bundle_entry *find_entry(const uint8_t uuid[16])
+{
+	size_t lo = 0;
+	size_t hi = bundle_num_entries;
+	size_t mid = 0;
+	int cmp = 0;
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		cmp = memcmp(uuid, bundle_index[mid].uuid, 16);
+		if (!cmp)
+			return bundle_index + mid;
+		if (cmp < 0)
+			hi = mid;
+		else
+			lo = mid + 1;
+	}
+
+	return NULL;
+}
+
+int ta_bundle_load(const TEEC_UUID *uuid, void *ta, size_t *ta_size)
+{
+	const struct ta_bundle_entry *e = NULL;
+	uint8_t octets[16] = { 0 };
+	size_t offs = 0;
+	size_t size = 0;
+
+	if (!bundle)
+		return TA_BINARY_NOT_FOUND;
+
+	uuid_to_octets(octets, uuid);
+	e = find_entry(octets);
+	if (!e)
+		return TA_BINARY_NOT_FOUND;
+
+	offs = le64toh(e->offs);
+	size = le64toh(e->size);
+	if (ta && size <= *ta_size) {
+		madvise((void *)(bundle + offs), size, MADV_WILLNEED);
+		memcpy(ta, bundle + offs, size);
+	}
+	*ta_size = size;
+
+	return TA_BINARY_FOUND;
+}
+
+/* Reads the pages of @size bytes at @offs in the bundle from storage */
+static void prefetch_range(size_t offs, size_t size)
+{
+	const volatile uint8_t *p = bundle + offs;
+	size_t n = 0;
+
+	if (!size)
+		return;
+
+	madvise((void *)(bundle + offs), size, MADV_WILLNEED);
+	for (n = 0; n < size; n += TA_BUNDLE_ALIGN)
+		(void)p[n];
+	(void)p[size - 1];
+}
+
+int ta_bundle_prefetch(const TEEC_UUID *uuid, size_t *bytes)
+{
+	const struct ta_bundle_entry *e = NULL;
+	uint8_t octets[16] = { 0 };
+
+	if (!bundle)
+		return TA_BINARY_NOT_FOUND;
+
+	uuid_to_octets(octets, uuid);
+	e = find_entry(octets);
+	if (!e)
+		return TA_BINARY_NOT_FOUND;
+
+	prefetch_range(le64toh(e->offs), le64toh(e->size));
+	*bytes += le64toh(e->size);
+
+	return TA_BINARY_FOUND;
+}
+
+size_t ta_bundle_prefetch_all(size_t *bytes)
+{
+	size_t n = 0;
+
+	for (n = 0; n < bundle_num_entries; n++) {
+		prefetch_range(le64toh(bundle_index[n].offs),
+			       le64toh(bundle_index[n].size));
+		*bytes += le64toh(bundle_index[n].size);
+	}
+
+	return bundle_num_entries;
+}
@@ -0,0 +1,81 @@
+/*
+ * Copyright (c) 2026, Linaro Limited
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef TA_BUNDLE_H
+#define TA_BUNDLE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <tee_client_api.h>
+
+/*
+ * A TA bundle holds many TA binaries in a single file, to be shipped
+ * instead of one file per TA on read-only images. All integers are
+ * little endian. The file starts with a struct ta_bundle_hdr followed by
+ * @num_entries struct ta_bundle_entry sorted by UUID, where the UUID is
+ * in the octet form used by the TEE, that is the 16 byte big endian
+ * encoding of RFC4122. Each TA image starts at a multiple of
+ * TA_BUNDLE_ALIGN. scripts/mk_ta_bundle.py creates bundles.
+ */
+#define TA_BUNDLE_MAGIC		"OPTEETAB"
+#define TA_BUNDLE_VERSION	1
+#define TA_BUNDLE_ALIGN		4096
+
+struct ta_bundle_hdr {
+	char magic[8];
+	uint32_t version;
+	uint32_t num_entries;
+};
+
+struct ta_bundle_entry {
+	uint8_t uuid[16];
+	uint64_t offs;
+	uint64_t size;
+};
+
+/*
+ * Maps the bundle at @path and checks its index. Returns 0 on success or
+ * -1.
+ */
+int ta_bundle_open(const char *path);
+
+/*
+ * Looks up @uuid in the bundle and copies the TA to @ta if it's non-NULL
+ * and *@ta_size is large enough. Updates *@ta_size with the size of the
+ * TA. Returns TA_BINARY_FOUND or TA_BINARY_NOT_FOUND, also if no bundle
+ * is open.
+ */
+int ta_bundle_load(const TEEC_UUID *uuid, void *ta, size_t *ta_size);
+
+/*
+ * Reads the TA @uuid, or all TAs, of the bundle from storage and adds
+ * their sizes to *@bytes. ta_bundle_prefetch() returns TA_BINARY_FOUND or
+ * TA_BINARY_NOT_FOUND, ta_bundle_prefetch_all() the number of TAs.
+ */
+int ta_bundle_prefetch(const TEEC_UUID *uuid, size_t *bytes);
+size_t ta_bundle_prefetch_all(size_t *bytes);
+
+#endif /*TA_BUNDLE_H*/
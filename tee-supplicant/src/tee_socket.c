@@ -70,12 +70,12 @@ TAILQ_HEAD(, sock_instance) sock_instances =
 
 static void sock_lock(void)
 {
-	pthread_mutex_lock(&sock_mutex);
+	tee_supp_mutex_lock(&sock_mutex);
 }
 
 static void sock_unlock(void)
 {
-	pthread_mutex_unlock(&sock_mutex);
+	tee_supp_mutex_unlock(&sock_mutex);
 }
 
 static struct sock_instance *sock_instance_find(uint32_t instance_id)
@@ -24,22 +24,38 @@
  * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
  * POSSIBILITY OF SUCH DAMAGE.
  */
+
+/* For sync_file_range() and fallocate() */
+#define _GNU_SOURCE
+
 #include <assert.h>
 #include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <fs_backend.h>
+#include <fs_powercut.h>
+#include <fs_ta_io.h>
+#include <fs_uring.h>
 #include <handle.h>
+#include <inttypes.h>
 #include <libgen.h>
+#include <linux/fiemap.h>
+#include <linux/fs.h>
 #include <optee_msg_supplicant.h>
+#include <pthread.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/ioctl.h>
+#include <sys/param.h>
+#include <sys/queue.h>
 #include <sys/stat.h>
 #include <teec_trace.h>
 #include <tee_supp_fs.h>
 #include <tee_supplicant.h>
+#include <time.h>
 #include <unistd.h>
 
 #ifndef __aligned
@@ -53,6 +69,14 @@
 
 /* Path to all secure storage files. */
 static char tee_fs_root[PATH_MAX];
+static int tee_fs_root_fd = -1;
+
+/* Set by --fs-backend to serve requests instead of the directory layout */
+static const struct fs_backend *fs_backend;
+
+/* Serializes tee_supp_fs_init() of concurrent first requests */
+static pthread_mutex_t fs_init_mutex = PTHREAD_MUTEX_INITIALIZER;
+static bool fs_ready;
 
 #define TEE_FS_FILENAME_MAX_LENGTH 150
 
@@ -60,15 +84,1471 @@ static pthread_mutex_t dir_handle_db_mutex = PTHREAD_MUTEX_INITIALIZER;
 static struct handle_db dir_handle_db =
 		HANDLE_DB_INITIALIZER_WITH_MUTEX(&dir_handle_db_mutex);
 
-static size_t tee_fs_get_absolute_filename(char *file, char *out,
-					   size_t out_size)
+/*
+ * With --fs-durability deferred files are opened without O_SYNC and
+ * writes are only made durable at barriers: closing, truncating or
+ * renaming a file, an explicit OPTEE_MRF_SYNC and around writes to the
+ * first block of a file.
+ *
+ * The REE FS of OP-TEE keeps each file as a hash tree where updated
+ * nodes and data blocks are written to unused slots, and an update is
+ * committed by writing one of the two headers, which live in the first
+ * block of the file. Syncing before a header write makes sure what it
+ * refers to is on disk, and syncing after it makes sure the commit is
+ * on disk before any update depending on it, such as of dirf.db, is
+ * started. So after a power cut each file is either in its previous or
+ * its new state, as with O_SYNC. fs_powercut.c checks this.
+ */
+
+/*
+ * Requests to sync a file wait in a list. The first thread to find no
+ * sync in progress takes the whole list and syncs all files in it,
+ * starting writeback of all of them before waiting for any, so
+ * concurrent requests share the device flushes.
+ */
+struct fs_sync_req {
+	int fd;
+	int res;
+	bool done;
+	struct fs_sync_req *next;
+};
+
+static struct {
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	struct fs_sync_req *pending;
+	bool busy;
+	uint64_t requests;
+	uint64_t batches;
+} fs_sync = {
+	.mutex = PTHREAD_MUTEX_INITIALIZER,
+	.cond = PTHREAD_COND_INITIALIZER,
+};
+
+/*
+ * With --fs-engine io_uring file data is read, written and synced
+ * through a ring shared by all threads instead of with one system call
+ * per request. Descriptors must then be closed with close_fd().
+ */
+static ssize_t pread_wrapper(int fd, void *buf, size_t len, off_t offs)
+{
+	if (fs_uring_enabled())
+		return fs_uring_pread(fd, buf, len, offs);
+	return pread(fd, buf, len, offs);
+}
+
+static ssize_t pwrite_wrapper(int fd, const void *buf, size_t len,
+			      off_t offs)
+{
+	if (fs_uring_enabled())
+		return fs_uring_pwrite(fd, buf, len, offs);
+	return pwrite(fd, buf, len, offs);
+}
+
+static void bcache_forget_fd(int fd);
+static void fs_fd_forget(int fd);
+
+static int close_fd(int fd)
+{
+	bcache_forget_fd(fd);
+	fs_fd_forget(fd);
+	fs_uring_close_fd(fd);
+	return close(fd);
+}
+
+static int fdatasync_wrapper(int fd)
+{
+	if (fs_uring_enabled())
+		return fs_uring_fdatasync(fd);
+
+	while (fdatasync(fd)) {
+		if (errno != EINTR)
+			return -1;
+	}
+	fs_powercut_synced(fd);
+	return 0;
+}
+
+static void fs_sync_batch(struct fs_sync_req *batch)
+{
+	struct fs_sync_req *req = NULL;
+	struct fs_sync_req *r = NULL;
+
+	for (req = batch; req; req = req->next)
+		sync_file_range(req->fd, 0, 0, SYNC_FILE_RANGE_WRITE);
+
+	for (req = batch; req; req = req->next) {
+		/* Files are often synced twice in a row, by the same TA */
+		for (r = batch; r != req; r = r->next)
+			if (r->fd == req->fd)
+				break;
+		if (r != req)
+			req->res = r->res;
+		else
+			req->res = fdatasync_wrapper(req->fd);
+	}
+}
+
+/* Returns 0 once data written to @fd is durable, or -1 */
+static int fs_sync_fd(int fd)
+{
+	struct fs_sync_req req = { .fd = fd };
+	struct fs_sync_req *batch = NULL;
+	struct fs_sync_req *r = NULL;
+
+	if (!supplicant_params.fs_deferred_sync)
+		return 0;
+
+	tee_supp_mutex_lock(&fs_sync.mutex);
+	req.next = fs_sync.pending;
+	fs_sync.pending = &req;
+	fs_sync.requests++;
+
+	while (!req.done) {
+		if (fs_sync.busy) {
+			pthread_cond_wait(&fs_sync.cond, &fs_sync.mutex);
+			continue;
+		}
+
+		batch = fs_sync.pending;
+		fs_sync.pending = NULL;
+		fs_sync.busy = true;
+		fs_sync.batches++;
+		tee_supp_mutex_unlock(&fs_sync.mutex);
+
+		fs_sync_batch(batch);
+
+		tee_supp_mutex_lock(&fs_sync.mutex);
+		for (r = batch; r; r = r->next)
+			r->done = true;
+		fs_sync.busy = false;
+		pthread_cond_broadcast(&fs_sync.cond);
+	}
+	tee_supp_mutex_unlock(&fs_sync.mutex);
+
+	return req.res;
+}
+
+/*
+ * Files are opened, created, removed and renamed relative to a
+ * descriptor of the directory holding them, so only the last
+ * component of the name is looked up. Descriptors of the directories
+ * known to exist, the root included, are kept in an LRU list keyed by
+ * the name relative to tee_fs_root_fd. An entry in use when dropped or
+ * evicted is closed once the last user is done with it.
+ */
+#define DIR_CACHE_SIZE	32
+
+struct dir_cache_entry {
+	char *path;
+	int fd;
+	unsigned int refs;
+	bool cached;
+	TAILQ_ENTRY(dir_cache_entry) link;
+};
+
+static struct {
+	pthread_mutex_t mutex;
+	TAILQ_HEAD(dir_cache_head, dir_cache_entry) lru;
+	size_t num_entries;
+	uint64_t hits;
+	uint64_t misses;
+} dir_cache = {
+	.mutex = PTHREAD_MUTEX_INITIALIZER,
+	.lru = TAILQ_HEAD_INITIALIZER(dir_cache.lru),
+};
+
+static void dir_cache_free(struct dir_cache_entry *e)
+{
+	close_fd(e->fd);
+	free(e->path);
+	free(e);
+}
+
+/* Takes @e out of the list, the caller holds dir_cache.mutex */
+static void dir_cache_unlink(struct dir_cache_entry *e)
+{
+	TAILQ_REMOVE(&dir_cache.lru, e, link);
+	dir_cache.num_entries--;
+	e->cached = false;
+	if (!e->refs)
+		dir_cache_free(e);
+}
+
+static struct dir_cache_entry *dir_cache_find(const char *path)
+{
+	struct dir_cache_entry *e = NULL;
+
+	TAILQ_FOREACH(e, &dir_cache.lru, link)
+		if (!strcmp(e->path, path))
+			return e;
+	return NULL;
+}
+
+/*
+ * Returns the entry of directory @path, opening it if needed, or NULL
+ * with errno set. Release it with dir_cache_put().
+ */
+static struct dir_cache_entry *dir_cache_get(const char *path)
+{
+	struct dir_cache_entry *e = NULL;
+	struct dir_cache_entry *ne = NULL;
+	int fd = -1;
+
+	tee_supp_mutex_lock(&dir_cache.mutex);
+	e = dir_cache_find(path);
+	if (e) {
+		TAILQ_REMOVE(&dir_cache.lru, e, link);
+		TAILQ_INSERT_HEAD(&dir_cache.lru, e, link);
+		e->refs++;
+		dir_cache.hits++;
+	} else {
+		dir_cache.misses++;
+	}
+	tee_supp_mutex_unlock(&dir_cache.mutex);
+	if (e)
+		return e;
+
+	do {
+		fd = openat(tee_fs_root_fd, path,
+			    O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	} while (fd < 0 && errno == EINTR);
+	if (fd < 0)
+		return NULL;
+
+	ne = calloc(1, sizeof(*ne));
+	if (ne)
+		ne->path = strdup(path);
+	if (!ne || !ne->path) {
+		free(ne);
+		close_fd(fd);
+		errno = ENOMEM;
+		return NULL;
+	}
+	ne->fd = fd;
+	ne->refs = 1;
+	ne->cached = true;
+
+	tee_supp_mutex_lock(&dir_cache.mutex);
+	/* Another thread may have opened it meanwhile */
+	e = dir_cache_find(path);
+	if (e) {
+		e->refs++;
+	} else {
+		e = ne;
+		ne = NULL;
+		TAILQ_INSERT_HEAD(&dir_cache.lru, e, link);
+		dir_cache.num_entries++;
+		while (dir_cache.num_entries > DIR_CACHE_SIZE)
+			dir_cache_unlink(TAILQ_LAST(&dir_cache.lru,
+						    dir_cache_head));
+	}
+	tee_supp_mutex_unlock(&dir_cache.mutex);
+
+	if (ne)
+		dir_cache_free(ne);
+	return e;
+}
+
+static void dir_cache_put(struct dir_cache_entry *e)
+{
+	tee_supp_mutex_lock(&dir_cache.mutex);
+	e->refs--;
+	if (!e->refs && !e->cached)
+		dir_cache_free(e);
+	tee_supp_mutex_unlock(&dir_cache.mutex);
+}
+
+/* Forgets directory @path, called when it's removed or found missing */
+static void dir_cache_drop(const char *path)
+{
+	struct dir_cache_entry *e = NULL;
+
+	tee_supp_mutex_lock(&dir_cache.mutex);
+	e = dir_cache_find(path);
+	if (e)
+		dir_cache_unlink(e);
+	tee_supp_mutex_unlock(&dir_cache.mutex);
+}
+
+/*
+ * Splits @name into the directory holding it, "." for the root, which
+ * is copied to @dir, and the last component, which is returned.
+ */
+static const char *split_name(const char *name, char *dir, size_t dir_size)
+{
+	const char *slash = strrchr(name, '/');
+
+	if (!slash) {
+		snprintf(dir, dir_size, ".");
+		return name;
+	}
+	snprintf(dir, dir_size, "%.*s", (int)(slash - name), name);
+	return slash + 1;
+}
+
+/* Makes the entries of directory @dir durable */
+static int fs_sync_dir(const char *dir)
+{
+	struct dir_cache_entry *e = NULL;
+	int res = 0;
+
+	if (!supplicant_params.fs_deferred_sync)
+		return 0;
+
+	e = dir_cache_get(dir);
+	if (!e)
+		return -1;
+	res = fs_sync_fd(e->fd);
+	dir_cache_put(e);
+
+	return res;
+}
+
+/*
+ * The secure side opens and closes the same files over and over, dirf.db
+ * above all. Closed descriptors are kept, keyed by the absolute path,
+ * and handed back when the file is opened again. The path of each open
+ * descriptor is tracked so it can be cached when closed. Removing,
+ * renaming or creating a file closes its cached descriptors and makes
+ * open descriptors of it be closed for real, since the path may then
+ * refer to another file.
+ */
+struct fd_cache_entry {
+	int fd;
+	char *path;
+	TAILQ_ENTRY(fd_cache_entry) link;
+};
+
+static struct {
+	pthread_mutex_t mutex;
+	TAILQ_HEAD(fd_cache_head, fd_cache_entry) lru;
+	size_t num_entries;
+	char **fd_paths;	/* Indexed by open descriptor */
+	size_t num_fd_paths;
+	uint64_t hits;
+	uint64_t misses;
+} fd_cache = {
+	.mutex = PTHREAD_MUTEX_INITIALIZER,
+	.lru = TAILQ_HEAD_INITIALIZER(fd_cache.lru),
+};
+
+static void fd_cache_remove(struct fd_cache_entry *e)
+{
+	TAILQ_REMOVE(&fd_cache.lru, e, link);
+	fd_cache.num_entries--;
+	close_fd(e->fd);
+	free(e->path);
+	free(e);
+}
+
+/* Returns a cached descriptor of @path or -1 */
+static int fd_cache_get(const char *path)
+{
+	struct fd_cache_entry *e = NULL;
+	int fd = -1;
+
+	if (!supplicant_params.fs_fd_cache_size)
+		return -1;
+
+	tee_supp_mutex_lock(&fd_cache.mutex);
+	TAILQ_FOREACH(e, &fd_cache.lru, link) {
+		if (!strcmp(e->path, path)) {
+			TAILQ_REMOVE(&fd_cache.lru, e, link);
+			fd_cache.num_entries--;
+			fd = e->fd;
+			/* The path moves over to the open descriptor */
+			free(fd_cache.fd_paths[fd]);
+			fd_cache.fd_paths[fd] = e->path;
+			free(e);
+			break;
+		}
+	}
+	if (fd >= 0)
+		fd_cache.hits++;
+	else
+		fd_cache.misses++;
+	tee_supp_mutex_unlock(&fd_cache.mutex);
+
+	return fd;
+}
+
+/* Remembers that @fd was opened as @path */
+static void fd_cache_track(int fd, const char *path)
+{
+	char **paths = NULL;
+	size_t n = 0;
+
+	if (!supplicant_params.fs_fd_cache_size || fd < 0)
+		return;
+
+	tee_supp_mutex_lock(&fd_cache.mutex);
+	if ((size_t)fd >= fd_cache.num_fd_paths) {
+		n = fd + 64;
+		paths = realloc(fd_cache.fd_paths, n * sizeof(*paths));
+		if (!paths)
+			goto out;
+		memset(paths + fd_cache.num_fd_paths, 0,
+		       (n - fd_cache.num_fd_paths) * sizeof(*paths));
+		fd_cache.fd_paths = paths;
+		fd_cache.num_fd_paths = n;
+	}
+	free(fd_cache.fd_paths[fd]);
+	fd_cache.fd_paths[fd] = strdup(path);
+out:
+	tee_supp_mutex_unlock(&fd_cache.mutex);
+}
+
+static void fd_cache_forget(int fd)
+{
+	if (!supplicant_params.fs_fd_cache_size || fd < 0)
+		return;
+
+	tee_supp_mutex_lock(&fd_cache.mutex);
+	if ((size_t)fd < fd_cache.num_fd_paths) {
+		free(fd_cache.fd_paths[fd]);
+		fd_cache.fd_paths[fd] = NULL;
+	}
+	tee_supp_mutex_unlock(&fd_cache.mutex);
+}
+
+/*
+ * Keeps @fd, which is being closed, in the cache. Returns false if it
+ * should be closed instead.
+ */
+static bool fd_cache_put(int fd)
+{
+	struct fd_cache_entry *e = NULL;
+	char *path = NULL;
+
+	if (!supplicant_params.fs_fd_cache_size || fd < 0)
+		return false;
+
+	tee_supp_mutex_lock(&fd_cache.mutex);
+	if ((size_t)fd < fd_cache.num_fd_paths) {
+		path = fd_cache.fd_paths[fd];
+		fd_cache.fd_paths[fd] = NULL;
+	}
+	if (!path)
+		goto err;
+
+	/* Only one descriptor is kept per path */
+	TAILQ_FOREACH(e, &fd_cache.lru, link)
+		if (!strcmp(e->path, path))
+			goto err;
+
+	e = calloc(1, sizeof(*e));
+	if (!e)
+		goto err;
+	e->fd = fd;
+	e->path = path;
+	TAILQ_INSERT_HEAD(&fd_cache.lru, e, link);
+	fd_cache.num_entries++;
+
+	while (fd_cache.num_entries > supplicant_params.fs_fd_cache_size)
+		fd_cache_remove(TAILQ_LAST(&fd_cache.lru, fd_cache_head));
+	tee_supp_mutex_unlock(&fd_cache.mutex);
+
+	return true;
+err:
+	tee_supp_mutex_unlock(&fd_cache.mutex);
+	free(path);
+	return false;
+}
+
+/* Forgets all descriptors of @path, called before it's changed */
+static void fd_cache_invalidate(const char *path)
+{
+	struct fd_cache_entry *next = NULL;
+	struct fd_cache_entry *e = NULL;
+	size_t n = 0;
+
+	if (!supplicant_params.fs_fd_cache_size)
+		return;
+
+	tee_supp_mutex_lock(&fd_cache.mutex);
+	for (e = TAILQ_FIRST(&fd_cache.lru); e; e = next) {
+		next = TAILQ_NEXT(e, link);
+		if (!strcmp(e->path, path))
+			fd_cache_remove(e);
+	}
+	for (n = 0; n < fd_cache.num_fd_paths; n++) {
+		if (fd_cache.fd_paths[n] &&
+		    !strcmp(fd_cache.fd_paths[n], path)) {
+			free(fd_cache.fd_paths[n]);
+			fd_cache.fd_paths[n] = NULL;
+		}
+	}
+	tee_supp_mutex_unlock(&fd_cache.mutex);
+}
+
+/*
+ * The secure side reads the same hash tree nodes and dirf.db blocks
+ * over and over. Full blocks of the files are cached, keyed by the
+ * device and inode of the file so renaming a file keeps its blocks,
+ * in shards with an LRU list each to spread the locking. Writes update
+ * cached blocks, or add blocks they cover fully, after they have been
+ * done. A read missing the cache only adds the blocks it read if no
+ * update of the shard has been done meanwhile, as it may have read
+ * data that was being overwritten. The last, partial block of a file
+ * is never cached so a cached block is never past the end of the file.
+ */
+#define BCACHE_BLOCK_SIZE	4096
+#define BCACHE_NUM_SHARDS	16
+#define BCACHE_MAX_RUN		16
+
+struct bcache_id {
+	dev_t dev;
+	ino_t ino;
+	bool valid;
+};
+
+struct bcache_block {
+	dev_t dev;
+	ino_t ino;
+	uint64_t blk;
+	LIST_ENTRY(bcache_block) hash_link;
+	TAILQ_ENTRY(bcache_block) lru_link;
+	uint8_t data[BCACHE_BLOCK_SIZE];
+};
+
+LIST_HEAD(bcache_bucket, bcache_block);
+
+struct bcache_shard {
+	pthread_mutex_t mutex;
+	struct bcache_bucket *buckets;
+	size_t num_buckets;
+	TAILQ_HEAD(bcache_lru, bcache_block) lru;
+	size_t num_blocks;
+	size_t max_blocks;
+	uint64_t seq;		/* Bumped by each update of the shard */
+	uint64_t hits;
+	uint64_t misses;
+};
+
+static struct {
+	bool enabled;
+	pthread_mutex_t mutex;	/* Of fd_ids */
+	struct bcache_id *fd_ids;	/* Indexed by open descriptor */
+	size_t num_fd_ids;
+	struct bcache_shard shards[BCACHE_NUM_SHARDS];
+} bcache = {
+	.mutex = PTHREAD_MUTEX_INITIALIZER,
+};
+
+static int bcache_init(void)
+{
+	struct bcache_shard *sh = NULL;
+	size_t max_blocks = 0;
+	size_t n = 0;
+
+	if (bcache.enabled || !supplicant_params.fs_block_cache_size)
+		return 0;
+
+	max_blocks = supplicant_params.fs_block_cache_size /
+		     BCACHE_BLOCK_SIZE / BCACHE_NUM_SHARDS;
+	if (!max_blocks)
+		max_blocks = 1;
+
+	for (n = 0; n < BCACHE_NUM_SHARDS; n++) {
+		sh = bcache.shards + n;
+		pthread_mutex_init(&sh->mutex, NULL);
+		TAILQ_INIT(&sh->lru);
+		sh->max_blocks = max_blocks;
+		sh->num_buckets = 1;
+		while (sh->num_buckets < max_blocks)
+			sh->num_buckets *= 2;
+		sh->buckets = calloc(sh->num_buckets, sizeof(*sh->buckets));
+		if (!sh->buckets)
+			return -1;
+	}
+
+	bcache.enabled = true;
+	return 0;
+}
+
+static uint64_t bcache_hash(const struct bcache_id *id, uint64_t blk)
+{
+	uint64_t h = (uint64_t)id->dev * 0x9e3779b97f4a7c15ULL;
+
+	h = (h ^ id->ino ^ (blk << 32) ^ (blk >> 32)) *
+	    0xff51afd7ed558ccdULL;
+	return h ^ (h >> 33);
+}
+
+static struct bcache_shard *bcache_shard(const struct bcache_id *id,
+					 uint64_t blk,
+					 struct bcache_bucket **bucket)
+{
+	uint64_t h = bcache_hash(id, blk);
+	struct bcache_shard *sh = bcache.shards + h % BCACHE_NUM_SHARDS;
+
+	*bucket = sh->buckets + ((h / BCACHE_NUM_SHARDS) &
+				 (sh->num_buckets - 1));
+	return sh;
+}
+
+static struct bcache_block *bcache_find(struct bcache_bucket *bucket,
+					const struct bcache_id *id,
+					uint64_t blk)
+{
+	struct bcache_block *b = NULL;
+
+	LIST_FOREACH(b, bucket, hash_link)
+		if (b->blk == blk && b->ino == id->ino && b->dev == id->dev)
+			return b;
+	return NULL;
+}
+
+static void bcache_drop_block(struct bcache_shard *sh,
+			      struct bcache_block *b)
+{
+	LIST_REMOVE(b, hash_link);
+	TAILQ_REMOVE(&sh->lru, b, lru_link);
+	sh->num_blocks--;
+	free(b);
+}
+
+/* Returns a block added for @id and @blk, the caller fills in the data */
+static struct bcache_block *bcache_add(struct bcache_shard *sh,
+				       struct bcache_bucket *bucket,
+				       const struct bcache_id *id,
+				       uint64_t blk)
+{
+	struct bcache_block *b = NULL;
+
+	if (sh->num_blocks < sh->max_blocks) {
+		b = malloc(sizeof(*b));
+		if (!b)
+			return NULL;
+		sh->num_blocks++;
+	} else {
+		b = TAILQ_LAST(&sh->lru, bcache_lru);
+		LIST_REMOVE(b, hash_link);
+		TAILQ_REMOVE(&sh->lru, b, lru_link);
+	}
+
+	b->dev = id->dev;
+	b->ino = id->ino;
+	b->blk = blk;
+	LIST_INSERT_HEAD(bucket, b, hash_link);
+	TAILQ_INSERT_HEAD(&sh->lru, b, lru_link);
+	return b;
+}
+
+/* Remembers the file @fd was opened as, after fstat() */
+static void bcache_track(int fd)
+{
+	struct bcache_id *ids = NULL;
+	struct stat st;
+	size_t n = 0;
+
+	if (!bcache.enabled || fd < 0)
+		return;
+
+	memset(&st, 0, sizeof(st));
+	if (fstat(fd, &st))
+		return;
+
+	tee_supp_mutex_lock(&bcache.mutex);
+	if ((size_t)fd >= bcache.num_fd_ids) {
+		n = fd + 64;
+		ids = realloc(bcache.fd_ids, n * sizeof(*ids));
+		if (!ids)
+			goto out;
+		memset(ids + bcache.num_fd_ids, 0,
+		       (n - bcache.num_fd_ids) * sizeof(*ids));
+		bcache.fd_ids = ids;
+		bcache.num_fd_ids = n;
+	}
+	bcache.fd_ids[fd].dev = st.st_dev;
+	bcache.fd_ids[fd].ino = st.st_ino;
+	bcache.fd_ids[fd].valid = true;
+out:
+	tee_supp_mutex_unlock(&bcache.mutex);
+}
+
+static void bcache_forget_fd(int fd)
+{
+	if (!bcache.enabled || fd < 0)
+		return;
+
+	tee_supp_mutex_lock(&bcache.mutex);
+	if ((size_t)fd < bcache.num_fd_ids)
+		bcache.fd_ids[fd].valid = false;
+	tee_supp_mutex_unlock(&bcache.mutex);
+}
+
+static bool bcache_fd_id(int fd, struct bcache_id *id)
+{
+	if (!bcache.enabled || fd < 0)
+		return false;
+
+	tee_supp_mutex_lock(&bcache.mutex);
+	if ((size_t)fd < bcache.num_fd_ids)
+		*id = bcache.fd_ids[fd];
+	else
+		id->valid = false;
+	tee_supp_mutex_unlock(&bcache.mutex);
+
+	return id->valid;
+}
+
+/*
+ * Copies @len bytes at @offs in block @blk to @dst and returns true if
+ * the block is cached. Otherwise returns false and the update sequence
+ * number of the shard in @seq. With @dst NULL only checks the block.
+ */
+static bool bcache_get(const struct bcache_id *id, uint64_t blk,
+		       uint8_t *dst, size_t offs, size_t len, uint64_t *seq)
+{
+	struct bcache_bucket *bucket = NULL;
+	struct bcache_shard *sh = bcache_shard(id, blk, &bucket);
+	struct bcache_block *b = NULL;
+
+	tee_supp_mutex_lock(&sh->mutex);
+	b = bcache_find(bucket, id, blk);
+	if (b && dst) {
+		TAILQ_REMOVE(&sh->lru, b, lru_link);
+		TAILQ_INSERT_HEAD(&sh->lru, b, lru_link);
+		memcpy(dst, b->data + offs, len);
+		sh->hits++;
+	} else if (!b) {
+		*seq = sh->seq;
+		sh->misses++;
+	}
+	tee_supp_mutex_unlock(&sh->mutex);
+
+	return b;
+}
+
+/* Adds block @blk read from the file unless the shard was updated */
+static void bcache_put(const struct bcache_id *id, uint64_t blk,
+		       const uint8_t *data, uint64_t seq)
+{
+	struct bcache_bucket *bucket = NULL;
+	struct bcache_shard *sh = bcache_shard(id, blk, &bucket);
+	struct bcache_block *b = NULL;
+
+	tee_supp_mutex_lock(&sh->mutex);
+	if (sh->seq == seq && !bcache_find(bucket, id, blk)) {
+		b = bcache_add(sh, bucket, id, blk);
+		if (b)
+			memcpy(b->data, data, BCACHE_BLOCK_SIZE);
+	}
+	tee_supp_mutex_unlock(&sh->mutex);
+}
+
+/*
+ * Updates the blocks written to with @len bytes from @buf at @offs,
+ * or drops them if the write failed.
+ */
+static void bcache_written(int fd, const uint8_t *buf, size_t len,
+			   uint64_t offs, bool ok)
+{
+	struct bcache_bucket *bucket = NULL;
+	struct bcache_shard *sh = NULL;
+	struct bcache_block *b = NULL;
+	struct bcache_id id;
+	uint64_t blk = 0;
+	size_t boffs = 0;
+	size_t n = 0;
+
+	if (!len || !bcache_fd_id(fd, &id))
+		return;
+
+	while (len) {
+		blk = offs / BCACHE_BLOCK_SIZE;
+		boffs = offs % BCACHE_BLOCK_SIZE;
+		n = MIN(len, BCACHE_BLOCK_SIZE - boffs);
+
+		sh = bcache_shard(&id, blk, &bucket);
+		tee_supp_mutex_lock(&sh->mutex);
+		sh->seq++;
+		b = bcache_find(bucket, &id, blk);
+		if (!ok) {
+			if (b)
+				bcache_drop_block(sh, b);
+		} else {
+			if (!b && n == BCACHE_BLOCK_SIZE)
+				b = bcache_add(sh, bucket, &id, blk);
+			if (b)
+				memcpy(b->data + boffs, buf, n);
+		}
+		tee_supp_mutex_unlock(&sh->mutex);
+
+		buf += n;
+		len -= n;
+		offs += n;
+	}
+}
+
+/* Drops the cached blocks of file @id from block @blk on */
+static void bcache_drop_file(const struct bcache_id *id, uint64_t blk)
+{
+	struct bcache_shard *sh = NULL;
+	struct bcache_block *next = NULL;
+	struct bcache_block *b = NULL;
+	size_t n = 0;
+
+	if (!bcache.enabled || !id->valid)
+		return;
+
+	for (n = 0; n < BCACHE_NUM_SHARDS; n++) {
+		sh = bcache.shards + n;
+		tee_supp_mutex_lock(&sh->mutex);
+		sh->seq++;
+		for (b = TAILQ_FIRST(&sh->lru); b; b = next) {
+			next = TAILQ_NEXT(b, lru_link);
+			if (b->ino == id->ino && b->dev == id->dev &&
+			    b->blk >= blk)
+				bcache_drop_block(sh, b);
+		}
+		tee_supp_mutex_unlock(&sh->mutex);
+	}
+}
+
+/* Drops the cached blocks of file @name in @dirfd, before it's replaced */
+static void bcache_drop_name(int dirfd, const char *name)
+{
+	struct bcache_id id = { .valid = true };
+	struct stat st;
+
+	if (!bcache.enabled)
+		return;
+
+	memset(&st, 0, sizeof(st));
+	if (fstatat(dirfd, name, &st, AT_SYMLINK_NOFOLLOW))
+		return;
+	id.dev = st.st_dev;
+	id.ino = st.st_ino;
+	bcache_drop_file(&id, 0);
+}
+
+/*
+ * With --fs-prealloc a write extending a file past the space allocated
+ * to it first allocates up to the next multiple of that size with
+ * fallocate(), keeping the file size, so files growing a block at a
+ * time, as the hash trees of the REE FS do, stay in a few extents. The
+ * space left past the end of a file is given back by truncating the
+ * file to its size when the last descriptor of it the secure side has
+ * open is closed. Truncating a file gives it back anyway.
+ *
+ * With --fs-defrag a background pass counts the physically contiguous
+ * runs of each file with FIEMAP every that many seconds. A file with
+ * more runs than one per FS_DEFRAG_RUN_SIZE of data and not modified
+ * since the previous pass is copied into a file allocated in one go,
+ * which is then renamed over it. Requests are held off while a file is
+ * copied, and files the secure side has open are left alone since its
+ * descriptors would still refer to the old copy. A crash leaves either
+ * copy under the name, and at worst a stray FS_DEFRAG_SUFFIX file that
+ * the next pass removes.
+ */
+#define FS_DEFRAG_RUN_SIZE	(1024 * 1024)
+#define FS_DEFRAG_SUFFIX	".defrag~"
+#define FS_DEFRAG_COPY_SIZE	(64 * 1024)
+#define FS_FIEMAP_EXTENTS	32
+
+struct fs_fd_state {
+	dev_t dev;
+	ino_t ino;
+	off_t alloc_end;	/* Space is allocated at least up to here */
+	bool prealloc;		/* Space may be allocated past end of file */
+	bool open;		/* Open by the secure side */
+};
+
+static struct {
+	pthread_mutex_t mutex;
+	struct fs_fd_state *fds;	/* Indexed by descriptor */
+	size_t num_fds;
+	bool unsupported;
+	uint64_t chunks;
+	uint64_t trims;
+} fs_alloc = {
+	.mutex = PTHREAD_MUTEX_INITIALIZER,
+};
+
+static struct {
+	pthread_rwlock_t lock;	/* Held for writing while a file is copied */
+	bool started;
+	pthread_mutex_t mutex;	/* Of the counters below */
+	uint64_t passes;
+	size_t files;		/* Counted by the last pass */
+	size_t runs;
+	size_t fragmented;
+	uint64_t defragmented;
+	uint64_t failed;
+} fs_defrag = {
+	.lock = PTHREAD_RWLOCK_INITIALIZER,
+	.mutex = PTHREAD_MUTEX_INITIALIZER,
+};
+
+static bool fs_fd_tracked(void)
+{
+	return supplicant_params.fs_prealloc_size ||
+	       supplicant_params.fs_defrag_secs;
+}
+
+/* Remembers that the secure side has @fd open, after fstat() if @stat */
+static void fs_fd_track(int fd, bool stat)
+{
+	struct fs_fd_state *fds = NULL;
+	struct stat st;
+	size_t n = 0;
+
+	if (!fs_fd_tracked() || fd < 0)
+		return;
+
+	memset(&st, 0, sizeof(st));
+	if (stat && fstat(fd, &st))
+		return;
+
+	tee_supp_mutex_lock(&fs_alloc.mutex);
+	if ((size_t)fd >= fs_alloc.num_fds) {
+		if (!stat)
+			goto out;
+		n = fd + 64;
+		fds = realloc(fs_alloc.fds, n * sizeof(*fds));
+		if (!fds)
+			goto out;
+		memset(fds + fs_alloc.num_fds, 0,
+		       (n - fs_alloc.num_fds) * sizeof(*fds));
+		fs_alloc.fds = fds;
+		fs_alloc.num_fds = n;
+	}
+	if (stat) {
+		fs_alloc.fds[fd].dev = st.st_dev;
+		fs_alloc.fds[fd].ino = st.st_ino;
+		fs_alloc.fds[fd].alloc_end = st.st_size;
+		fs_alloc.fds[fd].prealloc = false;
+	}
+	fs_alloc.fds[fd].open = true;
+out:
+	tee_supp_mutex_unlock(&fs_alloc.mutex);
+}
+
+static void fs_fd_forget(int fd)
+{
+	if (!fs_fd_tracked() || fd < 0)
+		return;
+
+	tee_supp_mutex_lock(&fs_alloc.mutex);
+	if ((size_t)fd < fs_alloc.num_fds)
+		memset(fs_alloc.fds + fd, 0, sizeof(*fs_alloc.fds));
+	tee_supp_mutex_unlock(&fs_alloc.mutex);
+}
+
+/* Returns another open descriptor of the file of @fd or -1, locked */
+static int fs_fd_other(int fd, dev_t dev, ino_t ino)
+{
+	struct fs_fd_state *s = NULL;
+	size_t n = 0;
+
+	for (n = 0; n < fs_alloc.num_fds; n++) {
+		s = fs_alloc.fds + n;
+		if ((int)n != fd && s->open && s->dev == dev && s->ino == ino)
+			return n;
+	}
+	return -1;
+}
+
+/*
+ * The secure side is done with @fd, gives back the space allocated past
+ * the end of the file unless another descriptor of it is still open.
+ * Nothing else can then change the size of the file meanwhile.
+ */
+static void fs_fd_release(int fd)
+{
+	struct fs_fd_state *s = NULL;
+	struct stat st;
+	int other = 0;
+	int r = 0;
+
+	if (!fs_fd_tracked() || fd < 0)
+		return;
+
+	tee_supp_mutex_lock(&fs_alloc.mutex);
+	if ((size_t)fd >= fs_alloc.num_fds || !fs_alloc.fds[fd].open)
+		goto out;
+	s = fs_alloc.fds + fd;
+	s->open = false;
+	if (!s->prealloc)
+		goto out;
+	s->prealloc = false;
+
+	other = fs_fd_other(fd, s->dev, s->ino);
+	if (other >= 0) {
+		fs_alloc.fds[other].prealloc = true;
+		goto out;
+	}
+
+	memset(&st, 0, sizeof(st));
+	if (fstat(fd, &st) || st.st_size >= s->alloc_end)
+		goto out;
+	do {
+		r = ftruncate(fd, st.st_size);
+	} while (r && errno == EINTR);
+	if (!r) {
+		s->alloc_end = st.st_size;
+		fs_alloc.trims++;
+	}
+out:
+	tee_supp_mutex_unlock(&fs_alloc.mutex);
+}
+
+/* Allocates space for writing @len bytes at @offs in @fd, if missing */
+static void fs_prealloc(int fd, size_t len, off_t offs)
+{
+	size_t chunk = supplicant_params.fs_prealloc_size;
+	struct fs_fd_state *s = NULL;
+	off_t start = 0;
+	off_t end = 0;
+
+	if (!chunk || fd < 0)
+		return;
+
+	tee_supp_mutex_lock(&fs_alloc.mutex);
+	if (fs_alloc.unsupported || (size_t)fd >= fs_alloc.num_fds)
+		goto out;
+	s = fs_alloc.fds + fd;
+	if (!s->open || offs + (off_t)len <= s->alloc_end)
+		goto out;
+	start = s->alloc_end;
+	end = (offs + len + chunk - 1) / chunk * chunk;
+	/* Set before allocating so a concurrent close trims the file */
+	s->prealloc = true;
+	tee_supp_mutex_unlock(&fs_alloc.mutex);
+
+	if (fallocate(fd, FALLOC_FL_KEEP_SIZE, start, end - start)) {
+		if (errno != EOPNOTSUPP)
+			return;
+		tee_supp_mutex_lock(&fs_alloc.mutex);
+		if (!fs_alloc.unsupported)
+			IMSG("fallocate() not supported, not preallocating");
+		fs_alloc.unsupported = true;
+		goto out;
+	}
+
+	tee_supp_mutex_lock(&fs_alloc.mutex);
+	fs_alloc.chunks++;
+	s = fs_alloc.fds + fd;
+	if (s->open && end > s->alloc_end)
+		s->alloc_end = end;
+out:
+	tee_supp_mutex_unlock(&fs_alloc.mutex);
+}
+
+/* Called once @fd has been truncated to @len */
+static void fs_prealloc_truncated(int fd, off_t len)
+{
+	if (!fs_fd_tracked() || fd < 0)
+		return;
+
+	tee_supp_mutex_lock(&fs_alloc.mutex);
+	if ((size_t)fd < fs_alloc.num_fds && fs_alloc.fds[fd].open) {
+		fs_alloc.fds[fd].alloc_end = len;
+		fs_alloc.fds[fd].prealloc = false;
+	}
+	tee_supp_mutex_unlock(&fs_alloc.mutex);
+}
+
+/* Returns the number of physically contiguous runs of @fd's data or -1 */
+static ssize_t fs_count_runs(int fd)
+{
+	struct fiemap_extent *e = NULL;
+	struct fiemap *fm = NULL;
+	uint64_t phys_end = 0;
+	uint64_t start = 0;
+	ssize_t runs = 0;
+	size_t size = 0;
+	bool last = false;
+	size_t n = 0;
+
+	size = sizeof(*fm) + FS_FIEMAP_EXTENTS * sizeof(*fm->fm_extents);
+	fm = malloc(size);
+	if (!fm)
+		return -1;
+
+	while (!last) {
+		memset(fm, 0, size);
+		fm->fm_start = start;
+		fm->fm_length = FIEMAP_MAX_OFFSET - start;
+		fm->fm_extent_count = FS_FIEMAP_EXTENTS;
+		if (ioctl(fd, FS_IOC_FIEMAP, fm)) {
+			runs = -1;
+			break;
+		}
+		if (!fm->fm_mapped_extents)
+			break;
+		for (n = 0; n < fm->fm_mapped_extents; n++) {
+			e = fm->fm_extents + n;
+			if (!runs || e->fe_physical != phys_end ||
+			    (e->fe_flags & FIEMAP_EXTENT_UNKNOWN))
+				runs++;
+			phys_end = e->fe_physical + e->fe_length;
+			start = e->fe_logical + e->fe_length;
+			if (e->fe_flags & FIEMAP_EXTENT_LAST)
+				last = true;
+		}
+	}
+
+	free(fm);
+	return runs;
+}
+
+/* Copies the @size bytes of @src to @dst, durably */
+static int fs_copy_file(int src, int dst, off_t size, uint8_t *buf)
+{
+	off_t offs = 0;
+	ssize_t r = 0;
+	ssize_t w = 0;
+	size_t n = 0;
+
+	while (offs < size) {
+		r = pread(src, buf, MIN(size - offs, FS_DEFRAG_COPY_SIZE),
+			  offs);
+		if (r < 0 && errno == EINTR)
+			continue;
+		if (r <= 0)
+			return -1;
+		for (n = 0; n < (size_t)r; n += w) {
+			w = pwrite(dst, buf + n, r - n, offs + n);
+			if (w < 0 && errno == EINTR)
+				w = 0;
+			else if (w <= 0)
+				return -1;
+		}
+		offs += r;
+	}
+
+	while (fdatasync(dst)) {
+		if (errno != EINTR)
+			return -1;
+	}
+	return 0;
+}
+
+/*
+ * Replaces @name in @dirfd, known as @path relative to tee_fs_root_fd
+ * and opened as @fd with @st and @runs runs, by a less fragmented copy.
+ * Returns 0 if replaced, 1 if left as is and -1 on error. Called with
+ * requests held off.
+ */
+static int fs_defrag_replace(int dirfd, const char *path, const char *name,
+			     int fd, const struct stat *st, ssize_t runs,
+			     uint8_t *buf)
+{
+	struct bcache_id id = { .valid = true };
+	char tmp[PATH_MAX] = { 0 };
+	struct stat cur;
+	ssize_t r = 0;
+	int res = -1;
+	int tfd = -1;
+	int n = 0;
+
+	/* Renamed, replaced or written since it was looked at */
+	memset(&cur, 0, sizeof(cur));
+	if (fstatat(dirfd, name, &cur, AT_SYMLINK_NOFOLLOW) ||
+	    cur.st_ino != st->st_ino || cur.st_dev != st->st_dev ||
+	    cur.st_mtime != st->st_mtime || cur.st_size != st->st_size)
+		return 1;
+
+	tee_supp_mutex_lock(&fs_alloc.mutex);
+	n = fs_fd_other(-1, st->st_dev, st->st_ino);
+	tee_supp_mutex_unlock(&fs_alloc.mutex);
+	if (n >= 0)
+		return 1;
+
+	n = snprintf(tmp, sizeof(tmp), "%s%s", name, FS_DEFRAG_SUFFIX);
+	if (n < 0 || (size_t)n >= sizeof(tmp))
+		return 1;
+
+	unlinkat(dirfd, tmp, 0);
+	tfd = openat(dirfd, tmp, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC,
+		     st->st_mode & 07777);
+	if (tfd < 0)
+		return -1;
+
+	if (fchmod(tfd, st->st_mode & 07777) ||
+	    fallocate(tfd, 0, 0, st->st_size) ||
+	    fs_copy_file(fd, tfd, st->st_size, buf))
+		goto out;
+
+	r = fs_count_runs(tfd);
+	if (r < 0 || r >= runs) {
+		res = 1;
+		goto out;
+	}
+
+	fd_cache_invalidate(path);
+	if (renameat(dirfd, tmp, dirfd, name))
+		goto out;
+	id.dev = st->st_dev;
+	id.ino = st->st_ino;
+	bcache_drop_file(&id, 0);
+	res = 0;
+out:
+	close(tfd);
+	if (res)
+		unlinkat(dirfd, tmp, 0);
+	return res;
+}
+
+static bool fs_defrag_is_tmp(const char *name)
+{
+	size_t len = strlen(name);
+	size_t slen = strlen(FS_DEFRAG_SUFFIX);
+
+	return len > slen && !strcmp(name + len - slen, FS_DEFRAG_SUFFIX);
+}
+
+struct fs_defrag_scan {
+	time_t before;		/* Only files not modified since */
+	uint8_t *buf;
+	size_t files;
+	size_t runs;
+	size_t fragmented;
+	uint64_t defragmented;
+	uint64_t failed;
+};
+
+static void fs_defrag_file(int dirfd, const char *path, const char *name,
+			   struct fs_defrag_scan *scan)
+{
+	struct stat st;
+	ssize_t runs = 0;
+	int res = 0;
+	int fd = -1;
+
+	fd = openat(dirfd, name, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+	if (fd < 0)
+		return;
+
+	memset(&st, 0, sizeof(st));
+	if (fstat(fd, &st) || !S_ISREG(st.st_mode))
+		goto out;
+	runs = fs_count_runs(fd);
+	if (runs < 0)
+		goto out;
+
+	scan->files++;
+	scan->runs += runs;
+	if (runs <= 1 ||
+	    runs <= (st.st_size + FS_DEFRAG_RUN_SIZE - 1) / FS_DEFRAG_RUN_SIZE)
+		goto out;
+	scan->fragmented++;
+	if (st.st_mtime >= scan->before)
+		goto out;
+
+	pthread_rwlock_wrlock(&fs_defrag.lock);
+	res = fs_defrag_replace(dirfd, path, name, fd, &st, runs, scan->buf);
+	pthread_rwlock_unlock(&fs_defrag.lock);
+	if (!res)
+		scan->defragmented++;
+	else if (res < 0)
+		scan->failed++;
+out:
+	close(fd);
+}
+
+/* Goes through @dirfd, known as @path, and the directories in it */
+static void fs_defrag_dir(int dirfd, const char *path,
+			  struct fs_defrag_scan *scan)
+{
+	char sub[PATH_MAX] = { 0 };
+	struct dirent *de = NULL;
+	DIR *dir = NULL;
+	struct stat st;
+	int fd = -1;
+	int n = 0;
+
+	dir = fdopendir(dirfd);
+	if (!dir) {
+		close(dirfd);
+		return;
+	}
+
+	while ((de = readdir(dir))) {
+		if (!strcmp(de->d_name, ".") || !strcmp(de->d_name, ".."))
+			continue;
+
+		if (*path)
+			n = snprintf(sub, sizeof(sub), "%s/%s", path,
+				     de->d_name);
+		else
+			n = snprintf(sub, sizeof(sub), "%s", de->d_name);
+		if (n < 0 || (size_t)n >= sizeof(sub))
+			continue;
+
+		memset(&st, 0, sizeof(st));
+		if (fstatat(dirfd, de->d_name, &st, AT_SYMLINK_NOFOLLOW))
+			continue;
+
+		if (S_ISDIR(st.st_mode)) {
+			fd = openat(dirfd, de->d_name, O_RDONLY | O_DIRECTORY |
+				    O_NOFOLLOW | O_CLOEXEC);
+			if (fd >= 0)
+				fs_defrag_dir(fd, sub, scan);
+		} else if (!S_ISREG(st.st_mode)) {
+			continue;
+		} else if (fs_defrag_is_tmp(de->d_name)) {
+			/* Left over by a crash, requests never see it */
+			pthread_rwlock_wrlock(&fs_defrag.lock);
+			unlinkat(dirfd, de->d_name, 0);
+			pthread_rwlock_unlock(&fs_defrag.lock);
+		} else {
+			fs_defrag_file(dirfd, sub, de->d_name, scan);
+		}
+	}
+
+	closedir(dir);
+}
+
+static void *fs_defrag_main(void *arg)
+{
+	unsigned int secs = supplicant_params.fs_defrag_secs;
+	struct fs_defrag_scan scan;
+	time_t prev = time(NULL);
+	int fd = -1;
+
+	(void)arg;
+
+	while (true) {
+		sleep(secs);
+
+		memset(&scan, 0, sizeof(scan));
+		scan.before = prev;
+		prev = time(NULL);
+		scan.buf = malloc(FS_DEFRAG_COPY_SIZE);
+		fd = openat(tee_fs_root_fd, ".",
+			    O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+		if (scan.buf && fd >= 0)
+			fs_defrag_dir(fd, "", &scan);
+		else if (fd >= 0)
+			close(fd);
+		free(scan.buf);
+
+		tee_supp_mutex_lock(&fs_defrag.mutex);
+		fs_defrag.passes++;
+		fs_defrag.files = scan.files;
+		fs_defrag.runs = scan.runs;
+		fs_defrag.fragmented = scan.fragmented;
+		fs_defrag.defragmented += scan.defragmented;
+		fs_defrag.failed += scan.failed;
+		tee_supp_mutex_unlock(&fs_defrag.mutex);
+	}
+
+	return NULL;
+}
+
+static int fs_defrag_start(void)
+{
+	pthread_t tid;
+	int e = 0;
+
+	if (fs_defrag.started || !supplicant_params.fs_defrag_secs)
+		return 0;
+
+	memset(&tid, 0, sizeof(tid));
+	e = pthread_create(&tid, NULL, fs_defrag_main, NULL);
+	if (e) {
+		EMSG("pthread_create: %s", strerror(e));
+		return -1;
+	}
+
+	e = pthread_detach(tid);
+	if (e)
+		EMSG("pthread_detach: %s", strerror(e));
+
+	fs_defrag.started = true;
+	return 0;
+}
+
+void tee_supp_fs_print_stats(FILE *f, void *arg)
+{
+	struct bcache_shard *sh = NULL;
+	uint64_t misses = 0;
+	uint64_t hits = 0;
+	size_t blocks = 0;
+	size_t n = 0;
+
+	(void)arg;
+
+	if (supplicant_params.fs_deferred_sync) {
+		tee_supp_mutex_lock(&fs_sync.mutex);
+		fprintf(f, "fs_sync requests %" PRIu64 " batches %" PRIu64
+			"\n", fs_sync.requests, fs_sync.batches);
+		tee_supp_mutex_unlock(&fs_sync.mutex);
+	}
+
+	if (supplicant_params.fs_fd_cache_size) {
+		tee_supp_mutex_lock(&fd_cache.mutex);
+		fprintf(f, "fs_fd_cache size %zu hits %" PRIu64 " misses %"
+			PRIu64 "\n", fd_cache.num_entries, fd_cache.hits,
+			fd_cache.misses);
+		tee_supp_mutex_unlock(&fd_cache.mutex);
+	}
+
+	if (!fs_backend) {
+		tee_supp_mutex_lock(&dir_cache.mutex);
+		fprintf(f, "fs_dir_cache size %zu hits %" PRIu64 " misses %"
+			PRIu64 "\n", dir_cache.num_entries, dir_cache.hits,
+			dir_cache.misses);
+		tee_supp_mutex_unlock(&dir_cache.mutex);
+	}
+
+	if (bcache.enabled) {
+		for (n = 0; n < BCACHE_NUM_SHARDS; n++) {
+			sh = bcache.shards + n;
+			tee_supp_mutex_lock(&sh->mutex);
+			blocks += sh->num_blocks;
+			hits += sh->hits;
+			misses += sh->misses;
+			tee_supp_mutex_unlock(&sh->mutex);
+		}
+		fprintf(f, "fs_block_cache blocks %zu hits %" PRIu64
+			" misses %" PRIu64 "\n", blocks, hits, misses);
+	}
+
+	if (supplicant_params.fs_prealloc_size && !fs_backend) {
+		tee_supp_mutex_lock(&fs_alloc.mutex);
+		fprintf(f, "fs_prealloc chunks %" PRIu64 " trims %" PRIu64
+			"\n", fs_alloc.chunks, fs_alloc.trims);
+		tee_supp_mutex_unlock(&fs_alloc.mutex);
+	}
+
+	if (fs_defrag.started) {
+		tee_supp_mutex_lock(&fs_defrag.mutex);
+		fprintf(f, "fs_defrag passes %" PRIu64 " files %zu runs %zu "
+			"fragmented %zu defragmented %" PRIu64 " failed %"
+			PRIu64 "\n", fs_defrag.passes, fs_defrag.files,
+			fs_defrag.runs, fs_defrag.fragmented,
+			fs_defrag.defragmented, fs_defrag.failed);
+		tee_supp_mutex_unlock(&fs_defrag.mutex);
+	}
+
+	fs_uring_print_stats(f);
+	fs_ta_io_print_stats(f);
+
+	if (fs_backend)
+		fs_backend->print_stats(f);
+}
+
+/* Gets the name of @file relative to tee_fs_root_fd, "." for the root */
+static size_t tee_fs_get_filename(const char *file, char *out,
+				  size_t out_size)
 {
 	int s = 0;
 
-	if (!file || !out || (out_size <= strlen(tee_fs_root) + 1))
+	if (!file || !out)
 		return 0;
 
-	s = snprintf(out, out_size, "%s%s", tee_fs_root, file);
+	while (*file == '/')
+		file++;
+	if (!*file)
+		file = ".";
+
+	s = snprintf(out, out_size, "%s", file);
 	if (s < 0 || (size_t)s >= out_size)
 		return 0;
 
@@ -121,22 +1601,54 @@ static int tee_supp_fs_init(void)
 	size_t n = 0;
 	mode_t mode = 0700;
 
-	n = snprintf(tee_fs_root, sizeof(tee_fs_root), "%s/", TEE_FS_PARENT_PATH);
+	n = snprintf(tee_fs_root, sizeof(tee_fs_root), "%s/",
+		     supplicant_params.fs_parent_path);
 	if (n >= sizeof(tee_fs_root))
 		return -1;
 
+	if (strcmp(supplicant_params.fs_backend, "dir")) {
+		fs_backend = fs_backend_find(supplicant_params.fs_backend);
+		if (!fs_backend ||
+		    (fs_backend->needs_root && mkpath(tee_fs_root, mode)) ||
+		    fs_backend->init(supplicant_params.fs_parent_path)) {
+			fs_backend = NULL;
+			return -1;
+		}
+		return 0;
+	}
+
 	if (mkpath(tee_fs_root, mode) != 0)
 		return -1;
 
+	if (tee_fs_root_fd < 0) {
+		tee_fs_root_fd = open(tee_fs_root,
+				      O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+		if (tee_fs_root_fd < 0)
+			return -1;
+	}
+
+	if (supplicant_params.fs_io_uring && !fs_uring_enabled() &&
+	    fs_uring_init())
+		IMSG("io_uring not available, using system calls");
+
+	if (bcache_init())
+		return -1;
+
+	if (fs_defrag_start())
+		return -1;
+
 	return 0;
 }
 
-static int open_wrapper(const char *fname, int flags)
+static int open_wrapper(int dirfd, const char *fname, int flags)
 {
 	int fd = 0;
 
+	if (!supplicant_params.fs_deferred_sync)
+		flags |= O_SYNC;
+
 	while (true) {
-		fd = open(fname, flags | O_SYNC, 0600);
+		fd = openat(dirfd, fname, flags, 0600);
 		if (fd >= 0 || errno != EINTR)
 			return fd;
 	}
@@ -145,7 +1657,10 @@ static int open_wrapper(const char *fname, int flags)
 static TEEC_Result ree_fs_new_open(size_t num_params,
 				   struct tee_ioctl_param *params)
 {
-	char abs_filename[PATH_MAX] = { 0 };
+	struct dir_cache_entry *e = NULL;
+	char filename[PATH_MAX] = { 0 };
+	char dir[PATH_MAX] = { 0 };
+	const char *base = NULL;
 	char *fname = NULL;
 	int fd = 0;
 
@@ -162,34 +1677,103 @@ static TEEC_Result ree_fs_new_open(size_t num_params,
 	if (!fname)
 		return TEEC_ERROR_BAD_PARAMETERS;
 
-	if (!tee_fs_get_absolute_filename(fname, abs_filename,
-					  sizeof(abs_filename)))
+	if (!tee_fs_get_filename(fname, filename, sizeof(filename)))
 		return TEEC_ERROR_BAD_PARAMETERS;
 
-	fd = open_wrapper(abs_filename, O_RDWR);
+	fd = fd_cache_get(filename);
+	if (fd >= 0) {
+		fs_fd_track(fd, false);
+		goto out;
+	}
+
+	base = split_name(filename, dir, sizeof(dir));
+	e = dir_cache_get(dir);
+	if (!e)
+		return TEEC_ERROR_ITEM_NOT_FOUND;
+
+	fd = open_wrapper(e->fd, base, O_RDWR);
 	if (fd < 0) {
 		/*
 		 * In case the problem is the filesystem is RO, retry with the
 		 * open flags restricted to RO.
 		 */
-		fd = open_wrapper(abs_filename, O_RDONLY);
-		if (fd < 0)
-			return TEEC_ERROR_ITEM_NOT_FOUND;
+		fd = open_wrapper(e->fd, base, O_RDONLY);
 	}
+	dir_cache_put(e);
+	if (fd < 0)
+		return TEEC_ERROR_ITEM_NOT_FOUND;
+	fd_cache_track(fd, filename);
+	bcache_track(fd);
+	fs_fd_track(fd, true);
 
+out:
 	params[2].a = fd;
 	return TEEC_SUCCESS;
 }
 
+/*
+ * Makes directory @dir, and its parent if missing too. Returns the
+ * number of directories made or -1.
+ */
+static int make_dirs(const char *dir)
+{
+	char parent[PATH_MAX] = { 0 };
+
+	if (!mkdirat(tee_fs_root_fd, dir, 0700))
+		return 1;
+	if (errno == EEXIST)
+		return 0;
+	if (errno != ENOENT)
+		return -1;
+
+	/* Parent directory for file missing, try to make it */
+	snprintf(parent, sizeof(parent), "%s", dir);
+	if (mkdirat(tee_fs_root_fd, dirname(parent), 0700) &&
+	    errno != EEXIST)
+		return -1;
+
+	/* Try to make directory for file again */
+	if (!mkdirat(tee_fs_root_fd, dir, 0700))
+		return 2;
+	if (errno == EEXIST)
+		return 1;
+	return -1;
+}
+
+/* Removes directory @dir, and then its parent, if empty */
+static void remove_empty_dirs(const char *dir)
+{
+	char parent[PATH_MAX] = { 0 };
+	char *d = NULL;
+
+	if (!strcmp(dir, ".") || unlinkat(tee_fs_root_fd, dir, AT_REMOVEDIR))
+		return;
+	dir_cache_drop(dir);
+
+	snprintf(parent, sizeof(parent), "%s", dir);
+	d = dirname(parent);
+	if (strcmp(d, ".") && !unlinkat(tee_fs_root_fd, d, AT_REMOVEDIR))
+		dir_cache_drop(d);
+}
+
+/* Times a file is tried again when its directory is removed meanwhile */
+#define CREATE_RETRIES	3
+
 static TEEC_Result ree_fs_new_create(size_t num_params,
 				     struct tee_ioctl_param *params)
 {
-	char abs_filename[PATH_MAX] = { 0 };
-	char abs_dir[PATH_MAX] = { 0 };
+	struct dir_cache_entry *e = NULL;
+	char filename[PATH_MAX] = { 0 };
+	char dir[PATH_MAX] = { 0 };
+	const char *base = NULL;
+	struct bcache_id id;
 	char *fname = NULL;
 	char *d = NULL;
 	int fd = 0;
 	const int flags = O_RDWR | O_CREAT | O_TRUNC;
+	int made_dirs = 0;
+	int made = 0;
+	int n = 0;
 
 	if (num_params != 3 ||
 	    (params[0].attr & TEE_IOCTL_PARAM_ATTR_TYPE_MASK) !=
@@ -204,88 +1788,235 @@ static TEEC_Result ree_fs_new_create(size_t num_params,
 	if (!fname)
 		return TEEC_ERROR_BAD_PARAMETERS;
 
-	if (!tee_fs_get_absolute_filename(fname, abs_filename,
-					  sizeof(abs_filename)))
+	if (!tee_fs_get_filename(fname, filename, sizeof(filename)))
 		return TEEC_ERROR_BAD_PARAMETERS;
 
-	fd = open_wrapper(abs_filename, flags);
-	if (fd >= 0)
-		goto out;
-	if (errno != ENOENT)
+	fd_cache_invalidate(filename);
+	base = split_name(filename, dir, sizeof(dir));
+
+	/*
+	 * The directory is made if missing. Removing the last file of a
+	 * directory removes it too, so it may be gone again before the
+	 * file is created in it.
+	 */
+	for (n = 0; ; n++) {
+		e = dir_cache_get(dir);
+		if (e) {
+			fd = open_wrapper(e->fd, base, flags);
+			if (fd >= 0)
+				break;
+			dir_cache_put(e);
+			if (errno != ENOENT)
+				return TEEC_ERROR_GENERIC;
+			dir_cache_drop(dir);
+		} else if (errno != ENOENT) {
+			return TEEC_ERROR_GENERIC;
+		}
+
+		made = -1;
+		if (n < CREATE_RETRIES)
+			made = make_dirs(dir);
+		if (made < 0) {
+			/* Nothing is left over if the file can't be made */
+			remove_empty_dirs(dir);
+			return TEEC_ERROR_GENERIC;
+		}
+		made_dirs = MAX(made_dirs, made);
+	}
+	fs_powercut_created(fd);
+
+	/* Make the new file, and any directory made for it, durable */
+	if (fs_sync_fd(e->fd)) {
+		dir_cache_put(e);
+		close_fd(fd);
 		return TEEC_ERROR_GENERIC;
+	}
+	dir_cache_put(e);
+	d = dir;
+	while (made_dirs--) {
+		d = dirname(d);
+		if (fs_sync_dir(d)) {
+			close_fd(fd);
+			return TEEC_ERROR_GENERIC;
+		}
+	}
 
-	/* Directory for file missing, try make to it */
-	strncpy(abs_dir, abs_filename, sizeof(abs_dir));
-	abs_dir[sizeof(abs_dir) - 1] = '\0';
-	d = dirname(abs_dir);
-	if (!mkdir(d, 0700)) {
-		fd = open_wrapper(abs_filename, flags);
-		if (fd >= 0)
-			goto out;
-		/*
-		 * The directory was made but the file could still not be
-		 * created.
-		 */
-		rmdir(d);
+	fd_cache_track(fd, filename);
+	/* An existing file was truncated, or a removed one's inode reused */
+	bcache_track(fd);
+	if (bcache_fd_id(fd, &id))
+		bcache_drop_file(&id, 0);
+	fs_fd_track(fd, true);
+	params[2].a = fd;
+	return TEEC_SUCCESS;
+}
+
+static TEEC_Result ree_fs_new_close(size_t num_params,
+				    struct tee_ioctl_param *params)
+{
+	int fd = 0;
+
+	if (num_params != 1 ||
+	    (params[0].attr & TEE_IOCTL_PARAM_ATTR_TYPE_MASK) !=
+			TEE_IOCTL_PARAM_ATTR_TYPE_VALUE_INPUT)
+		return TEEC_ERROR_BAD_PARAMETERS;
+
+	fd = params[0].b;
+	fs_fd_release(fd);
+	if (fs_sync_fd(fd)) {
+		fd_cache_forget(fd);
+		close_fd(fd);
 		return TEEC_ERROR_GENERIC;
 	}
-	if (errno != ENOENT)
-		return TEEC_ERROR_GENERIC;
+	if (fd_cache_put(fd))
+		return TEEC_SUCCESS;
+	while (close_fd(fd)) {
+		if (errno != EINTR)
+			return TEEC_ERROR_GENERIC;
+	}
+	return TEEC_SUCCESS;
+}
+
+/* Reads up to @len bytes at @offs, stopping early only at end of file */
+static TEEC_Result read_at(int fd, uint8_t *buf, size_t len, off_t offs,
+			   size_t *size)
+{
+	ssize_t r = -1;
+	size_t s = 0;
+
+	while (r && len) {
+		r = pread_wrapper(fd, buf, len, offs);
+		if (r < 0) {
+			if (errno == EINTR)
+				continue;
+			return TEEC_ERROR_GENERIC;
+		}
+		assert((size_t)r <= len);
+		buf += r;
+		len -= r;
+		offs += r;
+		s += r;
+	}
 
-	/* Parent directory for file missing, try to make it */
-	d = dirname(d);
-	if (mkdir(d, 0700))
-		return TEEC_ERROR_GENERIC;
+	*size = s;
+	return TEEC_SUCCESS;
+}
 
-	/* Try to make directory for file again */
-	strncpy(abs_dir, abs_filename, sizeof(abs_dir));
-	abs_dir[sizeof(abs_dir) - 1] = '\0';
-	d = dirname(abs_dir);
-	if (mkdir(d, 0700)) {
-		d = dirname(d);
-		rmdir(d);
-		return TEEC_ERROR_GENERIC;
-	}
+/*
+ * Reads like read_at() through the block cache. Blocks missing from it
+ * are read with one call up to the next cached block, and added.
+ */
+static TEEC_Result cached_read_at(int fd, uint8_t *buf, size_t len,
+				  off_t offs, size_t *size)
+{
+	uint64_t seqs[BCACHE_MAX_RUN] = { 0 };
+	TEEC_Result res = TEEC_SUCCESS;
+	uint8_t *tmp = NULL;
+	struct bcache_id id;
+	uint64_t blk = 0;
+	size_t boffs = 0;
+	size_t max_run = 0;
+	size_t run = 0;
+	size_t s = 0;
+	size_t n = 0;
 
-	fd = open_wrapper(abs_filename, flags);
-	if (fd < 0) {
-		rmdir(d);
-		d = dirname(d);
-		rmdir(d);
-		return TEEC_ERROR_GENERIC;
+	if (!bcache_fd_id(fd, &id))
+		return read_at(fd, buf, len, offs, size);
+
+	*size = 0;
+	while (len) {
+		blk = offs / BCACHE_BLOCK_SIZE;
+		boffs = offs % BCACHE_BLOCK_SIZE;
+		n = MIN(len, BCACHE_BLOCK_SIZE - boffs);
+		if (bcache_get(&id, blk, buf, boffs, n, seqs)) {
+			buf += n;
+			len -= n;
+			offs += n;
+			*size += n;
+			continue;
+		}
+
+		max_run = MIN((boffs + len + BCACHE_BLOCK_SIZE - 1) /
+			      BCACHE_BLOCK_SIZE, BCACHE_MAX_RUN);
+		for (run = 1; run < max_run; run++)
+			if (bcache_get(&id, blk + run, NULL, 0, 0, seqs + run))
+				break;
+
+		if (!tmp) {
+			tmp = malloc(BCACHE_MAX_RUN * BCACHE_BLOCK_SIZE);
+			if (!tmp) {
+				res = read_at(fd, buf, len, offs, &s);
+				*size += s;
+				return res;
+			}
+		}
+		res = read_at(fd, tmp, run * BCACHE_BLOCK_SIZE,
+			      blk * BCACHE_BLOCK_SIZE, &s);
+		if (res)
+			break;
+		for (n = 0; n < run && s >= (n + 1) * BCACHE_BLOCK_SIZE; n++)
+			bcache_put(&id, blk + n, tmp + n * BCACHE_BLOCK_SIZE,
+				   seqs[n]);
+
+		/* End of file */
+		if (s <= boffs)
+			break;
+		n = MIN(len, s - boffs);
+		memcpy(buf, tmp + boffs, n);
+		buf += n;
+		len -= n;
+		offs += n;
+		*size += n;
+		if (s < run * BCACHE_BLOCK_SIZE)
+			break;
 	}
 
-out:
-	params[2].a = fd;
-	return TEEC_SUCCESS;
+	free(tmp);
+	return res;
 }
 
-static TEEC_Result ree_fs_new_close(size_t num_params,
-				    struct tee_ioctl_param *params)
+static TEEC_Result write_at(int fd, const uint8_t *buf, size_t len,
+			    off_t offs)
 {
-	int fd = 0;
+	ssize_t r = 0;
+	bool head = false;
 
-	if (num_params != 1 ||
-	    (params[0].attr & TEE_IOCTL_PARAM_ATTR_TYPE_MASK) !=
-			TEE_IOCTL_PARAM_ATTR_TYPE_VALUE_INPUT)
-		return TEEC_ERROR_BAD_PARAMETERS;
+	fs_prealloc(fd, len, offs);
 
-	fd = params[0].b;
-	while (close(fd)) {
-		if (errno != EINTR)
+	/* Writes to the head area commit updates, see REE_FS_HEAD_AREA_SIZE */
+	head = offs < REE_FS_HEAD_AREA_SIZE;
+	if (head && supplicant_params.fs_deferred_sync &&
+	    fs_uring_enabled() && !fs_uring_pwrite_synced(fd, buf, len, offs))
+		return TEEC_SUCCESS;
+	if (head && fs_sync_fd(fd))
+		return TEEC_ERROR_GENERIC;
+
+	while (len) {
+		r = pwrite_wrapper(fd, buf, len, offs);
+		if (r < 0) {
+			if (errno == EINTR)
+				continue;
 			return TEEC_ERROR_GENERIC;
+		}
+		assert((size_t)r <= len);
+		fs_powercut_written(fd, buf, r, offs);
+		buf += r;
+		len -= r;
+		offs += r;
 	}
+
+	if (head && fs_sync_fd(fd))
+		return TEEC_ERROR_GENERIC;
+
 	return TEEC_SUCCESS;
 }
 
 static TEEC_Result ree_fs_new_read(size_t num_params,
 				   struct tee_ioctl_param *params)
 {
+	TEEC_Result res = TEEC_ERROR_GENERIC;
 	uint8_t *buf = NULL;
 	size_t len = 0;
-	off_t offs = 0;
-	int fd = 0;
-	ssize_t r = 0;
 	size_t s = 0;
 
 	if (num_params != 2 ||
@@ -295,29 +2026,14 @@ static TEEC_Result ree_fs_new_read(size_t num_params,
 			TEE_IOCTL_PARAM_ATTR_TYPE_MEMREF_OUTPUT)
 		return TEEC_ERROR_BAD_PARAMETERS;
 
-	fd = params[0].b;
-	offs = params[0].c;
-
 	buf = tee_supp_param_to_va(params + 1);
 	if (!buf)
 		return TEEC_ERROR_BAD_PARAMETERS;
 	len = MEMREF_SIZE(params + 1);
 
-	s = 0;
-	r = -1;
-	while (r && len) {
-		r = pread(fd, buf, len, offs);
-		if (r < 0) {
-			if (errno == EINTR)
-				continue;
-			return TEEC_ERROR_GENERIC;
-		}
-		assert((size_t)r <= len);
-		buf += r;
-		len -= r;
-		offs += r;
-		s += r;
-	}
+	res = cached_read_at(params[0].b, buf, len, params[0].c, &s);
+	if (res)
+		return res;
 
 	MEMREF_SIZE(params + 1) = s;
 	return TEEC_SUCCESS;
@@ -326,11 +2042,8 @@ static TEEC_Result ree_fs_new_read(size_t num_params,
 static TEEC_Result ree_fs_new_write(size_t num_params,
 				    struct tee_ioctl_param *params)
 {
+	TEEC_Result res = TEEC_ERROR_GENERIC;
 	uint8_t *buf = NULL;
-	size_t len = 0;
-	off_t offs = 0;
-	int fd = 0;
-	ssize_t r = 0;
 
 	if (num_params != 2 ||
 	    (params[0].attr & TEE_IOCTL_PARAM_ATTR_TYPE_MASK) !=
@@ -339,25 +2052,146 @@ static TEEC_Result ree_fs_new_write(size_t num_params,
 			TEE_IOCTL_PARAM_ATTR_TYPE_MEMREF_INPUT)
 		return TEEC_ERROR_BAD_PARAMETERS;
 
-	fd = params[0].b;
-	offs = params[0].c;
-
 	buf = tee_supp_param_to_va(params + 1);
 	if (!buf)
 		return TEEC_ERROR_BAD_PARAMETERS;
-	len = MEMREF_SIZE(params + 1);
 
-	while (len) {
-		r = pwrite(fd, buf, len, offs);
-		if (r < 0) {
-			if (errno == EINTR)
-				continue;
-			return TEEC_ERROR_GENERIC;
-		}
-		assert((size_t)r <= len);
-		buf += r;
-		len -= r;
-		offs += r;
+	res = write_at(params[0].b, buf, MEMREF_SIZE(params + 1),
+		       params[0].c);
+	bcache_written(params[0].b, buf, MEMREF_SIZE(params + 1),
+		       params[0].c, !res);
+	return res;
+}
+
+/* See OPTEE_MRF_READV */
+struct ree_fs_extent {
+	uint64_t offs;
+	uint64_t len;
+};
+
+/*
+ * Checks the parameters of OPTEE_MRF_READV and OPTEE_MRF_WRITEV, and
+ * returns the extents and the payload.
+ */
+static TEEC_Result get_extents(size_t num_params,
+			       struct tee_ioctl_param *params,
+			       uint64_t payload_type,
+			       struct ree_fs_extent **exts, size_t *num_exts,
+			       uint8_t **buf)
+{
+	struct ree_fs_extent *e = NULL;
+	uint64_t total = 0;
+	size_t n = 0;
+
+	if (num_params != 3 ||
+	    (params[0].attr & TEE_IOCTL_PARAM_ATTR_TYPE_MASK) !=
+			TEE_IOCTL_PARAM_ATTR_TYPE_VALUE_INPUT ||
+	    (params[1].attr & TEE_IOCTL_PARAM_ATTR_TYPE_MASK) !=
+			TEE_IOCTL_PARAM_ATTR_TYPE_MEMREF_INPUT ||
+	    (params[2].attr & TEE_IOCTL_PARAM_ATTR_TYPE_MASK) != payload_type)
+		return TEEC_ERROR_BAD_PARAMETERS;
+
+	e = tee_supp_param_to_va(params + 1);
+	*buf = tee_supp_param_to_va(params + 2);
+	if (!e || !*buf || params[0].c >
+			MEMREF_SIZE(params + 1) / sizeof(*e))
+		return TEEC_ERROR_BAD_PARAMETERS;
+
+	for (n = 0; n < params[0].c; n++) {
+		if (e[n].len > MEMREF_SIZE(params + 2) - total ||
+		    e[n].offs > INT64_MAX - e[n].len)
+			return TEEC_ERROR_BAD_PARAMETERS;
+		total += e[n].len;
+	}
+
+	*exts = e;
+	*num_exts = params[0].c;
+	return TEEC_SUCCESS;
+}
+
+/*
+ * Returns the number of extents from @e on that are adjacent in the
+ * file, and so can be served with one call as the payload is contiguous
+ * too. Writes to the head area are kept apart so write_at() can sync
+ * around them.
+ */
+static size_t extent_run(struct ree_fs_extent *e, size_t num_exts,
+			 size_t *len)
+{
+	bool head = e[0].offs < REE_FS_HEAD_AREA_SIZE;
+	size_t n = 1;
+
+	*len = e[0].len;
+	while (n < num_exts && e[n].offs == e[0].offs + *len &&
+	       (e[n].offs < REE_FS_HEAD_AREA_SIZE) == head) {
+		*len += e[n].len;
+		n++;
+	}
+
+	return n;
+}
+
+static TEEC_Result ree_fs_new_readv(size_t num_params,
+				    struct tee_ioctl_param *params)
+{
+	TEEC_Result res = TEEC_ERROR_GENERIC;
+	struct ree_fs_extent *e = NULL;
+	size_t num_exts = 0;
+	uint8_t *buf = NULL;
+	size_t total = 0;
+	size_t len = 0;
+	size_t s = 0;
+	size_t n = 0;
+	size_t m = 0;
+
+	res = get_extents(num_params, params,
+			  TEE_IOCTL_PARAM_ATTR_TYPE_MEMREF_OUTPUT, &e,
+			  &num_exts, &buf);
+	if (res)
+		return res;
+
+	while (n < num_exts) {
+		m = extent_run(e + n, num_exts - n, &len);
+		res = cached_read_at(params[0].b, buf + total, len,
+				     e[n].offs, &s);
+		if (res)
+			return res;
+		total += s;
+		/* End of file, like a short OPTEE_MRF_READ */
+		if (s < len)
+			break;
+		n += m;
+	}
+
+	MEMREF_SIZE(params + 2) = total;
+	return TEEC_SUCCESS;
+}
+
+static TEEC_Result ree_fs_new_writev(size_t num_params,
+				     struct tee_ioctl_param *params)
+{
+	TEEC_Result res = TEEC_ERROR_GENERIC;
+	struct ree_fs_extent *e = NULL;
+	size_t num_exts = 0;
+	uint8_t *buf = NULL;
+	size_t len = 0;
+	size_t n = 0;
+	size_t m = 0;
+
+	res = get_extents(num_params, params,
+			  TEE_IOCTL_PARAM_ATTR_TYPE_MEMREF_INPUT, &e,
+			  &num_exts, &buf);
+	if (res)
+		return res;
+
+	while (n < num_exts) {
+		m = extent_run(e + n, num_exts - n, &len);
+		res = write_at(params[0].b, buf, len, e[n].offs);
+		bcache_written(params[0].b, buf, len, e[n].offs, !res);
+		if (res)
+			return res;
+		buf += len;
+		n += m;
 	}
 
 	return TEEC_SUCCESS;
@@ -366,8 +2200,10 @@ static TEEC_Result ree_fs_new_write(size_t num_params,
 static TEEC_Result ree_fs_new_truncate(size_t num_params,
 				       struct tee_ioctl_param *params)
 {
+	struct bcache_id id;
 	size_t len = 0;
 	int fd = 0;
+	int r = 0;
 
 	if (num_params != 1 ||
 	    (params[0].attr & TEE_IOCTL_PARAM_ATTR_TYPE_MASK) !=
@@ -377,10 +2213,19 @@ static TEEC_Result ree_fs_new_truncate(size_t num_params,
 	fd = params[0].b;
 	len = params[0].c;
 
-	while (ftruncate(fd, len)) {
-		if (errno != EINTR)
-			return TEEC_ERROR_GENERIC;
-	}
+	do {
+		r = ftruncate(fd, len);
+	} while (r && errno == EINTR);
+	/* The block holding the new end of file is partial, if not gone */
+	if (bcache_fd_id(fd, &id))
+		bcache_drop_file(&id, len / BCACHE_BLOCK_SIZE);
+	if (r)
+		return TEEC_ERROR_GENERIC;
+	fs_prealloc_truncated(fd, len);
+	fs_powercut_truncated(fd, len);
+
+	if (fs_sync_fd(fd))
+		return TEEC_ERROR_GENERIC;
 
 	return TEEC_SUCCESS;
 }
@@ -388,9 +2233,12 @@ static TEEC_Result ree_fs_new_truncate(size_t num_params,
 static TEEC_Result ree_fs_new_remove(size_t num_params,
 				     struct tee_ioctl_param *params)
 {
-	char abs_filename[PATH_MAX] = { 0 };
+	struct dir_cache_entry *e = NULL;
+	char filename[PATH_MAX] = { 0 };
+	char dir[PATH_MAX] = { 0 };
+	const char *base = NULL;
 	char *fname = NULL;
-	char *d = NULL;
+	int res = 0;
 
 	if (num_params != 2 ||
 	    (params[0].attr & TEE_IOCTL_PARAM_ATTR_TYPE_MASK) !=
@@ -403,38 +2251,53 @@ static TEEC_Result ree_fs_new_remove(size_t num_params,
 	if (!fname)
 		return TEEC_ERROR_BAD_PARAMETERS;
 
-	if (!tee_fs_get_absolute_filename(fname, abs_filename,
-					  sizeof(abs_filename)))
+	if (!tee_fs_get_filename(fname, filename, sizeof(filename)))
 		return TEEC_ERROR_BAD_PARAMETERS;
 
-	if (unlink(abs_filename)) {
+	fd_cache_invalidate(filename);
+	base = split_name(filename, dir, sizeof(dir));
+	e = dir_cache_get(dir);
+	if (!e) {
 		if (errno == ENOENT)
 			return TEEC_ERROR_ITEM_NOT_FOUND;
 		return TEEC_ERROR_GENERIC;
 	}
-
-	/* If a file is removed, maybe the directory can be removed to? */
-	d = dirname(abs_filename);
-	if (!rmdir(d)) {
-		/*
-		 * If the directory was removed, maybe the parent directory
-		 * can be removed too?
-		 */
-		d = dirname(d);
-		rmdir(d);
+	bcache_drop_name(e->fd, base);
+	res = unlinkat(e->fd, base, 0);
+	dir_cache_put(e);
+	if (res) {
+		if (errno == ENOENT)
+			return TEEC_ERROR_ITEM_NOT_FOUND;
+		return TEEC_ERROR_GENERIC;
 	}
 
+	/*
+	 * If a file is removed, maybe the directory, and then the parent
+	 * directory, can be removed too?
+	 */
+	remove_empty_dirs(dir);
+
 	return TEEC_SUCCESS;
 }
 
 static TEEC_Result ree_fs_new_rename(size_t num_params,
 				     struct tee_ioctl_param *params)
 {
-	char old_abs_filename[PATH_MAX] = { 0 };
-	char new_abs_filename[PATH_MAX] = { 0 };
+	char old_filename[PATH_MAX] = { 0 };
+	char new_filename[PATH_MAX] = { 0 };
+	char old_dir[PATH_MAX] = { 0 };
+	char new_dir[PATH_MAX] = { 0 };
+	struct dir_cache_entry *old_e = NULL;
+	struct dir_cache_entry *new_e = NULL;
+	TEEC_Result ret = TEEC_ERROR_GENERIC;
+	const char *old_base = NULL;
+	const char *new_base = NULL;
 	char *old_fname = NULL;
 	char *new_fname = NULL;
 	bool overwrite = false;
+	struct stat st;
+	int res = 0;
+	int fd = -1;
 
 	if (num_params != 3 ||
 	    (params[0].attr & TEE_IOCTL_PARAM_ATTR_TYPE_MASK) !=
@@ -455,36 +2318,73 @@ static TEEC_Result ree_fs_new_rename(size_t num_params,
 	if (!new_fname)
 		return TEEC_ERROR_BAD_PARAMETERS;
 
-	if (!tee_fs_get_absolute_filename(old_fname, old_abs_filename,
-					  sizeof(old_abs_filename)))
+	if (!tee_fs_get_filename(old_fname, old_filename,
+				 sizeof(old_filename)))
 		return TEEC_ERROR_BAD_PARAMETERS;
 
-	if (!tee_fs_get_absolute_filename(new_fname, new_abs_filename,
-					  sizeof(new_abs_filename)))
+	if (!tee_fs_get_filename(new_fname, new_filename,
+				 sizeof(new_filename)))
 		return TEEC_ERROR_BAD_PARAMETERS;
 
-	if (!overwrite) {
-		struct stat st;
+	old_base = split_name(old_filename, old_dir, sizeof(old_dir));
+	new_base = split_name(new_filename, new_dir, sizeof(new_dir));
+	old_e = dir_cache_get(old_dir);
+	if (!old_e)
+		return TEEC_ERROR_ITEM_NOT_FOUND;
+	new_e = dir_cache_get(new_dir);
+	if (!new_e) {
+		ret = TEEC_ERROR_ITEM_NOT_FOUND;
+		goto out;
+	}
 
-		if (!stat(new_abs_filename, &st))
-			return TEEC_ERROR_ACCESS_CONFLICT;
+	if (!overwrite) {
+		memset(&st, 0, sizeof(st));
+		if (!fstatat(new_e->fd, new_base, &st, 0)) {
+			ret = TEEC_ERROR_ACCESS_CONFLICT;
+			goto out;
+		}
 	}
-	if (rename(old_abs_filename, new_abs_filename)) {
-		if (errno == ENOENT)
-			return TEEC_ERROR_ITEM_NOT_FOUND;
+	fd_cache_invalidate(old_filename);
+	fd_cache_invalidate(new_filename);
+	/* The renamed file keeps its blocks, the one replaced loses them */
+	bcache_drop_name(new_e->fd, new_base);
+	if (supplicant_params.fs_deferred_sync) {
+		/* The renamed content must be durable before the new name */
+		fd = open_wrapper(old_e->fd, old_base, O_RDONLY);
+		if (fd >= 0) {
+			res = fs_sync_fd(fd);
+			close_fd(fd);
+			if (res)
+				goto out;
+		}
 	}
-	return TEEC_SUCCESS;
+	if (renameat(old_e->fd, old_base, new_e->fd, new_base)) {
+		if (errno == ENOENT) {
+			ret = TEEC_ERROR_ITEM_NOT_FOUND;
+			goto out;
+		}
+	}
+	if (fs_sync_fd(new_e->fd) || fs_sync_fd(old_e->fd))
+		goto out;
+	ret = TEEC_SUCCESS;
+out:
+	if (new_e)
+		dir_cache_put(new_e);
+	dir_cache_put(old_e);
+	return ret;
 }
 
 static TEEC_Result ree_fs_new_opendir(size_t num_params,
 				      struct tee_ioctl_param *params)
 {
-	char abs_filename[PATH_MAX] = { 0 };
+	char filename[PATH_MAX] = { 0 };
 	char *fname = NULL;
 	DIR *dir = NULL;
 	int handle = 0;
+	int fd = -1;
 	struct dirent *dent = NULL;
 	bool empty = true;
+	long pos = 0;
 
 	if (num_params != 3 ||
 	    (params[0].attr & TEE_IOCTL_PARAM_ATTR_TYPE_MASK) !=
@@ -499,13 +2399,18 @@ static TEEC_Result ree_fs_new_opendir(size_t num_params,
 	if (!fname)
 		return TEEC_ERROR_BAD_PARAMETERS;
 
-	if (!tee_fs_get_absolute_filename(fname, abs_filename,
-					  sizeof(abs_filename)))
+	if (!tee_fs_get_filename(fname, filename, sizeof(filename)))
 		return TEEC_ERROR_BAD_PARAMETERS;
 
-	dir = opendir(abs_filename);
-	if (!dir)
+	fd = openat(tee_fs_root_fd, filename,
+		    O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (fd < 0)
+		return TEEC_ERROR_ITEM_NOT_FOUND;
+	dir = fdopendir(fd);
+	if (!dir) {
+		close(fd);
 		return TEEC_ERROR_ITEM_NOT_FOUND;
+	}
 
 	/*
 	 * Ignore empty directories. Works around an issue when the
@@ -519,7 +2424,11 @@ static TEEC_Result ree_fs_new_opendir(size_t num_params,
 	 * TEE_SUCCESS when it should return TEEC_ERROR_ITEM_NOT_FOUND.
 	 * Test case: "xtest 6009 6010".
 	 */
-	while ((dent = readdir(dir))) {
+	while (true) {
+		pos = telldir(dir);
+		dent = readdir(dir);
+		if (!dent)
+			break;
 		if (dent->d_name[0] == '.')
 			continue;
 		empty = false;
@@ -529,7 +2438,8 @@ static TEEC_Result ree_fs_new_opendir(size_t num_params,
 		closedir(dir);
 		return TEEC_ERROR_ITEM_NOT_FOUND;
 	}
-	rewinddir(dir);
+	/* Resume at the first name instead of reading the directory again */
+	seekdir(dir, pos);
 
 	handle = handle_get(&dir_handle_db, dir);
 	if (handle < 0) {
@@ -604,21 +2514,91 @@ static TEEC_Result ree_fs_new_readdir(size_t num_params,
 	return TEEC_SUCCESS;
 }
 
-TEEC_Result tee_supp_fs_process(size_t num_params,
-				struct tee_ioctl_param *params)
+static TEEC_Result ree_fs_new_readdir_batch(size_t num_params,
+					    struct tee_ioctl_param *params)
 {
-	if (!num_params || !tee_supp_param_is_value(params))
+	DIR *dir = NULL;
+	struct dirent *dirent = NULL;
+	uint8_t *buf = NULL;
+	size_t len = 0;
+	size_t used = 0;
+	size_t count = 0;
+	size_t fname_len = 0;
+	uint16_t l = 0;
+	bool eof = false;
+	long pos = 0;
+
+	if (num_params != 3 ||
+	    (params[0].attr & TEE_IOCTL_PARAM_ATTR_TYPE_MASK) !=
+			TEE_IOCTL_PARAM_ATTR_TYPE_VALUE_INPUT ||
+	    (params[1].attr & TEE_IOCTL_PARAM_ATTR_TYPE_MASK) !=
+			TEE_IOCTL_PARAM_ATTR_TYPE_MEMREF_OUTPUT ||
+	    (params[2].attr & TEE_IOCTL_PARAM_ATTR_TYPE_MASK) !=
+			TEE_IOCTL_PARAM_ATTR_TYPE_VALUE_OUTPUT)
 		return TEEC_ERROR_BAD_PARAMETERS;
 
-	if (strlen(tee_fs_root) == 0) {
-		if (tee_supp_fs_init() != 0) {
-			EMSG("error tee_supp_fs_init: failed to create %s/",
-				TEE_FS_PARENT_PATH);
-			memset(tee_fs_root, 0, sizeof(tee_fs_root));
-			return TEEC_ERROR_STORAGE_NOT_AVAILABLE;
+	buf = tee_supp_param_to_va(params + 1);
+	if (!buf)
+		return TEEC_ERROR_BAD_PARAMETERS;
+	len = MEMREF_SIZE(params + 1);
+
+	dir = handle_lookup(&dir_handle_db, params[0].b);
+	if (!dir)
+		return TEEC_ERROR_BAD_PARAMETERS;
+
+	while (true) {
+		pos = telldir(dir);
+		dirent = readdir(dir);
+		if (!dirent) {
+			eof = true;
+			break;
+		}
+		if (dirent->d_name[0] == '.')
+			continue;
+
+		fname_len = strlen(dirent->d_name) + 1;
+		if (sizeof(l) + fname_len > len - used) {
+			/* Leave the name to the next request */
+			seekdir(dir, pos);
+			break;
 		}
+		l = fname_len;
+		memcpy(buf + used, &l, sizeof(l));
+		memcpy(buf + used + sizeof(l), dirent->d_name, fname_len);
+		used += sizeof(l) + fname_len;
+		count++;
+	}
+
+	if (!count) {
+		if (eof)
+			return TEEC_ERROR_ITEM_NOT_FOUND;
+		MEMREF_SIZE(params + 1) = sizeof(l) + fname_len;
+		return TEEC_ERROR_SHORT_BUFFER;
 	}
 
+	MEMREF_SIZE(params + 1) = used;
+	params[2].a = count;
+	params[2].b = eof;
+	return TEEC_SUCCESS;
+}
+
+static TEEC_Result ree_fs_new_sync(size_t num_params,
+				   struct tee_ioctl_param *params)
+{
+	if (num_params != 1 ||
+	    (params[0].attr & TEE_IOCTL_PARAM_ATTR_TYPE_MASK) !=
+			TEE_IOCTL_PARAM_ATTR_TYPE_VALUE_INPUT)
+		return TEEC_ERROR_BAD_PARAMETERS;
+
+	if (fs_sync_fd(params[0].b))
+		return TEEC_ERROR_GENERIC;
+
+	return TEEC_SUCCESS;
+}
+
+static TEEC_Result ree_fs_process(size_t num_params,
+				  struct tee_ioctl_param *params)
+{
 	switch (params->a) {
 	case OPTEE_MRF_OPEN:
 		return ree_fs_new_open(num_params, params);
@@ -642,7 +2622,68 @@ TEEC_Result tee_supp_fs_process(size_t num_params,
 		return ree_fs_new_closedir(num_params, params);
 	case OPTEE_MRF_READDIR:
 		return ree_fs_new_readdir(num_params, params);
+	case OPTEE_MRF_SYNC:
+		return ree_fs_new_sync(num_params, params);
+	case OPTEE_MRF_READDIR_BATCH:
+		return ree_fs_new_readdir_batch(num_params, params);
+	case OPTEE_MRF_READV:
+		return ree_fs_new_readv(num_params, params);
+	case OPTEE_MRF_WRITEV:
+		return ree_fs_new_writev(num_params, params);
 	default:
 		return TEEC_ERROR_BAD_PARAMETERS;
 	}
 }
+
+TEEC_Result tee_supp_fs_process(size_t num_params,
+				struct tee_ioctl_param *params)
+{
+	TEEC_Result res = TEEC_ERROR_GENERIC;
+	struct fs_ta_io_req io;
+
+	if (!num_params || !tee_supp_param_is_value(params))
+		return TEEC_ERROR_BAD_PARAMETERS;
+
+	if (!__atomic_load_n(&fs_ready, __ATOMIC_ACQUIRE)) {
+		tee_supp_mutex_lock(&fs_init_mutex);
+		if (!fs_ready && tee_supp_fs_init() != 0) {
+			EMSG("error tee_supp_fs_init: failed to create %s/",
+				supplicant_params.fs_parent_path);
+			memset(tee_fs_root, 0, sizeof(tee_fs_root));
+			tee_supp_mutex_unlock(&fs_init_mutex);
+			return TEEC_ERROR_STORAGE_NOT_AVAILABLE;
+		}
+		__atomic_store_n(&fs_ready, true, __ATOMIC_RELEASE);
+		tee_supp_mutex_unlock(&fs_init_mutex);
+	}
+
+	/* Throttled before any lock is taken */
+	fs_ta_io_begin(&io, num_params, params);
+
+	if (fs_backend) {
+		res = fs_backend_process(fs_backend, num_params, params);
+	} else if (!supplicant_params.fs_defrag_secs) {
+		res = ree_fs_process(num_params, params);
+	} else {
+		/* The defrag pass holds off requests to replace a file */
+		pthread_rwlock_rdlock(&fs_defrag.lock);
+		res = ree_fs_process(num_params, params);
+		pthread_rwlock_unlock(&fs_defrag.lock);
+	}
+
+	fs_ta_io_end(&io, num_params, params, res);
+	return res;
+}
+
+int tee_supp_fs_migrate(void)
+{
+	if (tee_supp_fs_init() || !fs_backend)
+		return -1;
+
+	if (!fs_backend->migrate) {
+		EMSG("%s: cannot migrate", fs_backend->name);
+		return -1;
+	}
+
+	return fs_backend->migrate(supplicant_params.fs_parent_path);
+}
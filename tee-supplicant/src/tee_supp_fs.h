@@ -27,11 +27,24 @@
 #ifndef TEE_SUPP_FS_H
 #define TEE_SUPP_FS_H
 
+#include <stdio.h>
 #include <tee_client_api.h>
 
+/* Start of a REE FS file, holding the two headers which commit updates */
+#define REE_FS_HEAD_AREA_SIZE	4096
+
 struct tee_ioctl_param;
 
 TEEC_Result tee_supp_fs_process(size_t num_params,
 				struct tee_ioctl_param *params);
 
+/* Stats provider printing how file syncs were grouped */
+void tee_supp_fs_print_stats(FILE *f, void *arg);
+
+/*
+ * Copies the files of the directory layout into the --fs-backend.
+ * Returns 0 on success or -1.
+ */
+int tee_supp_fs_migrate(void);
+
 #endif
@@ -28,13 +28,23 @@
  */
 
 #include <assert.h>
+#include <capture.h>
 #include <dirent.h>
 #include <errno.h>
+#include <fake_tee.h>
 #include <fcntl.h>
+#include <fs_backend.h>
+#include <fs_powercut.h>
+#include <fs_ta_io.h>
+#include <getopt.h>
 #include <inttypes.h>
+#include <lanes.h>
+#include <limits.h>
 #include <prof.h>
 #include <pthread.h>
 #include <rpmb.h>
+#include <signal.h>
+#include <stats.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
@@ -45,13 +55,17 @@
 #include <sys/stat.h>
 #include <sys/time.h>
 #include <sys/types.h>
+#include <time.h>
 #include <tee_client_api.h>
 #include <teec_ta_load.h>
 #include <teec_trace.h>
 #include <tee_socket.h>
 #include <tee_supp_fs.h>
 #include <tee_supplicant.h>
+#include <timeline.h>
 #include <unistd.h>
+#include <ta_bundle.h>
+#include <watchdog.h>
 
 #include "optee_msg_supplicant.h"
 
@@ -75,16 +89,32 @@ struct tee_shm {
 	int id;
 	void *p;
 	size_t size;
+	size_t alloc_size;
 	bool registered;
 	int fd;
+	int pool_class;
+	time_t idle_since;
 	struct tee_shm *next;
 };
 
+/*
+ * Threads serving requests form a pool where idle threads are parked in
+ * TEE_IOC_SUPPL_RECV. The pool grows on demand when the last parked
+ * thread picks up a request and shrinks again once threads have been
+ * surplus for a while, see retire_thread(). All counters are protected by
+ * the mutex.
+ */
 struct thread_arg {
 	int fd;
 	uint32_t gen_caps;
 	bool abort;
 	size_t num_waiters;
+	size_t num_threads;
+	size_t num_active;
+	size_t peak_threads;
+	size_t peak_active;
+	time_t last_spawn;
+	pthread_attr_t attr;
 	pthread_mutex_t mutex;
 };
 
@@ -94,13 +124,90 @@ struct param_value {
 	uint64_t c;
 };
 
-static pthread_mutex_t shm_mutex = PTHREAD_MUTEX_INITIALIZER;
-static struct tee_shm *shm_head;
+/*
+ * Shared memory objects are looked up on every memref parameter of every
+ * request so they are kept in a hash table indexed by the shm id. The TEE
+ * driver hands out ids densely from a small range so the low bits of the
+ * id are good enough as hash. Each bucket has a read/write lock of its own
+ * so concurrent lookups neither serialize nor contend with alloc and free
+ * of shm objects in other buckets.
+ */
+#define SHM_HASH_BUCKETS	64
+
+struct shm_bucket {
+	pthread_rwlock_t lock;
+	struct tee_shm *head;
+};
+
+static struct shm_bucket shm_hash[SHM_HASH_BUCKETS] = {
+	[0 ... SHM_HASH_BUCKETS - 1] = { .lock = PTHREAD_RWLOCK_INITIALIZER },
+};
+
+/*
+ * Shared memory freed by secure world is kept registered with the driver
+ * in a pool of power of two size classes so that the next allocation of a
+ * similar size can be served without any syscalls. Buffers larger than the
+ * largest class are never pooled. Buffers left idle are released by a
+ * trim thread, which only wakes up while the pool holds buffers.
+ */
+#define SHM_POOL_MIN_SHIFT	12
+#define SHM_POOL_NUM_CLASSES	9
+
+struct shm_pool {
+	pthread_mutex_t mutex;
+	/* Signals the trim thread that the pool is no longer empty */
+	pthread_cond_t cond;
+	struct tee_shm *free[SHM_POOL_NUM_CLASSES];
+	size_t num_free[SHM_POOL_NUM_CLASSES];
+	size_t pooled_bytes;
+	size_t pooled_bytes_hwm;
+	size_t live_bytes;
+	size_t live_bytes_peak;
+	uint64_t hits;
+	uint64_t misses;
+	/* Allocations too large for any class, or with the pool disabled */
+	uint64_t unpooled;
+};
+
+static struct shm_pool shm_pool = {
+	.mutex = PTHREAD_MUTEX_INITIALIZER,
+	.cond = PTHREAD_COND_INITIALIZER,
+};
+
+struct tee_supplicant_params supplicant_params = {
+	.fs_parent_path = TEE_FS_PARENT_PATH,
+	.fs_fd_cache_size = TEE_SUPP_FS_FD_CACHE_SIZE,
+	.fs_block_cache_size = TEE_SUPP_FS_BLOCK_CACHE_SIZE,
+	.fs_prealloc_size = TEE_SUPP_FS_PREALLOC_SIZE,
+	.fs_defrag_secs = TEE_SUPP_FS_DEFRAG_SECS,
+	.fs_backend = TEE_SUPP_FS_BACKEND,
+	.fs_container_size = TEE_SUPP_FS_CONTAINER_SIZE,
+	.shm_pool_max_bytes = TEE_SUPP_SHM_POOL_MAX_BYTES,
+	.shm_pool_max_per_class = TEE_SUPP_SHM_POOL_MAX_PER_CLASS,
+	.shm_pool_idle_secs = TEE_SUPP_SHM_POOL_IDLE_SECS,
+	.min_threads = TEE_SUPP_MIN_THREADS,
+	.max_threads = TEE_SUPP_MAX_THREADS,
+	.standby_threads = TEE_SUPP_STANDBY_THREADS,
+	.thread_stack_size = TEE_SUPP_THREAD_STACK_SIZE,
+	.thread_idle_secs = TEE_SUPP_THREAD_IDLE_SECS,
+	.stats_interval = TEE_SUPP_STATS_INTERVAL_SECS,
+	.watchdog_ms = TEE_SUPP_WATCHDOG_MS,
+	.watchdog_slowest = TEE_SUPP_WATCHDOG_SLOWEST,
+	.ta_cache_max_bytes = TEE_SUPP_TA_CACHE_MAX_BYTES,
+};
 
 static const char *ta_dir;
 
 static void *thread_main(void *a);
 
+/* All ioctl() on the TEE device go through here so they can be faked */
+static int tee_ioctl(int fd, unsigned long req, void *data)
+{
+	if (fake_tee_enabled())
+		return fake_tee_ioctl(fd, req, data);
+	return ioctl(fd, req, data);
+}
+
 static size_t num_waiters_inc(struct thread_arg *arg)
 {
 	size_t ret = 0;
@@ -144,59 +251,113 @@ static int get_value(size_t num_params, struct tee_ioctl_param *params,
 	}
 }
 
+static struct shm_bucket *shm_bucket(int id)
+{
+	return shm_hash + ((unsigned int)id & (SHM_HASH_BUCKETS - 1));
+}
+
+static void shm_bucket_rdlock(struct shm_bucket *b)
+{
+	uint64_t start = 0;
+	int e = 0;
+
+	if (timeline_enabled()) {
+		e = pthread_rwlock_tryrdlock(&b->lock);
+		if (e != EBUSY)
+			goto out;
+		start = timeline_begin("shm_bucket_rdlock");
+	}
+
+	e = pthread_rwlock_rdlock(&b->lock);
+	timeline_end("lock", "shm_bucket_rdlock", start);
+out:
+	if (e) {
+		EMSG("pthread_rwlock_rdlock: %s", strerror(e));
+		EMSG("terminating...");
+		exit(EXIT_FAILURE);
+	}
+}
+
+static void shm_bucket_wrlock(struct shm_bucket *b)
+{
+	uint64_t start = 0;
+	int e = 0;
+
+	if (timeline_enabled()) {
+		e = pthread_rwlock_trywrlock(&b->lock);
+		if (e != EBUSY)
+			goto out;
+		start = timeline_begin("shm_bucket_wrlock");
+	}
+
+	e = pthread_rwlock_wrlock(&b->lock);
+	timeline_end("lock", "shm_bucket_wrlock", start);
+out:
+	if (e) {
+		EMSG("pthread_rwlock_wrlock: %s", strerror(e));
+		EMSG("terminating...");
+		exit(EXIT_FAILURE);
+	}
+}
+
+static void shm_bucket_unlock(struct shm_bucket *b)
+{
+	int e = pthread_rwlock_unlock(&b->lock);
+
+	if (e) {
+		EMSG("pthread_rwlock_unlock: %s", strerror(e));
+		EMSG("terminating...");
+		exit(EXIT_FAILURE);
+	}
+}
+
 static struct tee_shm *find_tshm(int id)
 {
+	struct shm_bucket *b = shm_bucket(id);
 	struct tee_shm *tshm = NULL;
 
-	tee_supp_mutex_lock(&shm_mutex);
+	shm_bucket_rdlock(b);
 
-	tshm = shm_head;
+	tshm = b->head;
 	while (tshm && tshm->id != id)
 		tshm = tshm->next;
 
-	tee_supp_mutex_unlock(&shm_mutex);
+	shm_bucket_unlock(b);
 
 	return tshm;
 }
 
 static struct tee_shm *pop_tshm(int id)
 {
+	struct shm_bucket *b = shm_bucket(id);
+	struct tee_shm **prev = NULL;
 	struct tee_shm *tshm = NULL;
-	struct tee_shm *prev = NULL;
 
-	tee_supp_mutex_lock(&shm_mutex);
+	shm_bucket_wrlock(b);
 
-	tshm = shm_head;
-	if (!tshm)
-		goto out;
-
-	if (tshm->id == id) {
-		shm_head = tshm->next;
-		goto out;
+	for (prev = &b->head; *prev; prev = &(*prev)->next) {
+		if ((*prev)->id == id) {
+			tshm = *prev;
+			*prev = tshm->next;
+			break;
+		}
 	}
 
-	do {
-		prev = tshm;
-		tshm = tshm->next;
-		if (!tshm)
-			goto out;
-	} while (tshm->id != id);
-	prev->next = tshm->next;
-
-out:
-	tee_supp_mutex_unlock(&shm_mutex);
+	shm_bucket_unlock(b);
 
 	return tshm;
 }
 
 static void push_tshm(struct tee_shm *tshm)
 {
-	tee_supp_mutex_lock(&shm_mutex);
+	struct shm_bucket *b = shm_bucket(tshm->id);
+
+	shm_bucket_wrlock(b);
 
-	tshm->next = shm_head;
-	shm_head = tshm;
+	tshm->next = b->head;
+	b->head = tshm;
 
-	tee_supp_mutex_unlock(&shm_mutex);
+	shm_bucket_unlock(b);
 }
 
 /* Get parameter allocated by secure world */
@@ -309,7 +470,7 @@ static struct tee_shm *alloc_shm(int fd, size_t size)
 		return NULL;
 
 	data.size = size;
-	shm->fd = ioctl(fd, TEE_IOC_SHM_ALLOC, &data);
+	shm->fd = tee_ioctl(fd, TEE_IOC_SHM_ALLOC, &data);
 	if (shm->fd < 0) {
 		free(shm);
 		return NULL;
@@ -324,6 +485,7 @@ static struct tee_shm *alloc_shm(int fd, size_t size)
 	}
 
 	shm->id = data.id;
+	shm->alloc_size = data.size;
 	shm->registered = false;
 	return shm;
 }
@@ -349,7 +511,7 @@ static struct tee_shm *register_local_shm(int fd, size_t size)
 	data.addr = (uintptr_t)buf;
 	data.length = size;
 
-	shm->fd = ioctl(fd, TEE_IOC_SHM_REGISTER, &data);
+	shm->fd = tee_ioctl(fd, TEE_IOC_SHM_REGISTER, &data);
 	if (shm->fd < 0) {
 		free(shm);
 		free(buf);
@@ -357,32 +519,280 @@ static struct tee_shm *register_local_shm(int fd, size_t size)
 	}
 
 	shm->p = buf;
+	shm->alloc_size = size;
 	shm->registered = true;
 	shm->id = data.id;
 
 	return shm;
 }
 
+static bool release_shm(struct tee_shm *shm)
+{
+	bool ret = true;
+
+	if (shm->registered) {
+		free(shm->p);
+	} else if (munmap(shm->p, shm->alloc_size) != 0) {
+		EMSG("munmap(%p, %zu) failed - Error = %s",
+		     shm->p, shm->alloc_size, strerror(errno));
+		ret = false;
+	}
+
+	close(shm->fd);
+	free(shm);
+	return ret;
+}
+
+static time_t monotonic_secs(void)
+{
+	struct timespec ts;
+
+	memset(&ts, 0, sizeof(ts));
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec;
+}
+
+/* Returns the size class for @size or -1 if it isn't to be pooled */
+static int shm_pool_class(size_t size)
+{
+	int n = 0;
+
+	if (!supplicant_params.shm_pool_max_bytes)
+		return -1;
+
+	for (n = 0; n < SHM_POOL_NUM_CLASSES; n++)
+		if (size <= ((size_t)1 << (SHM_POOL_MIN_SHIFT + n)))
+			return n;
+
+	return -1;
+}
+
+/*
+ * Unlinks buffers which have been idle for longer than the configured
+ * time from the pool and returns them as a list. @next is updated with
+ * the time the first of the remaining buffers becomes idle for long
+ * enough. Called with the pool mutex held, the buffers are released by
+ * the caller once the mutex is dropped.
+ */
+static struct tee_shm *shm_pool_trim_locked(time_t now, time_t *next)
+{
+	time_t idle_secs = supplicant_params.shm_pool_idle_secs;
+	struct tee_shm *trimmed = NULL;
+	struct tee_shm **prev = NULL;
+	struct tee_shm *shm = NULL;
+	int n = 0;
+
+	for (n = 0; n < SHM_POOL_NUM_CLASSES; n++) {
+		prev = &shm_pool.free[n];
+		while (*prev) {
+			shm = *prev;
+			if (now - shm->idle_since < idle_secs) {
+				if (shm->idle_since + idle_secs < *next)
+					*next = shm->idle_since + idle_secs;
+				prev = &shm->next;
+				continue;
+			}
+			*prev = shm->next;
+			shm_pool.num_free[n]--;
+			shm_pool.pooled_bytes -= shm->alloc_size;
+			shm->next = trimmed;
+			trimmed = shm;
+		}
+	}
+
+	return trimmed;
+}
+
+static void release_shm_list(struct tee_shm *list)
+{
+	struct tee_shm *shm = NULL;
+
+	while (list) {
+		shm = list;
+		list = shm->next;
+		release_shm(shm);
+	}
+}
+
+static void *shm_pool_trim_thread(void *arg)
+{
+	struct tee_shm *trimmed = NULL;
+	struct timespec ts;
+	time_t next = 0;
+
+	(void)arg;
+
+	memset(&ts, 0, sizeof(ts));
+	tee_supp_mutex_lock(&shm_pool.mutex);
+	while (true) {
+		if (!shm_pool.pooled_bytes) {
+			pthread_cond_wait(&shm_pool.cond, &shm_pool.mutex);
+			continue;
+		}
+
+		next = LONG_MAX;
+		trimmed = shm_pool_trim_locked(monotonic_secs(), &next);
+		if (trimmed) {
+			tee_supp_mutex_unlock(&shm_pool.mutex);
+			release_shm_list(trimmed);
+			tee_supp_mutex_lock(&shm_pool.mutex);
+			continue;
+		}
+
+		ts.tv_sec = next;
+		pthread_cond_timedwait(&shm_pool.cond, &shm_pool.mutex, &ts);
+	}
+
+	return NULL;
+}
+
+/*
+ * The condition variable is switched to the monotonic clock before the
+ * trim thread, the only one waiting on it, is started.
+ */
+static bool start_shm_pool_trim(void)
+{
+	pthread_condattr_t attr;
+	pthread_t tid = 0;
+	int e = 0;
+
+	if (!supplicant_params.shm_pool_max_bytes)
+		return true;
+
+	e = pthread_condattr_init(&attr);
+	if (!e) {
+		e = pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+		if (!e) {
+			pthread_cond_destroy(&shm_pool.cond);
+			e = pthread_cond_init(&shm_pool.cond, &attr);
+		}
+		pthread_condattr_destroy(&attr);
+	}
+	if (e) {
+		EMSG("pthread_cond_init: %s", strerror(e));
+		return false;
+	}
+
+	e = pthread_create(&tid, NULL, shm_pool_trim_thread, NULL);
+	if (e) {
+		EMSG("pthread_create: %s", strerror(e));
+		return false;
+	}
+	pthread_detach(tid);
+
+	return true;
+}
+
+static struct tee_shm *shm_pool_get(size_t size)
+{
+	struct tee_shm *shm = NULL;
+	int cl = shm_pool_class(size);
+
+	tee_supp_mutex_lock(&shm_pool.mutex);
+
+	if (cl < 0) {
+		shm_pool.unpooled++;
+	} else if (shm_pool.free[cl]) {
+		shm = shm_pool.free[cl];
+		shm_pool.free[cl] = shm->next;
+		shm_pool.num_free[cl]--;
+		shm_pool.pooled_bytes -= shm->alloc_size;
+		shm_pool.hits++;
+	} else {
+		shm_pool.misses++;
+	}
+
+	tee_supp_mutex_unlock(&shm_pool.mutex);
+
+	return shm;
+}
+
+/* Returns false if @shm wasn't taken by the pool */
+static bool shm_pool_put(struct tee_shm *shm)
+{
+	bool ret = false;
+	int cl = shm->pool_class;
+
+	if (cl < 0)
+		return false;
+
+	tee_supp_mutex_lock(&shm_pool.mutex);
+
+	if (shm_pool.num_free[cl] < supplicant_params.shm_pool_max_per_class &&
+	    shm_pool.pooled_bytes + shm->alloc_size <=
+			supplicant_params.shm_pool_max_bytes) {
+		if (!shm_pool.pooled_bytes)
+			pthread_cond_signal(&shm_pool.cond);
+		shm->idle_since = monotonic_secs();
+		shm->next = shm_pool.free[cl];
+		shm_pool.free[cl] = shm;
+		shm_pool.num_free[cl]++;
+		shm_pool.pooled_bytes += shm->alloc_size;
+		if (shm_pool.pooled_bytes > shm_pool.pooled_bytes_hwm)
+			shm_pool.pooled_bytes_hwm = shm_pool.pooled_bytes;
+		ret = true;
+	}
+
+	tee_supp_mutex_unlock(&shm_pool.mutex);
+
+	return ret;
+}
+
+static void shm_pool_account(ssize_t delta)
+{
+	tee_supp_mutex_lock(&shm_pool.mutex);
+
+	shm_pool.live_bytes += delta;
+	if (shm_pool.live_bytes > shm_pool.live_bytes_peak) {
+		shm_pool.live_bytes_peak = shm_pool.live_bytes;
+		DMSG("shm peak %zu bytes, pool hits %" PRIu64 " misses %"
+		     PRIu64 " unpooled %" PRIu64 ", pooled %zu bytes "
+		     "(high-water mark %zu)", shm_pool.live_bytes_peak,
+		     shm_pool.hits, shm_pool.misses, shm_pool.unpooled,
+		     shm_pool.pooled_bytes, shm_pool.pooled_bytes_hwm);
+	}
+
+	tee_supp_mutex_unlock(&shm_pool.mutex);
+}
+
 static uint32_t process_alloc(struct thread_arg *arg, size_t num_params,
 			      struct tee_ioctl_param *params)
 {
 	struct param_value *val = NULL;
 	struct tee_shm *shm = NULL;
+	size_t size = 0;
+	int cl = 0;
 
 	if (num_params != 1 || get_value(num_params, params, 0, &val))
 		return TEEC_ERROR_BAD_PARAMETERS;
 
-	if (arg->gen_caps & TEE_GEN_CAP_REG_MEM)
-		shm = register_local_shm(arg->fd, val->b);
-	else
-		shm = alloc_shm(arg->fd, val->b);
+	size = val->b;
+	cl = shm_pool_class(size);
 
-	if (!shm)
-		return TEEC_ERROR_OUT_OF_MEMORY;
+	shm = shm_pool_get(size);
+	if (!shm) {
+		/*
+		 * Poolable buffers are allocated with the size of the class
+		 * so they can be reused for any request in the class.
+		 */
+		if (cl >= 0)
+			size = (size_t)1 << (SHM_POOL_MIN_SHIFT + cl);
+
+		if (arg->gen_caps & TEE_GEN_CAP_REG_MEM)
+			shm = register_local_shm(arg->fd, size);
+		else
+			shm = alloc_shm(arg->fd, size);
+
+		if (!shm)
+			return TEEC_ERROR_OUT_OF_MEMORY;
+		shm->pool_class = cl;
+	}
 
 	shm->size = val->b;
 	val->c = shm->id;
 	push_tshm(shm);
+	shm_pool_account(shm->alloc_size);
 
 	return TEEC_SUCCESS;
 }
@@ -402,20 +812,14 @@ static uint32_t process_free(size_t num_params, struct tee_ioctl_param *params)
 	if (!shm)
 		return TEEC_ERROR_BAD_PARAMETERS;
 
-	if (shm->registered) {
-		free(shm->p);
-	} else  {
-		if (munmap(shm->p, shm->size) != 0) {
-			EMSG("munmap(%p, %zu) failed - Error = %s",
-			     shm->p, shm->size, strerror(errno));
-			close(shm->fd);
-			free(shm);
-			return TEEC_ERROR_BAD_PARAMETERS;
-		}
-	}
+	shm_pool_account(-(ssize_t)shm->alloc_size);
+
+	if (shm_pool_put(shm))
+		return TEEC_SUCCESS;
+
+	if (!release_shm(shm))
+		return TEEC_ERROR_BAD_PARAMETERS;
 
-	close(shm->fd);
-	free(shm);
 	return TEEC_SUCCESS;
 }
 
@@ -431,11 +835,14 @@ static int open_dev(const char *devname, uint32_t *gen_caps)
 
 	memset(&vers, 0, sizeof(vers));
 
-	fd = open(devname, O_RDWR);
+	if (fake_tee_enabled())
+		fd = fake_tee_open();
+	else
+		fd = open(devname, O_RDWR);
 	if (fd < 0)
 		return -1;
 
-	if (ioctl(fd, TEE_IOC_VERSION, &vers))
+	if (tee_ioctl(fd, TEE_IOC_VERSION, &vers))
 		goto err;
 
 	/* Only OP-TEE supported */
@@ -470,12 +877,220 @@ static int get_dev_fd(uint32_t *gen_caps)
 
 static int usage(int status)
 {
-	fprintf(stderr, "Usage: tee-supplicant [-d] [<device-name>]\n");
-	fprintf(stderr, "       -d: run as a daemon (fork after successful "
-			"initialization)\n");
+	fprintf(stderr, "Usage: tee-supplicant [options] [<device-name>]\n");
+	fprintf(stderr, "\t-h, --help: this help\n");
+	fprintf(stderr, "\t-d, --daemonize: run as a daemon (fork after "
+			"successful initialization)\n");
+	fprintf(stderr, "\t--shm-pool-size <bytes>: max bytes of freed shared "
+			"memory kept for reuse, 0 disables the pool [%zu]\n",
+			supplicant_params.shm_pool_max_bytes);
+	fprintf(stderr, "\t--shm-pool-class-max <n>: max buffers kept per "
+			"size class [%zu]\n",
+			supplicant_params.shm_pool_max_per_class);
+	fprintf(stderr, "\t--shm-pool-idle <secs>: release pooled buffers "
+			"idle for this long [%u]\n",
+			supplicant_params.shm_pool_idle_secs);
+	fprintf(stderr, "\t--min-threads <n>: threads kept in the pool at "
+			"all times [%zu]\n", supplicant_params.min_threads);
+	fprintf(stderr, "\t--max-threads <n>: max threads in the pool, 0 for "
+			"no limit [%zu]\n", supplicant_params.max_threads);
+	fprintf(stderr, "\t--standby-threads <n>: idle threads kept ready "
+			"for new requests [%zu]\n",
+			supplicant_params.standby_threads);
+	fprintf(stderr, "\t--thread-stack-size <bytes>: stack size of pool "
+			"threads, 0 for default [%zu]\n",
+			supplicant_params.thread_stack_size);
+	fprintf(stderr, "\t--thread-idle <secs>: reap surplus threads after "
+			"the pool hasn't grown for this long, checked as "
+			"threads finish requests [%u]\n",
+			supplicant_params.thread_idle_secs);
+	fprintf(stderr, "\t--stats-file <path>: periodically write request "
+			"latencies and counters to this file\n");
+	fprintf(stderr, "\t--stats-interval <secs>: how often the stats file "
+			"is rewritten [%u]\n",
+			supplicant_params.stats_interval);
+	fprintf(stderr, "\t--lane <name>:<limit>:<reserved>: limit concurrent "
+			"requests of lane storage, general or socket, 0 for no "
+			"limit, and reserve threads for it\n");
+	fprintf(stderr, "\t--fs-parent-path <path>: directory holding secure "
+			"storage [%s]\n", supplicant_params.fs_parent_path);
+	fprintf(stderr, "\t--fs-durability sync|deferred: write secure "
+			"storage synchronously, or sync only at commit points "
+			"[%s]\n", supplicant_params.fs_deferred_sync ?
+			"deferred" : "sync");
+	fprintf(stderr, "\t--fs-fd-cache <n>: closed secure storage files "
+			"kept open for reuse, 0 disables the cache [%zu]\n",
+			supplicant_params.fs_fd_cache_size);
+	fprintf(stderr, "\t--fs-block-cache <bytes>: max bytes of secure "
+			"storage file blocks cached in memory, 0 disables the "
+			"cache [%zu]\n", supplicant_params.fs_block_cache_size);
+	fprintf(stderr, "\t--fs-prealloc <bytes>: allocate space for growing "
+			"secure storage files in chunks this large, 0 "
+			"disables preallocation [%zu]\n",
+			supplicant_params.fs_prealloc_size);
+	fprintf(stderr, "\t--fs-defrag <secs>: look for fragmented secure "
+			"storage files this often and rewrite them, 0 "
+			"disables the pass [%u]\n",
+			supplicant_params.fs_defrag_secs);
+	fprintf(stderr, "\t--fs-ta-limit <ta>:<bytes>:<ops>: limit secure "
+			"storage bytes and requests per second of TA directory "
+			"<ta>, or of each TA with \"*\", 0 for no limit\n");
+	fprintf(stderr, "\t--fs-engine syscall|io_uring: how secure storage "
+			"files are read, written and synced [%s]\n",
+			supplicant_params.fs_io_uring ? "io_uring" : "syscall");
+	fprintf(stderr, "\t--fs-backend dir|container|ram: keep secure "
+			"storage as a file per object, in a single container "
+			"file, or in memory only [%s]\n",
+			supplicant_params.fs_backend);
+	fprintf(stderr, "\t--fs-container <path>: container file "
+			"[<fs-parent-path>/storage.ctr]\n");
+	fprintf(stderr, "\t--fs-container-size <bytes>: size a new "
+			"container is preallocated to [%zu]\n",
+			supplicant_params.fs_container_size);
+	fprintf(stderr, "\t--fs-migrate: copy the files below "
+			"--fs-parent-path into the --fs-backend and exit\n");
+	fprintf(stderr, "\t--fs-powercut: with --replay, check that secure "
+			"storage files would be consistent after a power cut "
+			"at any point\n");
+	fprintf(stderr, "\t--capture <path>: record all requests and "
+			"responses to this file\n");
+	fprintf(stderr, "\t--replay <path>: serve the requests recorded in "
+			"this file without a TEE, print statistics and exit\n");
+	fprintf(stderr, "\t--fake-tee <key>=<val>[,...]: serve synthetic "
+			"storage sessions from an in-process fake TEE, print "
+			"statistics and exit; keys are threads, rate, count, "
+			"size, io=single|vec, shm=reg|alloc, enum, "
+			"readdir=single|batch, ta, cache=warm|cold and "
+			"churn\n");
+	fprintf(stderr, "\t--timeline <path>: write a Chrome trace JSON "
+			"timeline of requests and lock waits to this file\n");
+	fprintf(stderr, "\t--timeline-marker: also write timeline events to "
+			"the ftrace trace_marker\n");
+	fprintf(stderr, "\t--watchdog <ms>: log requests in progress for "
+			"longer than this, 0 disables the watchdog [%u]\n",
+			supplicant_params.watchdog_ms);
+	fprintf(stderr, "\t--watchdog-slowest <n>: number of slowest "
+			"requests logged with those in progress on SIGUSR1 "
+			"[%zu]\n", supplicant_params.watchdog_slowest);
+	fprintf(stderr, "\t--ta-cache-size <bytes>: max bytes of TA binaries "
+			"cached in memory, 0 disables the cache [%zu]\n",
+			supplicant_params.ta_cache_max_bytes);
+	fprintf(stderr, "\t--ta-bundle <path>: load TAs from this bundle, "
+			"falling back to separate TA files\n");
+	fprintf(stderr, "\t--ta-prefetch <path>: read the TAs listed in this "
+			"file, one UUID per line, from storage at startup\n");
+	fprintf(stderr, "\t--ta-prefetch-all: read all TAs from storage at "
+			"startup\n");
 	return status;
 }
 
+static bool parse_size(const char *str, size_t *res)
+{
+	unsigned long long v = 0;
+	char *endp = NULL;
+
+	errno = 0;
+	v = strtoull(str, &endp, 0);
+	if (errno || endp == str || *endp || v > SIZE_MAX)
+		return false;
+
+	*res = v;
+	return true;
+}
+
+static bool parse_uint(const char *str, unsigned int *res)
+{
+	size_t v = 0;
+
+	if (!parse_size(str, &v) || v > UINT_MAX)
+		return false;
+
+	*res = v;
+	return true;
+}
+
+enum long_opt {
+	OPT_SHM_POOL_SIZE = 0x100,
+	OPT_SHM_POOL_CLASS_MAX,
+	OPT_SHM_POOL_IDLE,
+	OPT_MIN_THREADS,
+	OPT_MAX_THREADS,
+	OPT_STANDBY_THREADS,
+	OPT_THREAD_STACK_SIZE,
+	OPT_THREAD_IDLE,
+	OPT_STATS_FILE,
+	OPT_STATS_INTERVAL,
+	OPT_LANE,
+	OPT_FS_PARENT_PATH,
+	OPT_FS_DURABILITY,
+	OPT_FS_FD_CACHE,
+	OPT_FS_BLOCK_CACHE,
+	OPT_FS_PREALLOC,
+	OPT_FS_DEFRAG,
+	OPT_FS_TA_LIMIT,
+	OPT_FS_ENGINE,
+	OPT_FS_BACKEND,
+	OPT_FS_CONTAINER,
+	OPT_FS_CONTAINER_SIZE,
+	OPT_FS_MIGRATE,
+	OPT_FS_POWERCUT,
+	OPT_CAPTURE,
+	OPT_REPLAY,
+	OPT_FAKE_TEE,
+	OPT_TIMELINE,
+	OPT_TIMELINE_MARKER,
+	OPT_WATCHDOG,
+	OPT_WATCHDOG_SLOWEST,
+	OPT_TA_CACHE_SIZE,
+	OPT_TA_BUNDLE,
+	OPT_TA_PREFETCH,
+	OPT_TA_PREFETCH_ALL,
+};
+
+static const struct option long_options[] = {
+	{ "help", no_argument, NULL, 'h' },
+	{ "daemonize", no_argument, NULL, 'd' },
+	{ "shm-pool-size", required_argument, NULL, OPT_SHM_POOL_SIZE },
+	{ "shm-pool-class-max", required_argument, NULL,
+	  OPT_SHM_POOL_CLASS_MAX },
+	{ "shm-pool-idle", required_argument, NULL, OPT_SHM_POOL_IDLE },
+	{ "min-threads", required_argument, NULL, OPT_MIN_THREADS },
+	{ "max-threads", required_argument, NULL, OPT_MAX_THREADS },
+	{ "standby-threads", required_argument, NULL, OPT_STANDBY_THREADS },
+	{ "thread-stack-size", required_argument, NULL,
+	  OPT_THREAD_STACK_SIZE },
+	{ "thread-idle", required_argument, NULL, OPT_THREAD_IDLE },
+	{ "stats-file", required_argument, NULL, OPT_STATS_FILE },
+	{ "stats-interval", required_argument, NULL, OPT_STATS_INTERVAL },
+	{ "lane", required_argument, NULL, OPT_LANE },
+	{ "fs-parent-path", required_argument, NULL, OPT_FS_PARENT_PATH },
+	{ "fs-durability", required_argument, NULL, OPT_FS_DURABILITY },
+	{ "fs-fd-cache", required_argument, NULL, OPT_FS_FD_CACHE },
+	{ "fs-block-cache", required_argument, NULL, OPT_FS_BLOCK_CACHE },
+	{ "fs-prealloc", required_argument, NULL, OPT_FS_PREALLOC },
+	{ "fs-defrag", required_argument, NULL, OPT_FS_DEFRAG },
+	{ "fs-ta-limit", required_argument, NULL, OPT_FS_TA_LIMIT },
+	{ "fs-engine", required_argument, NULL, OPT_FS_ENGINE },
+	{ "fs-backend", required_argument, NULL, OPT_FS_BACKEND },
+	{ "fs-container", required_argument, NULL, OPT_FS_CONTAINER },
+	{ "fs-container-size", required_argument, NULL,
+	  OPT_FS_CONTAINER_SIZE },
+	{ "fs-migrate", no_argument, NULL, OPT_FS_MIGRATE },
+	{ "fs-powercut", no_argument, NULL, OPT_FS_POWERCUT },
+	{ "capture", required_argument, NULL, OPT_CAPTURE },
+	{ "replay", required_argument, NULL, OPT_REPLAY },
+	{ "fake-tee", required_argument, NULL, OPT_FAKE_TEE },
+	{ "timeline", required_argument, NULL, OPT_TIMELINE },
+	{ "timeline-marker", no_argument, NULL, OPT_TIMELINE_MARKER },
+	{ "watchdog", required_argument, NULL, OPT_WATCHDOG },
+	{ "watchdog-slowest", required_argument, NULL, OPT_WATCHDOG_SLOWEST },
+	{ "ta-cache-size", required_argument, NULL, OPT_TA_CACHE_SIZE },
+	{ "ta-bundle", required_argument, NULL, OPT_TA_BUNDLE },
+	{ "ta-prefetch", required_argument, NULL, OPT_TA_PREFETCH },
+	{ "ta-prefetch-all", no_argument, NULL, OPT_TA_PREFETCH_ALL },
+	{ NULL, 0, NULL, 0 }
+};
+
 static uint32_t process_rpmb(size_t num_params, struct tee_ioctl_param *params)
 {
 	TEEC_SharedMemory req;
@@ -499,7 +1114,7 @@ static bool read_request(int fd, union tee_rpc_invoke *request)
 
 	data.buf_ptr = (uintptr_t)request;
 	data.buf_len = sizeof(*request);
-	if (ioctl(fd, TEE_IOC_SUPPL_RECV, &data)) {
+	if (tee_ioctl(fd, TEE_IOC_SUPPL_RECV, &data)) {
 		EMSG("TEE_IOC_SUPPL_RECV: %s", strerror(errno));
 		return false;
 	}
@@ -516,7 +1131,7 @@ static bool write_response(int fd, union tee_rpc_invoke *request)
 	data.buf_len = sizeof(struct tee_iocl_supp_send_arg) +
 		       sizeof(struct tee_ioctl_param) *
 				(__u64)request->send.num_params;
-	if (ioctl(fd, TEE_IOC_SUPPL_SEND, &data)) {
+	if (tee_ioctl(fd, TEE_IOC_SUPPL_SEND, &data)) {
 		EMSG("TEE_IOC_SUPPL_SEND: %s", strerror(errno));
 		return false;
 	}
@@ -553,7 +1168,21 @@ static bool find_params(union tee_rpc_invoke *request, uint32_t *func,
 	return true;
 }
 
-static bool spawn_thread(struct thread_arg *arg)
+/* Called with arg->mutex held */
+static bool may_spawn_thread(struct thread_arg *arg)
+{
+	if (arg->num_waiters >= supplicant_params.standby_threads)
+		return false;
+
+	if (supplicant_params.max_threads &&
+	    arg->num_threads >= supplicant_params.max_threads)
+		return false;
+
+	return true;
+}
+
+/* Called with arg->mutex held */
+static bool start_thread_locked(struct thread_arg *arg)
 {
 	int e = 0;
 	pthread_t tid;
@@ -566,12 +1195,14 @@ static bool spawn_thread(struct thread_arg *arg)
 	 * Increase number of waiters now to avoid starting another thread
 	 * before this thread has been scheduled.
 	 */
-	num_waiters_inc(arg);
+	arg->num_waiters++;
+	arg->num_threads++;
 
-	e = pthread_create(&tid, NULL, thread_main, arg);
+	e = pthread_create(&tid, &arg->attr, thread_main, arg);
 	if (e) {
 		EMSG("pthread_create: %s", strerror(e));
-		num_waiters_dec(arg);
+		arg->num_waiters--;
+		arg->num_threads--;
 		return false;
 	}
 
@@ -579,16 +1210,168 @@ static bool spawn_thread(struct thread_arg *arg)
 	if (e)
 		EMSG("pthread_detach: %s", strerror(e));
 
+	arg->last_spawn = monotonic_secs();
+	if (arg->num_threads > arg->peak_threads) {
+		arg->peak_threads = arg->num_threads;
+		DMSG("peak %zu threads", arg->peak_threads);
+	}
+
 	return true;
 }
 
-static bool process_one_request(struct thread_arg *arg)
+static bool spawn_thread(struct thread_arg *arg)
+{
+	bool ret = true;
+
+	tee_supp_mutex_lock(&arg->mutex);
+	if (may_spawn_thread(arg))
+		ret = start_thread_locked(arg);
+	tee_supp_mutex_unlock(&arg->mutex);
+
+	return ret;
+}
+
+static void rpc_begin(struct thread_arg *arg)
+{
+	tee_supp_mutex_lock(&arg->mutex);
+	arg->num_active++;
+	if (arg->num_active > arg->peak_active) {
+		arg->peak_active = arg->num_active;
+		DMSG("peak %zu concurrent requests", arg->peak_active);
+	}
+	tee_supp_mutex_unlock(&arg->mutex);
+}
+
+static void rpc_end(struct thread_arg *arg)
+{
+	tee_supp_mutex_lock(&arg->mutex);
+	assert(arg->num_active);
+	arg->num_active--;
+	tee_supp_mutex_unlock(&arg->mutex);
+}
+
+/*
+ * Called by a pool thread before it parks in TEE_IOC_SUPPL_RECV again.
+ * The thread exits instead if enough threads are parked already and the
+ * pool hasn't needed to grow for the configured idle time.
+ *
+ * Threads are only retired here, after serving a request. Threads parked
+ * in TEE_IOC_SUPPL_RECV can't be reaped as there's no way to wake them
+ * short of a request, so an idle device keeps the threads of its last
+ * burst until requests arrive again and the pool drains one thread per
+ * request.
+ */
+static bool retire_thread(struct thread_arg *arg)
+{
+	bool ret = false;
+
+	tee_supp_mutex_lock(&arg->mutex);
+	if (arg->num_waiters >= supplicant_params.standby_threads &&
+	    arg->num_threads > supplicant_params.min_threads &&
+	    monotonic_secs() - arg->last_spawn >=
+			(time_t)supplicant_params.thread_idle_secs) {
+		arg->num_threads--;
+		ret = true;
+	}
+	tee_supp_mutex_unlock(&arg->mutex);
+
+	if (ret)
+		DMSG("Retiring idle thread");
+
+	return ret;
+}
+
+static uint32_t dispatch_request(struct thread_arg *arg, uint32_t func,
+				 size_t num_params,
+				 struct tee_ioctl_param *params)
+{
+	switch (func) {
+	case OPTEE_MSG_RPC_CMD_LOAD_TA:
+		return load_ta(num_params, params);
+	case OPTEE_MSG_RPC_CMD_FS:
+		return tee_supp_fs_process(num_params, params);
+	case OPTEE_MSG_RPC_CMD_RPMB:
+		return process_rpmb(num_params, params);
+	case OPTEE_MSG_RPC_CMD_SHM_ALLOC:
+		return process_alloc(arg, num_params, params);
+	case OPTEE_MSG_RPC_CMD_SHM_FREE:
+		return process_free(num_params, params);
+	case OPTEE_MSG_RPC_CMD_GPROF:
+		return prof_process(num_params, params, "gmon-");
+	case OPTEE_MSG_RPC_CMD_SOCKET:
+		return tee_socket_process(num_params, params);
+	case OPTEE_MSG_RPC_CMD_FTRACE:
+		return prof_process(num_params, params, "ftrace-");
+	default:
+		EMSG("Cmd [0x%" PRIx32 "] not supported", func);
+		/* Not supported. */
+		return TEEC_ERROR_NOT_SUPPORTED;
+	}
+}
+
+/* Replayed requests never include shm alloc and free so no thread_arg */
+static uint32_t replay_dispatch(uint32_t func, size_t num_params,
+				struct tee_ioctl_param *params)
+{
+	return dispatch_request(NULL, func, num_params, params);
+}
+
+/* Serves a request read by process_one_request() and sends the response */
+static bool serve_request(struct thread_arg *arg,
+			  union tee_rpc_invoke *request)
 {
 	size_t num_params = 0;
 	size_t num_meta = 0;
 	struct tee_ioctl_param *params = NULL;
+	struct capture_rec *rec = NULL;
+	struct watchdog_slot *wd = NULL;
+	unsigned int cls = 0;
 	uint32_t func = 0;
 	uint32_t ret = 0;
+	uint64_t start = 0;
+	uint64_t tl_start = 0;
+
+	if (!find_params(request, &func, &num_params, &params, &num_meta))
+		return false;
+
+	cls = stats_req_class(func, num_params, params);
+	rpc_begin(arg);
+	rec = capture_begin(func, num_params, params);
+	tl_start = timeline_begin(stats_req_class_name(cls));
+	wd = watchdog_begin(cls, func, num_params, params);
+	start = stats_now_ns();
+
+	ret = dispatch_request(arg, func, num_params, params);
+
+	stats_record(cls, stats_now_ns() - start);
+	watchdog_end(wd);
+	timeline_end("rpc", stats_req_class_name(cls), tl_start);
+	capture_end(rec, ret, params);
+	rpc_end(arg);
+
+	request->send.ret = ret;
+	return write_response(arg->fd, request);
+}
+
+static void *copy_request(void *request)
+{
+	union tee_rpc_invoke *copy = malloc(sizeof(*copy));
+
+	if (copy)
+		memcpy(copy, request, sizeof(*copy));
+
+	return copy;
+}
+
+static bool process_one_request(struct thread_arg *arg)
+{
+	size_t num_params = 0;
+	size_t num_meta = 0;
+	struct tee_ioctl_param *params = NULL;
+	union tee_rpc_invoke *queued = NULL;
+	unsigned int lane = 0;
+	uint32_t func = 0;
+	bool ret = false;
 	union tee_rpc_invoke request;
 
 	memset(&request, 0, sizeof(request));
@@ -608,43 +1391,36 @@ static bool process_one_request(struct thread_arg *arg)
 	if (!find_params(&request, &func, &num_params, &params, &num_meta))
 		return false;
 
-	if (num_meta && !num_waiters_dec(arg) && !spawn_thread(arg))
+	if (num_meta &&
+	    num_waiters_dec(arg) < supplicant_params.standby_threads &&
+	    !spawn_thread(arg))
 		return false;
 
-	switch (func) {
-	case OPTEE_MSG_RPC_CMD_LOAD_TA:
-		ret = load_ta(num_params, params);
-		break;
-	case OPTEE_MSG_RPC_CMD_FS:
-		ret = tee_supp_fs_process(num_params, params);
-		break;
-	case OPTEE_MSG_RPC_CMD_RPMB:
-		ret = process_rpmb(num_params, params);
-		break;
-	case OPTEE_MSG_RPC_CMD_SHM_ALLOC:
-		ret = process_alloc(arg, num_params, params);
-		break;
-	case OPTEE_MSG_RPC_CMD_SHM_FREE:
-		ret = process_free(num_params, params);
-		break;
-	case OPTEE_MSG_RPC_CMD_GPROF:
-		ret = prof_process(num_params, params, "gmon-");
-		break;
-	case OPTEE_MSG_RPC_CMD_SOCKET:
-		ret = tee_socket_process(num_params, params);
-		break;
-	case OPTEE_MSG_RPC_CMD_FTRACE:
-		ret = prof_process(num_params, params, "ftrace-");
-		break;
-	default:
-		EMSG("Cmd [0x%" PRIx32 "] not supported", func);
-		/* Not supported. */
-		ret = TEEC_ERROR_NOT_SUPPORTED;
-		break;
+	/*
+	 * Only a driver passing meta parameters can have several requests
+	 * in progress and receive responses out of order. Requests which
+	 * can't be admitted to their lane are queued and served by the
+	 * thread completing a request.
+	 */
+	if (!num_meta)
+		return serve_request(arg, &request);
+
+	lane = lane_of(func, num_params, params);
+	if (!lane_admit(lane, copy_request, &request))
+		return true;
+
+	/*
+	 * Queued requests are served even if a response couldn't be sent,
+	 * their secure threads would wait for ever otherwise.
+	 */
+	ret = serve_request(arg, &request);
+	while ((queued = lane_done(lane, &lane))) {
+		if (!serve_request(arg, queued))
+			ret = false;
+		free(queued);
 	}
 
-	request.send.ret = ret;
-	return write_response(arg->fd, &request);
+	return ret;
 }
 
 static void *thread_main(void *a)
@@ -660,16 +1436,172 @@ static void *thread_main(void *a)
 	while (!arg->abort) {
 		if (!process_one_request(arg))
 			arg->abort = true;
+		else if (retire_thread(arg))
+			break;
 	}
 
 	return NULL;
 }
 
+static void print_stats(FILE *f, void *a)
+{
+	struct thread_arg *arg = a;
+
+	tee_supp_mutex_lock(&arg->mutex);
+	fprintf(f, "threads %zu peak %zu\n", arg->num_threads,
+		arg->peak_threads);
+	fprintf(f, "waiters %zu\n", arg->num_waiters);
+	fprintf(f, "in_flight %zu peak %zu\n", arg->num_active,
+		arg->peak_active);
+	tee_supp_mutex_unlock(&arg->mutex);
+
+	tee_supp_mutex_lock(&shm_pool.mutex);
+	fprintf(f, "shm_live_bytes %zu peak %zu\n", shm_pool.live_bytes,
+		shm_pool.live_bytes_peak);
+	fprintf(f, "shm_pool_bytes %zu hwm %zu hits %" PRIu64 " misses %"
+		PRIu64 " unpooled %" PRIu64 "\n", shm_pool.pooled_bytes,
+		shm_pool.pooled_bytes_hwm, shm_pool.hits, shm_pool.misses,
+		shm_pool.unpooled);
+	tee_supp_mutex_unlock(&shm_pool.mutex);
+}
+
+static bool start_timeline(void)
+{
+	if (!supplicant_params.timeline_file)
+		return true;
+
+	if (timeline_start(supplicant_params.timeline_file,
+			   supplicant_params.timeline_marker)) {
+		EMSG("failed to start timeline \"%s\"",
+		     supplicant_params.timeline_file);
+		return false;
+	}
+
+	return true;
+}
+
+/*
+ * The watchdog thread waits for SIGUSR1 with sigtimedwait() so it must be
+ * blocked in all threads. This is called before any thread is created so
+ * they all inherit the mask. Without the watchdog the signal is left alone.
+ */
+static bool block_watchdog_signal(void)
+{
+	sigset_t set;
+	int e = 0;
+
+	if (!supplicant_params.watchdog_ms)
+		return true;
+
+	sigemptyset(&set);
+	sigaddset(&set, SIGUSR1);
+	e = pthread_sigmask(SIG_BLOCK, &set, NULL);
+	if (e) {
+		EMSG("pthread_sigmask: %s", strerror(e));
+		return false;
+	}
+
+	return true;
+}
+
+static bool start_watchdog(void)
+{
+	if (!supplicant_params.watchdog_ms)
+		return true;
+
+	if (watchdog_start(supplicant_params.watchdog_ms,
+			   supplicant_params.watchdog_slowest)) {
+		EMSG("failed to start the watchdog");
+		return false;
+	}
+
+	return true;
+}
+
+static void *ta_prefetch_thread(void *arg)
+{
+	uint64_t tl_start = timeline_begin("ta_prefetch");
+	uint64_t start = stats_now_ns();
+	size_t bytes = 0;
+	size_t num = 0;
+
+	(void)arg;
+
+	num = TEECI_PrefetchSecureModules(ta_dir,
+					  supplicant_params.ta_prefetch_list,
+					  &bytes);
+	IMSG("prefetched %zu TAs, %zu bytes in %" PRIu64 " ms", num, bytes,
+	     (stats_now_ns() - start) / 1000000);
+	timeline_end("ta", "ta_prefetch", tl_start);
+
+	return NULL;
+}
+
+/*
+ * TAs are read in the background, the RPC loop isn't delayed and a TA
+ * requested meanwhile is loaded as usual.
+ */
+static bool start_ta_prefetch(void)
+{
+	pthread_t tid = 0;
+	int e = 0;
+
+	if (!supplicant_params.ta_prefetch)
+		return true;
+
+	e = pthread_create(&tid, NULL, ta_prefetch_thread, NULL);
+	if (e) {
+		EMSG("pthread_create: %s", strerror(e));
+		return false;
+	}
+	pthread_detach(tid);
+
+	return true;
+}
+
+static bool init_thread_pool(struct thread_arg *arg)
+{
+	int e = 0;
+
+	e = pthread_attr_init(&arg->attr);
+	if (e) {
+		EMSG("pthread_attr_init: %s", strerror(e));
+		return false;
+	}
+
+	if (supplicant_params.thread_stack_size) {
+		e = pthread_attr_setstacksize(&arg->attr,
+					supplicant_params.thread_stack_size);
+		if (e) {
+			EMSG("pthread_attr_setstacksize(%zu): %s",
+			     supplicant_params.thread_stack_size, strerror(e));
+			return false;
+		}
+	}
+
+	tee_supp_mutex_lock(&arg->mutex);
+
+	/* The main thread is the first thread of the pool */
+	arg->num_threads = 1;
+	arg->peak_threads = 1;
+
+	while (arg->num_threads < supplicant_params.min_threads) {
+		if (!start_thread_locked(arg)) {
+			tee_supp_mutex_unlock(&arg->mutex);
+			return false;
+		}
+	}
+
+	tee_supp_mutex_unlock(&arg->mutex);
+
+	return true;
+}
+
 int main(int argc, char *argv[])
 {
 	struct thread_arg arg = { .fd = -1 };
 	bool daemonize = false;
-	char *dev = NULL;
+	const char *dev = NULL;
 	int e = 0;
 	int i = 0;
 
@@ -680,22 +1612,235 @@ int main(int argc, char *argv[])
 		exit(EXIT_FAILURE);
 	}
 
-	if (argc > 3)
+	while ((i = getopt_long(argc, argv, "hd", long_options, NULL)) != -1) {
+		switch (i) {
+		case 'h':
+			return usage(EXIT_SUCCESS);
+		case 'd':
+			daemonize = true;
+			break;
+		case OPT_SHM_POOL_SIZE:
+			if (!parse_size(optarg,
+					&supplicant_params.shm_pool_max_bytes))
+				return usage(EXIT_FAILURE);
+			break;
+		case OPT_SHM_POOL_CLASS_MAX:
+			if (!parse_size(optarg,
+				&supplicant_params.shm_pool_max_per_class))
+				return usage(EXIT_FAILURE);
+			break;
+		case OPT_SHM_POOL_IDLE:
+			if (!parse_uint(optarg,
+					&supplicant_params.shm_pool_idle_secs))
+				return usage(EXIT_FAILURE);
+			break;
+		case OPT_MIN_THREADS:
+			if (!parse_size(optarg, &supplicant_params.min_threads))
+				return usage(EXIT_FAILURE);
+			break;
+		case OPT_MAX_THREADS:
+			if (!parse_size(optarg, &supplicant_params.max_threads))
+				return usage(EXIT_FAILURE);
+			break;
+		case OPT_STANDBY_THREADS:
+			if (!parse_size(optarg,
+					&supplicant_params.standby_threads))
+				return usage(EXIT_FAILURE);
+			break;
+		case OPT_THREAD_STACK_SIZE:
+			if (!parse_size(optarg,
+					&supplicant_params.thread_stack_size))
+				return usage(EXIT_FAILURE);
+			break;
+		case OPT_THREAD_IDLE:
+			if (!parse_uint(optarg,
+					&supplicant_params.thread_idle_secs))
+				return usage(EXIT_FAILURE);
+			break;
+		case OPT_STATS_FILE:
+			supplicant_params.stats_file = optarg;
+			break;
+		case OPT_STATS_INTERVAL:
+			if (!parse_uint(optarg,
+					&supplicant_params.stats_interval))
+				return usage(EXIT_FAILURE);
+			break;
+		case OPT_LANE:
+			if (lane_configure(optarg))
+				return usage(EXIT_FAILURE);
+			break;
+		case OPT_FS_PARENT_PATH:
+			supplicant_params.fs_parent_path = optarg;
+			break;
+		case OPT_FS_DURABILITY:
+			if (!strcmp(optarg, "sync"))
+				supplicant_params.fs_deferred_sync = false;
+			else if (!strcmp(optarg, "deferred"))
+				supplicant_params.fs_deferred_sync = true;
+			else
+				return usage(EXIT_FAILURE);
+			break;
+		case OPT_FS_FD_CACHE:
+			if (!parse_size(optarg,
+					&supplicant_params.fs_fd_cache_size))
+				return usage(EXIT_FAILURE);
+			break;
+		case OPT_FS_BLOCK_CACHE:
+			if (!parse_size(optarg,
+					&supplicant_params.fs_block_cache_size))
+				return usage(EXIT_FAILURE);
+			break;
+		case OPT_FS_PREALLOC:
+			if (!parse_size(optarg,
+					&supplicant_params.fs_prealloc_size))
+				return usage(EXIT_FAILURE);
+			break;
+		case OPT_FS_DEFRAG:
+			if (!parse_uint(optarg,
+					&supplicant_params.fs_defrag_secs))
+				return usage(EXIT_FAILURE);
+			break;
+		case OPT_FS_TA_LIMIT:
+			if (fs_ta_io_configure(optarg))
+				return usage(EXIT_FAILURE);
+			break;
+		case OPT_FS_ENGINE:
+			if (!strcmp(optarg, "syscall"))
+				supplicant_params.fs_io_uring = false;
+			else if (!strcmp(optarg, "io_uring"))
+				supplicant_params.fs_io_uring = true;
+			else
+				return usage(EXIT_FAILURE);
+			break;
+		case OPT_FS_BACKEND:
+			if (strcmp(optarg, "dir") && !fs_backend_find(optarg))
+				return usage(EXIT_FAILURE);
+			supplicant_params.fs_backend = optarg;
+			break;
+		case OPT_FS_CONTAINER:
+			supplicant_params.fs_container = optarg;
+			break;
+		case OPT_FS_CONTAINER_SIZE:
+			if (!parse_size(optarg,
+					&supplicant_params.fs_container_size))
+				return usage(EXIT_FAILURE);
+			break;
+		case OPT_FS_MIGRATE:
+			supplicant_params.fs_migrate = true;
+			break;
+		case OPT_FS_POWERCUT:
+			supplicant_params.fs_powercut = true;
+			break;
+		case OPT_CAPTURE:
+			supplicant_params.capture_file = optarg;
+			break;
+		case OPT_REPLAY:
+			supplicant_params.replay_file = optarg;
+			break;
+		case OPT_FAKE_TEE:
+			if (fake_tee_configure(optarg))
+				return usage(EXIT_FAILURE);
+			break;
+		case OPT_TIMELINE:
+			supplicant_params.timeline_file = optarg;
+			break;
+		case OPT_TIMELINE_MARKER:
+			supplicant_params.timeline_marker = true;
+			break;
+		case OPT_WATCHDOG:
+			if (!parse_uint(optarg, &supplicant_params.watchdog_ms))
+				return usage(EXIT_FAILURE);
+			break;
+		case OPT_WATCHDOG_SLOWEST:
+			if (!parse_size(optarg,
+					&supplicant_params.watchdog_slowest))
+				return usage(EXIT_FAILURE);
+			break;
+		case OPT_TA_CACHE_SIZE:
+			if (!parse_size(optarg,
+					&supplicant_params.ta_cache_max_bytes))
+				return usage(EXIT_FAILURE);
+			break;
+		case OPT_TA_BUNDLE:
+			supplicant_params.ta_bundle_file = optarg;
+			break;
+		case OPT_TA_PREFETCH:
+			supplicant_params.ta_prefetch = true;
+			supplicant_params.ta_prefetch_list = optarg;
+			break;
+		case OPT_TA_PREFETCH_ALL:
+			supplicant_params.ta_prefetch = true;
+			supplicant_params.ta_prefetch_list = NULL;
+			break;
+		default:
+			return usage(EXIT_FAILURE);
+		}
+	}
+
+	if (argc - optind > 1)
+		return usage(EXIT_FAILURE);
+
+	if (!supplicant_params.min_threads ||
+	    !supplicant_params.standby_threads ||
+	    (supplicant_params.max_threads &&
+	     supplicant_params.max_threads < supplicant_params.min_threads)) {
+		EMSG("invalid thread pool configuration");
+		return usage(EXIT_FAILURE);
+	}
+
+	if (lane_init(supplicant_params.max_threads))
+		return usage(EXIT_FAILURE);
+
+	if (!block_watchdog_signal())
+		exit(EXIT_FAILURE);
+
+	if (supplicant_params.ta_bundle_file &&
+	    ta_bundle_open(supplicant_params.ta_bundle_file)) {
+		EMSG("failed to open TA bundle \"%s\"",
+		     supplicant_params.ta_bundle_file);
+		exit(EXIT_FAILURE);
+	}
+
+	if (supplicant_params.fs_migrate) {
+		if (!strcmp(supplicant_params.fs_backend, "dir"))
+			return usage(EXIT_FAILURE);
+		if (tee_supp_fs_migrate())
+			exit(EXIT_FAILURE);
+		return EXIT_SUCCESS;
+	}
+
+	/* Power cuts are simulated for the syscalls of the directory layout */
+	if (supplicant_params.fs_powercut &&
+	    (!supplicant_params.replay_file || supplicant_params.fs_io_uring ||
+	     supplicant_params.fs_defrag_secs ||
+	     strcmp(supplicant_params.fs_backend, "dir")))
 		return usage(EXIT_FAILURE);
 
-	for (i = 1; i < argc; i++) {
-		if (!strcmp(argv[i], "-d"))
-			daemonize = true;
-		else if (!strcmp(argv[i], "-h"))
-			return usage(EXIT_SUCCESS);
-		else
-			dev = argv[i];
+	if (supplicant_params.replay_file) {
+		if (supplicant_params.capture_file || daemonize ||
+		    fake_tee_enabled() || optind < argc)
+			return usage(EXIT_FAILURE);
+		ta_dir = "optee_armtz";
+		if (!start_timeline())
+			exit(EXIT_FAILURE);
+		stats_add_provider(tee_supp_fs_print_stats, NULL);
+		if (capture_replay(supplicant_params.replay_file,
+				   replay_dispatch))
+			exit(EXIT_FAILURE);
+		if (supplicant_params.fs_powercut && fs_powercut_report(stdout))
+			exit(EXIT_FAILURE);
+		return EXIT_SUCCESS;
 	}
 
+	if (optind < argc)
+		dev = argv[optind];
+	else if (fake_tee_enabled())
+		dev = "fake-tee";
+
 	if (dev) {
 		arg.fd = open_dev(dev, &arg.gen_caps);
 		if (arg.fd < 0) {
-			EMSG("failed to open \"%s\"", argv[1]);
+			EMSG("failed to open \"%s\"", dev);
 			exit(EXIT_FAILURE);
 		}
 	} else {
@@ -706,11 +1851,39 @@ int main(int argc, char *argv[])
 		}
 	}
 
+	if (supplicant_params.capture_file &&
+	    capture_open(supplicant_params.capture_file)) {
+		EMSG("failed to capture to \"%s\"",
+		     supplicant_params.capture_file);
+		exit(EXIT_FAILURE);
+	}
+
 	if (daemonize && daemon(0, 0) < 0) {
 		EMSG("daemon(): %s", strerror(errno));
 		exit(EXIT_FAILURE);
 	}
 
+	if (!start_timeline() || !start_watchdog() || !start_ta_prefetch() ||
+	    !start_shm_pool_trim())
+		exit(EXIT_FAILURE);
+
+	if (!init_thread_pool(&arg)) {
+		EMSG("failed to start threads");
+		exit(EXIT_FAILURE);
+	}
+
+	if (supplicant_params.stats_file) {
+		stats_add_provider(print_stats, &arg);
+		stats_add_provider(lane_print_stats, NULL);
+		stats_add_provider(tee_supp_fs_print_stats, NULL);
+		if (stats_start(supplicant_params.stats_file,
+				supplicant_params.stats_interval)) {
+			EMSG("failed to start writing \"%s\"",
+			     supplicant_params.stats_file);
+			exit(EXIT_FAILURE);
+		}
+	}
+
 	while (!arg.abort) {
 		if (!process_one_request(&arg))
 			arg.abort = true;
@@ -767,10 +1940,50 @@ void *tee_supp_param_to_va(struct tee_ioctl_param *param)
 	return (uint8_t *)tshm->p + MEMREF_SHM_OFFS(param);
 }
 
-void tee_supp_mutex_lock(pthread_mutex_t *mu)
+void *tee_supp_local_shm(int id, size_t size)
+{
+	struct tee_shm *tshm = pop_tshm(id);
+	void *p = NULL;
+
+	if (!tshm) {
+		tshm = calloc(1, sizeof(*tshm));
+		if (!tshm)
+			return NULL;
+		tshm->id = id;
+		tshm->fd = -1;
+		tshm->registered = true;
+	}
+
+	if (size > tshm->size) {
+		p = realloc(tshm->p, size);
+		if (!p) {
+			push_tshm(tshm);
+			return NULL;
+		}
+		tshm->p = p;
+		tshm->size = size;
+		tshm->alloc_size = size;
+	}
+
+	push_tshm(tshm);
+	return tshm->p;
+}
+
+void tee_supp_mutex_lock_named(pthread_mutex_t *mu, const char *name)
 {
-	int e = pthread_mutex_lock(mu);
+	uint64_t start = 0;
+	int e = 0;
 
+	if (name && timeline_enabled()) {
+		e = pthread_mutex_trylock(mu);
+		if (e != EBUSY)
+			goto out;
+		start = timeline_begin(name);
+	}
+
+	e = pthread_mutex_lock(mu);
+	timeline_end("lock", name, start);
+out:
 	if (e) {
 		EMSG("pthread_mutex_lock: %s", strerror(e));
 		EMSG("terminating...");
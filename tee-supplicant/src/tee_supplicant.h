@@ -29,6 +29,7 @@
 #define TEE_SUPPLICANT_H
 
 #include <stdbool.h>
+#include <stddef.h>
 #include <pthread.h>
 
 /* Helpers to access memref parts of a struct tee_ioctl_param */
@@ -36,13 +37,155 @@
 #define MEMREF_SHM_OFFS(p)	((p)->a)
 #define MEMREF_SIZE(p)		((p)->b)
 
+/* Default limits of the pool of freed shared memory buffers */
+#ifndef TEE_SUPP_SHM_POOL_MAX_BYTES
+#define TEE_SUPP_SHM_POOL_MAX_BYTES	(4 * 1024 * 1024)
+#endif
+#ifndef TEE_SUPP_SHM_POOL_MAX_PER_CLASS
+#define TEE_SUPP_SHM_POOL_MAX_PER_CLASS	16
+#endif
+#ifndef TEE_SUPP_SHM_POOL_IDLE_SECS
+#define TEE_SUPP_SHM_POOL_IDLE_SECS	10
+#endif
+
+/*
+ * Default configuration of the pool of threads serving requests. The pool
+ * is unbounded unless limited with --max-threads, as a limit makes secure
+ * threads wait for a supplicant thread to free up. A stack size of 0 keeps
+ * the system default, integrators with many threads can opt in to smaller
+ * stacks with --thread-stack-size.
+ */
+#ifndef TEE_SUPP_MIN_THREADS
+#define TEE_SUPP_MIN_THREADS		1
+#endif
+#ifndef TEE_SUPP_MAX_THREADS
+#define TEE_SUPP_MAX_THREADS		0
+#endif
+#ifndef TEE_SUPP_STANDBY_THREADS
+#define TEE_SUPP_STANDBY_THREADS	1
+#endif
+#ifndef TEE_SUPP_THREAD_STACK_SIZE
+#define TEE_SUPP_THREAD_STACK_SIZE	0
+#endif
+#ifndef TEE_SUPP_THREAD_IDLE_SECS
+#define TEE_SUPP_THREAD_IDLE_SECS	30
+#endif
+
+/* Default period of rewriting the stats file */
+#ifndef TEE_SUPP_STATS_INTERVAL_SECS
+#define TEE_SUPP_STATS_INTERVAL_SECS	10
+#endif
+
+/*
+ * Default configuration of the watchdog logging slow requests, it's off
+ * unless enabled with --watchdog so SIGUSR1 keeps its default action.
+ */
+#ifndef TEE_SUPP_WATCHDOG_MS
+#define TEE_SUPP_WATCHDOG_MS		0
+#endif
+#ifndef TEE_SUPP_WATCHDOG_SLOWEST
+#define TEE_SUPP_WATCHDOG_SLOWEST	16
+#endif
+
+/*
+ * Default number of closed secure storage files kept open for reuse. The
+ * cache is opt-in with --fs-fd-cache.
+ */
+#ifndef TEE_SUPP_FS_FD_CACHE_SIZE
+#define TEE_SUPP_FS_FD_CACHE_SIZE	0
+#endif
+
+/*
+ * Default max bytes of secure storage file blocks cached in memory. The
+ * cache is opt-in with --fs-block-cache.
+ */
+#ifndef TEE_SUPP_FS_BLOCK_CACHE_SIZE
+#define TEE_SUPP_FS_BLOCK_CACHE_SIZE	0
+#endif
+
+/* Default chunk secure storage files are preallocated in, 0 for none */
+#ifndef TEE_SUPP_FS_PREALLOC_SIZE
+#define TEE_SUPP_FS_PREALLOC_SIZE	0
+#endif
+
+/* Default period of the secure storage defrag pass, 0 for none */
+#ifndef TEE_SUPP_FS_DEFRAG_SECS
+#define TEE_SUPP_FS_DEFRAG_SECS		0
+#endif
+
+/* Default secure storage layout, "dir" or an alternative fs_backend */
+#ifndef TEE_SUPP_FS_BACKEND
+#define TEE_SUPP_FS_BACKEND		"dir"
+#endif
+
+/* Default size a new --fs-backend container is preallocated to */
+#ifndef TEE_SUPP_FS_CONTAINER_SIZE
+#define TEE_SUPP_FS_CONTAINER_SIZE	(16 * 1024 * 1024)
+#endif
+
+/* Default max bytes of TA binaries cached in memory */
+#ifndef TEE_SUPP_TA_CACHE_MAX_BYTES
+#define TEE_SUPP_TA_CACHE_MAX_BYTES	(8 * 1024 * 1024)
+#endif
+
+/* Run time configuration, set from the command line */
+struct tee_supplicant_params {
+	const char *fs_parent_path;
+	bool fs_deferred_sync;
+	size_t fs_fd_cache_size;
+	size_t fs_block_cache_size;
+	size_t fs_prealloc_size;
+	unsigned int fs_defrag_secs;
+	bool fs_io_uring;
+	const char *fs_backend;
+	const char *fs_container;
+	size_t fs_container_size;
+	bool fs_migrate;
+	bool fs_powercut;
+	size_t shm_pool_max_bytes;
+	size_t shm_pool_max_per_class;
+	unsigned int shm_pool_idle_secs;
+	size_t min_threads;
+	size_t max_threads;
+	size_t standby_threads;
+	size_t thread_stack_size;
+	unsigned int thread_idle_secs;
+	const char *stats_file;
+	unsigned int stats_interval;
+	const char *capture_file;
+	const char *replay_file;
+	const char *timeline_file;
+	bool timeline_marker;
+	unsigned int watchdog_ms;
+	size_t watchdog_slowest;
+	size_t ta_cache_max_bytes;
+	const char *ta_bundle_file;
+	bool ta_prefetch;
+	const char *ta_prefetch_list;
+};
+
+extern struct tee_supplicant_params supplicant_params;
+
 struct tee_ioctl_param;
 
 bool tee_supp_param_is_memref(struct tee_ioctl_param *param);
 bool tee_supp_param_is_value(struct tee_ioctl_param *param);
 void *tee_supp_param_to_va(struct tee_ioctl_param *param);
 
-void tee_supp_mutex_lock(pthread_mutex_t *mu);
+/*
+ * Returns the start of a process local shm object with the supplied id
+ * and at least @size bytes, creating or growing it as needed. Only used
+ * when no TEE driver is involved, such as when replaying a capture.
+ */
+void *tee_supp_local_shm(int id, size_t size);
+
+/*
+ * Locks @mu, recording the wait in the timeline if it was contended. The
+ * expression naming the mutex is used as name of the event, a NULL name
+ * is never recorded.
+ */
+void tee_supp_mutex_lock_named(pthread_mutex_t *mu, const char *name);
+#define tee_supp_mutex_lock(mu)	tee_supp_mutex_lock_named((mu), #mu)
 void tee_supp_mutex_unlock(pthread_mutex_t *mu);
 
 #endif /*TEE_SUPPLICANT_H*/
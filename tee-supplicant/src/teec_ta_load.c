@@ -25,6 +25,7 @@
  * POSSIBILITY OF SUCH DAMAGE.
  */
 #include <dirent.h>
+#include <errno.h>
 #include <fcntl.h>
 #include <stdbool.h>
 #include <stdio.h>
@@ -32,9 +33,22 @@
 #include <stdlib.h>
 #include <string.h>
 #include <pthread.h>
+#include <sys/inotify.h>
+#include <sys/mman.h>
+#include <sys/queue.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#ifdef CFG_TA_ZSTD
+#include <zstd.h>
+#endif
+#ifdef CFG_TA_LZ4
+#include <lz4frame.h>
+#endif
 
+#include <ta_bundle.h>
 #include <teec_trace.h>
 #include <teec_ta_load.h>
+#include <tee_supplicant.h>
 
 /*
  * Attempt to first load TAs from a writable directory.  This is
@@ -63,6 +77,307 @@ struct tee_rpc_cmd {
 	int fd;
 };
 
+/*
+ * TA images are cached by UUID, along with TAs known to be missing, so
+ * repeated loads of the same TA are served from memory. The first load
+ * reads the file straight into the caller's buffer, without the cache
+ * mutex held, and the entry is copied from there. An entry is only
+ * cached if the directory it was looked up in is watched with inotify.
+ * Any change in a watched directory flushes the whole cache, TAs are
+ * rarely installed. Pending events are drained before each lookup and
+ * before an entry read from a file is inserted, an entry read while the
+ * cache was flushed is dropped. So an entry is never older than the
+ * last change made before the lookup.
+ */
+#define TA_CACHE_NUM_DIRS	2
+
+struct ta_cache_entry {
+	TEEC_UUID uuid;
+	struct ta_cache_dir *dir;
+	bool found;
+	size_t size;
+	void *data;
+	TAILQ_ENTRY(ta_cache_entry) link;
+};
+
+struct ta_cache_dir {
+	const char *prefix;
+	char dev_path[PATH_MAX];
+	int wd;		/* watch of prefix/dev_path, -1 if missing */
+	int parent_wd;	/* watch of prefix, catches dev_path being made */
+};
+
+struct ta_cache {
+	pthread_mutex_t mutex;
+	bool initialized;
+	int ifd;
+	size_t max_bytes;
+	size_t bytes;
+	unsigned int generation;
+	struct ta_cache_dir dirs[TA_CACHE_NUM_DIRS];
+	size_t num_dirs;
+	TAILQ_HEAD(ta_cache_head, ta_cache_entry) lru;
+};
+
+static struct ta_cache ta_cache = {
+	.mutex = PTHREAD_MUTEX_INITIALIZER,
+	.ifd = -1,
+	.lru = TAILQ_HEAD_INITIALIZER(ta_cache.lru),
+};
+
+enum ta_format {
+	TA_FORMAT_RAW,
+	TA_FORMAT_ZSTD,
+	TA_FORMAT_LZ4,
+};
+
+/*
+ * TA binaries may be compressed on slow storage, then the size of the
+ * TA is taken from the content size field of the frame header so
+ * reporting it doesn't need any decompression. Files must be compressed
+ * with the content size included, as done by "zstd" and by
+ * "lz4 --content-size".
+ */
+static const struct {
+	const char *suffix;
+	enum ta_format fmt;
+} ta_formats[] = {
+	{ ".ta", TA_FORMAT_RAW },
+#ifdef CFG_TA_ZSTD
+	{ ".ta.zst", TA_FORMAT_ZSTD },
+#endif
+#ifdef CFG_TA_LZ4
+	{ ".ta.lz4", TA_FORMAT_LZ4 },
+#endif
+};
+
+struct ta_file {
+	int fd;
+	enum ta_format fmt;
+	size_t file_size;
+	size_t size;	/* Size of the TA, once decompressed */
+};
+
+static int get_ta_size(struct ta_file *f)
+{
+	uint8_t hdr[32] = { 0 };
+	ssize_t n = 0;
+
+	if (f->fmt == TA_FORMAT_RAW) {
+		f->size = f->file_size;
+		return 0;
+	}
+
+	n = pread(f->fd, hdr, sizeof(hdr), 0);
+	if (n <= 0)
+		return -1;
+
+#ifdef CFG_TA_ZSTD
+	if (f->fmt == TA_FORMAT_ZSTD) {
+		unsigned long long sz = ZSTD_getFrameContentSize(hdr, n);
+
+		if (sz == ZSTD_CONTENTSIZE_UNKNOWN ||
+		    sz == ZSTD_CONTENTSIZE_ERROR || sz > SIZE_MAX)
+			return -1;
+		f->size = sz;
+		return 0;
+	}
+#endif
+#ifdef CFG_TA_LZ4
+	if (f->fmt == TA_FORMAT_LZ4) {
+		LZ4F_dctx *dctx = NULL;
+		LZ4F_frameInfo_t info;
+		size_t hdr_size = n;
+		size_t res = 0;
+
+		memset(&info, 0, sizeof(info));
+		if (LZ4F_isError(LZ4F_createDecompressionContext(&dctx,
+								 LZ4F_VERSION)))
+			return -1;
+		res = LZ4F_getFrameInfo(dctx, &info, hdr, &hdr_size);
+		LZ4F_freeDecompressionContext(dctx);
+		if (LZ4F_isError(res) || !info.contentSize ||
+		    info.contentSize > SIZE_MAX)
+			return -1;
+		f->size = info.contentSize;
+		return 0;
+	}
+#endif
+
+	return -1;
+}
+
+/*
+ * Opens the TA binary named after @destination in @prefix/@dev_path.
+ * Returns -1 if it's not there.
+ */
+static int open_secure_module(const char *prefix, const char *dev_path,
+			      const TEEC_UUID *destination, struct ta_file *f)
+{
+	char fname[PATH_MAX] = { 0 };
+	struct stat st;
+	bool first_try = true;
+	size_t i = 0;
+	int n = 0;
+
+	/*
+	 * We expect the TA binary to be named after the UUID as per RFC4122,
+	 * that is: xxxxxxxx-xxxx-xxxx-xxxx-xxxxxxxxxxxx.ta
+	 * If the file cannot be open, try the deprecated format:
+	 * xxxxxxxx-xxxx-xxxx-xxxxxxxxxxxxxxxx.ta
+	 */
+again:
+	for (i = 0; i < sizeof(ta_formats) / sizeof(ta_formats[0]); i++) {
+		n = snprintf(fname, PATH_MAX,
+			     "%s/%s/%08x-%04x-%04x-%02x%02x%s%02x%02x%02x%02x%02x%02x%s",
+			     prefix, dev_path,
+			     destination->timeLow,
+			     destination->timeMid,
+			     destination->timeHiAndVersion,
+			     destination->clockSeqAndNode[0],
+			     destination->clockSeqAndNode[1],
+			     first_try ? "-" : "",
+			     destination->clockSeqAndNode[2],
+			     destination->clockSeqAndNode[3],
+			     destination->clockSeqAndNode[4],
+			     destination->clockSeqAndNode[5],
+			     destination->clockSeqAndNode[6],
+			     destination->clockSeqAndNode[7],
+			     ta_formats[i].suffix);
+
+		DMSG("Attempt to load %s", fname);
+
+		if ((n < 0) || (n >= PATH_MAX)) {
+			EMSG("wrong TA path [%s]", fname);
+			return -1;
+		}
+
+		f->fd = open(fname, O_RDONLY | O_CLOEXEC);
+		if (f->fd >= 0)
+			break;
+		DMSG("failed to open the ta %s TA-file", fname);
+	}
+
+	if (f->fd < 0) {
+		if (first_try) {
+			first_try = false;
+			goto again;
+		}
+		return -1;
+	}
+
+	memset(&st, 0, sizeof(st));
+	if (fstat(f->fd, &st) || !S_ISREG(st.st_mode))
+		goto err;
+	f->fmt = ta_formats[i].fmt;
+	f->file_size = st.st_size;
+	if (get_ta_size(f)) {
+		EMSG("%s: no valid content size", fname);
+		goto err;
+	}
+
+	return 0;
+err:
+	close(f->fd);
+	f->fd = -1;
+	return -1;
+}
+
+static int decompress(struct ta_file *f, const void *src, void *dst)
+{
+#ifdef CFG_TA_ZSTD
+	if (f->fmt == TA_FORMAT_ZSTD) {
+		size_t res = ZSTD_decompress(dst, f->size, src, f->file_size);
+
+		if (ZSTD_isError(res) || res != f->size)
+			return -1;
+		return 0;
+	}
+#endif
+#ifdef CFG_TA_LZ4
+	if (f->fmt == TA_FORMAT_LZ4) {
+		LZ4F_dctx *dctx = NULL;
+		size_t src_offs = 0;
+		size_t dst_offs = 0;
+		size_t src_sz = 0;
+		size_t dst_sz = 0;
+		size_t res = 1;
+
+		if (LZ4F_isError(LZ4F_createDecompressionContext(&dctx,
+								 LZ4F_VERSION)))
+			return -1;
+		while (res && src_offs < f->file_size) {
+			src_sz = f->file_size - src_offs;
+			dst_sz = f->size - dst_offs;
+			res = LZ4F_decompress(dctx, (uint8_t *)dst + dst_offs,
+					      &dst_sz,
+					      (const uint8_t *)src + src_offs,
+					      &src_sz, NULL);
+			if (LZ4F_isError(res) || (!src_sz && !dst_sz))
+				break;
+			src_offs += src_sz;
+			dst_offs += dst_sz;
+		}
+		LZ4F_freeDecompressionContext(dctx);
+		if (res || dst_offs != f->size)
+			return -1;
+		return 0;
+	}
+#endif
+	(void)f;
+	(void)src;
+	(void)dst;
+	return -1;
+}
+
+/* Reads @size bytes from the start of @fd, fails if the file is shorter */
+static int read_file(int fd, void *dst, size_t size)
+{
+	uint8_t *p = dst;
+	ssize_t n = 0;
+	off_t offs = 0;
+
+	while (size) {
+		n = pread(fd, p, size, offs);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return -1;
+		p += n;
+		offs += n;
+		size -= n;
+	}
+
+	return 0;
+}
+
+/*
+ * Copies the TA binary opened as @f to @dst, which must hold f->size
+ * bytes. An uncompressed file is read straight into @dst, a compressed
+ * one into a temporary buffer it's decompressed from. The file isn't
+ * mapped: if it's truncated or rewritten in place while it's read, as
+ * with a cp into TEEC_TEST_LOAD_PATH, the load fails instead of the
+ * supplicant being killed by SIGBUS.
+ */
+static int read_secure_module(struct ta_file *f, void *dst)
+{
+	void *buf = NULL;
+	int res = 0;
+
+	if (f->fmt == TA_FORMAT_RAW)
+		return read_file(f->fd, dst, f->file_size);
+
+	buf = malloc(f->file_size);
+	if (!buf)
+		return -1;
+	res = read_file(f->fd, buf, f->file_size);
+	if (!res)
+		res = decompress(f, buf, dst);
+	free(buf);
+
+	return res;
+}
+
 /*
  * Based on the uuid this function will try to find a TA-binary on the
  * filesystem and return it back to the caller in the parameter ta.
@@ -81,64 +396,17 @@ static int try_load_secure_module(const char* prefix,
 				  const TEEC_UUID *destination, void *ta,
 				  size_t *ta_size)
 {
-	char fname[PATH_MAX] = { 0 };
-	FILE *file = NULL;
-	bool first_try = true;
-	size_t s = 0;
-	int n = 0;
+	struct ta_file f = { .fd = -1 };
 
 	if (!ta_size || !destination) {
 		printf("wrong inparameter to TEECI_LoadSecureModule\n");
 		return TA_BINARY_NOT_FOUND;
 	}
 
-	/*
-	 * We expect the TA binary to be named after the UUID as per RFC4122,
-	 * that is: xxxxxxxx-xxxx-xxxx-xxxx-xxxxxxxxxxxx.ta
-	 * If the file cannot be open, try the deprecated format:
-	 * xxxxxxxx-xxxx-xxxx-xxxxxxxxxxxxxxxx.ta
-	 */
-again:
-	n = snprintf(fname, PATH_MAX,
-		     "%s/%s/%08x-%04x-%04x-%02x%02x%s%02x%02x%02x%02x%02x%02x.ta",
-		     prefix, dev_path,
-		     destination->timeLow,
-		     destination->timeMid,
-		     destination->timeHiAndVersion,
-		     destination->clockSeqAndNode[0],
-		     destination->clockSeqAndNode[1],
-		     first_try ? "-" : "",
-		     destination->clockSeqAndNode[2],
-		     destination->clockSeqAndNode[3],
-		     destination->clockSeqAndNode[4],
-		     destination->clockSeqAndNode[5],
-		     destination->clockSeqAndNode[6],
-		     destination->clockSeqAndNode[7]);
-
-	DMSG("Attempt to load %s", fname);
-
-	if ((n < 0) || (n >= PATH_MAX)) {
-		EMSG("wrong TA path [%s]", fname);
+	if (open_secure_module(prefix, dev_path, destination, &f))
 		return TA_BINARY_NOT_FOUND;
-	}
 
-	file = fopen(fname, "r");
-	if (file == NULL) {
-		DMSG("failed to open the ta %s TA-file", fname);
-		if (first_try) {
-			first_try = false;
-			goto again;
-		}
-		return TA_BINARY_NOT_FOUND;
-	}
-
-	if (fseek(file, 0, SEEK_END) != 0) {
-		fclose(file);
-		return TA_BINARY_NOT_FOUND;
-	}
-
-	s = ftell(file);
-	if (s > *ta_size || !ta) {
+	if (f.size > *ta_size || !ta) {
 		/*
 		 * Buffer isn't large enough, return the required size to
 		 * let the caller increase the size of the buffer and try
@@ -147,36 +415,592 @@ again:
 		goto out;
 	}
 
-	if (fseek(file, 0, SEEK_SET) != 0) {
-		fclose(file);
+	if (read_secure_module(&f, ta)) {
+		printf("error reading TA file\n");
+		close(f.fd);
 		return TA_BINARY_NOT_FOUND;
 	}
 
-	if (s != fread(ta, 1, s, file)) {
-		printf("error fread TA file\n");
-		fclose(file);
-		return TA_BINARY_NOT_FOUND;
+out:
+	*ta_size = f.size;
+	close(f.fd);
+	return TA_BINARY_FOUND;
+}
+
+static size_t ta_cache_entry_bytes(struct ta_cache_entry *e)
+{
+	return sizeof(*e) + e->size;
+}
+
+static void ta_cache_remove(struct ta_cache_entry *e)
+{
+	TAILQ_REMOVE(&ta_cache.lru, e, link);
+	ta_cache.bytes -= ta_cache_entry_bytes(e);
+	free(e->data);
+	free(e);
+}
+
+static void ta_cache_flush(void)
+{
+	while (!TAILQ_EMPTY(&ta_cache.lru))
+		ta_cache_remove(TAILQ_FIRST(&ta_cache.lru));
+	ta_cache.generation++;
+}
+
+static void ta_cache_watch_dir(struct ta_cache_dir *dir)
+{
+	char path[PATH_MAX] = { 0 };
+	int n = 0;
+
+	n = snprintf(path, sizeof(path), "%s/%s", dir->prefix, dir->dev_path);
+	if (n < 0 || (size_t)n >= sizeof(path))
+		return;
+
+	dir->wd = inotify_add_watch(ta_cache.ifd, path,
+				    IN_CREATE | IN_DELETE | IN_MODIFY |
+				    IN_CLOSE_WRITE | IN_MOVED_FROM |
+				    IN_MOVED_TO | IN_ATTRIB | IN_DELETE_SELF |
+				    IN_MOVE_SELF | IN_ONLYDIR);
+	if (dir->wd < 0 && errno != ENOENT)
+		DMSG("inotify_add_watch(\"%s\"): %s", path, strerror(errno));
+}
+
+static void ta_cache_event(struct inotify_event *ev)
+{
+	struct ta_cache_dir *dir = NULL;
+	size_t n = 0;
+
+	if (ev->mask & IN_Q_OVERFLOW) {
+		ta_cache_flush();
+		return;
+	}
+
+	for (n = 0; n < ta_cache.num_dirs; n++) {
+		dir = ta_cache.dirs + n;
+		if (ev->wd == dir->wd) {
+			ta_cache_flush();
+			if (ev->mask & (IN_IGNORED | IN_DELETE_SELF |
+					IN_MOVE_SELF))
+				dir->wd = -1;
+		} else if (ev->wd == dir->parent_wd && ev->len &&
+			   !strcmp(ev->name, dir->dev_path)) {
+			/* The TA directory itself was made, moved or removed */
+			ta_cache_flush();
+			if (dir->wd < 0 &&
+			    (ev->mask & (IN_CREATE | IN_MOVED_TO)))
+				ta_cache_watch_dir(dir);
+		} else if (ev->wd == dir->parent_wd &&
+			   (ev->mask & IN_IGNORED)) {
+			ta_cache_flush();
+			dir->parent_wd = -1;
+		}
 	}
+}
+
+/* Called with ta_cache.mutex held */
+static void ta_cache_drain_events(void)
+{
+	char buf[4096]
+		__attribute__((aligned(__alignof__(struct inotify_event))));
+	struct inotify_event *ev = NULL;
+	ssize_t len = 0;
+	char *p = NULL;
+
+	while (true) {
+		len = read(ta_cache.ifd, buf, sizeof(buf));
+		if (len <= 0)
+			return;
+
+		for (p = buf; p < buf + len; p += sizeof(*ev) + ev->len) {
+			ev = (struct inotify_event *)p;
+			ta_cache_event(ev);
+		}
+	}
+}
+
+/* Called with ta_cache.mutex held, returns false if caching is disabled */
+static bool ta_cache_init(void)
+{
+	if (ta_cache.initialized)
+		return ta_cache.ifd >= 0;
+
+	ta_cache.initialized = true;
+	ta_cache.max_bytes = supplicant_params.ta_cache_max_bytes;
+	if (!ta_cache.max_bytes)
+		return false;
+
+	ta_cache.ifd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (ta_cache.ifd < 0) {
+		IMSG("inotify_init1: %s, TA cache disabled", strerror(errno));
+		return false;
+	}
+
+	return true;
+}
+
+/*
+ * Returns the watched directory, or NULL if lookups in @prefix/@dev_path
+ * can't be cached.
+ */
+static struct ta_cache_dir *ta_cache_get_dir(const char *prefix,
+					     const char *dev_path)
+{
+	struct ta_cache_dir *dir = NULL;
+	size_t n = 0;
+
+	for (n = 0; n < ta_cache.num_dirs; n++) {
+		dir = ta_cache.dirs + n;
+		if (dir->prefix == prefix && !strcmp(dir->dev_path, dev_path))
+			goto out;
+	}
+
+	if (ta_cache.num_dirs == TA_CACHE_NUM_DIRS ||
+	    strlen(dev_path) >= sizeof(dir->dev_path))
+		return NULL;
+
+	dir = ta_cache.dirs + ta_cache.num_dirs;
+	ta_cache.num_dirs++;
+	dir->prefix = prefix;
+	strcpy(dir->dev_path, dev_path);
+	dir->parent_wd = inotify_add_watch(ta_cache.ifd, prefix,
+					   IN_CREATE | IN_DELETE |
+					   IN_MOVED_FROM | IN_MOVED_TO |
+					   IN_ONLYDIR);
+	if (dir->parent_wd < 0)
+		DMSG("inotify_add_watch(\"%s\"): %s", prefix, strerror(errno));
+	ta_cache_watch_dir(dir);
 
 out:
-	*ta_size = s;
-	fclose(file);
+	/*
+	 * Without a watch of the directory, or of its parent while it's
+	 * missing, changes would go unnoticed.
+	 */
+	if (dir->wd < 0 && dir->parent_wd < 0)
+		return NULL;
+	return dir;
+}
+
+static struct ta_cache_entry *ta_cache_find(struct ta_cache_dir *dir,
+					    const TEEC_UUID *uuid)
+{
+	struct ta_cache_entry *e = NULL;
+
+	TAILQ_FOREACH(e, &ta_cache.lru, link)
+		if (e->dir == dir && !memcmp(&e->uuid, uuid, sizeof(*uuid)))
+			return e;
+
+	return NULL;
+}
+
+/*
+ * Inserts an entry for @uuid holding the @size bytes at @data, or
+ * telling that the TA is missing if !@found, unless the directory
+ * changed since @generation. The entry takes @data, it's freed if the
+ * entry isn't inserted. Another thread may have inserted the same TA
+ * meanwhile, then that entry is kept.
+ */
+static void ta_cache_insert(struct ta_cache_dir *dir, const TEEC_UUID *uuid,
+			    unsigned int generation, bool found, void *data,
+			    size_t size)
+{
+	struct ta_cache_entry *e = calloc(1, sizeof(*e));
+
+	if (!e)
+		goto err;
+	e->uuid = *uuid;
+	e->dir = dir;
+	e->found = found;
+	e->size = size;
+	e->data = data;
+	if (ta_cache_entry_bytes(e) > ta_cache.max_bytes)
+		goto err;
+
+	tee_supp_mutex_lock(&ta_cache.mutex);
+
+	/* Don't cache what may have changed while it was read */
+	ta_cache_drain_events();
+	if (generation != ta_cache.generation || ta_cache_find(dir, uuid)) {
+		tee_supp_mutex_unlock(&ta_cache.mutex);
+		goto err;
+	}
+
+	while (ta_cache.bytes + ta_cache_entry_bytes(e) > ta_cache.max_bytes)
+		ta_cache_remove(TAILQ_LAST(&ta_cache.lru, ta_cache_head));
+
+	TAILQ_INSERT_HEAD(&ta_cache.lru, e, link);
+	ta_cache.bytes += ta_cache_entry_bytes(e);
+
+	tee_supp_mutex_unlock(&ta_cache.mutex);
+	return;
+err:
+	free(e);
+	free(data);
+}
+
+/*
+ * Loads @uuid from its file on a cache miss. The TA is read straight
+ * into @ta and copied from there to the new cache entry, so the load
+ * itself doesn't go through the cache. A size query, with @ta NULL or
+ * too small, only opens the file and caches nothing but a missing TA.
+ * Called without ta_cache.mutex, so reading a large TA from cold storage
+ * doesn't hold up loads of other TAs. @generation is the generation of
+ * the cache when the lookup missed.
+ */
+static int ta_cache_miss(struct ta_cache_dir *dir, unsigned int generation,
+			 const TEEC_UUID *uuid, void *ta, size_t *ta_size)
+{
+	struct ta_file f = { .fd = -1 };
+	void *data = NULL;
+
+	if (open_secure_module(dir->prefix, dir->dev_path, uuid, &f)) {
+		ta_cache_insert(dir, uuid, generation, false, NULL, 0);
+		return TA_BINARY_NOT_FOUND;
+	}
+
+	if (!ta || f.size > *ta_size) {
+		*ta_size = f.size;
+		close(f.fd);
+		return TA_BINARY_FOUND;
+	}
+
+	if (read_secure_module(&f, ta)) {
+		EMSG("error reading TA file");
+		close(f.fd);
+		return TA_BINARY_NOT_FOUND;
+	}
+	close(f.fd);
+	*ta_size = f.size;
+
+	if (sizeof(struct ta_cache_entry) + f.size <= ta_cache.max_bytes) {
+		data = malloc(f.size ? f.size : 1);
+		if (data) {
+			memcpy(data, ta, f.size);
+			ta_cache_insert(dir, uuid, generation, true, data,
+					f.size);
+		}
+	}
+
 	return TA_BINARY_FOUND;
 }
 
+/*
+ * Like try_load_secure_module() but served from the cache when possible.
+ * Returns -2 if the cache can't be used.
+ */
+static int ta_cache_load(const char *prefix, const char *dev_path,
+			 const TEEC_UUID *destination, void *ta,
+			 size_t *ta_size)
+{
+	struct ta_cache_entry *e = NULL;
+	struct ta_cache_dir *dir = NULL;
+	unsigned int generation = 0;
+	int res = -2;
+
+	if (!ta_size || !destination)
+		return -2;
+
+	tee_supp_mutex_lock(&ta_cache.mutex);
+
+	if (!ta_cache_init())
+		goto out;
+	ta_cache_drain_events();
+
+	dir = ta_cache_get_dir(prefix, dev_path);
+	if (!dir)
+		goto out;
+
+	e = ta_cache_find(dir, destination);
+	if (!e) {
+		generation = ta_cache.generation;
+		tee_supp_mutex_unlock(&ta_cache.mutex);
+		return ta_cache_miss(dir, generation, destination, ta,
+				     ta_size);
+	}
+	TAILQ_REMOVE(&ta_cache.lru, e, link);
+	TAILQ_INSERT_HEAD(&ta_cache.lru, e, link);
+
+	if (!e->found) {
+		res = TA_BINARY_NOT_FOUND;
+		goto out;
+	}
+
+	if (ta && e->size <= *ta_size)
+		memcpy(ta, e->data, e->size);
+	*ta_size = e->size;
+	res = TA_BINARY_FOUND;
+out:
+	tee_supp_mutex_unlock(&ta_cache.mutex);
+	return res;
+}
+
+static int load_secure_module(const char *prefix, const char *dev_path,
+			      const TEEC_UUID *destination, void *ta,
+			      size_t *ta_size)
+{
+	int res = ta_cache_load(prefix, dev_path, destination, ta, ta_size);
+
+	if (res != -2)
+		return res;
+
+	return try_load_secure_module(prefix, dev_path, destination, ta,
+				      ta_size);
+}
+
 int TEECI_LoadSecureModule(const char* dev_path,
 			   const TEEC_UUID *destination, void *ta,
 			   size_t *ta_size)
 {
-#ifdef TEEC_TEST_LOAD_PATH
 	int res = 0;
 
-	res = try_load_secure_module(TEEC_TEST_LOAD_PATH,
-				     dev_path, destination, ta, ta_size);
+#ifdef TEEC_TEST_LOAD_PATH
+	res = load_secure_module(TEEC_TEST_LOAD_PATH,
+				 dev_path, destination, ta, ta_size);
+	if (res != TA_BINARY_NOT_FOUND)
+		return res;
+#endif
+
+	if (!ta_size || !destination)
+		return TA_BINARY_NOT_FOUND;
+
+	/* Loose files in TEEC_LOAD_PATH are a fallback for the bundle */
+	res = ta_bundle_load(destination, ta, ta_size);
 	if (res != TA_BINARY_NOT_FOUND)
 		return res;
+
+	return load_secure_module(TEEC_LOAD_PATH,
+				  dev_path, destination, ta, ta_size);
+}
+
+/*
+ * Reads @uuid into the TA cache unless it's there already. As for a
+ * load, ta_cache.mutex is only held for the lookup and the insertion so
+ * RPCs loading TAs meanwhile aren't held up. Adds the size of the file
+ * to *@bytes. Returns -2 if the TA can't be cached.
+ */
+static int ta_cache_prefetch(const char *prefix, const char *dev_path,
+			     const TEEC_UUID *uuid, size_t *bytes)
+{
+	struct ta_cache_entry *e = NULL;
+	struct ta_cache_dir *dir = NULL;
+	struct ta_file f = { .fd = -1 };
+	unsigned int generation = 0;
+	void *data = NULL;
+	int res = -2;
+
+	tee_supp_mutex_lock(&ta_cache.mutex);
+	if (!ta_cache_init())
+		goto out;
+	ta_cache_drain_events();
+	dir = ta_cache_get_dir(prefix, dev_path);
+	if (!dir)
+		goto out;
+	e = ta_cache_find(dir, uuid);
+	if (e) {
+		if (e->found) {
+			*bytes += e->size;
+			res = TA_BINARY_FOUND;
+		} else {
+			res = TA_BINARY_NOT_FOUND;
+		}
+		goto out;
+	}
+	generation = ta_cache.generation;
+	tee_supp_mutex_unlock(&ta_cache.mutex);
+
+	if (open_secure_module(prefix, dev_path, uuid, &f)) {
+		ta_cache_insert(dir, uuid, generation, false, NULL, 0);
+		return TA_BINARY_NOT_FOUND;
+	}
+
+	if (sizeof(struct ta_cache_entry) + f.size > ta_cache.max_bytes) {
+		close(f.fd);
+		return -2;
+	}
+
+	data = malloc(f.size ? f.size : 1);
+	if (!data || read_secure_module(&f, data)) {
+		free(data);
+		close(f.fd);
+		return -2;
+	}
+	*bytes += f.file_size;
+	close(f.fd);
+
+	ta_cache_insert(dir, uuid, generation, true, data, f.size);
+	return TA_BINARY_FOUND;
+out:
+	tee_supp_mutex_unlock(&ta_cache.mutex);
+	return res;
+}
+
+/*
+ * Reads the TA file from storage into the TA cache if it's enabled and
+ * the TA fits, or else into the page cache. Adds the size of the file to
+ * *@bytes.
+ */
+static int prefetch_secure_module(const char *prefix, const char *dev_path,
+				  const TEEC_UUID *uuid, size_t *bytes)
+{
+	struct ta_file f = { .fd = -1 };
+	void *map = NULL;
+	int res = ta_cache_prefetch(prefix, dev_path, uuid, bytes);
+
+	if (res != -2)
+		return res;
+
+	if (open_secure_module(prefix, dev_path, uuid, &f))
+		return TA_BINARY_NOT_FOUND;
+
+	if (f.file_size) {
+		map = mmap(NULL, f.file_size, PROT_READ,
+			   MAP_PRIVATE | MAP_POPULATE, f.fd, 0);
+		if (map != MAP_FAILED)
+			munmap(map, f.file_size);
+		else
+			posix_fadvise(f.fd, 0, 0, POSIX_FADV_WILLNEED);
+	}
+	*bytes += f.file_size;
+	close(f.fd);
+
+	return TA_BINARY_FOUND;
+}
+
+/* Prefetches @uuid from where TEECI_LoadSecureModule() would load it */
+static int prefetch_uuid(const char *dev_path, const TEEC_UUID *uuid,
+			 size_t *bytes)
+{
+#ifdef TEEC_TEST_LOAD_PATH
+	if (prefetch_secure_module(TEEC_TEST_LOAD_PATH, dev_path, uuid,
+				   bytes) == TA_BINARY_FOUND)
+		return TA_BINARY_FOUND;
+#endif
+
+	if (ta_bundle_prefetch(uuid, bytes) == TA_BINARY_FOUND)
+		return TA_BINARY_FOUND;
+
+	return prefetch_secure_module(TEEC_LOAD_PATH, dev_path, uuid, bytes);
+}
+
+/*
+ * Parses a UUID in RFC4122 format, or in the deprecated format without
+ * the fourth '-', at the start of @str. Returns the number of characters
+ * parsed or 0.
+ */
+static size_t parse_uuid(const char *str, TEEC_UUID *uuid)
+{
+	uint8_t *c = uuid->clockSeqAndNode;
+	size_t len = strspn(str, "0123456789abcdefABCDEF-");
+	int n = 0;
+
+	if (len != 36 && len != 35)
+		return 0;
+
+	if (sscanf(str, "%8x-%4hx-%4hx-%2hhx%2hhx%n", &uuid->timeLow,
+		   &uuid->timeMid, &uuid->timeHiAndVersion, c, c + 1,
+		   &n) != 5 || n != 23)
+		return 0;
+	if ((len == 36) != (str[n] == '-'))
+		return 0;
+	if (len == 36)
+		n++;
+	if (sscanf(str + n, "%2hhx%2hhx%2hhx%2hhx%2hhx%2hhx", c + 2, c + 3,
+		   c + 4, c + 5, c + 6, c + 7) != 6)
+		return 0;
+
+	return len;
+}
+
+static size_t prefetch_list(const char *dev_path, const char *list,
+			    size_t *bytes)
+{
+	char line[128] = { 0 };
+	size_t num_tas = 0;
+	TEEC_UUID uuid;
+	FILE *f = NULL;
+	char *p = NULL;
+
+	memset(&uuid, 0, sizeof(uuid));
+
+	f = fopen(list, "r");
+	if (!f) {
+		EMSG("fopen(\"%s\"): %s", list, strerror(errno));
+		return 0;
+	}
+
+	while (fgets(line, sizeof(line), f)) {
+		p = line + strspn(line, " \t");
+		p[strcspn(p, "\r\n")] = '\0';
+		if (*p == '#' || !*p)
+			continue;
+		if (!parse_uuid(p, &uuid)) {
+			EMSG("%s: bad UUID \"%s\"", list, p);
+			continue;
+		}
+		if (prefetch_uuid(dev_path, &uuid, bytes) == TA_BINARY_FOUND)
+			num_tas++;
+		else
+			IMSG("%s: TA \"%.36s\" not found", list, p);
+	}
+
+	fclose(f);
+	return num_tas;
+}
+
+static size_t prefetch_dir(const char *prefix, const char *dev_path,
+			   size_t *bytes)
+{
+	char path[PATH_MAX] = { 0 };
+	struct dirent *de = NULL;
+	size_t num_tas = 0;
+	TEEC_UUID uuid;
+	DIR *dir = NULL;
+	size_t len = 0;
+	size_t i = 0;
+
+	memset(&uuid, 0, sizeof(uuid));
+
+	len = snprintf(path, sizeof(path), "%s/%s", prefix, dev_path);
+	if (len >= sizeof(path))
+		return 0;
+
+	dir = opendir(path);
+	if (!dir)
+		return 0;
+
+	while ((de = readdir(dir))) {
+		len = parse_uuid(de->d_name, &uuid);
+		if (!len)
+			continue;
+		for (i = 0; i < sizeof(ta_formats) / sizeof(ta_formats[0]);
+		     i++)
+			if (!strcmp(de->d_name + len, ta_formats[i].suffix))
+				break;
+		if (i == sizeof(ta_formats) / sizeof(ta_formats[0]))
+			continue;
+		if (prefetch_secure_module(prefix, dev_path, &uuid,
+					   bytes) == TA_BINARY_FOUND)
+			num_tas++;
+	}
+
+	closedir(dir);
+	return num_tas;
+}
+
+size_t TEECI_PrefetchSecureModules(const char *dev_path, const char *list,
+				   size_t *bytes)
+{
+	size_t num_tas = 0;
+
+	*bytes = 0;
+
+	if (list)
+		return prefetch_list(dev_path, list, bytes);
+
+#ifdef TEEC_TEST_LOAD_PATH
+	num_tas += prefetch_dir(TEEC_TEST_LOAD_PATH, dev_path, bytes);
 #endif
+	num_tas += ta_bundle_prefetch_all(bytes);
+	num_tas += prefetch_dir(TEEC_LOAD_PATH, dev_path, bytes);
 
-	return try_load_secure_module(TEEC_LOAD_PATH,
-				      dev_path, destination, ta, ta_size);
+	return num_tas;
 }
@@ -47,4 +47,16 @@
 int TEECI_LoadSecureModule(const char *name,
 			   const TEEC_UUID *destination, void *ta,
 			   size_t *ta_size);
+
+/**
+ * Reads TA binaries from storage so that later loads don't have to wait
+ * for it, either the TAs listed in the file @list, one UUID per line,
+ * or if @list is NULL all TAs which can be found.
+ *
+ * @param: bytes        Updated with the number of bytes read.
+ *
+ * @return              The number of TAs read.
+ */
+size_t TEECI_PrefetchSecureModules(const char *name, const char *list,
+				   size_t *bytes);
 #endif
@@ -0,0 +1,327 @@
+/*
+ * Copyright (c) 2026, Linaro Limited
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stats.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <teec_trace.h>
+#include <tee_supplicant.h>
+#include <timeline.h>
+#include <unistd.h>
+
+/* Number of events in the ring buffer of each thread, a power of two */
+#define TIMELINE_RING_SIZE	4096
+#define TIMELINE_FLUSH_MS	100
+
+static const char * const marker_paths[] = {
+	"/sys/kernel/tracing/trace_marker",
+	"/sys/kernel/debug/tracing/trace_marker",
+};
+
+struct timeline_event {
+	const char *cat;
+	const char *name;
+	uint64_t start_ns;
+	uint64_t dur_ns;
+};
+
+/*
+ * Ring buffer of a thread. Only the owning thread advances head and only
+ * the flush thread advances tail. As with the histograms in stats.c the
+ * buffer of an exited thread is handed over to the next new thread, but
+ * only once the flush thread has emptied it.
+ */
+struct timeline_thread {
+	bool in_use;
+	long tid;
+	uint64_t head;
+	uint64_t tail;
+	uint64_t dropped;
+	struct timeline_event ev[TIMELINE_RING_SIZE];
+	struct timeline_thread *next;
+};
+
+static pthread_mutex_t timeline_mutex = PTHREAD_MUTEX_INITIALIZER;
+/* Serializes writing to the file, held by the flush thread and at exit */
+static pthread_mutex_t flush_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct timeline_thread *timeline_threads;
+static pthread_key_t timeline_key;
+static pthread_once_t timeline_key_once = PTHREAD_ONCE_INIT;
+static bool timeline_on;
+static FILE *timeline_file;
+static int marker_fd = -1;
+static uint64_t timeline_base_ns;
+static long timeline_pid;
+
+bool timeline_enabled(void)
+{
+	return __atomic_load_n(&timeline_on, __ATOMIC_RELAXED);
+}
+
+static void timeline_thread_release(void *p)
+{
+	struct timeline_thread *tt = p;
+
+	__atomic_store_n(&tt->in_use, false, __ATOMIC_RELEASE);
+}
+
+static void timeline_key_init(void)
+{
+	int e = pthread_key_create(&timeline_key, timeline_thread_release);
+
+	if (e) {
+		EMSG("pthread_key_create: %s", strerror(e));
+		EMSG("terminating...");
+		exit(EXIT_FAILURE);
+	}
+}
+
+static bool timeline_thread_free(struct timeline_thread *tt)
+{
+	return !__atomic_load_n(&tt->in_use, __ATOMIC_ACQUIRE) &&
+	       __atomic_load_n(&tt->tail, __ATOMIC_ACQUIRE) == tt->head;
+}
+
+static struct timeline_thread *timeline_thread_get(void)
+{
+	struct timeline_thread *tt = NULL;
+
+	pthread_once(&timeline_key_once, timeline_key_init);
+
+	tt = pthread_getspecific(timeline_key);
+	if (tt)
+		return tt;
+
+	/* Not recorded, that would recurse */
+	tee_supp_mutex_lock_named(&timeline_mutex, NULL);
+
+	for (tt = timeline_threads; tt; tt = tt->next)
+		if (timeline_thread_free(tt))
+			break;
+
+	if (!tt) {
+		tt = calloc(1, sizeof(*tt));
+		if (tt) {
+			tt->next = timeline_threads;
+			__atomic_store_n(&timeline_threads, tt,
+					 __ATOMIC_RELEASE);
+		}
+	}
+	if (tt) {
+		tt->tid = syscall(SYS_gettid);
+		__atomic_store_n(&tt->in_use, true, __ATOMIC_RELEASE);
+	}
+
+	tee_supp_mutex_unlock(&timeline_mutex);
+
+	if (tt)
+		pthread_setspecific(timeline_key, tt);
+
+	return tt;
+}
+
+static void write_marker(const char *buf, int len)
+{
+	/* A lost marker isn't worth more than a debug message */
+	if (len > 0 && write(marker_fd, buf, len) < 0)
+		DMSG("trace_marker: %s", strerror(errno));
+}
+
+uint64_t timeline_begin(const char *name)
+{
+	char buf[128] = { 0 };
+
+	if (!timeline_enabled())
+		return 0;
+
+	if (marker_fd >= 0)
+		write_marker(buf, snprintf(buf, sizeof(buf), "B|%ld|%s",
+					   timeline_pid, name));
+
+	return stats_now_ns();
+}
+
+void timeline_end(const char *cat, const char *name, uint64_t start)
+{
+	struct timeline_thread *tt = NULL;
+	struct timeline_event *ev = NULL;
+	char buf[32] = { 0 };
+
+	if (!timeline_enabled() || !start)
+		return;
+
+	if (marker_fd >= 0)
+		write_marker(buf, snprintf(buf, sizeof(buf), "E|%ld",
+					   timeline_pid));
+
+	tt = timeline_thread_get();
+	if (!tt)
+		return;
+
+	if (tt->head - __atomic_load_n(&tt->tail, __ATOMIC_ACQUIRE) >=
+	    TIMELINE_RING_SIZE) {
+		__atomic_store_n(&tt->dropped, tt->dropped + 1,
+				 __ATOMIC_RELAXED);
+		return;
+	}
+
+	ev = tt->ev + (tt->head & (TIMELINE_RING_SIZE - 1));
+	ev->cat = cat;
+	ev->name = name;
+	ev->start_ns = start;
+	ev->dur_ns = stats_now_ns() - start;
+	__atomic_store_n(&tt->head, tt->head + 1, __ATOMIC_RELEASE);
+}
+
+static void flush_thread(struct timeline_thread *tt)
+{
+	uint64_t head = __atomic_load_n(&tt->head, __ATOMIC_ACQUIRE);
+	uint64_t tail = tt->tail;
+	struct timeline_event *ev = NULL;
+	uint64_t start = 0;
+
+	for (; tail != head; tail++) {
+		ev = tt->ev + (tail & (TIMELINE_RING_SIZE - 1));
+		start = ev->start_ns - timeline_base_ns;
+		fprintf(timeline_file,
+			"{\"ph\":\"X\",\"cat\":\"%s\",\"name\":\"%s\","
+			"\"pid\":%ld,\"tid\":%ld,\"ts\":%" PRIu64 ".%03u,"
+			"\"dur\":%" PRIu64 ".%03u},\n", ev->cat, ev->name,
+			timeline_pid, tt->tid, start / 1000,
+			(unsigned int)(start % 1000), ev->dur_ns / 1000,
+			(unsigned int)(ev->dur_ns % 1000));
+	}
+
+	__atomic_store_n(&tt->tail, tail, __ATOMIC_RELEASE);
+}
+
+static void flush_all(void)
+{
+	static uint64_t dropped;
+	struct timeline_thread *tt = NULL;
+	uint64_t d = 0;
+
+	tee_supp_mutex_lock_named(&flush_mutex, NULL);
+
+	for (tt = __atomic_load_n(&timeline_threads, __ATOMIC_ACQUIRE); tt;
+	     tt = tt->next) {
+		flush_thread(tt);
+		d += __atomic_load_n(&tt->dropped, __ATOMIC_RELAXED);
+	}
+
+	if (d != dropped) {
+		fprintf(timeline_file,
+			"{\"ph\":\"C\",\"name\":\"dropped_events\","
+			"\"pid\":%ld,\"ts\":%" PRIu64 ",\"args\":"
+			"{\"count\":%" PRIu64 "}},\n", timeline_pid,
+			(stats_now_ns() - timeline_base_ns) / 1000, d);
+		dropped = d;
+	}
+
+	if (fflush(timeline_file))
+		EMSG("timeline: %s", strerror(errno));
+
+	tee_supp_mutex_unlock(&flush_mutex);
+}
+
+static void *timeline_thread_main(void *arg)
+{
+	(void)arg;
+
+	while (true) {
+		usleep(TIMELINE_FLUSH_MS * 1000);
+		flush_all();
+	}
+
+	return NULL;
+}
+
+static void open_marker(void)
+{
+	size_t n = 0;
+
+	for (n = 0; n < sizeof(marker_paths) / sizeof(marker_paths[0]); n++) {
+		marker_fd = open(marker_paths[n], O_WRONLY | O_CLOEXEC);
+		if (marker_fd >= 0)
+			return;
+	}
+
+	IMSG("no trace_marker found, timeline markers disabled");
+}
+
+int timeline_start(const char *path, bool marker)
+{
+	pthread_t tid;
+	int e = 0;
+
+	memset(&tid, 0, sizeof(tid));
+
+	timeline_file = fopen(path, "w");
+	if (!timeline_file) {
+		EMSG("fopen(\"%s\"): %s", path, strerror(errno));
+		return -1;
+	}
+
+	/*
+	 * The JSON array format of Chrome traces doesn't need the closing
+	 * bracket so a file cut short when the supplicant is stopped can
+	 * still be opened.
+	 */
+	timeline_pid = getpid();
+	timeline_base_ns = stats_now_ns();
+	fprintf(timeline_file, "[\n{\"ph\":\"M\",\"name\":\"process_name\","
+		"\"pid\":%ld,\"args\":{\"name\":\"tee-supplicant\"}},\n",
+		timeline_pid);
+
+	if (marker)
+		open_marker();
+
+	e = pthread_create(&tid, NULL, timeline_thread_main, NULL);
+	if (e) {
+		EMSG("pthread_create: %s", strerror(e));
+		fclose(timeline_file);
+		timeline_file = NULL;
+		return -1;
+	}
+
+	e = pthread_detach(tid);
+	if (e)
+		EMSG("pthread_detach: %s", strerror(e));
+
+	/* Catch the events since the last flush when the process exits */
+	if (atexit(flush_all))
+		EMSG("atexit() failed");
+
+	__atomic_store_n(&timeline_on, true, __ATOMIC_RELEASE);
+	return 0;
+}
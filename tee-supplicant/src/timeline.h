@@ -0,0 +1,56 @@
+/*
+ * Copyright (c) 2026, Linaro Limited
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef TIMELINE_H
+#define TIMELINE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * Opt-in timeline of what each thread is doing, written as Chrome trace
+ * JSON which chrome://tracing and Perfetto can open. Events are kept in
+ * per-thread ring buffers and written to the file by a background
+ * thread, so recording an event never blocks on I/O. Events which don't
+ * fit in a full ring buffer are dropped and counted.
+ *
+ * Event names and categories must be string literals or otherwise stay
+ * valid for the life of the process.
+ */
+
+/*
+ * Starts writing the timeline to @path. If @marker is true begin and end
+ * of events are also written to the ftrace trace_marker so they line up
+ * with kernel events. Returns 0 on success or -1.
+ */
+int timeline_start(const char *path, bool marker);
+bool timeline_enabled(void);
+
+/* Returns the start time of an event to be passed to timeline_end() */
+uint64_t timeline_begin(const char *name);
+void timeline_end(const char *cat, const char *name, uint64_t start);
+
+#endif /*TIMELINE_H*/
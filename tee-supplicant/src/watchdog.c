@@ -0,0 +1,427 @@
+/*
+ * Copyright (c) 2026, Linaro Limited
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <errno.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stats.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <teec_trace.h>
+#include <tee_supplicant.h>
+#include <time.h>
+#include <unistd.h>
+#include <watchdog.h>
+
+#include "optee_msg_supplicant.h"
+
+#ifndef __aligned
+#define __aligned(x) __attribute__((__aligned__(x)))
+#endif
+#include <linux/tee.h>
+
+#define WATCHDOG_DETAIL_LEN	64
+/* Bounds of how often requests in progress are checked */
+#define WATCHDOG_MIN_PERIOD_MS	10
+#define WATCHDOG_MAX_PERIOD_MS	1000
+
+struct watchdog_req {
+	uint64_t start_ns;
+	uint64_t elapsed_ns;
+	unsigned int cls;
+	uint32_t func;
+	uint64_t sub_op;
+	long tid;
+	char detail[WATCHDOG_DETAIL_LEN];
+};
+
+/*
+ * The request in progress in a thread, 0 start_ns when there's none.
+ * Slots are handed over to new threads like the histograms in stats.c.
+ * The mutex is only contended when the watchdog thread scans the slots.
+ */
+struct watchdog_slot {
+	bool in_use;
+	bool reported;
+	pthread_mutex_t mutex;
+	struct watchdog_req req;
+	struct watchdog_slot *next;
+};
+
+static pthread_mutex_t watchdog_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct watchdog_slot *watchdog_slots;
+static pthread_key_t watchdog_key;
+static bool watchdog_on;
+static uint64_t watchdog_threshold_ns;
+
+/* The slowest requests seen, protected by watchdog_mutex */
+static struct watchdog_req *slowest;
+static size_t slowest_max;
+static size_t slowest_count;
+/* Shortest elapsed time in a full table, read without the mutex */
+static uint64_t slowest_min_ns;
+
+static void watchdog_slot_release(void *p)
+{
+	struct watchdog_slot *slot = p;
+
+	__atomic_store_n(&slot->in_use, false, __ATOMIC_RELEASE);
+}
+
+static struct watchdog_slot *watchdog_slot_get(void)
+{
+	struct watchdog_slot *slot = pthread_getspecific(watchdog_key);
+
+	if (slot)
+		return slot;
+
+	tee_supp_mutex_lock(&watchdog_mutex);
+
+	for (slot = watchdog_slots; slot; slot = slot->next)
+		if (!__atomic_load_n(&slot->in_use, __ATOMIC_ACQUIRE))
+			break;
+
+	if (!slot) {
+		slot = calloc(1, sizeof(*slot));
+		if (slot) {
+			if (pthread_mutex_init(&slot->mutex, NULL)) {
+				free(slot);
+				slot = NULL;
+			} else {
+				slot->next = watchdog_slots;
+				__atomic_store_n(&watchdog_slots, slot,
+						 __ATOMIC_RELEASE);
+			}
+		}
+	}
+	if (slot)
+		slot->in_use = true;
+
+	tee_supp_mutex_unlock(&watchdog_mutex);
+
+	if (slot)
+		pthread_setspecific(watchdog_key, slot);
+
+	return slot;
+}
+
+static void describe_fs(char *buf, size_t len, uint64_t sub_op,
+			size_t num_params, struct tee_ioctl_param *params)
+{
+	const char *path = NULL;
+
+	switch (sub_op) {
+	case OPTEE_MRF_OPEN:
+	case OPTEE_MRF_CREATE:
+	case OPTEE_MRF_REMOVE:
+	case OPTEE_MRF_RENAME:
+	case OPTEE_MRF_OPENDIR:
+		if (num_params > 1)
+			path = tee_supp_param_to_va(params + 1);
+		if (path)
+			snprintf(buf, len, "path %.*s",
+				 (int)MEMREF_SIZE(params + 1), path);
+		break;
+	case OPTEE_MRF_CLOSEDIR:
+	case OPTEE_MRF_READDIR:
+	case OPTEE_MRF_READDIR_BATCH:
+		snprintf(buf, len, "dir %" PRIu64, (uint64_t)params->b);
+		break;
+	case OPTEE_MRF_READV:
+	case OPTEE_MRF_WRITEV:
+		snprintf(buf, len, "fd %" PRIu64 " extents %" PRIu64,
+			 (uint64_t)params->b, (uint64_t)params->c);
+		break;
+	default:
+		snprintf(buf, len, "fd %" PRIu64 " offs %" PRIu64,
+			 (uint64_t)params->b, (uint64_t)params->c);
+		break;
+	}
+}
+
+static void describe(struct watchdog_req *req, size_t num_params,
+		     struct tee_ioctl_param *params)
+{
+	char *buf = req->detail;
+	size_t len = sizeof(req->detail);
+	uint8_t u[TEE_IOCTL_UUID_LEN] = { 0 };
+
+	buf[0] = '\0';
+	if (!num_params || !tee_supp_param_is_value(params))
+		return;
+
+	switch (req->func) {
+	case OPTEE_MSG_RPC_CMD_LOAD_TA:
+		memcpy(u, &params->a, sizeof(params->a));
+		memcpy(u + sizeof(params->a), &params->b, sizeof(params->b));
+		snprintf(buf, len, "uuid %02x%02x%02x%02x-%02x%02x-%02x%02x-"
+			 "%02x%02x-%02x%02x%02x%02x%02x%02x", u[0], u[1], u[2],
+			 u[3], u[4], u[5], u[6], u[7], u[8], u[9], u[10], u[11],
+			 u[12], u[13], u[14], u[15]);
+		break;
+	case OPTEE_MSG_RPC_CMD_FS:
+		describe_fs(buf, len, req->sub_op, num_params, params);
+		break;
+	case OPTEE_MSG_RPC_CMD_SOCKET:
+		snprintf(buf, len, "instance %" PRIu64 " handle %" PRIu64,
+			 (uint64_t)params->b, (uint64_t)params->c);
+		break;
+	default:
+		break;
+	}
+}
+
+struct watchdog_slot *watchdog_begin(unsigned int cls, uint32_t func,
+				     size_t num_params,
+				     struct tee_ioctl_param *params)
+{
+	struct watchdog_slot *slot = NULL;
+
+	if (!__atomic_load_n(&watchdog_on, __ATOMIC_RELAXED))
+		return NULL;
+
+	slot = watchdog_slot_get();
+	if (!slot)
+		return NULL;
+
+	tee_supp_mutex_lock(&slot->mutex);
+	slot->req.cls = cls;
+	slot->req.func = func;
+	slot->req.sub_op = 0;
+	if (num_params && tee_supp_param_is_value(params))
+		slot->req.sub_op = params->a;
+	slot->req.tid = syscall(SYS_gettid);
+	describe(&slot->req, num_params, params);
+	slot->reported = false;
+	slot->req.start_ns = stats_now_ns();
+	tee_supp_mutex_unlock(&slot->mutex);
+
+	return slot;
+}
+
+/* Called with watchdog_mutex held */
+static void slowest_insert(struct watchdog_req *req)
+{
+	size_t min = 0;
+	size_t n = 0;
+
+	if (slowest_count < slowest_max) {
+		slowest[slowest_count] = *req;
+		slowest_count++;
+		if (slowest_count < slowest_max)
+			return;
+	} else {
+		for (n = 1; n < slowest_count; n++)
+			if (slowest[n].elapsed_ns < slowest[min].elapsed_ns)
+				min = n;
+		if (req->elapsed_ns <= slowest[min].elapsed_ns)
+			return;
+		slowest[min] = *req;
+	}
+
+	min = 0;
+	for (n = 1; n < slowest_count; n++)
+		if (slowest[n].elapsed_ns < slowest[min].elapsed_ns)
+			min = n;
+	__atomic_store_n(&slowest_min_ns, slowest[min].elapsed_ns,
+			 __ATOMIC_RELAXED);
+}
+
+void watchdog_end(struct watchdog_slot *slot)
+{
+	struct watchdog_req req;
+	bool reported = false;
+
+	if (!slot)
+		return;
+
+	tee_supp_mutex_lock(&slot->mutex);
+	slot->req.elapsed_ns = stats_now_ns() - slot->req.start_ns;
+	slot->req.start_ns = 0;
+	req = slot->req;
+	reported = slot->reported;
+	tee_supp_mutex_unlock(&slot->mutex);
+
+	if (reported)
+		EMSG("slow request done: %s %s after %" PRIu64 " ms",
+		     stats_req_class_name(req.cls), req.detail,
+		     req.elapsed_ns / 1000000);
+
+	if (slowest_max &&
+	    req.elapsed_ns > __atomic_load_n(&slowest_min_ns,
+					     __ATOMIC_RELAXED)) {
+		tee_supp_mutex_lock(&watchdog_mutex);
+		slowest_insert(&req);
+		tee_supp_mutex_unlock(&watchdog_mutex);
+	}
+}
+
+static void log_req(const char *what, struct watchdog_req *req)
+{
+	EMSG("%s: thread %ld %s (func %" PRIu32 " op %" PRIu64 ") %s: %"
+	     PRIu64 " ms", what, req->tid, stats_req_class_name(req->cls),
+	     req->func, req->sub_op, req->detail, req->elapsed_ns / 1000000);
+}
+
+/* Slots are never freed so the list can be walked without the mutex */
+static void check_slots(bool dump)
+{
+	struct watchdog_slot *slot = NULL;
+	struct watchdog_req req;
+	uint64_t now = stats_now_ns();
+	bool in_progress = false;
+	bool report = false;
+
+	memset(&req, 0, sizeof(req));
+
+	for (slot = __atomic_load_n(&watchdog_slots, __ATOMIC_ACQUIRE); slot;
+	     slot = slot->next) {
+		tee_supp_mutex_lock(&slot->mutex);
+		in_progress = slot->req.start_ns;
+		report = false;
+		if (in_progress) {
+			req = slot->req;
+			req.elapsed_ns = now - req.start_ns;
+			if (!slot->reported &&
+			    req.elapsed_ns > watchdog_threshold_ns) {
+				slot->reported = true;
+				report = true;
+			}
+		}
+		tee_supp_mutex_unlock(&slot->mutex);
+
+		if (report)
+			log_req("slow request", &req);
+		else if (dump && in_progress)
+			log_req("in progress", &req);
+	}
+}
+
+static int cmp_elapsed(const void *a, const void *b)
+{
+	const struct watchdog_req *ra = a;
+	const struct watchdog_req *rb = b;
+
+	return (ra->elapsed_ns < rb->elapsed_ns) -
+	       (ra->elapsed_ns > rb->elapsed_ns);
+}
+
+static void dump_slowest(void)
+{
+	struct watchdog_req *reqs = NULL;
+	size_t count = 0;
+	size_t n = 0;
+
+	reqs = calloc(slowest_max ? slowest_max : 1, sizeof(*reqs));
+	if (!reqs)
+		return;
+
+	/* Log from a copy so requests completing don't wait for the log */
+	tee_supp_mutex_lock(&watchdog_mutex);
+	count = slowest_count;
+	memcpy(reqs, slowest, count * sizeof(*reqs));
+	tee_supp_mutex_unlock(&watchdog_mutex);
+
+	qsort(reqs, count, sizeof(*reqs), cmp_elapsed);
+	EMSG("%zu slowest requests:", count);
+	for (n = 0; n < count; n++)
+		log_req("slowest", reqs + n);
+
+	free(reqs);
+}
+
+static void *watchdog_thread_main(void *arg)
+{
+	uint64_t period_ms = watchdog_threshold_ns / 2000000;
+	struct timespec ts;
+	sigset_t set;
+	int sig = 0;
+
+	(void)arg;
+
+	memset(&ts, 0, sizeof(ts));
+	sigemptyset(&set);
+	sigaddset(&set, SIGUSR1);
+
+	if (period_ms < WATCHDOG_MIN_PERIOD_MS)
+		period_ms = WATCHDOG_MIN_PERIOD_MS;
+	if (period_ms > WATCHDOG_MAX_PERIOD_MS)
+		period_ms = WATCHDOG_MAX_PERIOD_MS;
+
+	while (true) {
+		ts.tv_sec = period_ms / 1000;
+		ts.tv_nsec = (period_ms % 1000) * 1000000;
+		sig = sigtimedwait(&set, NULL, &ts);
+		if (sig == SIGUSR1) {
+			check_slots(true);
+			dump_slowest();
+		} else {
+			check_slots(false);
+		}
+	}
+
+	return NULL;
+}
+
+int watchdog_start(unsigned int threshold_ms, size_t slowest_n)
+{
+	pthread_t tid;
+	int e = 0;
+
+	memset(&tid, 0, sizeof(tid));
+
+	e = pthread_key_create(&watchdog_key, watchdog_slot_release);
+	if (e) {
+		EMSG("pthread_key_create: %s", strerror(e));
+		return -1;
+	}
+
+	if (slowest_n) {
+		slowest = calloc(slowest_n, sizeof(*slowest));
+		if (!slowest)
+			return -1;
+		slowest_max = slowest_n;
+	}
+	watchdog_threshold_ns = (uint64_t)threshold_ms * 1000000;
+
+	e = pthread_create(&tid, NULL, watchdog_thread_main, NULL);
+	if (e) {
+		EMSG("pthread_create: %s", strerror(e));
+		return -1;
+	}
+
+	e = pthread_detach(tid);
+	if (e)
+		EMSG("pthread_detach: %s", strerror(e));
+
+	__atomic_store_n(&watchdog_on, true, __ATOMIC_RELEASE);
+	return 0;
+}
@@ -0,0 +1,54 @@
+/*
+ * Copyright (c) 2026, Linaro Limited
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef WATCHDOG_H
+#define WATCHDOG_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+struct tee_ioctl_param;
+struct watchdog_slot;
+
+/*
+ * Starts a thread logging requests which have been in progress for more
+ * than @threshold_ms and keeping the @slowest_n slowest requests seen,
+ * which are logged together with the requests in progress when the
+ * process gets SIGUSR1. SIGUSR1 must be blocked in all threads before
+ * this is called. Returns 0 on success or -1.
+ */
+int watchdog_start(unsigned int threshold_ms, size_t slowest_n);
+
+/*
+ * Records the start of a request about to be passed to its handler.
+ * Returns NULL if the watchdog isn't started.
+ */
+struct watchdog_slot *watchdog_begin(unsigned int cls, uint32_t func,
+				     size_t num_params,
+				     struct tee_ioctl_param *params);
+void watchdog_end(struct watchdog_slot *slot);
+
+#endif /*WATCHDOG_H*/
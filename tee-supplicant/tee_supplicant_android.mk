@@ -19,11 +19,32 @@ ifeq ($(CFG_TA_TEST_PATH),y)
 LOCAL_CFLAGS += -DCFG_TA_TEST_PATH=1
 endif
 
+ifeq ($(CFG_TA_ZSTD),y)
+LOCAL_CFLAGS += -DCFG_TA_ZSTD
+LOCAL_STATIC_LIBRARIES += libzstd
+endif
+
+ifeq ($(CFG_TA_LZ4),y)
+LOCAL_CFLAGS += -DCFG_TA_LZ4
+LOCAL_STATIC_LIBRARIES += liblz4
+endif
+
 LOCAL_SRC_FILES += src/handle.c \
                    src/tee_supp_fs.c \
                    src/tee_supplicant.c \
                    src/teec_ta_load.c \
-                   src/rpmb.c
+                   src/rpmb.c \
+                   src/lanes.c \
+                   src/stats.c \
+                   src/capture.c \
+                   src/timeline.c \
+                   src/watchdog.c \
+                   src/ta_bundle.c \
+                   src/fs_backend.c \
+                   src/fs_container.c \
+                   src/fs_ram.c \
+                   src/fs_ta_io.c \
+                   src/fs_powercut.c
 
 ifeq ($(CFG_GP_SOCKETS),y)
 LOCAL_SRC_FILES += src/tee_socket.c
@@ -48,6 +69,16 @@ ifeq ($(CFG_FTRACE_SUPPORT),y)
 LOCAL_CFLAGS += -DCFG_FTRACE_SUPPORT
 endif
 
+ifeq ($(CFG_FAKE_TEE),y)
+LOCAL_SRC_FILES += src/fake_tee.c
+LOCAL_CFLAGS += -DCFG_FAKE_TEE
+endif
+
+ifeq ($(CFG_FS_IO_URING),y)
+LOCAL_SRC_FILES += src/fs_uring.c
+LOCAL_CFLAGS += -DCFG_FS_IO_URING
+endif
+
 LOCAL_C_INCLUDES := $(LOCAL_PATH)/../public \
                     $(LOCAL_PATH)/../libteec/include \
                     $(LOCAL_PATH)/src